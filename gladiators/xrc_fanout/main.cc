@@ -0,0 +1,264 @@
+// Compares the throughput of one-sided reads spread over a growing number of
+// loopback RC QPs with that of the same reads issued through a single XRC QP,
+// so a single machine with one device is enough. The number of outstanding
+// reads is the same for every point, so any drop in throughput comes from the
+// QPs that the NIC has to keep track of.
+//
+// On the XRC side, every read goes from one send QP to one target QP. Each
+// names a different SRQ of the domain, but RDMA reads never consume a receive,
+// so the SRQs do not change the work the NIC does. That column is therefore
+// the throughput of a single QP, not of a fan-out to many target QPs.
+
+#include <infiniband/verbs.h>
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "fmt/core.h"
+#include "rome/logging/logging.h"
+#include "rome/rdma/connection_manager/qp_config.h"
+#include "rome/rdma/rdma_device.h"
+#include "rome/rdma/rdma_memory.h"
+#include "rome/rdma/rdma_util.h"
+#include "rome/rdma/tcp_bootstrap.h"
+#include "rome/rdma/xrc_domain.h"
+#include "rome/util/status_util.h"
+
+ABSL_FLAG(int, max_qps, 256, "Largest number of RC QPs to read through");
+ABSL_FLAG(int, inflight, 32, "Number of outstanding reads");
+ABSL_FLAG(int, runtime, 2, "Number of seconds to run each configuration for");
+ABSL_FLAG(int, gid_index, 0, "GID table entry to route by on RoCE");
+
+using ::rome::rdma::QpConfig;
+using ::rome::rdma::RdmaDevice;
+using ::rome::rdma::RdmaMemory;
+using ::rome::rdma::XrcDomain;
+using ::util::InternalErrorBuilder;
+
+namespace {
+
+constexpr char kPdId[] = "xrc_fanout";
+constexpr char kLocalId[] = "local";
+constexpr char kRemoteId[] = "remote";
+
+// Reads are spread over this many bytes, one cache line per QP.
+constexpr uint64_t kRemoteBytes = 1 << 20;
+constexpr uint64_t kReadBytes = 8;
+constexpr uint64_t kStride = 64;
+
+// Where reads go, and the attributes of the QPs that issue them.
+struct Setup {
+  ibv_mr* local;
+  ibv_mr* remote;
+  QpConfig config;
+  uint8_t port_num;
+};
+
+void PrepareRead(const Setup& setup, int qp, ibv_sge* sge,
+                 ibv_send_wr* wr) {
+  std::memset(sge, 0, sizeof(*sge));
+  sge->addr = reinterpret_cast<uint64_t>(setup.local->addr);
+  sge->length = kReadBytes;
+  sge->lkey = setup.local->lkey;
+
+  std::memset(wr, 0, sizeof(*wr));
+  wr->wr_id = qp;
+  wr->sg_list = sge;
+  wr->num_sge = 1;
+  wr->opcode = IBV_WR_RDMA_READ;
+  wr->send_flags = IBV_SEND_SIGNALED;
+  wr->wr.rdma.remote_addr = reinterpret_cast<uint64_t>(setup.remote->addr) +
+                            (qp * kStride) % kRemoteBytes;
+  wr->wr.rdma.rkey = setup.remote->rkey;
+}
+
+// Keeps `inflight` reads outstanding, issuing each to the next of `num_qps` in
+// turn, and returns the number completed per second.
+absl::StatusOr<double> Run(ibv_cq* cq, int num_qps,
+                           const std::function<absl::Status(int)>& post) {
+  const int inflight = absl::GetFlag(FLAGS_inflight);
+  const auto runtime = std::chrono::seconds(absl::GetFlag(FLAGS_runtime));
+  int next = 0;
+  for (int i = 0; i < inflight; ++i) {
+    auto status = post(next);
+    if (!status.ok()) return status;
+    next = (next + 1) % num_qps;
+  }
+
+  uint64_t completed = 0;
+  int outstanding = inflight;
+  ibv_wc wcs[16];
+  auto start = std::chrono::steady_clock::now();
+  auto elapsed = std::chrono::steady_clock::duration::zero();
+  while (outstanding > 0) {
+    int n = ibv_poll_cq(cq, 16, wcs);
+    ROME_CHECK_QUIET(
+        ROME_RETURN(InternalErrorBuilder() << "ibv_poll_cq(): " << n), n >= 0);
+    for (int i = 0; i < n; ++i) {
+      ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                                   << "Read failed: "
+                                   << ibv_wc_status_str(wcs[i].status)),
+                       wcs[i].status == IBV_WC_SUCCESS);
+    }
+    outstanding -= n;
+    if (elapsed == elapsed.zero()) {
+      completed += n;
+      if (std::chrono::steady_clock::now() - start >= runtime) {
+        // Stops issuing reads and drains those still outstanding.
+        elapsed = std::chrono::steady_clock::now() - start;
+        continue;
+      }
+      for (int i = 0; i < n; ++i) {
+        auto status = post(next);
+        if (!status.ok()) return status;
+        next = (next + 1) % num_qps;
+        ++outstanding;
+      }
+    }
+  }
+  return completed / std::chrono::duration<double>(elapsed).count();
+}
+
+// Reads through `num_qps` loopback RC QPs.
+absl::StatusOr<double> RunRc(ibv_pd* pd, const Setup& setup, int num_qps) {
+  const uint32_t depth = setup.config.max_send_wr;
+  ibv_cq_unique_ptr cq(
+      ibv_create_cq(pd->context, num_qps * depth, nullptr, nullptr, 0));
+  ibv_cq_unique_ptr server_cq(
+      ibv_create_cq(pd->context, depth, nullptr, nullptr, 0));
+  ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                               << "ibv_create_cq(): " << strerror(errno)),
+                   cq != nullptr && server_cq != nullptr);
+
+  ibv_qp_init_attr init_attr;
+  std::memset(&init_attr, 0, sizeof(init_attr));
+  init_attr.qp_type = IBV_QPT_RC;
+  init_attr.cap.max_send_wr = depth;
+  init_attr.cap.max_recv_wr = 1;
+  init_attr.cap.max_send_sge = init_attr.cap.max_recv_sge = 1;
+
+  std::vector<ibv_qp_unique_ptr> qps, server_qps;
+  for (int i = 0; i < num_qps; ++i) {
+    init_attr.send_cq = init_attr.recv_cq = cq.get();
+    qps.emplace_back(ibv_create_qp(pd, &init_attr));
+    init_attr.send_cq = init_attr.recv_cq = server_cq.get();
+    server_qps.emplace_back(ibv_create_qp(pd, &init_attr));
+    ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                                 << "ibv_create_qp(): " << strerror(errno)),
+                     qps.back() != nullptr && server_qps.back() != nullptr);
+
+    auto info = rome::rdma::GetQpInfo(qps.back().get(), setup.port_num,
+                                      setup.config.gid_index);
+    if (!info.ok()) return info.status();
+    auto server_info = rome::rdma::GetQpInfo(
+        server_qps.back().get(), setup.port_num, setup.config.gid_index);
+    if (!server_info.ok()) return server_info.status();
+    auto status = rome::rdma::ConnectQp(qps.back().get(), setup.port_num,
+                                        *server_info, setup.config);
+    if (!status.ok()) return status;
+    status = rome::rdma::ConnectQp(server_qps.back().get(), setup.port_num,
+                                   *info, setup.config);
+    if (!status.ok()) return status;
+  }
+
+  return Run(cq.get(), num_qps, [&](int qp) -> absl::Status {
+    ibv_sge sge;
+    ibv_send_wr wr, *bad;
+    PrepareRead(setup, qp, &sge, &wr);
+    RDMA_CM_CHECK(ibv_post_send, qps[qp].get(), &wr, &bad);
+    return absl::OkStatus();
+  });
+}
+
+// Issues the same reads as `RunRc` with `num_qps` QPs, all through a single
+// XRC QP, naming one of `num_qps` SRQs in each as XRC requires.
+absl::StatusOr<double> RunXrc(ibv_pd* pd, const Setup& setup, int num_qps) {
+  auto domain = XrcDomain::Create(pd, std::nullopt, setup.config.max_send_wr);
+  if (!domain.ok()) return domain.status();
+
+  std::vector<uint32_t> srq_nums;
+  for (int i = 0; i < num_qps; ++i) {
+    auto srq = (*domain)->CreateSrq(1);
+    if (!srq.ok()) return srq.status();
+    srq_nums.push_back(srq->second);
+  }
+
+  auto send_qp = (*domain)->CreateSendQp(setup.config);
+  if (!send_qp.ok()) return send_qp.status();
+  auto recv_qp = (*domain)->CreateRecvQp();
+  if (!recv_qp.ok()) return recv_qp.status();
+  auto send_info = rome::rdma::GetQpInfo(*send_qp, setup.port_num,
+                                         setup.config.gid_index);
+  if (!send_info.ok()) return send_info.status();
+  auto recv_info = rome::rdma::GetQpInfo(*recv_qp, setup.port_num,
+                                         setup.config.gid_index);
+  if (!recv_info.ok()) return recv_info.status();
+  auto status = rome::rdma::ConnectQp(*send_qp, setup.port_num, *recv_info,
+                                      setup.config);
+  if (!status.ok()) return status;
+  status = rome::rdma::ConnectQp(*recv_qp, setup.port_num, *send_info,
+                                 setup.config);
+  if (!status.ok()) return status;
+
+  return Run((*domain)->cq(), num_qps, [&](int qp) -> absl::Status {
+    ibv_sge sge;
+    ibv_send_wr wr, *bad;
+    PrepareRead(setup, qp, &sge, &wr);
+    wr.qp_type.xrc.remote_srqn = srq_nums[qp];
+    RDMA_CM_CHECK(ibv_post_send, *send_qp, &wr, &bad);
+    return absl::OkStatus();
+  });
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  ROME_INIT_LOG();
+  absl::ParseCommandLine(argc, argv);
+
+  auto devices = RdmaDevice::GetAvailableDevices();
+  ROME_ASSERT(devices.ok() && !devices->empty(), "No RDMA device found");
+  auto [name, port] = devices->front();
+  auto device = RdmaDevice::Create(name, port);
+  ROME_ASSERT(device != nullptr, "Failed to open device: {}", name);
+  ROME_ASSERT_OK(device->CreateProtectionDomain(kPdId));
+  auto* pd = VALUE_OR_DIE(device->GetProtectionDomain(kPdId));
+
+  ibv_device_attr device_attr;
+  ROME_ASSERT(ibv_query_device(pd->context, &device_attr) == 0,
+              "ibv_query_device(): {}", strerror(errno));
+  QpConfig config;
+  config.max_send_wr = absl::GetFlag(FLAGS_inflight);
+  config.gid_index = static_cast<uint8_t>(absl::GetFlag(FLAGS_gid_index));
+  config = config.Negotiate(device_attr);
+  ROME_ASSERT(config.max_send_wr >= uint32_t(absl::GetFlag(FLAGS_inflight)),
+              "--inflight exceeds the device's queue depth");
+
+  RdmaMemory rm(kReadBytes + kRemoteBytes, pd);
+  ROME_ASSERT_OK(rm.RegisterMemoryRegion(kLocalId, 0, kReadBytes));
+  ROME_ASSERT_OK(rm.RegisterMemoryRegion(kRemoteId, kReadBytes, kRemoteBytes));
+  Setup setup{VALUE_OR_DIE(rm.GetMemoryRegion(kLocalId)),
+              VALUE_OR_DIE(rm.GetMemoryRegion(kRemoteId)), config,
+              static_cast<uint8_t>(device->port())};
+
+  std::cout << fmt::format("{:>8} {:>14} {:>14}", "QPs", "rc_ops/s",
+                           "xrc_ops/s")
+            << std::endl;
+  for (int n = 1; n <= absl::GetFlag(FLAGS_max_qps); n *= 2) {
+    auto rc = RunRc(pd, setup, n);
+    ROME_ASSERT_OK(rc.status());
+    auto xrc = RunXrc(pd, setup, n);
+    ROME_ASSERT_OK(xrc.status());
+    std::cout << fmt::format("{:>8} {:>14.0f} {:>14.0f}", n, *rc, *xrc)
+              << std::endl;
+  }
+  return 0;
+}
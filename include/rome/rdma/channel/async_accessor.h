@@ -0,0 +1,56 @@
+#pragma once
+
+#include <infiniband/verbs.h>
+
+#include <atomic>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/synchronization/mutex.h"
+#include "rome/rdma/channel/rdma_accessor.h"
+#include "rome/rdma/rdma_util.h"
+
+namespace rome::rdma {
+
+// Posts chains of work requests without waiting for them, so that several may
+// be in flight on the QP at once. Only the last work request of a chain is
+// signaled, and its `wr_id` is replaced by the chain's token. Completions on an
+// RC QP arrive in the order work requests were posted, so a chain is complete
+// once its own completion or that of any later chain has been polled. This
+// also means that an abandoned chain never confuses a later wait.
+//
+// A chain's token is the number of work requests posted through the accessor
+// up to and including it, so the difference between the latest token and the
+// latest completed one is the number of work requests still in the SQ. Posting
+// waits while that would exceed the accessor's share of the SQ (see
+// `SendCompletions`). Completions of the channel's two-sided sends are passed
+// on to the messenger. Several threads may use the accessor at once, so chains
+// are posted under a lock to keep their tokens in posting order.
+class AsyncRdmaAccessor : public RdmaAccessor {
+ public:
+  ~AsyncRdmaAccessor() = default;
+  explicit AsyncRdmaAccessor(rdma_cm_id* id);
+  absl::Status PostInternal(ibv_send_wr* wr, ibv_send_wr** bad) override;
+  absl::StatusOr<CompletionToken> PostAsyncInternal(ibv_send_wr* wr,
+                                                    ibv_send_wr** bad) override;
+  absl::StatusOr<bool> TryCompleteInternal(CompletionToken token) override;
+  absl::Status WaitInternal(CompletionToken token) override;
+
+ private:
+  rdma_cm_id* id_;  //! NOT OWNED
+
+  // The accessor's share of the SQ.
+  uint64_t sq_depth_;
+
+  // The last token handed out, and the last one known to be complete.
+  absl::Mutex post_mu_;
+  CompletionToken posted_ GUARDED_BY(post_mu_);
+  std::atomic<CompletionToken> completed_;
+
+  // Held while polling, so that completions are passed on in order. Also
+  // guards the first failed completion polled, if any.
+  absl::Mutex poll_mu_;
+  absl::Status failed_ GUARDED_BY(poll_mu_);
+};
+
+}  // namespace rome::rdma
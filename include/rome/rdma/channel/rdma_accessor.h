@@ -2,14 +2,140 @@
 
 #include <rdma/rdma_cma.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
 #include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
 
 namespace rome::rdma {
 
+// Identifies a chain of work requests posted through an accessor. Tokens
+// increase in the order that chains are posted.
+using CompletionToken = uint64_t;
+
+// A channel's messenger and accessor post to the same QP, so they share its
+// send CQ and either one may poll completions of the other's work requests.
+// Accessors tag the `wr_id` of their work requests with `kAccessorTag` so that
+// the two can be told apart, and a completion polled by the wrong side is
+// passed on through here. Completions on an RC QP arrive in order, so the
+// accessor only needs its latest token, while the messenger gets each `wr_id`
+// in the order it was polled.
+//
+// The two also share the SQ. Neither knows how much of it the other is using,
+// so it is split between them up front: the messenger keeps at most
+// `MessengerDepth()` work requests outstanding, and the accessor the rest.
+class SendCompletions {
+ public:
+  static constexpr uint64_t kAccessorTag = 1ul << 63;
+
+  static bool IsAccessor(uint64_t wr_id) { return wr_id & kAccessorTag; }
+
+  // The shares of an SQ holding `max_send_wr` work requests.
+  static uint32_t MessengerDepth(uint32_t max_send_wr) {
+    return std::max(max_send_wr / 2, 1u);
+  }
+  static uint32_t AccessorDepth(uint32_t max_send_wr) {
+    return std::max(max_send_wr - MessengerDepth(max_send_wr), 1u);
+  }
+
+  // A completion passed from one side to the other. Failed completions are
+  // passed on too, since the QP is in the error state from then on and the
+  // side that posted the work request would otherwise wait for it forever.
+  struct Completion {
+    uint64_t wr_id;
+    ibv_wc_status status;
+    bool operator==(const Completion&) const = default;
+  };
+
+  // Called by the messenger with the `wr_id` of an accessor's completion.
+  void PassToAccessor(uint64_t wr_id, ibv_wc_status status = IBV_WC_SUCCESS) {
+    if (status != IBV_WC_SUCCESS) {
+      absl::MutexLock lock(&mu_);
+      if (accessor_failed_.ok()) {
+        accessor_failed_ = absl::InternalError(
+            absl::StrCat("ibv_poll_cq(): ", ibv_wc_status_str(status),
+                         " (wr_id=", wr_id, ")"));
+        has_accessor_failed_ = true;
+      }
+      return;
+    }
+    CompletionToken token = wr_id & ~kAccessorTag;
+    auto completed = accessor_.load(std::memory_order_relaxed);
+    while (completed < token &&
+           !accessor_.compare_exchange_weak(completed, token)) {
+    }
+  }
+
+  // The latest token of the accessor that the messenger polled.
+  CompletionToken accessor_completed() const { return accessor_.load(); }
+
+  // The first failed completion of the accessor that the messenger polled, if
+  // any. No chain that has not completed by then ever will.
+  absl::Status accessor_failed() {
+    if (!has_accessor_failed_.load(std::memory_order_acquire)) {
+      return absl::OkStatus();
+    }
+    absl::MutexLock lock(&mu_);
+    return accessor_failed_;
+  }
+
+  // Called by the accessor with the `wr_id` of a messenger's completion.
+  void PassToMessenger(uint64_t wr_id, ibv_wc_status status = IBV_WC_SUCCESS) {
+    absl::MutexLock lock(&mu_);
+    messenger_.push_back({wr_id, status});
+    has_messenger_ = true;
+  }
+
+  // Returns the messenger's completions polled by the accessor since the last
+  // call, in order.
+  std::vector<Completion> TakeMessengerCompletions() {
+    std::vector<Completion> completions;
+    if (!has_messenger_.load(std::memory_order_acquire)) return completions;
+    absl::MutexLock lock(&mu_);
+    completions.swap(messenger_);
+    has_messenger_ = false;
+    return completions;
+  }
+
+ private:
+  std::atomic<CompletionToken> accessor_{0};
+  std::atomic<bool> has_messenger_{false};
+  std::atomic<bool> has_accessor_failed_{false};
+  absl::Mutex mu_;
+  std::vector<Completion> messenger_ GUARDED_BY(mu_);
+  absl::Status accessor_failed_ GUARDED_BY(mu_);
+};
+
+// Posts one-sided operations on behalf of an `RdmaChannel`. `PostInternal`
+// returns once the posted chain has completed. `PostAsyncInternal` may return
+// as soon as the chain is posted, in which case its completion is checked for
+// with `TryCompleteInternal` or waited for with `WaitInternal`. Whether
+// anything is left to wait for is up to the accessor, so that code written
+// against this interface works with any of them.
 class RdmaAccessor {
  public:
   virtual ~RdmaAccessor() = default;
+
+  // Called by `RdmaChannel` so that completions of the messenger's work
+  // requests, which share the send CQ, are passed on instead of dropped.
+  void ShareSendCompletions(SendCompletions* shared) {
+    send_completions_ = shared;
+  }
+
   virtual absl::Status PostInternal(ibv_send_wr* sge, ibv_send_wr** bad) = 0;
+  virtual absl::StatusOr<CompletionToken> PostAsyncInternal(
+      ibv_send_wr* wr, ibv_send_wr** bad) = 0;
+  virtual absl::StatusOr<bool> TryCompleteInternal(CompletionToken token) = 0;
+  virtual absl::Status WaitInternal(CompletionToken token) = 0;
+
+ protected:
+  SendCompletions* send_completions_ = nullptr;  //! NOT OWNED
 };
 
 class EmptyRdmaAccessor : public RdmaAccessor {
@@ -19,6 +145,16 @@ class EmptyRdmaAccessor : public RdmaAccessor {
   absl::Status PostInternal(ibv_send_wr* sge, ibv_send_wr** bad) override {
     return absl::OkStatus();
   }
+  absl::StatusOr<CompletionToken> PostAsyncInternal(
+      ibv_send_wr* wr, ibv_send_wr** bad) override {
+    return 0;
+  }
+  absl::StatusOr<bool> TryCompleteInternal(CompletionToken token) override {
+    return true;
+  }
+  absl::Status WaitInternal(CompletionToken token) override {
+    return absl::OkStatus();
+  }
 };
 
-}  // namespace rome
\ No newline at end of file
+}  // namespace rome
@@ -5,22 +5,56 @@
 #include <rdma/rdma_cma.h>
 #include <rdma/rdma_verbs.h>
 
+#include <algorithm>
+#include <concepts>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <limits>
 #include <type_traits>
+#include <utility>
 
 #include "absl/status/status.h"
+#include "rdma_accessor.h"
 #include "rdma_messenger.h"
+#include "rome/logging/logging.h"
 #include "rome/rdma/rdma_memory.h"
 #include "rome/util/status_util.h"
 
 namespace rome::rdma {
 
+// Small, plain structs that are sent by copying their bytes as is, which skips
+// protobuf serialization entirely. Each type declares a `kMessageTag` that is
+// sent ahead of it, so that receiving a different type than expected fails
+// instead of silently reinterpreting the bytes. Both sides must agree on the
+// layout, so these are only meant for peers running the same binary.
+template <typename T>
+concept FixedLayoutMessage = std::is_trivially_copyable_v<T> && requires {
+  { T::kMessageTag } -> std::convertible_to<uint32_t>;
+};
+
 template <typename Messenger, typename Accessor>
 class RdmaChannel : public Messenger, Accessor {
  public:
   ~RdmaChannel() {}
-  explicit RdmaChannel(rdma_cm_id* id) : Messenger(id), Accessor(id), id_(id) {}
+  explicit RdmaChannel(rdma_cm_id* id) : Messenger(id), Accessor(id), id_(id) {
+    // The messenger and the accessor share the QP's send CQ.
+    this->Accessor::ShareSendCompletions(&send_completions_);
+    if constexpr (requires(Messenger& m) {
+                    m.ShareSendCompletions(&send_completions_);
+                  }) {
+      this->Messenger::ShareSendCompletions(&send_completions_);
+    }
+  }
+
+  // For messengers that are not bound to a connection, such as
+  // `UdRdmaMessenger`, which are constructed from `args` instead. The accessor
+  // has no QP to post to, so only messaging is available.
+  template <typename... Args>
+  explicit RdmaChannel(std::in_place_t, Args&&... args)
+      : Messenger(std::forward<Args>(args)...),
+        Accessor(nullptr),
+        id_(nullptr) {}
 
   // No copy or move.
   RdmaChannel(const RdmaChannel& c) = delete;
@@ -29,42 +63,251 @@ class RdmaChannel : public Messenger, Accessor {
   // Getters.
   rdma_cm_id* id() const { return id_; }
 
-  template <typename ProtoType>
-  absl::Status Send(const ProtoType& proto) {
-    Message msg{std::make_unique<uint8_t[]>(proto.ByteSizeLong()),
-                proto.ByteSizeLong()};
-    proto.SerializeToArray(msg.buffer.get(), msg.length);
-    return this->SendMessage(msg);
+  // Messages are either protobufs or `FixedLayoutMessage`s, which are copied
+  // as is instead of being serialized.
+  template <typename MessageType>
+  absl::Status Send(const MessageType& msg) {
+    const size_t length = EncodedSize(msg);
+    if constexpr (ZeroCopyMessenger<Messenger>) {
+      // Encode straight into the messenger's registered send buffer.
+      auto buffer = this->AcquireSendBuffer(length);
+      if (!buffer.ok()) return buffer.status();
+      Encode(msg, *buffer);
+      return this->PostSendBuffer(*buffer, length);
+    } else {
+      Message raw{std::make_unique<uint8_t[]>(length), length};
+      Encode(msg, raw.buffer.get());
+      return this->SendMessage(raw);
+    }
+  }
+
+  // Encodes `msg` as `Send` would, so that a message sent on many channels can
+  // be encoded once and then passed to each one's `SendEncoded`.
+  template <typename MessageType>
+  static Message EncodeMessage(const MessageType& msg) {
+    const size_t length = EncodedSize(msg);
+    Message raw{std::make_unique<uint8_t[]>(length), length};
+    Encode(msg, raw.buffer.get());
+    return raw;
+  }
+
+  absl::Status SendEncoded(const uint8_t* buffer, size_t length) {
+    if constexpr (ZeroCopyMessenger<Messenger>) {
+      auto send_buffer = this->AcquireSendBuffer(length);
+      if (!send_buffer.ok()) return send_buffer.status();
+      std::memcpy(*send_buffer, buffer, length);
+      return this->PostSendBuffer(*send_buffer, length);
+    } else {
+      Message raw{std::make_unique<uint8_t[]>(length), length};
+      std::memcpy(raw.buffer.get(), buffer, length);
+      return this->SendMessage(raw);
+    }
+  }
+
+  template <typename MessageType>
+  absl::StatusOr<MessageType> TryDeliver() {
+    if constexpr (ZeroCopyMessenger<Messenger>) {
+      MessageType msg;
+      auto status = TryHandle<MessageType>([&msg](MessageType& received) {
+        if constexpr (FixedLayoutMessage<MessageType>) {
+          msg = received;
+        } else {
+          msg.Swap(&received);
+        }
+      });
+      if (!status.ok()) return status;
+      return msg;
+    } else {
+      absl::StatusOr<Message> raw = this->TryDeliverMessage();
+      if (!raw.ok()) return raw.status();
+      MessageType msg;
+      ROME_CHECK_QUIET(ROME_RETURN(absl::DataLossError(
+                           "Failed to decode received message")),
+                       Decode(raw->buffer.get(), raw->length, &msg));
+      return msg;
+    }
+  }
+
+  // Decodes the next message directly from the buffer it was received into and
+  // passes it to `handler`. The buffer is returned to the messenger once the
+  // handler returns.
+  template <typename MessageType, typename Handler>
+  absl::Status TryHandle(Handler&& handler)
+    requires ZeroCopyMessenger<Messenger>
+  {
+    auto view = this->TryPeekMessage();
+    if (!view.ok()) return view.status();
+    MessageType msg;
+    bool decoded = Decode(view->buffer, view->length, &msg);
+    if (decoded) handler(msg);
+    auto status = this->ReleaseMessage();
+    if (!status.ok()) return status;
+    ROME_CHECK_QUIET(
+        ROME_RETURN(absl::DataLossError("Failed to decode received message")),
+        decoded);
+    return absl::OkStatus();
+  }
+
+  // Like `TryDeliver`, but first passes the message as it was received to
+  // `forward`, which returns a status, so that it can be passed on with
+  // `SendEncoded` without being encoded again.
+  template <typename MessageType, typename Forward>
+  absl::StatusOr<MessageType> TryDeliverForwarding(Forward&& forward) {
+    MessageType msg;
+    bool decoded;
+    absl::Status status;
+    if constexpr (ZeroCopyMessenger<Messenger>) {
+      auto view = this->TryPeekMessage();
+      if (!view.ok()) return view.status();
+      status = forward(view->buffer, view->length);
+      decoded = Decode(view->buffer, view->length, &msg);
+      auto released = this->ReleaseMessage();
+      if (status.ok()) status = released;
+    } else {
+      auto raw = this->TryDeliverMessage();
+      if (!raw.ok()) return raw.status();
+      status = forward(raw->buffer.get(), raw->length);
+      decoded = Decode(raw->buffer.get(), raw->length, &msg);
+    }
+    if (!status.ok()) return status;
+    ROME_CHECK_QUIET(
+        ROME_RETURN(absl::DataLossError("Failed to decode received message")),
+        decoded);
+    return msg;
   }
 
-  template <typename ProtoType>
-  absl::StatusOr<ProtoType> TryDeliver() {
-    absl::StatusOr<Message> msg_or = this->TryDeliverMessage();
-    if (msg_or.ok()) {
-      ProtoType proto;
-      proto.ParseFromArray(msg_or->buffer.get(), msg_or->length);
-      return proto;
+  // Delivers up to `max_messages` messages that have already arrived, passing
+  // each to `handler` in order, and returns how many were delivered. Messengers
+  // that support it are checked for new messages only once (see
+  // `BatchingMessenger`), and messages are decoded in place into a single
+  // reused message. Returns `absl::UnavailableError()` if there were none. An
+  // error after some messages were delivered ends the batch early, and is
+  // returned by the next call instead, so that the count is never lost.
+  template <typename MessageType, typename Handler>
+  absl::StatusOr<size_t> TryDeliverBatch(
+      Handler&& handler,
+      size_t max_messages = std::numeric_limits<size_t>::max()) {
+    if (!batch_error_.ok()) {
+      return std::exchange(batch_error_, absl::OkStatus());
+    }
+    size_t delivered = 0;
+    absl::Status status;
+    if constexpr (BatchingMessenger<Messenger>) {
+      auto ready = this->TryPeekMessages();
+      if (!ready.ok()) return ready.status();
+      MessageType msg;
+      while (delivered < std::min(*ready, max_messages)) {
+        auto view = this->TryPeekMessage();
+        if (absl::IsUnavailable(view.status())) break;
+        if (!view.ok()) {
+          status = view.status();
+          break;
+        }
+        bool decoded = Decode(view->buffer, view->length, &msg);
+        if (decoded) {
+          handler(msg);
+          ++delivered;
+        }
+        status = this->ReleaseMessage();
+        if (!status.ok()) break;
+        if (!decoded) {
+          status = absl::DataLossError("Failed to decode received message");
+          break;
+        }
+      }
     } else {
-      return msg_or.status();
+      for (; delivered < max_messages; ++delivered) {
+        auto msg = this->TryDeliver<MessageType>();
+        if (absl::IsUnavailable(msg.status())) break;
+        if (!msg.ok()) {
+          status = msg.status();
+          break;
+        }
+        handler(*msg);
+      }
+    }
+    if (!status.ok()) {
+      if (delivered == 0) return status;
+      batch_error_ = status;
     }
+    ROME_CHECK_QUIET(ROME_RETURN(absl::UnavailableError("Retry")),
+                     delivered > 0);
+    return delivered;
   }
 
-  template <typename ProtoType>
-  absl::StatusOr<ProtoType> Deliver() {
-    auto p = this->TryDeliver<ProtoType>();
+  template <typename MessageType>
+  absl::StatusOr<MessageType> Deliver() {
+    auto p = this->TryDeliver<MessageType>();
     while (p.status().code() == absl::StatusCode::kUnavailable) {
-      p = this->TryDeliver<ProtoType>();
+      p = this->TryDeliver<MessageType>();
     }
     return p;
   }
 
+  // One-sided operations go through the accessor (see `RdmaAccessor`). `Post`
+  // returns once `wr` has completed, while `PostAsync` may return as soon as it
+  // is posted.
   absl::Status Post(ibv_send_wr* wr, ibv_send_wr** bad) {
     return this->PostInternal(wr, bad);
   }
 
+  absl::StatusOr<CompletionToken> PostAsync(ibv_send_wr* wr,
+                                            ibv_send_wr** bad) {
+    return this->PostAsyncInternal(wr, bad);
+  }
+
+  absl::StatusOr<bool> TryComplete(CompletionToken token) {
+    return this->TryCompleteInternal(token);
+  }
+
+  absl::Status Wait(CompletionToken token) { return this->WaitInternal(token); }
+
  private:
+  // A fixed-layout message is preceded by its tag. Protobufs are encoded with
+  // the size computed by `EncodedSize`, which must be called first.
+  template <typename MessageType>
+  static size_t EncodedSize(const MessageType& msg) {
+    if constexpr (FixedLayoutMessage<MessageType>) {
+      return sizeof(uint32_t) + sizeof(MessageType);
+    } else {
+      return msg.ByteSizeLong();
+    }
+  }
+
+  template <typename MessageType>
+  static void Encode(const MessageType& msg, uint8_t* buffer) {
+    if constexpr (FixedLayoutMessage<MessageType>) {
+      const uint32_t tag = MessageType::kMessageTag;
+      std::memcpy(buffer, &tag, sizeof(tag));
+      std::memcpy(buffer + sizeof(tag), &msg, sizeof(MessageType));
+    } else {
+      msg.SerializeWithCachedSizesToArray(buffer);
+    }
+  }
+
+  template <typename MessageType>
+  static bool Decode(const uint8_t* buffer, size_t length, MessageType* msg) {
+    if constexpr (FixedLayoutMessage<MessageType>) {
+      uint32_t tag;
+      if (length != sizeof(tag) + sizeof(MessageType)) return false;
+      std::memcpy(&tag, buffer, sizeof(tag));
+      if (tag != MessageType::kMessageTag) return false;
+      std::memcpy(msg, buffer + sizeof(tag), sizeof(MessageType));
+      return true;
+    } else {
+      return msg->ParseFromArray(buffer, length);
+    }
+  }
+
   // A pointer to the QP used to post sends and receives.
   rdma_cm_id* id_;  //! NOT OWNED
+
+  // Completions that the messenger and the accessor poll for each other.
+  SendCompletions send_completions_;
+
+  // An error that ended the last call to `TryDeliverBatch` after it had
+  // delivered some messages, to be returned by the next call.
+  absl::Status batch_error_;
 };
 
 }  // namespace rome::rdma
\ No newline at end of file
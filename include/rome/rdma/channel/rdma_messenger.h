@@ -2,6 +2,11 @@
 
 #include <rdma/rdma_cma.h>
 
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
 
@@ -14,6 +19,13 @@ struct Message {
   size_t length;
 };
 
+// Refers to a received message in place, without copying it out of the memory
+// it was received into. Only valid until the messenger's `ReleaseMessage`.
+struct MessageView {
+  const uint8_t* buffer;
+  size_t length;
+};
+
 class RdmaMessenger {
  public:
   virtual ~RdmaMessenger() = default;
@@ -21,6 +33,31 @@ class RdmaMessenger {
   virtual absl::StatusOr<Message> TryDeliverMessage() = 0;
 };
 
+// Messengers that can hand out their registered buffers directly. A message is
+// sent by writing into the buffer returned by `AcquireSendBuffer` and passing
+// it to `PostSendBuffer`, and received by reading from the view returned by
+// `TryPeekMessage` until calling `ReleaseMessage`, which may fail if returning
+// the message's slot to the peer does. `RdmaChannel` uses these in
+// place of `SendMessage` and `TryDeliverMessage` when they are available.
+template <typename Messenger>
+concept ZeroCopyMessenger = requires(Messenger m, uint8_t* buffer,
+                                     size_t length) {
+  { m.AcquireSendBuffer(length) } -> std::same_as<absl::StatusOr<uint8_t*>>;
+  { m.PostSendBuffer(buffer, length) } -> std::same_as<absl::Status>;
+  { m.TryPeekMessage() } -> std::same_as<absl::StatusOr<MessageView>>;
+  { m.ReleaseMessage() } -> std::same_as<absl::Status>;
+};
+
+// Zero-copy messengers that can report how many messages are ready in one go.
+// `TryPeekMessages` checks for new messages at most once (e.g., with a single
+// `ibv_poll_cq` burst) and returns how many can then be peeked in a row without
+// checking again.
+template <typename Messenger>
+concept BatchingMessenger =
+    ZeroCopyMessenger<Messenger> && requires(Messenger m) {
+      { m.TryPeekMessages() } -> std::same_as<absl::StatusOr<size_t>>;
+    };
+
 class EmptyRdmaMessenger : public RdmaMessenger {
  public:
   ~EmptyRdmaMessenger() = default;
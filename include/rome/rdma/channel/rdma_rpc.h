@@ -0,0 +1,147 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "rdma_messenger.h"
+
+namespace rome::rdma {
+
+// Identifies a method registered with an `RdmaRpcEndpoint`.
+using RpcMethodId = uint32_t;
+
+// Precedes every request and response sent by an `RdmaRpcEndpoint`. A response
+// carries the ID of the request it answers and the code of the handler's
+// status, with the error message in place of the response if it failed.
+struct RpcHeader {
+  uint64_t request_id;
+  RpcMethodId method_id;
+  uint16_t flags;
+  uint16_t code;
+};
+static_assert(sizeof(RpcHeader) == 16, "RPC header must stay compact.");
+
+// Request/response RPCs over a single `RdmaChannel`. Both ends of a connection
+// use an endpoint, and either side may register methods and issue calls. Calls
+// are matched to their responses by request ID, so any number of them may be in
+// flight on the connection at once.
+//
+// Once started, a worker thread is the only user of the channel. It sends the
+// requests queued by `Call`, dispatches received requests to the registered
+// handlers and completes calls as their responses arrive. Handlers run on the
+// worker thread, so a slow handler delays every other call on the connection.
+//
+// The worker never waits to send while it holds a received message, since the
+// peer's worker may be waiting for the credits that releasing it returns.
+// Requests stay queued until the channel can take them, and a response that
+// cannot be sent yet is copied aside and sent once it can.
+template <typename Channel>
+class RdmaRpcEndpoint {
+ public:
+  static constexpr uint16_t kResponse = 1;
+
+  ~RdmaRpcEndpoint();
+  explicit RdmaRpcEndpoint(Channel* channel);
+
+  // No copy or move.
+  RdmaRpcEndpoint(const RdmaRpcEndpoint&) = delete;
+  RdmaRpcEndpoint(RdmaRpcEndpoint&&) = delete;
+
+  // Registers `handler` to answer requests for `method_id`. Methods must be
+  // registered before the endpoint is started. An error returned by the
+  // handler is passed on to the caller in place of a response.
+  template <typename Request, typename Response>
+  absl::Status RegisterMethod(
+      RpcMethodId method_id,
+      std::function<absl::StatusOr<Response>(const Request&)> handler);
+
+  // Starts the worker thread.
+  absl::Status Start();
+
+  // Stops the worker thread. Calls that have not completed yet fail with
+  // `absl::CancelledError()`.
+  void Stop();
+
+  // Queues `request` for the peer's handler of `method_id` and returns a future
+  // that is completed with its response. The request is serialized on the
+  // calling thread, but sent by the worker thread.
+  template <typename Response, typename Request>
+  std::future<absl::StatusOr<Response>> Call(RpcMethodId method_id,
+                                             const Request& request);
+
+ private:
+  // Parses a received request, runs the handler and sends the response.
+  using Method = std::function<absl::Status(const RpcHeader&, MessageView)>;
+
+  // Completes a call with the body of its response, or with its error.
+  using Completion = std::function<void(absl::StatusOr<MessageView>)>;
+
+  // A request or response waiting to be sent.
+  struct QueuedFrame {
+    RpcHeader header;
+    std::string body;
+  };
+
+  void Run();
+
+  // Sends queued requests until the channel cannot take more without waiting
+  // for the peer. Requests are held back while responses are.
+  absl::Status SendRequests() LOCKS_EXCLUDED(mu_);
+
+  // Sends held back responses until the channel cannot take more.
+  absl::Status SendBacklog();
+
+  // Handles the next received message, if there is one.
+  absl::Status TryReceive();
+  absl::Status Dispatch(MessageView msg) LOCKS_EXCLUDED(mu_);
+
+  // Sends a message made of `header` followed by `length` bytes written by
+  // `write` directly into the send buffer. Fails with
+  // `absl::UnavailableError()` if the channel cannot take it yet.
+  template <typename Writer>
+  absl::Status SendFrame(const RpcHeader& header, size_t length,
+                         Writer&& write);
+  absl::Status SendFrame(const QueuedFrame& frame);
+
+  // Sends a response like `SendFrame`, but copies it to `backlog_` if it
+  // cannot be sent yet, since the request it answers is still held.
+  template <typename Writer>
+  absl::Status SendResponse(const RpcHeader& header, size_t length,
+                            Writer&& write);
+  absl::Status SendError(const RpcHeader& request, const absl::Status& status);
+
+  // Fails every call that has not completed yet with `status`.
+  void FailPending(const absl::Status& status) LOCKS_EXCLUDED(mu_);
+
+  Channel* channel_;  //! NOT OWNED
+
+  std::unordered_map<RpcMethodId, Method> methods_;
+
+  // Responses that could not be sent when they were produced, in order. Only
+  // used by the worker thread.
+  std::deque<QueuedFrame> backlog_;
+
+  std::atomic<bool> running_;
+  std::unique_ptr<std::thread> worker_;
+
+  absl::Mutex mu_;
+  bool stopped_ GUARDED_BY(mu_);
+  uint64_t next_request_id_ GUARDED_BY(mu_);
+  std::deque<QueuedFrame> requests_ GUARDED_BY(mu_);
+  std::unordered_map<uint64_t, Completion> pending_ GUARDED_BY(mu_);
+};
+
+}  // namespace rome::rdma
+
+#include "rdma_rpc_impl.h"
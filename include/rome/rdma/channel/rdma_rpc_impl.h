@@ -0,0 +1,291 @@
+#pragma once
+
+#include <cstring>
+
+#include "absl/strings/string_view.h"
+#include "rdma_messenger.h"
+#include "rome/logging/logging.h"
+#include "rome/rdma/channel/rdma_rpc.h"
+#include "rome/util/status_util.h"
+#include "rome/util/thread_util.h"
+
+namespace rome::rdma {
+
+using ::util::AlreadyExistsErrorBuilder;
+using ::util::FailedPreconditionErrorBuilder;
+using ::util::NotFoundErrorBuilder;
+
+template <typename Channel>
+RdmaRpcEndpoint<Channel>::~RdmaRpcEndpoint() {
+  Stop();
+}
+
+template <typename Channel>
+RdmaRpcEndpoint<Channel>::RdmaRpcEndpoint(Channel* channel)
+    : channel_(channel),
+      running_(false),
+      worker_(nullptr),
+      stopped_(false),
+      next_request_id_(0) {}
+
+template <typename Channel>
+template <typename Request, typename Response>
+absl::Status RdmaRpcEndpoint<Channel>::RegisterMethod(
+    RpcMethodId method_id,
+    std::function<absl::StatusOr<Response>(const Request&)> handler) {
+  ROME_CHECK_QUIET(
+      ROME_RETURN(FailedPreconditionErrorBuilder()
+                  << "Cannot register method after starting: " << method_id),
+      worker_ == nullptr);
+  auto method = [this, handler = std::move(handler)](
+                    const RpcHeader& header, MessageView body) -> absl::Status {
+    Request request;
+    if (!request.ParseFromArray(body.buffer, body.length)) {
+      return SendError(header, absl::DataLossError("Failed to parse request"));
+    }
+    auto response = handler(request);
+    if (!response.ok()) return SendError(header, response.status());
+    RpcHeader reply{header.request_id, header.method_id, kResponse,
+                    static_cast<uint16_t>(absl::StatusCode::kOk)};
+    return SendResponse(reply, response->ByteSizeLong(), [&](uint8_t* buffer) {
+      response->SerializeWithCachedSizesToArray(buffer);
+    });
+  };
+  ROME_CHECK_QUIET(ROME_RETURN(AlreadyExistsErrorBuilder()
+                               << "Method already registered: " << method_id),
+                   methods_.emplace(method_id, std::move(method)).second);
+  return absl::OkStatus();
+}
+
+template <typename Channel>
+absl::Status RdmaRpcEndpoint<Channel>::Start() {
+  ROME_CHECK_QUIET(
+      ROME_RETURN(FailedPreconditionErrorBuilder() << "Already started"),
+      worker_ == nullptr);
+  running_ = true;
+  worker_ = std::make_unique<std::thread>([this]() { Run(); });
+  return absl::OkStatus();
+}
+
+template <typename Channel>
+void RdmaRpcEndpoint<Channel>::Stop() {
+  {
+    absl::MutexLock lock(&mu_);
+    stopped_ = true;
+  }
+  running_ = false;
+  if (worker_ != nullptr && worker_->joinable()) worker_->join();
+  FailPending(absl::CancelledError("RPC endpoint stopped"));
+}
+
+template <typename Channel>
+template <typename Response, typename Request>
+std::future<absl::StatusOr<Response>> RdmaRpcEndpoint<Channel>::Call(
+    RpcMethodId method_id, const Request& request) {
+  // Completions are copied into `std::function`, so they share the promise.
+  auto promise = std::make_shared<std::promise<absl::StatusOr<Response>>>();
+  auto future = promise->get_future();
+  std::string body;
+  request.SerializeToString(&body);
+
+  absl::MutexLock lock(&mu_);
+  if (stopped_) {
+    promise->set_value(absl::CancelledError("RPC endpoint stopped"));
+    return future;
+  }
+  auto request_id = next_request_id_++;
+  pending_.emplace(request_id, [promise](absl::StatusOr<MessageView> body) {
+    if (!body.ok()) {
+      promise->set_value(body.status());
+      return;
+    }
+    Response response;
+    if (!response.ParseFromArray(body->buffer, body->length)) {
+      promise->set_value(absl::DataLossError("Failed to parse response"));
+      return;
+    }
+    promise->set_value(std::move(response));
+  });
+  requests_.push_back(
+      QueuedFrame{RpcHeader{request_id, method_id, 0, 0}, std::move(body)});
+  return future;
+}
+
+template <typename Channel>
+void RdmaRpcEndpoint<Channel>::Run() {
+  while (running_) {
+    auto status = SendBacklog();
+    if (status.ok()) status = SendRequests();
+    if (status.ok()) status = TryReceive();
+    if (status.ok()) continue;
+    if (absl::IsUnavailable(status)) {
+      cpu_relax();
+      continue;
+    }
+
+    // The channel is unusable, so no call in flight will ever complete.
+    ROME_ERROR("RPC worker stopped: {}", status.ToString());
+    {
+      absl::MutexLock lock(&mu_);
+      stopped_ = true;
+    }
+    FailPending(status);
+    return;
+  }
+}
+
+template <typename Channel>
+absl::Status RdmaRpcEndpoint<Channel>::SendRequests() {
+  if (!backlog_.empty()) return absl::OkStatus();
+  while (true) {
+    QueuedFrame request;
+    {
+      absl::MutexLock lock(&mu_);
+      if (requests_.empty()) return absl::OkStatus();
+      request = std::move(requests_.front());
+      requests_.pop_front();
+    }
+    auto status = SendFrame(request);
+    if (absl::IsUnavailable(status)) {
+      // Receiving the peer's messages frees up the channel, so try again then.
+      absl::MutexLock lock(&mu_);
+      requests_.push_front(std::move(request));
+      return absl::OkStatus();
+    }
+    if (!status.ok()) return status;
+  }
+}
+
+template <typename Channel>
+absl::Status RdmaRpcEndpoint<Channel>::SendBacklog() {
+  while (!backlog_.empty()) {
+    auto status = SendFrame(backlog_.front());
+    if (absl::IsUnavailable(status)) return absl::OkStatus();
+    if (!status.ok()) return status;
+    backlog_.pop_front();
+  }
+  return absl::OkStatus();
+}
+
+template <typename Channel>
+absl::Status RdmaRpcEndpoint<Channel>::TryReceive() {
+  if constexpr (ZeroCopyMessenger<Channel>) {
+    auto view = channel_->TryPeekMessage();
+    if (!view.ok()) return view.status();
+    auto status = Dispatch(*view);
+    auto released = channel_->ReleaseMessage();
+    return status.ok() ? released : status;
+  } else {
+    auto msg = channel_->TryDeliverMessage();
+    if (!msg.ok()) return msg.status();
+    return Dispatch(MessageView{msg->buffer.get(), msg->length});
+  }
+}
+
+template <typename Channel>
+absl::Status RdmaRpcEndpoint<Channel>::Dispatch(MessageView msg) {
+  ROME_CHECK_QUIET(
+      ROME_RETURN(absl::DataLossError("Message is shorter than RPC header")),
+      msg.length >= sizeof(RpcHeader));
+  RpcHeader header;
+  std::memcpy(&header, msg.buffer, sizeof(header));
+  MessageView body{msg.buffer + sizeof(header), msg.length - sizeof(header)};
+
+  if (!(header.flags & kResponse)) {
+    auto iter = methods_.find(header.method_id);
+    if (iter == methods_.end()) {
+      return SendError(header, NotFoundErrorBuilder()
+                                   << "Unknown method: " << header.method_id);
+    }
+    return iter->second(header, body);
+  }
+
+  Completion completion;
+  {
+    absl::MutexLock lock(&mu_);
+    auto node = pending_.extract(header.request_id);
+    if (node.empty()) {
+      ROME_WARN("Dropping response to unknown request: {}", header.request_id);
+      return absl::OkStatus();
+    }
+    completion = std::move(node.mapped());
+  }
+  auto code = static_cast<absl::StatusCode>(header.code);
+  if (code == absl::StatusCode::kOk) {
+    completion(body);
+  } else {
+    completion(absl::Status(
+        code, absl::string_view(reinterpret_cast<const char*>(body.buffer),
+                                body.length)));
+  }
+  return absl::OkStatus();
+}
+
+template <typename Channel>
+template <typename Writer>
+absl::Status RdmaRpcEndpoint<Channel>::SendFrame(const RpcHeader& header,
+                                                 size_t length,
+                                                 Writer&& write) {
+  const size_t total = sizeof(RpcHeader) + length;
+  if constexpr (ZeroCopyMessenger<Channel>) {
+    auto buffer = channel_->AcquireSendBuffer(total);
+    if (!buffer.ok()) return buffer.status();
+    std::memcpy(*buffer, &header, sizeof(header));
+    write(*buffer + sizeof(header));
+    return channel_->PostSendBuffer(*buffer, total);
+  } else {
+    Message msg{std::make_unique<uint8_t[]>(total), total};
+    std::memcpy(msg.buffer.get(), &header, sizeof(header));
+    write(msg.buffer.get() + sizeof(header));
+    return channel_->SendMessage(msg);
+  }
+}
+
+template <typename Channel>
+absl::Status RdmaRpcEndpoint<Channel>::SendFrame(const QueuedFrame& frame) {
+  return SendFrame(frame.header, frame.body.size(), [&frame](uint8_t* buffer) {
+    std::memcpy(buffer, frame.body.data(), frame.body.size());
+  });
+}
+
+template <typename Channel>
+template <typename Writer>
+absl::Status RdmaRpcEndpoint<Channel>::SendResponse(const RpcHeader& header,
+                                                    size_t length,
+                                                    Writer&& write) {
+  // Responses already held back go first, so this one would not get through.
+  if (backlog_.empty()) {
+    auto status = SendFrame(header, length, write);
+    if (!absl::IsUnavailable(status)) return status;
+  }
+  std::string body(length, '\0');
+  write(reinterpret_cast<uint8_t*>(body.data()));
+  backlog_.push_back(QueuedFrame{header, std::move(body)});
+  return absl::OkStatus();
+}
+
+template <typename Channel>
+absl::Status RdmaRpcEndpoint<Channel>::SendError(const RpcHeader& request,
+                                                 const absl::Status& status) {
+  RpcHeader reply{request.request_id, request.method_id, kResponse,
+                  static_cast<uint16_t>(status.code())};
+  auto message = status.message();
+  return SendResponse(reply, message.size(), [&message](uint8_t* buffer) {
+    std::memcpy(buffer, message.data(), message.size());
+  });
+}
+
+template <typename Channel>
+void RdmaRpcEndpoint<Channel>::FailPending(const absl::Status& status) {
+  std::unordered_map<uint64_t, Completion> pending;
+  {
+    absl::MutexLock lock(&mu_);
+    pending.swap(pending_);
+    requests_.clear();
+  }
+  for (auto& [request_id, completion] : pending) {
+    completion(status);
+  }
+}
+
+}  // namespace rome::rdma
@@ -7,14 +7,25 @@
 
 namespace rome::rdma {
 
+// Waits for every posted chain to complete before returning, so the tokens it
+// hands out are always complete. Only one thread may post at a time, since
+// each waits for the completion of its own chain on the send CQ. A chain may
+// be at most as long as the accessor's share of the SQ (see
+// `SendCompletions`).
 class SyncRdmaAccessor : public RdmaAccessor {
  public:
   ~SyncRdmaAccessor() = default;
   explicit SyncRdmaAccessor(rdma_cm_id* id);
   absl::Status PostInternal(ibv_send_wr* wr, ibv_send_wr** bad) override;
+  absl::StatusOr<CompletionToken> PostAsyncInternal(ibv_send_wr* wr,
+                                                    ibv_send_wr** bad) override;
+  absl::StatusOr<bool> TryCompleteInternal(CompletionToken token) override;
+  absl::Status WaitInternal(CompletionToken token) override;
 
  private:
   rdma_cm_id* id_;  //! NOT OWNED
+  uint64_t sq_depth_;
+  CompletionToken posted_;
 };
 
-}  // namespace rome
\ No newline at end of file
+}  // namespace rome
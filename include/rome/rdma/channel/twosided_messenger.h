@@ -2,6 +2,12 @@
 
 #include <rdma/rdma_verbs.h>
 
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "rdma_accessor.h"
 #include "rdma_messenger.h"
 #include "rome/logging/logging.h"
 #include "rome/rdma/rdma_memory.h"
@@ -12,29 +18,140 @@ namespace rome::rdma {
 
 using ::util::InternalErrorBuilder;
 using ::util::ResourceExhaustedErrorBuilder;
-
+using ::util::UnavailableErrorBuilder;
+
+// Sends messages into receive buffers posted by the peer, which is assumed to
+// use the same template arguments. Flow control is credit based: each message
+// consumes one of the peer's receive slots, and the peer returns credits as it
+// releases and reposts slots, so a sender never overruns the peer's RQ.
+// Credits are returned in the immediate data of outgoing messages, or in a
+// credit-only message that uses one of `kReservedSlots` slots set aside for
+// them if the peer has nothing to send.
+//
+// Messages of `kRecvMaxBytes` or more use a rendezvous protocol: the payload is
+// staged in registered memory and advertised in a small header message, and
+// the receiver pulls it with a single RDMA read before delivering it.
 template <uint32_t kCapacity = 1ul << 12, uint32_t kRecvMaxBytes = 1ul << 8>
 class TwoSidedRdmaMessenger : public RdmaMessenger {
   static_assert(kCapacity % 2 == 0, "Capacity must be divisible by two.");
 
  public:
+  static constexpr uint32_t kRecvSlots = (kCapacity / 2) / kRecvMaxBytes;
+  static constexpr uint32_t kReservedSlots = 2;
+  static constexpr uint32_t kInitialCredits = kRecvSlots - kReservedSlots;
+  static_assert(kRecvSlots > kReservedSlots, "Not enough receive slots.");
+
   explicit TwoSidedRdmaMessenger(rdma_cm_id* id);
 
+  // Posts the message and returns without waiting for it to complete. Sends are
+  // only signaled periodically, and the space they occupy in the send buffer is
+  // reclaimed as signaled completions arrive. A send blocks when the send
+  // buffer or the SQ is full, or when it has no credits left, in which case it
+  // waits for the peer to consume earlier messages. Since the peer may in turn
+  // be waiting for credits, a send without credits instead fails with
+  // `absl::UnavailableError()` if received messages are still held; the caller
+  // should release them before retrying. Messages of any size up to 4 GiB may
+  // be sent.
   absl::Status SendMessage(const Message& msg) override;
 
+  // Waits until every signaled send has completed.
+  absl::Status Flush();
+
+  // Sends share the QP's send CQ with the channel's accessor, so completions
+  // polled by either are passed on to the other through `shared`. They also
+  // share the SQ, so from then on only the messenger's part of it is used.
+  void ShareSendCompletions(SendCompletions* shared) {
+    send_completions_ = shared;
+    sq_depth_ = SendCompletions::MessengerDepth(sq_depth_);
+    signal_interval_ = std::max(sq_depth_ / 2, 1u);
+  }
+
   // Attempts to deliver a sent message by checking for completed receives and
   // then returning a `Message` containing a copy of the received buffer.
   absl::StatusOr<Message> TryDeliverMessage() override;
 
+  // Zero-copy interface (see `ZeroCopyMessenger`). The buffer returned by
+  // `AcquireSendBuffer` is a slot in the registered send buffer and is only
+  // valid until the next send. A peeked message occupies its receive slot, and
+  // repeated calls return it again, until it is released. A staged message is
+  // only returned once its payload has been read, until then calls return
+  // `absl::UnavailableError()`. Releasing a message reposts its slot and
+  // returns a credit to the peer, which may require a credit-only send.
+  absl::StatusOr<uint8_t*> AcquireSendBuffer(size_t length);
+  absl::Status PostSendBuffer(uint8_t* buffer, size_t length);
+  absl::StatusOr<MessageView> TryPeekMessage();
+  absl::Status ReleaseMessage();
+
+  // Polls the recv CQ once if no received messages are waiting, and returns
+  // the number that are (see `BatchingMessenger`). A single poll returns at
+  // most 64 completions, so it may leave some on the CQ for the next call.
+  absl::StatusOr<size_t> TryPeekMessages();
+
  private:
   // Memorry region IDs.
   static constexpr char kSendId[] = "send";
   static constexpr char kRecvId[] = "recv";
 
-  // Reset the receive buffer and post `ibv_recv_wr` on the RQ. This should only
-  // be called when all posted receives have corresponding completions,
-  // otherwise there may be a race on memory by posted recvs.
-  void PrepareRecvBuffer();
+  // Immediate data carries returned credits, with the high bits marking
+  // credit-only and rendezvous messages.
+  static constexpr uint32_t kCreditOnly = 1u << 31;
+  static constexpr uint32_t kRendezvous = 1u << 30;
+  static constexpr uint32_t kCreditMask = kRendezvous - 1;
+
+  // Staging and landing buffers for rendezvous messages are sized in powers of
+  // two, starting at this size.
+  static constexpr uint64_t kMinStagingBytes = 1ul << 16;
+
+  // Sent in place of a large message, describing where to read it from.
+  struct RendezvousHeader {
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t length;
+  };
+  static_assert(sizeof(RendezvousHeader) < kRecvMaxBytes,
+                "Receive slots cannot hold a rendezvous header.");
+
+  // Credits owed to the peer are sent in a credit-only message once they reach
+  // this many, so that the peer does not stall while this side only receives.
+  // Until the peer polls its RQ, it can send at most `kInitialCredits`
+  // messages, so this side sends at most `kInitialCredits / kCreditThreshold`
+  // credit-only messages, which must fit in the reserved slots.
+  static constexpr uint32_t kCreditThreshold =
+      (kInitialCredits + kReservedSlots - 1) / kReservedSlots;
+  static_assert(kCreditThreshold > 0 &&
+                    kInitialCredits / kCreditThreshold <= kReservedSlots,
+                "Credit-only messages can overrun the reserved slots.");
+
+  // Posts the receive slot with index `slot` on the RQ.
+  void PostRecv(uint32_t slot);
+
+  // Returns space for a message of `length` bytes in the send buffer, or in a
+  // staging buffer for rendezvous messages.
+  absl::StatusOr<uint8_t*> AcquireRingBuffer(size_t length);
+  uint8_t* AcquireStagingBuffer(size_t length);
+
+  // Posts a read of the payload of a rendezvous message into `landing_`, and
+  // sets `wr_id` to the ID of its work request. Returns
+  // `absl::UnavailableError()` if the SQ is full.
+  absl::Status ReadStaged(const RendezvousHeader& header, uint32_t* wr_id);
+
+  // Posts a send of `length` bytes at `buffer`, piggybacking any credits owed
+  // to the peer.
+  absl::Status PostSend(uint8_t* buffer, size_t length, uint32_t flags);
+
+  // Polls the recv CQ. Credits are collected from every completion, credit-only
+  // messages are reposted immediately and other messages are queued until they
+  // are released.
+  absl::Status PollRecvCompletions();
+
+  // Returns whether a message of `length` bytes can be sent without first
+  // reclaiming space in the send buffer or the SQ.
+  bool HasSendSpace(size_t length) const;
+
+  // Polls the send CQ and reclaims the send buffer up to the latest completed
+  // signaled send.
+  absl::Status PollSendCompletions();
+  void OnSendCompletion(uint64_t wr_id);
 
   // The remotely accessible memory used for the send and recv buffers.
   RdmaMemory rm_;
@@ -51,7 +168,28 @@ class TwoSidedRdmaMessenger : public RdmaMessenger {
   // Pointer to the base address and next unposted address of send buffer.
   uint8_t *send_base_, *send_next_;
 
+  // Oldest address in the send buffer that may still be read by a posted send.
+  uint8_t* send_head_;
+
+  // Number of sends posted and known to be complete. Their difference is the
+  // number of sends that may still occupy the SQ.
   uint32_t send_total_;
+  uint32_t send_acked_;
+
+  // Maximum number of outstanding sends, and how often they are signaled.
+  uint32_t sq_depth_;
+  uint32_t signal_interval_;
+  uint32_t unsignaled_;
+
+  // Signaled sends that have not completed, in the order they were posted.
+  struct SignaledSend {
+    uint32_t wr_id;
+    uint8_t* next;  // `send_next_` after posting it.
+  };
+  std::deque<SignaledSend> signaled_;
+
+  // Passes completions to and from the accessor, if there is one.
+  SendCompletions* send_completions_ = nullptr;  //! NOT OWNED
 
   // Pointer to memory region identified by `kRecvId`.
   ibv_mr* recv_mr_;
@@ -59,13 +197,44 @@ class TwoSidedRdmaMessenger : public RdmaMessenger {
   // Size of the recv buffer.
   const int recv_capacity_;
 
-  // Pointer to base address and next unposted address.
-  uint8_t *recv_base_, *recv_next_;
-
-  // Tracks the number of completed receives. This is used by
-  // `PrepareRecvBuffer()` to ensure that it is only called when all posted
-  // receives have been completed.
-  uint32_t recv_total_;
+  // Pointer to base address of the recv buffer.
+  uint8_t* recv_base_;
+
+  // Received messages that have not been released, in the order they arrived.
+  struct Received {
+    uint32_t slot;
+    uint32_t length;
+    bool rendezvous;
+    // Whether the read of a rendezvous payload was posted, as `read_wr_id`, and
+    // whether it has completed.
+    bool reading;
+    bool fetched;
+    uint32_t read_wr_id;
+  };
+  std::deque<Received> received_;
+
+  // Messages that may still be sent to the peer, and credits owed to the peer
+  // for slots that were reposted since the last send.
+  uint32_t send_credits_;
+  uint32_t recv_credits_;
+
+  // Number of messages sent, and how many of those the peer has released.
+  uint64_t send_messages_;
+  uint64_t send_released_;
+
+  // Registered memory holding the payloads of rendezvous messages sent, each
+  // tagged with the number of messages the peer must have released before it
+  // is free again. That is one past the index of the message that advertised
+  // it, or zero if it is not in use.
+  struct StagingBuffer {
+    std::unique_ptr<RdmaMemory> memory;
+    uint64_t released_after;
+  };
+  std::vector<StagingBuffer> staging_;
+
+  // Registered memory that the payload of the next rendezvous message received
+  // is read into.
+  std::unique_ptr<RdmaMemory> landing_;
 };
 
 }  // namespace rome
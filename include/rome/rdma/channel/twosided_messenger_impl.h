@@ -1,8 +1,13 @@
 #pragma once
 
+#include <arpa/inet.h>
 #include <rdma/rdma_cma.h>
 #include <rdma/rdma_verbs.h>
 
+#include <algorithm>
+#include <bit>
+#include <limits>
+
 #include "rdma_messenger.h"
 #include "rome/logging/logging.h"
 #include "rome/rdma/channel/twosided_messenger.h"
@@ -22,8 +27,13 @@ TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::TwoSidedRdmaMessenger(
       id_(id),
       send_capacity_(kCapacity / 2),
       send_total_(0),
+      send_acked_(0),
+      unsignaled_(0),
       recv_capacity_(kCapacity / 2),
-      recv_total_(0) {
+      send_credits_(kInitialCredits),
+      recv_credits_(0),
+      send_messages_(0),
+      send_released_(0) {
   ROME_ASSERT_OK(rm_.RegisterMemoryRegion(kSendId, 0, send_capacity_));
   ROME_ASSERT_OK(
       rm_.RegisterMemoryRegion(kRecvId, send_capacity_, recv_capacity_));
@@ -31,123 +41,416 @@ TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::TwoSidedRdmaMessenger(
   recv_mr_ = VALUE_OR_DIE(rm_.GetMemoryRegion(kRecvId));
   send_base_ = reinterpret_cast<uint8_t*>(send_mr_->addr);
   send_next_ = send_base_;
+  send_head_ = send_base_;
   recv_base_ = reinterpret_cast<uint8_t*>(recv_mr_->addr);
-  recv_next_ = recv_base_;
-  PrepareRecvBuffer();
+
+  ibv_qp_attr attr;
+  ibv_qp_init_attr init_attr;
+  RDMA_CM_ASSERT(ibv_query_qp, id_->qp, &attr, IBV_QP_CAP, &init_attr);
+  ROME_ASSERT(init_attr.cap.max_recv_wr >= kRecvSlots,
+              "Receive queue holds {} work requests, but needs {}",
+              init_attr.cap.max_recv_wr, kRecvSlots);
+  sq_depth_ = std::max(init_attr.cap.max_send_wr, 1u);
+  signal_interval_ = std::max(sq_depth_ / 2, 1u);
+
+  for (uint32_t slot = 0; slot < kRecvSlots; ++slot) {
+    PostRecv(slot);
+  }
 }
 
 template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
 absl::Status TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::SendMessage(
     const Message& msg) {
-  // The proto we send may not be larger than the maximum size received at the
-  // peer. We assume that everyone uses the same value, so we check what we
-  // know locally instead of doing something fancy to ask the remote node.
+  auto buffer = AcquireSendBuffer(msg.length);
+  if (!buffer.ok()) return buffer.status();
+  std::memcpy(*buffer, msg.buffer.get(), msg.length);
+  return PostSendBuffer(*buffer, msg.length);
+}
+
+template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
+absl::StatusOr<uint8_t*>
+TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::AcquireSendBuffer(
+    size_t length) {
   ROME_CHECK_QUIET(ROME_RETURN(ResourceExhaustedErrorBuilder()
-                               << "Message too large: expected<="
-                               << kRecvMaxBytes << ", actual=" << msg.length),
-                   msg.length < kRecvMaxBytes);
+                               << "Message too large: " << length),
+                   length <= std::numeric_limits<uint32_t>::max());
+  while (send_credits_ == 0) {
+    auto status = PollRecvCompletions();
+    if (!status.ok()) return status;
+    // The peer may be waiting for the credits that releasing our received
+    // messages returns, so only wait for credits if we hold none of them.
+    ROME_CHECK_QUIET(ROME_RETURN(UnavailableErrorBuilder()
+                                 << "Out of send credits with "
+                                 << received_.size()
+                                 << " received messages unreleased"),
+                     send_credits_ > 0 || received_.empty());
+  }
+
+  // Messages that may not fit in the peer's receive slots are staged for the
+  // peer to read. We assume that everyone uses the same `kRecvMaxBytes`, so we
+  // check what we know locally instead of asking the remote node.
+  // The header advertising a staged message is reserved first, so that a
+  // staging buffer is only taken once the message can actually be sent.
+  if (length >= kRecvMaxBytes) {
+    auto header = AcquireRingBuffer(sizeof(RendezvousHeader));
+    if (!header.ok()) return header.status();
+    return AcquireStagingBuffer(length);
+  }
+  return AcquireRingBuffer(length);
+}
+
+template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
+absl::StatusOr<uint8_t*>
+TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::AcquireRingBuffer(
+    size_t length) {
+  while (!HasSendSpace(length)) {
+    auto status = PollSendCompletions();
+    if (!status.ok()) return status;
+  }
 
   // If the new message will not fit in remaining memory, then we reset the
   // head pointer to the beginning.
-  auto tail = send_next_ + msg.length;
-  auto end = send_base_ + send_capacity_;
-  if (tail > end) {
+  if (send_total_ == send_acked_) {
+    send_next_ = send_head_ = send_base_;
+  } else if (send_next_ >= send_head_ &&
+             send_next_ + length > send_base_ + send_capacity_) {
     send_next_ = send_base_;
   }
-  std::memcpy(send_next_, msg.buffer.get(), msg.length);
+  return send_next_;
+}
+
+template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
+uint8_t* TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::AcquireStagingBuffer(
+    size_t length) {
+  // A staging buffer can be reused once the peer has released the message that
+  // advertised it, which it does only after reading the payload. Messages are
+  // released in order, so this is known from the credits it has returned. The
+  // buffer is only taken by `PostSendBuffer`, so one that is never posted stays
+  // free.
+  StagingBuffer* staging = nullptr;
+  for (auto& buffer : staging_) {
+    if (buffer.released_after <= send_released_ &&
+        buffer.memory->capacity() >= length &&
+        (staging == nullptr ||
+         buffer.memory->capacity() < staging->memory->capacity())) {
+      staging = &buffer;
+    }
+  }
+  if (staging != nullptr) return staging->memory->raw();
+
+  // Every free buffer is too small, so they are deregistered in favor of the
+  // new one. What remains is one buffer per message in flight, which the
+  // credits bound.
+  std::erase_if(staging_, [this](const StagingBuffer& buffer) {
+    return buffer.released_after <= send_released_;
+  });
+  auto capacity = std::max<uint64_t>(std::bit_ceil(length), kMinStagingBytes);
+  staging = &staging_.emplace_back(
+      StagingBuffer{std::make_unique<RdmaMemory>(capacity, id_->pd), 0});
+  return staging->memory->raw();
+}
+
+template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
+absl::Status TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::PostSendBuffer(
+    uint8_t* buffer, size_t length) {
+  if (length < kRecvMaxBytes) {
+    ROME_ASSERT_DEBUG(buffer == send_next_,
+                      "Send buffer was not acquired: {} (expected={})",
+                      fmt::ptr(buffer), fmt::ptr(send_next_));
+    --send_credits_;
+    ++send_messages_;
+    return PostSend(buffer, length, 0);
+  }
+
+  // Advertise the staged payload in a header that fits in a receive slot.
+  auto staging = std::find_if(
+      staging_.begin(), staging_.end(),
+      [buffer](const auto& s) { return s.memory->raw() == buffer; });
+  ROME_ASSERT_DEBUG(staging != staging_.end(),
+                    "Send buffer was not acquired: {}", fmt::ptr(buffer));
+  auto header = AcquireRingBuffer(sizeof(RendezvousHeader));
+  if (!header.ok()) return header.status();
+  auto* mr = staging->memory->GetDefaultMemoryRegion();
+  *reinterpret_cast<RendezvousHeader*>(*header) = RendezvousHeader{
+      reinterpret_cast<uint64_t>(buffer), mr->rkey,
+      static_cast<uint32_t>(length)};
+  staging->released_after = send_messages_ + 1;
+  --send_credits_;
+  ++send_messages_;
+  return PostSend(*header, sizeof(RendezvousHeader), kRendezvous);
+}
 
-  // Copy the proto into the send buffer.
+template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
+absl::Status TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::PostSend(
+    uint8_t* buffer, size_t length, uint32_t flags) {
   ibv_sge sge;
   std::memset(&sge, 0, sizeof(sge));
-  sge.addr = reinterpret_cast<uint64_t>(send_next_);
-  sge.length = msg.length;
+  sge.addr = reinterpret_cast<uint64_t>(buffer);
+  sge.length = length;
   sge.lkey = send_mr_->lkey;
 
   // Note that we use a custom `ibv_send_wr` here since we want to add an
   // immediate. Otherwise we could have just used `rdma_post_send()`.
   ibv_send_wr wr;
   std::memset(&wr, 0, sizeof(wr));
-  wr.send_flags = IBV_SEND_SIGNALED;
-  wr.num_sge = 1;
+  wr.num_sge = length > 0 ? 1 : 0;
   wr.sg_list = &sge;
   wr.opcode = IBV_WR_SEND_WITH_IMM;
+  wr.imm_data = htonl(flags | recv_credits_);
   wr.wr_id = send_total_++;
+  recv_credits_ = 0;
+  send_next_ = buffer + length;
+
+  // Unsignaled sends are only known to be complete once a later signaled send
+  // completes. So, a send is signaled whenever the next one might otherwise
+  // have to wait for space that would never be reclaimed.
+  if (++unsignaled_ >= signal_interval_ || !HasSendSpace(kRecvMaxBytes)) {
+    wr.send_flags = IBV_SEND_SIGNALED;
+    signaled_.push_back({static_cast<uint32_t>(wr.wr_id), send_next_});
+    unsignaled_ = 0;
+  }
 
   ibv_send_wr* bad_wr;
   RDMA_CM_CHECK(ibv_post_send, id_->qp, &wr, &bad_wr);
+  return absl::OkStatus();
+}
 
-  // Assumes that the CQ associated with the SQ is synchronous.
-  ibv_wc wc;
-  int comps = rdma_get_send_comp(id_, &wc);
-  while (comps < 0 && errno == EAGAIN) {
-    comps = rdma_get_send_comp(id_, &wc);
+template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
+absl::Status TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::Flush() {
+  while (!signaled_.empty()) {
+    auto status = PollSendCompletions();
+    if (!status.ok()) return status;
   }
+  return absl::OkStatus();
+}
 
-  if (comps < 0) {
-    return util::InternalErrorBuilder()
-           << "rdma_get_send_comp: {}" << strerror(errno);
-  } else if (wc.status != IBV_WC_SUCCESS) {
-    return util::InternalErrorBuilder()
-           << "rdma_get_send_comp(): " << ibv_wc_status_str(wc.status);
+template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
+bool TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::HasSendSpace(
+    size_t length) const {
+  if (send_total_ - send_acked_ >= sq_depth_) return false;
+  if (send_total_ == send_acked_) return true;
+  // Posted sends occupy `[send_head_, send_next_)`, or wrap around the end of
+  // the buffer if `send_next_` is behind `send_head_`.
+  if (send_next_ >= send_head_) {
+    return send_next_ + length <= send_base_ + send_capacity_ ||
+           send_base_ + length < send_head_;
   }
+  return send_next_ + length < send_head_;
+}
 
-  send_next_ += msg.length;
+template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
+absl::Status
+TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::PollSendCompletions() {
+  static constexpr int kMaxPoll = 16;
+  ibv_wc wcs[kMaxPoll];
+  int comps = ibv_poll_cq(id_->send_cq, kMaxPoll, wcs);
+  if (comps < 0 && errno != EAGAIN) {
+    return util::InternalErrorBuilder() << "ibv_poll_cq(): " << strerror(errno);
+  }
+  // The accessor's completions are passed on before reporting a failure, so
+  // that it still sees those that were polled here, failed ones included.
+  absl::Status status = absl::OkStatus();
+  for (int i = 0; i < comps; ++i) {
+    if (SendCompletions::IsAccessor(wcs[i].wr_id)) {
+      if (send_completions_ != nullptr) {
+        send_completions_->PassToAccessor(wcs[i].wr_id, wcs[i].status);
+      }
+    } else if (wcs[i].status == IBV_WC_SUCCESS) {
+      OnSendCompletion(wcs[i].wr_id);
+    }
+    if (wcs[i].status != IBV_WC_SUCCESS && status.ok()) {
+      status = util::InternalErrorBuilder()
+               << "ibv_poll_cq(): " << ibv_wc_status_str(wcs[i].status);
+    }
+  }
+  if (!status.ok()) return status;
+  if (send_completions_ != nullptr) {
+    for (auto wc : send_completions_->TakeMessengerCompletions()) {
+      if (wc.status != IBV_WC_SUCCESS) {
+        return util::InternalErrorBuilder()
+               << "ibv_poll_cq(): " << ibv_wc_status_str(wc.status);
+      }
+      OnSendCompletion(wc.wr_id);
+    }
+  }
   return absl::OkStatus();
 }
 
+template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
+void TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::OnSendCompletion(
+    uint64_t wr_id) {
+  // Completions arrive in order, so this send and every one before it has
+  // completed. One passed on by the accessor may arrive after a later one, in
+  // which case it was already accounted for.
+  auto iter = std::find_if(
+      signaled_.begin(), signaled_.end(), [wr_id](const SignaledSend& send) {
+        return send.wr_id == static_cast<uint32_t>(wr_id);
+      });
+  if (iter == signaled_.end()) return;
+  send_head_ = iter->next;
+  send_acked_ = iter->wr_id + 1;
+  signaled_.erase(signaled_.begin(), iter + 1);
+}
+
 // Attempts to deliver a sent message by checking for completed receives and
 // then returning a `Message` containing a copy of the received buffer.
 template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
 absl::StatusOr<Message>
 TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::TryDeliverMessage() {
-  ibv_wc wc;
-  auto ret = rdma_get_recv_comp(id_, &wc);
-  if (ret < 0 && errno != EAGAIN) {
-    return util::InternalErrorBuilder()
-           << "rdma_get_recv_comp: " << strerror(errno);
-  } else if (ret < 0 && errno == EAGAIN) {
-    return absl::UnavailableError("Retry");
-  } else {
-    switch (wc.status) {
-      case IBV_WC_WR_FLUSH_ERR:
-        return absl::AbortedError("QP in error state");
-      case IBV_WC_SUCCESS: {
-        // Prepare the response.
-        Message msg;
-        msg.buffer = std::make_unique<uint8_t[]>(wc.byte_len);
-        std::memcpy(msg.buffer.get(), recv_next_, wc.byte_len);
-        msg.length = wc.byte_len;
-
-        // If the tail reached the end of the receive buffer then all posted
-        // wrs have been consumed and we can post new ones.
-        // `PrepareRecvBuffer` also handles resetting `recv_next_` to point to
-        // the base address of the receive buffer.
-        recv_total_++;
-        recv_next_ += kRecvMaxBytes;
-        if (recv_next_ > recv_base_ + (recv_capacity_ - kRecvMaxBytes)) {
-          PrepareRecvBuffer();
-        }
-        return msg;
-      }
-      default:
-        return InternalErrorBuilder()
-               << "rdma_get_recv_comp(): " << ibv_wc_status_str(wc.status);
+  auto view = TryPeekMessage();
+  if (!view.ok()) return view.status();
+
+  // Prepare the response.
+  Message msg;
+  msg.buffer = std::make_unique<uint8_t[]>(view->length);
+  std::memcpy(msg.buffer.get(), view->buffer, view->length);
+  msg.length = view->length;
+  auto status = ReleaseMessage();
+  if (!status.ok()) return status;
+  return msg;
+}
+
+template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
+absl::StatusOr<MessageView>
+TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::TryPeekMessage() {
+  if (received_.empty()) {
+    auto status = PollRecvCompletions();
+    if (!status.ok()) return status;
+    if (received_.empty()) return absl::UnavailableError("Retry");
+  }
+  auto& received = received_.front();
+  auto* slot = recv_base_ + received.slot * kRecvMaxBytes;
+  if (!received.rendezvous) return MessageView{slot, received.length};
+
+  RendezvousHeader header;
+  std::memcpy(&header, slot, sizeof(header));
+  if (!received.fetched) {
+    if (!received.reading) {
+      auto status = ReadStaged(header, &received.read_wr_id);
+      if (!status.ok()) return status;
+      received.reading = true;
     }
+    auto status = PollSendCompletions();
+    if (!status.ok()) return status;
+    // The read is signaled, so it has completed once it is no longer tracked.
+    auto pending = std::find_if(signaled_.begin(), signaled_.end(),
+                                [&received](const SignaledSend& send) {
+                                  return send.wr_id == received.read_wr_id;
+                                });
+    if (pending != signaled_.end()) return absl::UnavailableError("Retry");
+    received.fetched = true;
+  }
+  return MessageView{landing_->raw(), header.length};
+}
+
+template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
+absl::StatusOr<size_t>
+TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::TryPeekMessages() {
+  if (received_.empty()) {
+    auto status = PollRecvCompletions();
+    if (!status.ok()) return status;
   }
+  return received_.size();
 }
 
 template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
-void TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::PrepareRecvBuffer() {
-  ROME_ASSERT(recv_total_ % (recv_capacity_ / kRecvMaxBytes) == 0,
-              "Unexpected number of completions from RQ");
-  // Prepare the recv buffer for incoming messages with the assumption that
-  // the maximum received message will be `max_recv_` bytes long.
-  for (auto curr = recv_base_;
-       curr <= recv_base_ + (recv_capacity_ - kRecvMaxBytes);
-       curr += kRecvMaxBytes) {
-    RDMA_CM_ASSERT(rdma_post_recv, id_, nullptr, curr, kRecvMaxBytes, recv_mr_);
+absl::Status TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::ReadStaged(
+    const RendezvousHeader& header, uint32_t* wr_id) {
+  if (!HasSendSpace(0)) {
+    auto status = PollSendCompletions();
+    if (!status.ok()) return status;
+    if (!HasSendSpace(0)) return absl::UnavailableError("Retry");
+  }
+  if (landing_ == nullptr || landing_->capacity() < header.length) {
+    auto capacity =
+        std::max<uint64_t>(std::bit_ceil(header.length), kMinStagingBytes);
+    landing_ = std::make_unique<RdmaMemory>(capacity, id_->pd);
   }
-  recv_next_ = recv_base_;
+
+  ibv_sge sge;
+  std::memset(&sge, 0, sizeof(sge));
+  sge.addr = reinterpret_cast<uint64_t>(landing_->raw());
+  sge.length = header.length;
+  sge.lkey = landing_->GetDefaultMemoryRegion()->lkey;
+
+  ibv_send_wr wr;
+  std::memset(&wr, 0, sizeof(wr));
+  wr.num_sge = 1;
+  wr.sg_list = &sge;
+  wr.opcode = IBV_WR_RDMA_READ;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  wr.wr.rdma.remote_addr = header.addr;
+  wr.wr.rdma.rkey = header.rkey;
+  wr.wr_id = send_total_++;
+  signaled_.push_back({static_cast<uint32_t>(wr.wr_id), send_next_});
+  unsignaled_ = 0;
+
+  ibv_send_wr* bad_wr;
+  RDMA_CM_CHECK(ibv_post_send, id_->qp, &wr, &bad_wr);
+  *wr_id = static_cast<uint32_t>(wr.wr_id);
+  return absl::OkStatus();
+}
+
+template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
+absl::Status
+TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::ReleaseMessage() {
+  ROME_ASSERT_DEBUG(!received_.empty(), "No message to release");
+  PostRecv(received_.front().slot);
+  received_.pop_front();
+
+  // Return credits explicitly if they are not being piggybacked on sends.
+  if (++recv_credits_ >= kCreditThreshold) {
+    while (!HasSendSpace(0)) {
+      auto status = PollSendCompletions();
+      if (!status.ok()) return status;
+    }
+    return PostSend(send_next_, 0, kCreditOnly);
+  }
+  return absl::OkStatus();
+}
+
+template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
+void TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::PostRecv(uint32_t slot) {
+  // Slots are identified by the context of the posted receive because
+  // credit-only messages are reposted before any earlier messages are released.
+  RDMA_CM_ASSERT(rdma_post_recv, id_, reinterpret_cast<void*>(uintptr_t{slot}),
+                 recv_base_ + slot * kRecvMaxBytes, kRecvMaxBytes, recv_mr_);
+}
+
+template <uint32_t kCapacity, uint32_t kRecvMaxBytes>
+absl::Status
+TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>::PollRecvCompletions() {
+  // A burst holds every posted receive only when there are at most 64 slots,
+  // to keep `wcs` small. Any completions beyond that are left for the next
+  // poll, which is fine since each caller polls again until it is satisfied.
+  static constexpr int kMaxPoll = std::min<uint32_t>(kRecvSlots, 64);
+  ibv_wc wcs[kMaxPoll];
+  int comps = ibv_poll_cq(id_->recv_cq, kMaxPoll, wcs);
+  if (comps < 0 && errno != EAGAIN) {
+    return util::InternalErrorBuilder() << "ibv_poll_cq(): " << strerror(errno);
+  }
+  for (int i = 0; i < comps; ++i) {
+    switch (wcs[i].status) {
+      case IBV_WC_WR_FLUSH_ERR:
+        return absl::AbortedError("QP in error state");
+      case IBV_WC_SUCCESS:
+        break;
+      default:
+        return InternalErrorBuilder()
+               << "ibv_poll_cq(): " << ibv_wc_status_str(wcs[i].status);
+    }
+    auto imm = ntohl(wcs[i].imm_data);
+    send_credits_ += imm & kCreditMask;
+    send_released_ += imm & kCreditMask;
+    auto slot = static_cast<uint32_t>(wcs[i].wr_id);
+    if (imm & kCreditOnly) {
+      PostRecv(slot);
+    } else {
+      received_.push_back(Received{slot, wcs[i].byte_len,
+                                   (imm & kRendezvous) != 0, false, false, 0});
+    }
+  }
+  return absl::OkStatus();
 }
 
 }  // namespace rome
\ No newline at end of file
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <infiniband/verbs.h>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "protos/rdma.pb.h"
+#include "rdma_messenger.h"
+#include "rome/rdma/rdma_memory.h"
+#include "rome/rdma/rdma_util.h"
+
+namespace rome::rdma {
+
+// Reliable messaging over a single Unreliable Datagram QP, which reaches any
+// number of peers through an address handle for each. Unlike RC, the QPs and
+// their state on the NIC do not grow with the number of peers, so a node can
+// talk to thousands of others with one endpoint per thread. Endpoints are not
+// thread safe.
+//
+// Every message is a single datagram, so it must fit in the path MTU. Messages
+// to each peer carry sequence numbers and are acknowledged cumulatively in the
+// header of messages going the other way. If there are none, a single ack-only
+// datagram covers every message received once `kAckBatch` are owed or the
+// oldest has waited `kAckDelay`. Up to `kWindow` messages to a peer
+// may be unacknowledged, and if the oldest of them is not acknowledged within
+// `kRetransmitTimeout` they are all sent again (i.e., go-back-N). Receivers
+// only accept the next message in sequence, so messages from a peer are
+// delivered exactly once and in order. Progress is only made while the
+// endpoint is used, so a node that stops calling `Send` and `TryDeliver` also
+// stops acknowledging.
+class UdEndpoint {
+ public:
+  // All endpoints share the same Q_Key.
+  static constexpr uint32_t kQkey = 0x524f4d45;
+
+  static constexpr uint32_t kWindow = 32;
+  static constexpr uint32_t kSendSlots = 64;
+  static constexpr uint32_t kRecvSlots = 256;
+  static constexpr auto kRetransmitTimeout = std::chrono::milliseconds(1);
+
+  // Acknowledgements are delayed until this many are owed to a peer, or for at
+  // most this long, so that they can be coalesced or ride on a message. Both
+  // are well short of what makes the peer stall or retransmit.
+  static constexpr uint32_t kAckBatch = kWindow / 2;
+  static constexpr auto kAckDelay = std::chrono::microseconds(250);
+  static_assert(kAckDelay < kRetransmitTimeout,
+                "Delayed acks would cause retransmissions.");
+
+  ~UdEndpoint();
+
+  // Creates an endpoint for node `my_id` on port `port_num` of the device of
+  // `pd`. Messages may be as large as the port's active MTU allows. On RoCE,
+  // datagrams are routed by the GID at `gid_index` in the port's table.
+  static absl::StatusOr<std::unique_ptr<UdEndpoint>> Create(
+      uint32_t my_id, ibv_pd* pd, uint8_t port_num, uint8_t gid_index = 0);
+
+  UdEndpoint(const UdEndpoint&) = delete;
+  UdEndpoint(UdEndpoint&&) = delete;
+
+  // Getters.
+  uint32_t id() const { return my_id_; }
+  size_t max_message_bytes() const { return mtu_bytes_ - sizeof(Header); }
+
+  // Returns the address that peers pass to `AddPeer`, for example through a
+  // `BootstrapCoordinator`.
+  absl::StatusOr<QpInfoProto> address() const;
+
+  // Creates the address handle for reaching the endpoint of node `peer_id`.
+  // Sequence numbers in both directions start at `first_seq`, which both
+  // endpoints must agree on. Datagrams from a node are dropped until it is
+  // added.
+  absl::Status AddPeer(uint32_t peer_id, const QpInfoProto& address,
+                       uint32_t first_seq = 0);
+
+  // Sends a copy of `length` bytes at `buffer` to `peer_id`. Blocks while the
+  // peer has `kWindow` messages that were not acknowledged.
+  absl::Status Send(uint32_t peer_id, const uint8_t* buffer, size_t length);
+
+  // Returns the next message received from `peer_id`, or
+  // `absl::UnavailableError()` if there is none.
+  absl::StatusOr<Message> TryDeliver(uint32_t peer_id);
+
+  // Handles received datagrams, then retransmits to peers whose oldest message
+  // timed out and acknowledges messages that were received.
+  absl::Status Progress();
+
+ private:
+  // Memory region IDs.
+  static constexpr char kSendId[] = "send";
+  static constexpr char kRecvId[] = "recv";
+
+  // Received datagrams are preceded by a Global Routing Header in the buffer,
+  // whether or not the sender included one.
+  static constexpr uint32_t kGrhBytes = 40;
+
+  // Handles at most this many received datagrams per call to `Progress`.
+  static constexpr int kPollBurst = 16;
+
+  static constexpr uint16_t kAckOnly = 1;
+
+  // Only every this many sends is signaled. A completion frees the slots of
+  // every send posted up to it, and there is always a signaled send among a
+  // full SQ.
+  static constexpr uint32_t kSignalInterval = kSendSlots / 2;
+
+  struct Header {
+    uint32_t src;
+    uint32_t seq;
+    // Every message from the receiver with a lower sequence number arrived.
+    uint32_t ack;
+    uint16_t flags;
+    uint16_t length;
+  };
+
+  struct Peer {
+    ibv_ah_unique_ptr ah;
+    uint32_t qp_num;
+
+    // Sequence number of the next message to send, and copies of the messages
+    // sent since the oldest unacknowledged one.
+    uint32_t next_seq = 0;
+    uint32_t acked = 0;
+    std::deque<std::string> unacked;
+    std::chrono::steady_clock::time_point sent_at;
+
+    // Sequence number of the next message expected, the number received since
+    // the last acknowledgement and when the first of them arrived, and those
+    // waiting to be delivered.
+    uint32_t expected = 0;
+    uint32_t owed_acks = 0;
+    std::chrono::steady_clock::time_point owed_since;
+    std::deque<Message> delivered;
+  };
+
+  UdEndpoint(uint32_t my_id, ibv_pd* pd, uint8_t port_num, uint8_t gid_index);
+
+  absl::Status Init();
+
+  // Posts the receive slot with index `slot` on the RQ.
+  absl::Status PostRecv(uint32_t slot);
+
+  // Sends a datagram to `peer` that carries `length` bytes at `buffer` and
+  // acknowledges every message received from it so far.
+  absl::Status PostDatagram(Peer& peer, uint16_t flags, uint32_t seq,
+                            const void* buffer, size_t length);
+
+  // Reclaims the send slots of completed sends, waiting for a completion if
+  // all are in use.
+  absl::Status PollSendCompletions(bool wait);
+
+  // Handles a datagram received in `slot`, then reposts the slot.
+  absl::Status HandleDatagram(uint32_t slot, uint32_t length);
+
+  uint32_t my_id_;
+  ibv_pd* pd_;  //! NOT OWNED
+  uint8_t port_num_;
+  uint8_t gid_index_;
+  bool global_routing_;
+  uint32_t mtu_bytes_;
+
+  // The send and recv slots, each of which holds a single datagram.
+  std::unique_ptr<RdmaMemory> rm_;
+  ibv_mr* send_mr_;
+  ibv_mr* recv_mr_;
+  uint8_t* send_base_;
+  uint8_t* recv_base_;
+
+  // The next send slot to use, and the number of sends posted and known to
+  // have completed. Signaled sends carry the number posted up to them.
+  uint32_t send_next_;
+  uint64_t send_posted_;
+  uint64_t send_completed_;
+
+  // Declared after `rm_`, so the QP is destroyed before its memory.
+  ibv_cq_unique_ptr send_cq_;
+  ibv_cq_unique_ptr recv_cq_;
+  ibv_qp_unique_ptr qp_;
+
+  std::unordered_map<uint32_t, Peer> peers_;
+};
+
+// A messenger for a single peer of a `UdEndpoint`, so that it can be used
+// through an `RdmaChannel`, which must be constructed with `std::in_place`.
+// Messengers for different peers may share an endpoint, but not threads.
+class UdRdmaMessenger : public RdmaMessenger {
+ public:
+  UdRdmaMessenger(UdEndpoint* endpoint, uint32_t peer_id)
+      : endpoint_(endpoint), peer_id_(peer_id) {}
+
+  absl::Status SendMessage(const Message& msg) override {
+    return endpoint_->Send(peer_id_, msg.buffer.get(), msg.length);
+  }
+
+  absl::StatusOr<Message> TryDeliverMessage() override {
+    return endpoint_->TryDeliver(peer_id_);
+  }
+
+ private:
+  UdEndpoint* endpoint_;  //! NOT OWNED
+  uint32_t peer_id_;
+};
+
+}  // namespace rome::rdma
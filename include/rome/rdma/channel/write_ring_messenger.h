@@ -0,0 +1,176 @@
+#pragma once
+
+#include <rdma/rdma_verbs.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "rdma_accessor.h"
+#include "rdma_messenger.h"
+#include "rome/logging/logging.h"
+#include "rome/rdma/rdma_memory.h"
+#include "rome/rdma/rdma_util.h"
+#include "rome/util/status_util.h"
+
+namespace rome::rdma {
+
+// Sends messages by writing them directly into a ring of fixed-size slots in
+// the peer's registered memory with one-sided writes, instead of consuming
+// receives posted by the peer. The receiver polls the slot at the head of its
+// ring for a footer written at the end of each message, so delivering a
+// message involves no completion at the receiver at all. Like FaRM, this relies
+// on the NIC placing the data of a single write in increasing address order so
+// that the footer is the last part of a message to become visible.
+//
+// The peer is assumed to use the same template arguments. Both sides exchange
+// the location of their ring with a single send the first time the messenger
+// is used. The receiver periodically writes the number of messages it has
+// released back to the sender, which never overwrites a slot that has not been
+// released.
+template <uint32_t kCapacity = 1ul << 12, uint32_t kSlotBytes = 1ul << 8>
+class WriteRingRdmaMessenger : public RdmaMessenger {
+  static_assert(kCapacity % 2 == 0, "Capacity must be divisible by two.");
+  static_assert(kSlotBytes % 8 == 0, "Slots must be 8-byte aligned.");
+
+ public:
+  static constexpr uint32_t kSlots = (kCapacity / 2) / kSlotBytes;
+  static_assert(kSlots > 1, "Not enough slots.");
+
+  // How many times a send checks for space in the peer's full ring, or for the
+  // peer's `PeerInfo` before the handshake has completed.
+  static constexpr uint64_t kMaxFullPolls = 1ul << 24;
+
+  explicit WriteRingRdmaMessenger(rdma_cm_id* id);
+
+  // Writes the message into the next slot of the peer's ring without waiting
+  // for it to complete. Waits while the peer's ring is full, but fails with
+  // `absl::UnavailableError()` if it stays full for `kMaxFullPolls` polls, or
+  // right away if messages from the peer are waiting to be released here,
+  // since the peer may be waiting on those in turn. Likewise fails if the
+  // peer's `PeerInfo` has not arrived after `kMaxFullPolls` polls.
+  absl::Status SendMessage(const Message& msg) override;
+
+  // Waits until every signaled write has completed.
+  absl::Status Flush();
+
+  // Writes share the QP's send CQ with the channel's accessor, so completions
+  // polled by either are passed on to the other through `shared`. They also
+  // share the SQ, so from then on only the messenger's part of it is used.
+  void ShareSendCompletions(SendCompletions* shared) {
+    send_completions_ = shared;
+    sq_depth_ = SendCompletions::MessengerDepth(sq_depth_);
+    signal_interval_ = std::max(sq_depth_ / 2, 1u);
+  }
+
+  // Attempts to deliver a message by checking the head of the ring and then
+  // returning a `Message` containing a copy of it.
+  absl::StatusOr<Message> TryDeliverMessage() override;
+
+  // Zero-copy interface (see `ZeroCopyMessenger`). The buffer returned by
+  // `AcquireSendBuffer` is the local copy of the peer's next slot and is only
+  // valid until the next send. A peeked message stays in its slot, and
+  // repeated calls return it again, until it is released.
+  absl::StatusOr<uint8_t*> AcquireSendBuffer(size_t length);
+  absl::Status PostSendBuffer(uint8_t* buffer, size_t length);
+  absl::StatusOr<MessageView> TryPeekMessage();
+  absl::Status ReleaseMessage();
+
+  // Returns the number of consecutive slots from the head of the ring that
+  // hold new messages (see `BatchingMessenger`).
+  absl::StatusOr<size_t> TryPeekMessages();
+
+ private:
+  // Written at the end of every slot, after the message. A slot holds a new
+  // message once its sequence number matches the one the receiver expects.
+  struct Footer {
+    uint32_t length;
+    uint32_t seq;
+  };
+  static constexpr uint32_t kMaxMessageBytes = kSlotBytes - sizeof(Footer);
+
+  // Exchanged once so that each side can write into the other's memory.
+  struct PeerInfo {
+    uint64_t ring;
+    uint64_t head;
+    uint32_t rkey;
+  };
+
+  // Sends this side's `PeerInfo` if it was not sent already, and polls for the
+  // peer's. Returns `absl::UnavailableError()` until the peer's has arrived.
+  absl::Status Handshake();
+
+  // Posts `wr`, waiting for room in the SQ if needed. Work requests are only
+  // signaled periodically.
+  absl::Status Post(ibv_send_wr* wr);
+
+  // Posts a write of `length` bytes at `local` into the peer's memory.
+  absl::Status PostWrite(const void* local, uint64_t remote, size_t length);
+
+  // Polls the send CQ once and records completed signaled work requests.
+  absl::Status PollSendCompletions();
+
+  // Reports the number of released messages to the peer, once enough of them
+  // have not been reported yet.
+  absl::Status MaybeWriteHead();
+
+  uint8_t* slot(uint8_t* ring, uint64_t i) const {
+    return ring + (i % kSlots) * kSlotBytes;
+  }
+
+  // Returns whether the `i`-th message received is in its slot.
+  bool Arrived(uint64_t i) const {
+    auto* footer = reinterpret_cast<volatile Footer*>(slot(recv_ring_, i) +
+                                                      kMaxMessageBytes);
+    return footer->seq == static_cast<uint32_t>(i + 1);
+  }
+
+  static constexpr uint32_t kMetadataBytes =
+      2 * sizeof(uint64_t) + 2 * sizeof(PeerInfo);
+
+  // Registered memory holding both rings, the head written by the peer and the
+  // buffers used for the handshake and for writing back the head.
+  RdmaMemory rm_;
+  ibv_mr* mr_;
+
+  // A pointer to the QP used to post writes.
+  rdma_cm_id* id_;  //! NOT OWNED
+
+  // The ring written by the peer, and local copies of the slots of the peer's
+  // ring that are written from.
+  uint8_t* recv_ring_;
+  uint8_t* send_ring_;
+
+  // Number of messages released by the peer, as written by the peer, and the
+  // local copy of the number released here that is written to the peer.
+  volatile uint64_t* remote_head_;
+  uint64_t* head_out_;
+
+  PeerInfo* local_info_;
+  PeerInfo* peer_info_;
+  bool info_sent_;
+  bool info_received_;
+
+  // Messages sent, and messages received and released.
+  uint64_t sent_;
+  uint64_t released_;
+  uint64_t head_written_;
+
+  // Work requests posted, how many are known to be complete and how many will
+  // be once every signaled work request has completed.
+  uint64_t posted_;
+  uint64_t acked_;
+  uint64_t signaled_;
+
+  // Maximum number of outstanding work requests, and how often they are
+  // signaled.
+  uint32_t sq_depth_;
+  uint32_t signal_interval_;
+
+  // Passes completions to and from the accessor, if there is one.
+  SendCompletions* send_completions_ = nullptr;  //! NOT OWNED
+};
+
+}  // namespace rome::rdma
+
+#include "write_ring_messenger_impl.h"
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#include "rdma_messenger.h"
+#include "rome/logging/logging.h"
+#include "rome/rdma/channel/write_ring_messenger.h"
+#include "rome/rdma/rdma_memory.h"
+#include "rome/rdma/rdma_util.h"
+#include "rome/util/status_util.h"
+#include "rome/util/thread_util.h"
+
+namespace rome::rdma {
+
+using ::util::InternalErrorBuilder;
+using ::util::ResourceExhaustedErrorBuilder;
+using ::util::UnavailableErrorBuilder;
+
+template <uint32_t kCapacity, uint32_t kSlotBytes>
+WriteRingRdmaMessenger<kCapacity, kSlotBytes>::WriteRingRdmaMessenger(
+    rdma_cm_id* id)
+    : rm_(kCapacity + kMetadataBytes, id->pd),
+      mr_(rm_.GetDefaultMemoryRegion()),
+      id_(id),
+      info_sent_(false),
+      info_received_(false),
+      sent_(0),
+      released_(0),
+      head_written_(0),
+      posted_(0),
+      acked_(0),
+      signaled_(0) {
+  // Slots are recognized by their sequence numbers, which start at one, so the
+  // ring must start out zeroed.
+  auto* base = rm_.raw();
+  std::memset(base, 0, rm_.capacity());
+  recv_ring_ = base;
+  send_ring_ = base + kCapacity / 2;
+  auto* metadata = base + kCapacity;
+  remote_head_ = reinterpret_cast<volatile uint64_t*>(metadata);
+  head_out_ = reinterpret_cast<uint64_t*>(metadata + sizeof(uint64_t));
+  local_info_ = reinterpret_cast<PeerInfo*>(metadata + 2 * sizeof(uint64_t));
+  peer_info_ = local_info_ + 1;
+  *local_info_ = PeerInfo{reinterpret_cast<uint64_t>(recv_ring_),
+                          reinterpret_cast<uint64_t>(remote_head_), mr_->rkey};
+  RDMA_CM_ASSERT(rdma_post_recv, id_, nullptr, peer_info_, sizeof(PeerInfo),
+                 mr_);
+
+  ibv_qp_attr attr;
+  ibv_qp_init_attr init_attr;
+  RDMA_CM_ASSERT(ibv_query_qp, id_->qp, &attr, IBV_QP_CAP, &init_attr);
+  sq_depth_ = std::max(init_attr.cap.max_send_wr, 1u);
+  signal_interval_ = std::max(sq_depth_ / 2, 1u);
+}
+
+template <uint32_t kCapacity, uint32_t kSlotBytes>
+absl::Status WriteRingRdmaMessenger<kCapacity, kSlotBytes>::SendMessage(
+    const Message& msg) {
+  auto buffer = AcquireSendBuffer(msg.length);
+  if (!buffer.ok()) return buffer.status();
+  std::memcpy(*buffer, msg.buffer.get(), msg.length);
+  return PostSendBuffer(*buffer, msg.length);
+}
+
+template <uint32_t kCapacity, uint32_t kSlotBytes>
+absl::StatusOr<uint8_t*>
+WriteRingRdmaMessenger<kCapacity, kSlotBytes>::AcquireSendBuffer(
+    size_t length) {
+  ROME_CHECK_QUIET(ROME_RETURN(ResourceExhaustedErrorBuilder()
+                               << "Message too large: expected<="
+                               << kMaxMessageBytes << ", actual=" << length),
+                   length <= kMaxMessageBytes);
+  // A peer that never connects never sends its `PeerInfo`, so this wait is
+  // bounded as well.
+  auto status = Handshake();
+  for (uint64_t polls = 1;
+       absl::IsUnavailable(status) && polls < kMaxFullPolls; ++polls) {
+    status = Handshake();
+  }
+  if (!status.ok()) return status;
+
+  // Wait for the peer to release the message that was last written to the
+  // slot. Once it has, the write from the local copy has also completed. The
+  // peer may itself be waiting for this side to release messages, and a peer
+  // that is gone never reports its head again, so the wait is bounded.
+  for (uint64_t polls = 0; sent_ - *remote_head_ >= kSlots; ++polls) {
+    ROME_CHECK_QUIET(ROME_RETURN(UnavailableErrorBuilder()
+                                 << "Peer's ring is full with messages "
+                                    "waiting to be released locally"),
+                     !Arrived(released_));
+    ROME_CHECK_QUIET(
+        ROME_RETURN(UnavailableErrorBuilder() << "Peer's ring is full"),
+        polls < kMaxFullPolls);
+    cpu_relax();
+  }
+
+  // Messages end where the footer starts, so that a single write covers both.
+  return slot(send_ring_, sent_) + kMaxMessageBytes - length;
+}
+
+template <uint32_t kCapacity, uint32_t kSlotBytes>
+absl::Status WriteRingRdmaMessenger<kCapacity, kSlotBytes>::PostSendBuffer(
+    uint8_t* buffer, size_t length) {
+  auto* local = slot(send_ring_, sent_);
+  ROME_ASSERT_DEBUG(buffer == local + kMaxMessageBytes - length,
+                    "Send buffer was not acquired: {} (expected={})",
+                    fmt::ptr(buffer),
+                    fmt::ptr(local + kMaxMessageBytes - length));
+  auto* footer = reinterpret_cast<Footer*>(local + kMaxMessageBytes);
+  footer->length = length;
+  footer->seq = static_cast<uint32_t>(sent_ + 1);
+
+  auto offset = buffer - send_ring_;
+  ++sent_;
+  return PostWrite(buffer, peer_info_->ring + offset, length + sizeof(Footer));
+}
+
+template <uint32_t kCapacity, uint32_t kSlotBytes>
+absl::Status WriteRingRdmaMessenger<kCapacity, kSlotBytes>::Flush() {
+  while (acked_ < signaled_) {
+    auto status = PollSendCompletions();
+    if (!status.ok()) return status;
+  }
+  return absl::OkStatus();
+}
+
+template <uint32_t kCapacity, uint32_t kSlotBytes>
+absl::StatusOr<Message>
+WriteRingRdmaMessenger<kCapacity, kSlotBytes>::TryDeliverMessage() {
+  auto view = TryPeekMessage();
+  if (!view.ok()) return view.status();
+
+  // Prepare the response.
+  Message msg;
+  msg.buffer = std::make_unique<uint8_t[]>(view->length);
+  std::memcpy(msg.buffer.get(), view->buffer, view->length);
+  msg.length = view->length;
+  auto status = ReleaseMessage();
+  if (!status.ok()) return status;
+  return msg;
+}
+
+template <uint32_t kCapacity, uint32_t kSlotBytes>
+absl::StatusOr<MessageView>
+WriteRingRdmaMessenger<kCapacity, kSlotBytes>::TryPeekMessage() {
+  // The peer can only write to this side once it has received this side's
+  // information, but this side needs the peer's to report released messages.
+  if (!info_received_) {
+    auto status = Handshake();
+    if (!status.ok() && !absl::IsUnavailable(status)) return status;
+  }
+  auto status = MaybeWriteHead();
+  if (!status.ok()) return status;
+
+  if (!Arrived(released_)) return absl::UnavailableError("Retry");
+  std::atomic_thread_fence(std::memory_order_acquire);
+  auto* local = slot(recv_ring_, released_);
+  uint32_t length = reinterpret_cast<Footer*>(local + kMaxMessageBytes)->length;
+  return MessageView{local + kMaxMessageBytes - length, length};
+}
+
+template <uint32_t kCapacity, uint32_t kSlotBytes>
+absl::StatusOr<size_t>
+WriteRingRdmaMessenger<kCapacity, kSlotBytes>::TryPeekMessages() {
+  auto view = TryPeekMessage();
+  if (absl::IsUnavailable(view.status())) return 0;
+  if (!view.ok()) return view.status();
+  size_t ready = 1;
+  while (ready < kSlots && Arrived(released_ + ready)) ++ready;
+  return ready;
+}
+
+template <uint32_t kCapacity, uint32_t kSlotBytes>
+absl::Status WriteRingRdmaMessenger<kCapacity, kSlotBytes>::ReleaseMessage() {
+  ++released_;
+  return MaybeWriteHead();
+}
+
+template <uint32_t kCapacity, uint32_t kSlotBytes>
+absl::Status WriteRingRdmaMessenger<kCapacity, kSlotBytes>::Handshake() {
+  if (!info_sent_) {
+    ibv_sge sge;
+    std::memset(&sge, 0, sizeof(sge));
+    sge.addr = reinterpret_cast<uint64_t>(local_info_);
+    sge.length = sizeof(PeerInfo);
+    sge.lkey = mr_->lkey;
+
+    ibv_send_wr wr;
+    std::memset(&wr, 0, sizeof(wr));
+    wr.num_sge = 1;
+    wr.sg_list = &sge;
+    wr.opcode = IBV_WR_SEND;
+    auto status = Post(&wr);
+    if (!status.ok()) return status;
+    info_sent_ = true;
+  }
+
+  if (!info_received_) {
+    ibv_wc wc;
+    int ret = ibv_poll_cq(id_->recv_cq, 1, &wc);
+    if (ret < 0 && errno != EAGAIN) {
+      return InternalErrorBuilder() << "ibv_poll_cq(): " << strerror(errno);
+    } else if (ret <= 0) {
+      return absl::UnavailableError("Retry");
+    }
+    switch (wc.status) {
+      case IBV_WC_WR_FLUSH_ERR:
+        return absl::AbortedError("QP in error state");
+      case IBV_WC_SUCCESS:
+        info_received_ = true;
+        break;
+      default:
+        return InternalErrorBuilder()
+               << "ibv_poll_cq(): " << ibv_wc_status_str(wc.status);
+    }
+  }
+  return absl::OkStatus();
+}
+
+template <uint32_t kCapacity, uint32_t kSlotBytes>
+absl::Status WriteRingRdmaMessenger<kCapacity, kSlotBytes>::Post(
+    ibv_send_wr* wr) {
+  // Every `signal_interval_` work requests one is signaled, so a full SQ always
+  // has a signaled work request whose completion frees it.
+  while (posted_ - acked_ >= sq_depth_) {
+    auto status = PollSendCompletions();
+    if (!status.ok()) return status;
+  }
+  wr->wr_id = posted_++;
+  if (posted_ % signal_interval_ == 0) {
+    wr->send_flags |= IBV_SEND_SIGNALED;
+    signaled_ = posted_;
+  }
+  ibv_send_wr* bad_wr;
+  RDMA_CM_CHECK(ibv_post_send, id_->qp, wr, &bad_wr);
+  return absl::OkStatus();
+}
+
+template <uint32_t kCapacity, uint32_t kSlotBytes>
+absl::Status WriteRingRdmaMessenger<kCapacity, kSlotBytes>::PostWrite(
+    const void* local, uint64_t remote, size_t length) {
+  ibv_sge sge;
+  std::memset(&sge, 0, sizeof(sge));
+  sge.addr = reinterpret_cast<uint64_t>(local);
+  sge.length = length;
+  sge.lkey = mr_->lkey;
+
+  ibv_send_wr wr;
+  std::memset(&wr, 0, sizeof(wr));
+  wr.num_sge = 1;
+  wr.sg_list = &sge;
+  wr.opcode = IBV_WR_RDMA_WRITE;
+  wr.wr.rdma.remote_addr = remote;
+  wr.wr.rdma.rkey = peer_info_->rkey;
+  return Post(&wr);
+}
+
+template <uint32_t kCapacity, uint32_t kSlotBytes>
+absl::Status
+WriteRingRdmaMessenger<kCapacity, kSlotBytes>::PollSendCompletions() {
+  static constexpr int kMaxPoll = 16;
+  ibv_wc wcs[kMaxPoll];
+  int comps = ibv_poll_cq(id_->send_cq, kMaxPoll, wcs);
+  if (comps < 0 && errno != EAGAIN) {
+    return InternalErrorBuilder() << "ibv_poll_cq(): " << strerror(errno);
+  }
+  // The accessor's completions are passed on before reporting a failure, so
+  // that it still sees those that were polled here, failed ones included.
+  absl::Status status = absl::OkStatus();
+  for (int i = 0; i < comps; ++i) {
+    if (SendCompletions::IsAccessor(wcs[i].wr_id)) {
+      if (send_completions_ != nullptr) {
+        send_completions_->PassToAccessor(wcs[i].wr_id, wcs[i].status);
+      }
+    } else if (wcs[i].status == IBV_WC_SUCCESS) {
+      acked_ = std::max(acked_, wcs[i].wr_id + 1);
+    }
+    if (wcs[i].status != IBV_WC_SUCCESS && status.ok()) {
+      status = InternalErrorBuilder()
+               << "ibv_poll_cq(): " << ibv_wc_status_str(wcs[i].status);
+    }
+  }
+  if (!status.ok()) return status;
+  // Ones passed on by the accessor may arrive after later ones.
+  if (send_completions_ != nullptr) {
+    for (auto wc : send_completions_->TakeMessengerCompletions()) {
+      if (wc.status != IBV_WC_SUCCESS) {
+        return InternalErrorBuilder()
+               << "ibv_poll_cq(): " << ibv_wc_status_str(wc.status);
+      }
+      acked_ = std::max(acked_, wc.wr_id + 1);
+    }
+  }
+  return absl::OkStatus();
+}
+
+template <uint32_t kCapacity, uint32_t kSlotBytes>
+absl::Status WriteRingRdmaMessenger<kCapacity, kSlotBytes>::MaybeWriteHead() {
+  if (released_ - head_written_ < kSlots / 2) return absl::OkStatus();
+  if (!info_received_) {
+    // Reported once the peer's information arrives.
+    auto status = Handshake();
+    if (absl::IsUnavailable(status)) return absl::OkStatus();
+    if (!status.ok()) return status;
+  }
+  // The value only grows, so it does not matter if a later report overwrites
+  // it before an earlier write has read it.
+  *head_out_ = released_;
+  head_written_ = released_;
+  return PostWrite(head_out_, peer_info_->head, sizeof(uint64_t));
+}
+
+}  // namespace rome::rdma
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <infiniband/verbs.h>
 #include <rdma/rdma_cma.h>
 
 #include <cstdint>
@@ -24,12 +25,14 @@ class Connection {
       : terminated_(false),
         src_id_(std::numeric_limits<uint32_t>::max()),
         dst_id_(std::numeric_limits<uint32_t>::max()),
+        peer_data_(0),
         channel_(nullptr) {}
   Connection(uint32_t src_id, uint32_t dst_id,
-             std::unique_ptr<channel_type> channel)
+             std::unique_ptr<channel_type> channel, uint32_t peer_data = 0)
       : terminated_(false),
         src_id_(src_id),
         dst_id_(dst_id),
+        peer_data_(peer_data),
         channel_(std::move(channel)) {}
 
   Connection(const Connection&) = delete;
@@ -37,22 +40,38 @@ class Connection {
       : terminated_(c.terminated_),
         src_id_(c.src_id_),
         dst_id_(c.dst_id_),
+        peer_data_(c.peer_data_),
         channel_(std::move(c.channel_)) {}
 
   // Getters.
   inline bool terminated() const { return terminated_; }
   uint32_t src_id() const { return src_id_; }
   uint32_t dst_id() const { return dst_id_; }
+  // The value that the peer set with `ConnectionManager::SetConnectData` when
+  // this connection was established.
+  uint32_t peer_data() const { return peer_data_; }
   rdma_cm_id* id() const { return channel_->id(); }
   channel_type* channel() const { return channel_.get(); }
 
   void Terminate() { terminated_ = true; }
 
+  // Returns whether the QP has failed and can no longer be used, which is also
+  // the case once it is disconnected.
+  bool HasFailed() const {
+    ibv_qp_attr attr;
+    ibv_qp_init_attr init_attr;
+    if (ibv_query_qp(id()->qp, &attr, IBV_QP_STATE, &init_attr) != 0) {
+      return true;
+    }
+    return attr.qp_state == IBV_QPS_ERR || attr.qp_state == IBV_QPS_SQE;
+  }
+
  private:
   volatile bool terminated_;
 
   uint32_t src_id_;
   uint32_t dst_id_;
+  uint32_t peer_data_;
 
   // Remotely accessible memory that is used for 2-sided message-passing.
   std::unique_ptr<channel_type> channel_;
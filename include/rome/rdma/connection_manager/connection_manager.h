@@ -3,17 +3,23 @@
 #include <infiniband/verbs.h>
 #include <rdma/rdma_cma.h>
 
+#include <atomic>
 #include <chrono>
 #include <limits>
 #include <memory>
 #include <optional>
+#include <string>
 #include <string_view>
 #include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
 #include "connection.h"
+#include "qp_config.h"
 #include "rome/rdma/channel/rdma_accessor.h"
 #include "rome/rdma/channel/rdma_channel.h"
 #include "rome/rdma/channel/twosided_messenger.h"
@@ -25,26 +31,49 @@
 
 namespace rome::rdma {
 
+// Manages the connections of a node to its peers. A node may keep several QPs
+// to each peer, which are connected to the same QPs on the peer, so that
+// threads can issue operations to a peer on QPs of their own. Every node of a
+// cluster must use the same number of QPs per peer.
 template <typename ChannelType>
 class ConnectionManager : public RdmaReceiverInterface {
  public:
   typedef Connection<ChannelType> conn_type;
 
+  // The address of a node's broker, as given to `ConnectAll`.
+  struct PeerAddress {
+    uint32_t id;
+    std::string address;
+    uint16_t port;
+  };
+
+  // How long `ConnectAll` and `Reconnect` wait by default.
+  static constexpr auto kConnectTimeout = std::chrono::seconds(30);
+
   ~ConnectionManager();
-  explicit ConnectionManager(uint32_t my_id);
+  explicit ConnectionManager(uint32_t my_id, uint32_t qps_per_peer = 1,
+                             const QpConfig& qp_config = {});
 
+  // Starts the broker and lowers the QP config to what its device supports.
+  // The broker listens on `addr`, which selects the device and port that every
+  // connection uses. To use several ports, start a connection manager on the
+  // address of each and pick one per thread with an `RdmaTopology`.
   absl::Status Start(std::string_view addr, std::optional<uint16_t> port);
 
   // Getters.
   std::string address() const { return broker_->address(); }
   uint16_t port() const { return broker_->port(); }
   ibv_pd* pd() const { return broker_->pd(); }
+  uint32_t qps_per_peer() const { return qps_per_peer_; }
+  const QpConfig& qp_config() const { return qp_config_; }
+
+  // Returns the lane used by the calling thread. Threads are assigned lanes
+  // round-robin the first time they ask for one.
+  uint32_t GetLane() const { return ThreadIndex() % qps_per_peer_; }
 
   int GetNumConnections() {
-    Acquire(my_id_);
-    int size = established_.size();
-    Release();
-    return size;
+    absl::MutexLock lock(&mu_);
+    return established_.size();
   }
 
   // `RdmaReceiverInterface` implementaiton
@@ -52,96 +81,289 @@ class ConnectionManager : public RdmaReceiverInterface {
   void OnEstablished(rdma_cm_id* id, rdma_cm_event* event) override;
   void OnDisconnect(rdma_cm_id* id) override;
 
-  // `RdmaClientInterface` implementation
+  // `RdmaClientInterface` implementation. Only connects the first lane to the
+  // peer, which is also the one used by the loopback connection.
   absl::StatusOr<conn_type*> Connect(uint32_t node_id, std::string_view server,
                                      uint16_t port);
 
+  // Connects every lane to every node in `peers`, which may include this node.
+  // Of every pair of nodes, only the one with the lower ID initiates the
+  // connections, so each node must call this with the nodes it expects to be
+  // connected to. All outgoing requests are issued up front, and their address
+  // and route resolution and handshakes are driven by a single event loop, so
+  // this takes about as long as the slowest handshake rather than the sum of
+  // them. Returns once every connection is established, including those
+  // initiated by the peers, or `absl::DeadlineExceededError()` if that takes
+  // longer than `timeout`.
+  absl::Status ConnectAll(
+      const std::vector<PeerAddress>& peers,
+      std::chrono::milliseconds timeout = kConnectTimeout);
+
+  // Returns the established connection to `node_id` on the calling thread's
+  // lane, or on the first lane if that one is not connected. Lookups never
+  // wait for connection events being handled, since they do not take the lock.
+  // A connection that failed is still returned until its replacement is
+  // established, so callers should check `HasFailed` when an operation fails.
+  //
+  // Messages sent on a lane are only delivered from the same lane on the peer,
+  // so two-sided exchanges between threads should name the lane explicitly.
   absl::StatusOr<conn_type*> GetConnection(uint32_t node_id);
+  absl::StatusOr<conn_type*> GetConnection(uint32_t node_id, uint32_t lane);
+
+  // Replaces the connection to `node_id` on `lane` after it failed, for
+  // example once its channel reports that the QP is in the error state. The
+  // failed connection is disconnected, which lets the peer know to replace its
+  // end too, and a new one is requested with the same backoff as
+  // `ConnectAll`. If both ends reconnect at once, the request of the lower ID
+  // wins, and if the peer has already replaced the connection, its replacement
+  // is returned. Threads may still hold the failed connection, so it stays
+  // allocated until the connection manager is destroyed. Only peers that were
+  // connected with `Connect` or `ConnectAll` can be reconnected. Returns
+  // `absl::UnavailableError()` if no replacement is established within
+  // `timeout`.
+  absl::StatusOr<conn_type*> Reconnect(
+      uint32_t node_id, uint32_t lane,
+      std::chrono::milliseconds timeout = kConnectTimeout);
+
+  // Sets a value that is exchanged during the handshake of every connection
+  // made afterwards, including replacements, so that peers can read it with
+  // `conn_type::peer_data()` instead of waiting for a message. Should be set
+  // before connecting.
+  void SetConnectData(uint32_t data);
+
+  // Sends `msg` to every node in `peers` on the first lane. The message is
+  // encoded once and posted to every peer back-to-back, and only then are the
+  // sends waited for, all together.
+  template <typename MessageType>
+  absl::Status Broadcast(const MessageType& msg,
+                         const std::vector<uint32_t>& peers);
+
+  // Broadcasts `msg` from this node to every other node in `group` along a
+  // tree in which each node sends to at most `fanout` others, so that no node
+  // sends more than `fanout` messages and the message reaches everyone after a
+  // number of hops logarithmic in the size of the group. The tree is derived
+  // from `group` alone, which must contain this node and be the same on every
+  // node. Every other node receives the message with `DeliverTreeBroadcast`.
+  template <typename MessageType>
+  absl::Status TreeBroadcast(const MessageType& msg,
+                             const std::vector<uint32_t>& group,
+                             uint32_t fanout);
+
+  // Waits for a message broadcast by `root` with `TreeBroadcast`, and forwards
+  // it to this node's children in the tree as it was received before
+  // returning it. Returns `absl::DeadlineExceededError()` if the message does
+  // not arrive within `timeout`.
+  template <typename MessageType>
+  absl::StatusOr<MessageType> DeliverTreeBroadcast(
+      uint32_t root, const std::vector<uint32_t>& group, uint32_t fanout,
+      std::chrono::milliseconds timeout = kConnectTimeout);
 
   void Shutdown();
 
  private:
-  // The size of each memory region dedicated to a single connection.
-  static constexpr int kCapacity = 1 << 12;  // 4 KiB
-  static constexpr int kMaxRecvBytes = 64;
-
-  static constexpr int kMaxWr = kCapacity / kMaxRecvBytes;
-  static constexpr int kMaxSge = 1;
-  static constexpr int kMaxInlineData = 0;
-
   static constexpr char kPdId[] = "ConnectionManager";
 
-  static constexpr int kUnlocked = -1;
-
   static constexpr uint32_t kMinBackoffUs = 100;
   static constexpr uint32_t kMaxBackoffUs = 5000000;
 
+  // Bounds the delay before a rejected request of `ConnectAll` is retried, so
+  // that a peer whose broker starts late is connected to soon after.
+  static constexpr uint32_t kMaxRetryBackoffUs = 10000;
+
+  // How long the RDMA CM may take to resolve an address or a route.
+  static constexpr int kResolveTimeoutMs = 2000;
+
+  // Sent as the private data of a connection request and of its acceptance.
+  // Peers that only send the node ID are connecting the first lane, with no
+  // data.
+  struct ConnectData {
+    uint32_t node_id;
+    uint32_t lane;
+    uint32_t data;
+  };
+
   // Each `rdma_cm_id` can be associated with some context, which is represented
   // by `IdContext`. `node_id` is the numerical identifier for the peer node of
   // the connection and `conn_param` is used to provide private data during the
   // connection set up to send the local node identifier upon connection setup.
   struct IdContext {
     uint32_t node_id;
+    uint32_t lane;
     rdma_conn_param conn_param;
     ChannelType* channel;
+    ConnectData data;
 
     static inline uint32_t GetNodeId(void* ctx) {
       return reinterpret_cast<IdContext*>(ctx)->node_id;
     }
 
+    static inline uint32_t GetLane(void* ctx) {
+      return reinterpret_cast<IdContext*>(ctx)->lane;
+    }
+
     static inline ChannelType* GetRdmaChannel(void* ctx) {
       return reinterpret_cast<IdContext*>(ctx)->channel;
     }
   };
 
-  // Lock acquisition will spin until either the lock is acquired successfully
-  // or the locker is an outgoing connection request from this node.
-  inline bool Acquire(int peer_id) {
-    for (int expected = kUnlocked;
-         !mu_.compare_exchange_weak(expected, peer_id); expected = kUnlocked) {
-      if (expected == my_id_) {
-        ROME_DEBUG(
-            "[Acquire] (Node {}) Giving up lock acquisition: actual={}, "
-            "swap={}",
-            my_id_, expected, peer_id);
-        return false;
-      }
+  // Returns the data sent by the peer, in the private data of an event.
+  static uint32_t PeerData(const rdma_cm_event* event) {
+    if (event->param.conn.private_data == nullptr ||
+        event->param.conn.private_data_len < sizeof(ConnectData)) {
+      return 0;
     }
-    return true;
+    return reinterpret_cast<const ConnectData*>(event->param.conn.private_data)
+        ->data;
+  }
+
+  static uint32_t ThreadIndex() {
+    static std::atomic<uint32_t> next{0};
+    thread_local uint32_t index = next.fetch_add(1, std::memory_order_relaxed);
+    return index;
   }
 
-  inline void Release() { mu_ = kUnlocked; }
+  // Connections are identified by the peer and the lane.
+  uint64_t Slot(uint32_t peer_id, uint32_t lane) const {
+    return static_cast<uint64_t>(peer_id) * qps_per_peer_ + lane;
+  }
 
-  constexpr ibv_qp_init_attr DefaultQpInitAttr() {
+  ibv_qp_init_attr DefaultQpInitAttr() const {
     ibv_qp_init_attr init_attr;
     std::memset(&init_attr, 0, sizeof(init_attr));
-    init_attr.cap.max_send_wr = init_attr.cap.max_recv_wr = kMaxWr;
-    init_attr.cap.max_send_sge = init_attr.cap.max_recv_sge = kMaxSge;
-    init_attr.cap.max_inline_data = kMaxInlineData;
+    init_attr.cap.max_send_wr = qp_config_.max_send_wr;
+    init_attr.cap.max_recv_wr = qp_config_.max_recv_wr;
+    init_attr.cap.max_send_sge = qp_config_.max_send_sge;
+    init_attr.cap.max_recv_sge = qp_config_.max_recv_sge;
+    init_attr.cap.max_inline_data = qp_config_.max_inline_data;
     init_attr.sq_sig_all = 0;  // Must request completions.
     init_attr.qp_type = IBV_QPT_RC;
     return init_attr;
   }
 
-  constexpr ibv_qp_attr DefaultQpAttr() {
+  ibv_qp_attr DefaultQpAttr() const {
     ibv_qp_attr attr;
     std::memset(&attr, 0, sizeof(attr));
     attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
                            IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC;
-    attr.max_dest_rd_atomic = 8;
-    attr.path_mtu = IBV_MTU_4096;
-    attr.min_rnr_timer = 12;
+    attr.max_dest_rd_atomic = qp_config_.max_dest_rd_atomic;
+    attr.path_mtu = qp_config_.path_mtu;
+    attr.min_rnr_timer = qp_config_.min_rnr_timer;
     attr.rq_psn = 0;
     attr.sq_psn = 0;
-    attr.timeout = 12;
-    attr.retry_cnt = 7;
-    attr.rnr_retry = 1;
-    attr.max_rd_atomic = 8;
+    attr.timeout = qp_config_.timeout;
+    attr.retry_cnt = qp_config_.retry_cnt;
+    attr.rnr_retry = qp_config_.rnr_retry;
+    attr.max_rd_atomic = qp_config_.max_rd_atomic;
     return attr;
   }
 
+  rdma_conn_param DefaultConnParam() {
+    rdma_conn_param conn_param;
+    std::memset(&conn_param, 0, sizeof(conn_param));
+    conn_param.private_data = &my_id_;
+    conn_param.private_data_len = sizeof(my_id_);
+    conn_param.retry_count = qp_config_.retry_cnt;
+    conn_param.rnr_retry_count = qp_config_.rnr_retry;
+    conn_param.responder_resources = qp_config_.max_dest_rd_atomic;
+    conn_param.initiator_depth = qp_config_.max_rd_atomic;
+    return conn_param;
+  }
+
+  // Applies the configured ACK timeout to a connection made through the RDMA
+  // CM, which must happen before it is connected or accepted.
+  void SetAckTimeout(rdma_cm_id* id) {
+    if (rdma_set_option(id, RDMA_OPTION_ID, RDMA_OPTION_ID_ACK_TIMEOUT,
+                        &qp_config_.timeout, sizeof(qp_config_.timeout)) != 0) {
+      ROME_WARN("rdma_set_option(): {}", strerror(errno));
+    }
+  }
+
+  // An outgoing request of `ConnectAll`, which is retried once `retry_at` has
+  // passed if the peer rejects it.
+  struct PendingConnect {
+    PeerAddress peer;
+    uint32_t lane;
+    uint32_t backoff_us;
+    std::chrono::steady_clock::time_point retry_at;
+  };
+
+  // Translates `server` and `port` into the addresses of a connection from
+  // the broker's address. The result must be freed with `rdma_freeaddrinfo`.
+  absl::StatusOr<rdma_addrinfo*> GetAddrInfo(std::string_view server,
+                                             uint16_t port);
+
+  // Resolves `server` and creates an endpoint with a QP for connecting to it.
+  absl::StatusOr<rdma_cm_id*> CreateEndpoint(std::string_view server,
+                                             uint16_t port);
+
+  // Starts resolving the address of `peer` for a connection whose events are
+  // reported on `event_channel`. The route is resolved and the connection
+  // requested by `ConnectPending` as the events arrive.
+  absl::StatusOr<rdma_cm_id*> IssueConnect(const PeerAddress& peer,
+                                           rdma_event_channel* event_channel);
+
+  // Creates the QP of `id`, whose route is resolved, and requests a connection
+  // on `lane`.
+  absl::Status ConnectResolved(rdma_cm_id* id, uint32_t lane);
+
+  // Issues every request in `outgoing` and handles their events until all of
+  // them are established, or fails with `absl::DeadlineExceededError()` once
+  // `deadline` passes.
+  absl::Status ConnectPending(std::vector<PendingConnect> outgoing,
+                              std::chrono::steady_clock::time_point deadline);
+
+  // Adds a connection established by `ConnectPending`, after moving it to an
+  // event channel of its own like those made by `Connect`. `peer_data` is the
+  // data the peer accepted it with.
+  absl::Status AddOutgoing(uint32_t peer_id, uint32_t lane, rdma_cm_id* id,
+                           uint32_t peer_data);
+
+  // Returns the connection to `peer_id` on `lane`, or null.
+  conn_type* Lookup(uint32_t peer_id, uint32_t lane);
+
+  // Established connections indexed by slot, which `GetConnection` reads
+  // without taking the lock. A retired connection stays in its slot until it is
+  // replaced. Writers hold the lock and update the slot of the current table in
+  // place, replacing the table with a larger copy when an ID does not fit.
+  // Readers may still hold a replaced table, so it is only freed with the
+  // connection manager. Tables double in size, so replaced tables use at most
+  // as much memory as the current one.
+  struct ConnectionTable {
+    explicit ConnectionTable(size_t size)
+        : size(size), slots(new std::atomic<conn_type*>[size]()) {}
+    size_t size;
+    std::unique_ptr<std::atomic<conn_type*>[]> slots;
+  };
+  static constexpr size_t kInitialTableSize = 64;
+
+  // Adds `conn` on `lane` and publishes it to `GetConnection`. Must be called
+  // with the lock held.
+  conn_type* AddEstablished(uint32_t lane, std::unique_ptr<conn_type> conn);
+
+  // Disconnects the connection to `peer_id` on `lane`, if there is one, and
+  // moves it to `retired_`. It is still returned by `GetConnection` until
+  // `AddEstablished` replaces it. Must be called with the lock held.
+  void RetireEstablished(uint32_t peer_id, uint32_t lane);
+
   absl::StatusOr<conn_type*> ConnectLoopback(rdma_cm_id* id);
 
+  // Requests the first lane to `peer_id` for `Connect` and waits for the
+  // handshake, without holding the lock.
+  absl::StatusOr<conn_type*> Handshake(uint32_t peer_id,
+                                       std::string_view server, uint16_t port);
+
+  // Sends a message that was already encoded to every node in `peers`, then
+  // waits for all of the sends.
+  absl::Status SendEncodedToAll(const std::vector<uint32_t>& peers,
+                                const uint8_t* buffer, size_t length);
+
+  // Returns the parent of this node in the broadcast tree rooted at `root`,
+  // and fills `children` with its children.
+  absl::StatusOr<uint32_t> GetTreeNeighbors(uint32_t root,
+                                            const std::vector<uint32_t>& group,
+                                            uint32_t fanout,
+                                            std::vector<uint32_t>* children);
+
   // Whether or not to stop handling requests.
   volatile bool accepting_;
 
@@ -149,15 +371,33 @@ class ConnectionManager : public RdmaReceiverInterface {
   absl::Status status_;
 
   uint32_t my_id_;
+  uint32_t qps_per_peer_;
+  QpConfig qp_config_;
   std::unique_ptr<RdmaBroker> broker_;
   ibv_pd* pd_;  // Convenience ptr to protection domain of `broker_`
 
   // Maintains connection information for a given Internet address. A connection
-  // manager only maintains a single connection per node. Nodes are identified
-  // by a string representing their IP address.
-  std::atomic<int> mu_;
-  std::unordered_map<uint32_t, std::unique_ptr<conn_type>> requested_;
-  std::unordered_map<uint32_t, std::unique_ptr<conn_type>> established_;
+  // manager maintains a single connection per node and lane, keyed by `Slot`.
+  // The lock is only held while updating this state, never while waiting on a
+  // peer, so the broker waits for it instead of rejecting requests.
+  absl::Mutex mu_;
+  // Replacements accepted from a peer, which are published once established.
+  std::unordered_map<uint64_t, std::unique_ptr<conn_type>> requested_;
+  std::unordered_map<uint64_t, std::unique_ptr<conn_type>> established_;
+  std::atomic<ConnectionTable*> table_;
+  std::vector<std::unique_ptr<ConnectionTable>> tables_;
+
+  // Connections that were replaced, kept until destruction.
+  std::vector<std::unique_ptr<conn_type>> retired_;
+
+  // Slots that have been connected before, and those that this node is
+  // requesting a connection on with `Connect` or `Reconnect`.
+  std::unordered_set<uint64_t> connected_;
+  std::unordered_set<uint64_t> requesting_;
+
+  // Where to reconnect to each peer.
+  std::unordered_map<uint32_t, PeerAddress> addresses_;
+  std::atomic<uint32_t> connect_data_{0};
 
   uint32_t backoff_us_{0};
 
@@ -4,13 +4,16 @@
 #include <infiniband/verbs.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <rdma/rdma_cma.h>
 #include <rdma/rdma_verbs.h>
 #include <sys/socket.h>
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
-#include <experimental/coroutine>
+#include <coroutine>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <random>
@@ -25,26 +28,29 @@
 #include "rome/util/coroutine.h"
 #include "rome/util/status_util.h"
 
-#define LOOPBACK_PORT_NUM 0
 namespace rome::rdma {
 
+using ::util::DeadlineExceededErrorBuilder;
+using ::util::FailedPreconditionErrorBuilder;
 using ::util::InternalErrorBuilder;
 
 template <typename ChannelType>
 ConnectionManager<ChannelType>::~ConnectionManager() {
   ROME_DEBUG("Shutting down: {}", fmt::ptr(this));
-  Acquire(my_id_);
   Shutdown();
 
+  // The broker may be waiting for the lock, so it is stopped first.
   ROME_DEBUG("Stopping broker...");
   if (broker_ != nullptr) auto s = broker_->Stop();
+  absl::MutexLock lock(&mu_);
 
-  auto cleanup = [this](auto& iter) {
+  auto cleanup = [this](conn_type* conn) {
     // A loopback connection is made manually, so we do not need to deal with
     // the regular `rdma_cm` handling. Similarly, we avoid destroying the event
     // channel below since it is destroyed along with the id.
-    auto id = iter.second->id();
-    if (iter.first != my_id_) {
+    auto id = conn->id();
+    bool loopback = conn->dst_id() == my_id_;
+    if (!loopback) {
       rdma_disconnect(id);
       rdma_cm_event* event;
       auto result = rdma_get_cm_event(id->channel, &event);
@@ -61,15 +67,16 @@ ConnectionManager<ChannelType>::~ConnectionManager() {
     auto* channel = id->channel;
     rdma_destroy_ep(id);
 
-    if (iter.first != my_id_ && context != nullptr) {
+    if (!loopback && context != nullptr) {
       free(context);
-    } else if (iter.first != my_id_) {
+    } else if (!loopback) {
       rdma_destroy_event_channel(channel);
     }
   };
 
-  std::for_each(established_.begin(), established_.end(), cleanup);
-  Release();
+  for (auto& [slot, conn] : established_) cleanup(conn.get());
+  for (auto& [slot, conn] : requested_) cleanup(conn.get());
+  for (auto& conn : retired_) cleanup(conn.get());
   ROME_DEBUG("Connection Manager Deconstructed.");
 }
 
@@ -80,8 +87,17 @@ void ConnectionManager<ChannelType>::Shutdown() {
 }
 
 template <typename ChannelType>
-ConnectionManager<ChannelType>::ConnectionManager(uint32_t my_id)
-    : accepting_(false), my_id_(my_id), broker_(nullptr), mu_(-1) {}
+ConnectionManager<ChannelType>::ConnectionManager(uint32_t my_id,
+                                                  uint32_t qps_per_peer,
+                                                  const QpConfig& qp_config)
+    : accepting_(false),
+      my_id_(my_id),
+      qps_per_peer_(std::max(qps_per_peer, 1u)),
+      qp_config_(qp_config),
+      broker_(nullptr) {
+  tables_.emplace_back(std::make_unique<ConnectionTable>(kInitialTableSize));
+  table_ = tables_.back().get();
+}
 
 template <typename ChannelType>
 absl::Status ConnectionManager<ChannelType>::Start(
@@ -95,6 +111,26 @@ absl::Status ConnectionManager<ChannelType>::Start(
   ROME_CHECK_QUIET(
       ROME_RETURN(InternalErrorBuilder() << "Failed to create broker"),
       broker_ != nullptr)
+
+  ibv_device_attr device_attr;
+  RDMA_CM_CHECK(ibv_query_device, pd()->context, &device_attr);
+  qp_config_ = qp_config_.Negotiate(device_attr);
+
+  // The messenger posts all of its receive slots up front.
+  if constexpr (requires { ChannelType::kRecvSlots; }) {
+    constexpr uint32_t kRecvSlots = ChannelType::kRecvSlots;
+    ROME_CHECK_QUIET(ROME_RETURN(FailedPreconditionErrorBuilder()
+                                 << "Device supports " << device_attr.max_qp_wr
+                                 << " work requests per queue, but the "
+                                    "messenger needs "
+                                 << kRecvSlots),
+                     static_cast<int64_t>(kRecvSlots) <= device_attr.max_qp_wr);
+    if (qp_config_.max_recv_wr < kRecvSlots) {
+      ROME_WARN("Raising max_recv_wr from {} to {} for the messenger",
+                qp_config_.max_recv_wr, kRecvSlots);
+      qp_config_.max_recv_wr = kRecvSlots;
+    }
+  }
   return absl::OkStatus();
 }
 
@@ -123,39 +159,49 @@ void ConnectionManager<ChannelType>::OnConnectRequest(rdma_cm_id* id,
                     "Received connect request without private data.");
   uint32_t peer_id =
       *reinterpret_cast<const uint32_t*>(event->param.conn.private_data);
-  ROME_DEBUG("[OnConnectRequest] (Node {}) Got connection request from: {}",
-             my_id_, peer_id);
+  uint32_t lane = 0;
+  if (event->param.conn.private_data_len >= sizeof(ConnectData)) {
+    lane = reinterpret_cast<const ConnectData*>(event->param.conn.private_data)
+               ->lane;
+  }
+  ROME_DEBUG(
+      "[OnConnectRequest] (Node {}) Got connection request from: {} (lane={})",
+      my_id_, peer_id, lane);
 
+  bool replaced = false;
   if (peer_id != my_id_) {
-    // Attempt to acquire lock when not originating from same node
-    if (!Acquire(peer_id)) {
-      ROME_DEBUG("Lock acquisition failed: {}", mu_);
-      rdma_reject(event->id, nullptr, 0);
-      rdma_destroy_ep(id);
-      rdma_ack_cm_event(event);
-      return;
-    }
+    // Local threads only hold the lock briefly, so wait for it rather than
+    // making the peer back off and retry.
+    mu_.Lock();
 
-    // Check if the connection has already been established.
-    if (auto conn = established_.find(peer_id);
-        conn != established_.end() || requested_.contains(peer_id)) {
+    // Check if the connection is already being made. If both ends are
+    // requesting it at once, the request of the lower ID wins.
+    auto slot = Slot(peer_id, lane);
+    if (lane >= qps_per_peer_ || requested_.contains(slot) ||
+        (requesting_.contains(slot) && my_id_ < peer_id)) {
       rdma_reject(event->id, nullptr, 0);
       rdma_destroy_ep(id);
       rdma_ack_cm_event(event);
-      if (peer_id != my_id_) Release();
-      auto status =
-          util::AlreadyExistsErrorBuilder()
-          << "[OnConnectRequest] (Node " << my_id_ << ") Connection already "
-          << (conn != established_.end() ? "established" : "requested") << ": "
-          << peer_id;
+      mu_.Unlock();
+      auto status = util::AlreadyExistsErrorBuilder()
+                    << "[OnConnectRequest] (Node " << my_id_
+                    << ") Connection already requested: " << peer_id
+                    << " (lane=" << lane << ")";
       ROME_DEBUG(absl::Status(status).ToString());
       return;
     }
 
+    // A peer only requests a connection that exists here if it has replaced
+    // its end, so the local end is no longer usable. It stays visible to
+    // `GetConnection` until the replacement is established.
+    replaced = connected_.contains(slot);
+    RetireEstablished(peer_id, lane);
+
     // Create a new QP for the connection.
     ibv_qp_init_attr init_attr = DefaultQpInitAttr();
     ROME_ASSERT(id->qp == nullptr, "QP already allocated...?");
     RDMA_CM_ASSERT(rdma_create_qp, id, pd(), &init_attr);
+    SetAckTimeout(id);
   } else {
     // rdma_destroy_id(id);
     id = loopback_id_;
@@ -166,54 +212,74 @@ void ConnectionManager<ChannelType>::OnConnectRequest(rdma_cm_id* id,
   // The underlying QP is RC, so we reuse it for issuing 1-sided RDMA too. We
   // also store the `peer_id` associated with this id so that we can reference
   // it later.
-  auto context = new IdContext{peer_id, {}, {}};
-  std::memset(&context->conn_param, 0, sizeof(context->conn_param));
-  context->conn_param.private_data = &context->node_id;
-  context->conn_param.private_data_len = sizeof(context->node_id);
-  context->conn_param.rnr_retry_count = 1;  // Retry forever
-  context->conn_param.retry_count = 7;
-  context->conn_param.responder_resources = 8;
-  context->conn_param.initiator_depth = 8;
+  auto context = new IdContext{peer_id, lane, {}, {}, {}};
+  context->data = ConnectData{my_id_, lane, connect_data_};
+  context->conn_param = DefaultConnParam();
+  context->conn_param.private_data = &context->data;
+  context->conn_param.private_data_len = sizeof(context->data);
   id->context = context;
 
-  auto iter = established_.emplace(
-      peer_id,
-      new Connection{my_id_, peer_id, std::make_unique<ChannelType>(id)});
-  ROME_ASSERT_DEBUG(iter.second, "Insertion failed");
+  auto conn = std::make_unique<conn_type>(
+      my_id_, peer_id, std::make_unique<ChannelType>(id), PeerData(event));
+  if (replaced) {
+    // Published once established, so that the old connection is used until
+    // the new one can be.
+    requested_.emplace(Slot(peer_id, lane), std::move(conn));
+  } else {
+    AddEstablished(lane, std::move(conn));
+  }
 
   ROME_DEBUG("[OnConnectRequest] (Node {}) peer={}, id={}", my_id_, peer_id,
              fmt::ptr(id));
   RDMA_CM_ASSERT(rdma_accept, id,
                  peer_id == my_id_ ? nullptr : &context->conn_param);
   rdma_ack_cm_event(event);
-  if (peer_id != my_id_) Release();
+  if (peer_id != my_id_) mu_.Unlock();
 }
 
 template <typename ChannelType>
 void ConnectionManager<ChannelType>::OnEstablished(rdma_cm_id* id,
                                                    rdma_cm_event* event) {
   rdma_ack_cm_event(event);
+  if (id->context == nullptr) return;
+
+  uint32_t peer_id = IdContext::GetNodeId(id->context);
+  uint32_t lane = IdContext::GetLane(id->context);
+  absl::MutexLock lock(&mu_);
+  if (auto conn = requested_.find(Slot(peer_id, lane));
+      conn != requested_.end() && conn->second->id() == id) {
+    auto accepted = std::move(conn->second);
+    requested_.erase(conn);
+    // A connection established before the peer replaced it again is retired.
+    RetireEstablished(peer_id, lane);
+    AddEstablished(lane, std::move(accepted));
+  }
 }
 
 template <typename ChannelType>
 void ConnectionManager<ChannelType>::OnDisconnect(rdma_cm_id* id) {
   // This disconnection originated from the peer, so we simply disconnect the
-  // local endpoint and clean it up.
+  // local endpoint and retire the connection. Other threads may still be using
+  // it, so it is only cleaned up along with the connection manager.
   //
   // NOTE: The event is already ack'ed by the caller.
   rdma_disconnect(id);
+  if (id->context == nullptr) return;
 
   uint32_t peer_id = IdContext::GetNodeId(id->context);
-  Acquire(peer_id);
-  if (auto conn = established_.find(peer_id);
+  uint32_t lane = IdContext::GetLane(id->context);
+  absl::MutexLock lock(&mu_);
+  auto slot = Slot(peer_id, lane);
+  if (auto conn = established_.find(slot);
       conn != established_.end() && conn->second->id() == id) {
-    ROME_DEBUG("(Node {}) Disconnected from node {}", my_id_, peer_id);
-    established_.erase(peer_id);
+    ROME_DEBUG("(Node {}) Disconnected from node {} (lane={})", my_id_,
+               peer_id, lane);
+    RetireEstablished(peer_id, lane);
+  } else if (auto conn = requested_.find(slot);
+             conn != requested_.end() && conn->second->id() == id) {
+    retired_.push_back(std::move(conn->second));
+    requested_.erase(conn);
   }
-  Release();
-  auto* event_channel = id->channel;
-  rdma_destroy_ep(id);
-  rdma_destroy_event_channel(event_channel);
 }
 
 template <typename ChannelType>
@@ -226,18 +292,19 @@ ConnectionManager<ChannelType>::ConnectLoopback(rdma_cm_id* id) {
 
   attr = DefaultQpAttr();
   attr.qp_state = IBV_QPS_INIT;
-  attr.port_num = LOOPBACK_PORT_NUM; // id->port_num;
+  attr.port_num = id->port_num;
   attr_mask =
       IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
   ROME_TRACE("Loopback: IBV_QPS_INIT");
   RDMA_CM_CHECK(ibv_modify_qp, id->qp, &attr, attr_mask);
 
   ibv_port_attr port_attr;
-  RDMA_CM_CHECK(ibv_query_port, id->verbs, LOOPBACK_PORT_NUM, &port_attr); // RDMA_CM_CHECK(ibv_query_port, id->verbs, id->port_num, &port_attr);
+  RDMA_CM_CHECK(ibv_query_port, id->verbs, id->port_num, &port_attr);
+  attr.path_mtu = std::min(attr.path_mtu, port_attr.active_mtu);
   attr.ah_attr.dlid = port_attr.lid;
   attr.qp_state = IBV_QPS_RTR;
   attr.dest_qp_num = id->qp->qp_num;
-  attr.ah_attr.port_num = LOOPBACK_PORT_NUM; // id->port_num;
+  attr.ah_attr.port_num = id->port_num;
   attr_mask =
       (IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
        IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
@@ -256,12 +323,12 @@ ConnectionManager<ChannelType>::ConnectLoopback(rdma_cm_id* id) {
                 fcntl(id->send_cq->channel->fd, F_GETFL) | O_NONBLOCK);
 
   // Allocate a new control channel to be used with this connection
-  auto channel = std::make_unique<ChannelType>(id);
-  auto iter = established_.emplace(
-      my_id_, new Connection{my_id_, my_id_, std::move(channel)});
-  ROME_ASSERT(iter.second, "Unexepected error");
-  Release();
-  return established_[my_id_].get();
+  absl::MutexLock lock(&mu_);
+  requesting_.erase(Slot(my_id_, 0));
+  return AddEstablished(
+      0, std::make_unique<conn_type>(my_id_, my_id_,
+                                     std::make_unique<ChannelType>(id),
+                                     connect_data_));
 }
 
 template <typename ChannelType>
@@ -269,182 +336,695 @@ absl::StatusOr<typename ConnectionManager<ChannelType>::conn_type*>
 ConnectionManager<ChannelType>::Connect(uint32_t peer_id,
                                         std::string_view server,
                                         uint16_t port) {
-  if (Acquire(my_id_)) {
-    auto conn = established_.find(peer_id);
-    if (conn != established_.end()) {
-      Release();
-      return conn->second.get();
+  auto slot = Slot(peer_id, 0);
+  {
+    absl::MutexLock lock(&mu_);
+    addresses_.insert_or_assign(
+        peer_id, PeerAddress{peer_id, std::string(server), port});
+    auto conn = established_.find(slot);
+    if (conn != established_.end()) return conn->second.get();
+
+    // The slot is marked instead of holding the lock during the handshake, so
+    // that the broker can tell a request of the peer for the same connection.
+    if (!requesting_.insert(slot).second) {
+      return util::UnavailableErrorBuilder()
+             << "[Connect] (Node " << my_id_
+             << ") Connection is already requested: " << peer_id;
     }
+  }
 
-    auto port_str = std::to_string(htons(port));
-    rdma_cm_id* id = nullptr;
-    rdma_addrinfo hints, *resolved = nullptr;
-
-    std::memset(&hints, 0, sizeof(hints));
-    hints.ai_port_space = RDMA_PS_TCP;
-    hints.ai_qp_type = IBV_QPT_RC;
-    hints.ai_family = AF_IB;
-
-    struct sockaddr_in src;
-    std::memset(&src, 0, sizeof(src));
-    src.sin_family = AF_INET;
-    auto src_addr_str = broker_->address();
-    inet_aton(src_addr_str.data(), &src.sin_addr);
-
-    hints.ai_src_addr = reinterpret_cast<sockaddr*>(&src);
-    hints.ai_src_len = sizeof(src);
-
-    // Resolve the server's address. If this connection request is for the
-    // loopback connection, then we are going to
-    int gai_ret =
-        rdma_getaddrinfo(server.data(), port_str.data(), &hints, &resolved);
-    ROME_CHECK_QUIET(
-        ROME_RETURN(InternalErrorBuilder()
-                    << "rdma_getaddrinfo(): " << gai_strerror(gai_ret)),
-        gai_ret == 0);
+  absl::StatusOr<conn_type*> conn;
+  if (peer_id == my_id_) {
+    auto endpoint = CreateEndpoint(server, port);
+    conn = endpoint.ok() ? ConnectLoopback(*endpoint) : endpoint.status();
+  } else {
+    conn = Handshake(peer_id, server, port);
+  }
+  if (!conn.ok()) {
+    absl::MutexLock lock(&mu_);
+    requesting_.erase(slot);
+  }
+  return conn;
+}
 
-    ibv_qp_init_attr init_attr = DefaultQpInitAttr();
-    auto err = rdma_create_ep(&id, resolved, pd(), &init_attr);
-    rdma_freeaddrinfo(resolved);
-    if (err) {
-      Release();
-      return util::InternalErrorBuilder()
-             << "rdma_create_ep(): " << strerror(errno) << " (" << errno << ")";
-    }
-    ROME_DEBUG("[Connect] (Node {}) Trying to connect to: {} (id={})", my_id_,
-               peer_id, fmt::ptr(id));
+template <typename ChannelType>
+absl::StatusOr<typename ConnectionManager<ChannelType>::conn_type*>
+ConnectionManager<ChannelType>::Handshake(uint32_t peer_id,
+                                          std::string_view server,
+                                          uint16_t port) {
+  auto endpoint = CreateEndpoint(server, port);
+  if (!endpoint.ok()) return endpoint.status();
+  rdma_cm_id* id = *endpoint;
+  ROME_DEBUG("[Connect] (Node {}) Trying to connect to: {} (id={})", my_id_,
+             peer_id, fmt::ptr(id));
 
-    if (peer_id == my_id_) return ConnectLoopback(id);
+  auto* event_channel = rdma_create_event_channel();
+  RDMA_CM_CHECK(fcntl, event_channel->fd, F_SETFL,
+                fcntl(event_channel->fd, F_GETFL) | O_NONBLOCK);
+  RDMA_CM_CHECK(rdma_migrate_id, id, event_channel);
 
-    auto* event_channel = rdma_create_event_channel();
-    RDMA_CM_CHECK(fcntl, event_channel->fd, F_SETFL,
-                  fcntl(event_channel->fd, F_GETFL) | O_NONBLOCK);
-    RDMA_CM_CHECK(rdma_migrate_id, id, event_channel);
+  ConnectData data{my_id_, 0, connect_data_};
+  auto conn_param = DefaultConnParam();
+  conn_param.private_data = &data;
+  conn_param.private_data_len = sizeof(data);
+  RDMA_CM_CHECK(rdma_connect, id, &conn_param);
 
-    rdma_conn_param conn_param;
-    std::memset(&conn_param, 0, sizeof(conn_param));
-    conn_param.private_data = &my_id_;
-    conn_param.private_data_len = sizeof(my_id_);
-    conn_param.retry_count = 7;
-    conn_param.rnr_retry_count = 1;
-    conn_param.responder_resources = 8;
-    conn_param.initiator_depth = 8;
+  // Handle events.
+  while (true) {
+    rdma_cm_event* event;
+    auto result = rdma_get_cm_event(id->channel, &event);
+    while (result < 0 && errno == EAGAIN) {
+      result = rdma_get_cm_event(id->channel, &event);
+    }
+    ROME_DEBUG("[Connect] (Node {}) Got event: {} (id={})", my_id_,
+               rdma_event_str(event->event), fmt::ptr(id));
 
-    RDMA_CM_CHECK(rdma_connect, id, &conn_param);
+    switch (event->event) {
+      case RDMA_CM_EVENT_ESTABLISHED: {
+        auto peer_data = PeerData(event);
+        RDMA_CM_CHECK(rdma_ack_cm_event, event);
+        ROME_DEBUG(
+            "Connected: dev={}, addr={}, port={}", id->verbs->device->name,
+            inet_ntoa(reinterpret_cast<sockaddr_in*>(rdma_get_local_addr(id))
+                          ->sin_addr),
+            rdma_get_src_port(id));
+        RDMA_CM_CHECK(fcntl, event_channel->fd, F_SETFL,
+                      fcntl(event_channel->fd, F_GETFL) | O_SYNC);
+        RDMA_CM_CHECK(fcntl, id->recv_cq->channel->fd, F_SETFL,
+                      fcntl(id->recv_cq->channel->fd, F_GETFL) | O_NONBLOCK);
+        RDMA_CM_CHECK(fcntl, id->send_cq->channel->fd, F_SETFL,
+                      fcntl(id->send_cq->channel->fd, F_GETFL) | O_NONBLOCK);
 
-    // Handle events.
-    while (true) {
-      rdma_cm_event* event;
-      auto result = rdma_get_cm_event(id->channel, &event);
-      while (result < 0 && errno == EAGAIN) {
-        result = rdma_get_cm_event(id->channel, &event);
-      }
-      ROME_DEBUG("[Connect] (Node {}) Got event: {} (id={})", my_id_,
-                 rdma_event_str(event->event), fmt::ptr(id));
+        mu_.Lock();
+        requesting_.erase(Slot(peer_id, 0));
+        if (auto conn = established_.find(Slot(peer_id, 0));
+            conn != established_.end()) {
+          auto* existing = conn->second.get();
+          mu_.Unlock();
 
-      absl::StatusOr<ChannelType*> conn_or;
-      switch (event->event) {
-        case RDMA_CM_EVENT_ESTABLISHED: {
-          RDMA_CM_CHECK(rdma_ack_cm_event, event);
-          auto conn = established_.find(peer_id);
-          if (bool is_established = (conn != established_.end());
-              is_established && peer_id != my_id_) {
-            Release();
-
-            // Since we are initiating the disconnection, we must get and ack
-            // the event.
-            ROME_DEBUG("[Connect] (Node {}) Disconnecting: (id={})", my_id_,
-                       fmt::ptr(id));
-            RDMA_CM_CHECK(rdma_disconnect, id);
-            rdma_cm_event* event;
-            auto result = rdma_get_cm_event(id->channel, &event);
-            while (result < 0 && errno == EAGAIN) {
-              result = rdma_get_cm_event(id->channel, &event);
-            }
-            RDMA_CM_CHECK(rdma_ack_cm_event, event);
-
-            rdma_destroy_ep(id);
-            rdma_destroy_event_channel(event_channel);
-
-            if (is_established) {
-              ROME_DEBUG("[Connect] Already connected: {}", peer_id);
-              return conn->second.get();
-            } else {
-              return util::UnavailableErrorBuilder()
-                     << "[Connect] (Node " << my_id_
-                     << ") Connection is already requested: " << peer_id;
-            }
+          // Since we are initiating the disconnection, we must get and ack
+          // the event.
+          ROME_DEBUG("[Connect] (Node {}) Disconnecting: (id={})", my_id_,
+                     fmt::ptr(id));
+          RDMA_CM_CHECK(rdma_disconnect, id);
+          rdma_cm_event* event;
+          auto result = rdma_get_cm_event(id->channel, &event);
+          while (result < 0 && errno == EAGAIN) {
+            result = rdma_get_cm_event(id->channel, &event);
           }
+          RDMA_CM_CHECK(rdma_ack_cm_event, event);
 
-          // If this code block is reached, then the connection established by
-          // this call is the first successful connection to be established and
-          // therefore we must add it to the set of established connections.
-          ROME_DEBUG(
-              "Connected: dev={}, addr={}, port={}", id->verbs->device->name,
-              inet_ntoa(reinterpret_cast<sockaddr_in*>(rdma_get_local_addr(id))
-                            ->sin_addr),
-              rdma_get_src_port(id));
-
-          RDMA_CM_CHECK(fcntl, event_channel->fd, F_SETFL,
-                        fcntl(event_channel->fd, F_GETFL) | O_SYNC);
-          RDMA_CM_CHECK(fcntl, id->recv_cq->channel->fd, F_SETFL,
-                        fcntl(id->recv_cq->channel->fd, F_GETFL) | O_NONBLOCK);
-          RDMA_CM_CHECK(fcntl, id->send_cq->channel->fd, F_SETFL,
-                        fcntl(id->send_cq->channel->fd, F_GETFL) | O_NONBLOCK);
-
-          // Allocate a new control channel to be used with this connection
-          auto channel = std::make_unique<ChannelType>(id);
-          auto iter = established_.emplace(
-              peer_id, new Connection{my_id_, peer_id, std::move(channel)});
-          ROME_ASSERT(iter.second, "Unexepected error");
-          auto* new_conn = established_[peer_id].get();
-          Release();
-          return new_conn;
+          rdma_destroy_ep(id);
+          rdma_destroy_event_channel(event_channel);
+          ROME_DEBUG("[Connect] Already connected: {}", peer_id);
+          return existing;
         }
-        case RDMA_CM_EVENT_ADDR_RESOLVED:
-          ROME_WARN("Got addr resolved...");
-          RDMA_CM_CHECK(rdma_ack_cm_event, event);
-          break;
-        default: {
-          auto cm_event = event->event;
-          RDMA_CM_CHECK(rdma_ack_cm_event, event);
+
+        // If this code block is reached, then the connection established by
+        // this call is the first successful connection to be established and
+        // therefore we must add it to the set of established connections.
+        auto* new_conn = AddEstablished(
+            0, std::make_unique<conn_type>(
+                   my_id_, peer_id, std::make_unique<ChannelType>(id),
+                   peer_data));
+        mu_.Unlock();
+        return new_conn;
+      }
+      case RDMA_CM_EVENT_ADDR_RESOLVED:
+        ROME_WARN("Got addr resolved...");
+        RDMA_CM_CHECK(rdma_ack_cm_event, event);
+        break;
+      default: {
+        auto cm_event = event->event;
+        RDMA_CM_CHECK(rdma_ack_cm_event, event);
+        uint32_t backoff_us;
+        {
+          absl::MutexLock lock(&mu_);
           backoff_us_ =
               backoff_us_ > 0
                   ? std::min((backoff_us_ + (100 * my_id_)) * 2, kMaxBackoffUs)
                   : kMinBackoffUs;
-          Release();
-          rdma_destroy_ep(id);
-          rdma_destroy_event_channel(event_channel);
-          if (cm_event == RDMA_CM_EVENT_REJECTED) {
-            std::this_thread::sleep_for(std::chrono::microseconds(backoff_us_));
-            return util::UnavailableErrorBuilder()
-                   << "Connection request rejected";
-          }
-          return InternalErrorBuilder()
-                 << "Got unexpected event: " << rdma_event_str(cm_event);
+          backoff_us = backoff_us_;
+        }
+        rdma_destroy_ep(id);
+        rdma_destroy_event_channel(event_channel);
+        if (cm_event == RDMA_CM_EVENT_REJECTED) {
+          std::this_thread::sleep_for(std::chrono::microseconds(backoff_us));
+          return util::UnavailableErrorBuilder()
+                 << "Connection request rejected";
         }
+        return InternalErrorBuilder()
+               << "Got unexpected event: " << rdma_event_str(cm_event);
       }
     }
-  } else {
-    return util::UnavailableErrorBuilder() << "Lock acquisition failed";
   }
 }
 
+template <typename ChannelType>
+absl::StatusOr<rdma_addrinfo*> ConnectionManager<ChannelType>::GetAddrInfo(
+    std::string_view server, uint16_t port) {
+  auto port_str = std::to_string(htons(port));
+  rdma_addrinfo hints, *resolved = nullptr;
+
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_port_space = RDMA_PS_TCP;
+  hints.ai_qp_type = IBV_QPT_RC;
+  hints.ai_family = AF_IB;
+
+  struct sockaddr_in src;
+  std::memset(&src, 0, sizeof(src));
+  src.sin_family = AF_INET;
+  auto src_addr_str = broker_->address();
+  inet_aton(src_addr_str.data(), &src.sin_addr);
+
+  hints.ai_src_addr = reinterpret_cast<sockaddr*>(&src);
+  hints.ai_src_len = sizeof(src);
+
+  // Resolve the server's address. If this connection request is for the
+  // loopback connection, then we are going to
+  int gai_ret =
+      rdma_getaddrinfo(server.data(), port_str.data(), &hints, &resolved);
+  ROME_CHECK_QUIET(
+      ROME_RETURN(InternalErrorBuilder()
+                  << "rdma_getaddrinfo(): " << gai_strerror(gai_ret)),
+      gai_ret == 0);
+  return resolved;
+}
+
+template <typename ChannelType>
+absl::StatusOr<rdma_cm_id*> ConnectionManager<ChannelType>::CreateEndpoint(
+    std::string_view server, uint16_t port) {
+  auto resolved = GetAddrInfo(server, port);
+  if (!resolved.ok()) return resolved.status();
+  rdma_cm_id* id = nullptr;
+  ibv_qp_init_attr init_attr = DefaultQpInitAttr();
+  auto err = rdma_create_ep(&id, *resolved, pd(), &init_attr);
+  rdma_freeaddrinfo(*resolved);
+  if (err) {
+    return util::InternalErrorBuilder()
+           << "rdma_create_ep(): " << strerror(errno) << " (" << errno << ")";
+  }
+  SetAckTimeout(id);
+  return id;
+}
+
+template <typename ChannelType>
+absl::StatusOr<rdma_cm_id*> ConnectionManager<ChannelType>::IssueConnect(
+    const PeerAddress& peer, rdma_event_channel* event_channel) {
+  auto resolved = GetAddrInfo(peer.address, peer.port);
+  if (!resolved.ok()) return resolved.status();
+  rdma_cm_id* id = nullptr;
+  if (rdma_create_id(event_channel, &id, nullptr, RDMA_PS_TCP) != 0 ||
+      rdma_resolve_addr(id, (*resolved)->ai_src_addr, (*resolved)->ai_dst_addr,
+                        kResolveTimeoutMs) != 0) {
+    auto status = InternalErrorBuilder()
+                  << "Failed to resolve " << peer.id << ": " << strerror(errno);
+    if (id != nullptr) rdma_destroy_id(id);
+    rdma_freeaddrinfo(*resolved);
+    return status;
+  }
+  rdma_freeaddrinfo(*resolved);
+  return id;
+}
+
+template <typename ChannelType>
+absl::Status ConnectionManager<ChannelType>::ConnectResolved(rdma_cm_id* id,
+                                                             uint32_t lane) {
+  ibv_qp_init_attr init_attr = DefaultQpInitAttr();
+  RDMA_CM_CHECK(rdma_create_qp, id, pd(), &init_attr);
+  SetAckTimeout(id);
+  ConnectData data{my_id_, lane, connect_data_};
+  auto conn_param = DefaultConnParam();
+  conn_param.private_data = &data;
+  conn_param.private_data_len = sizeof(data);
+  RDMA_CM_CHECK(rdma_connect, id, &conn_param);
+  return absl::OkStatus();
+}
+
+template <typename ChannelType>
+absl::Status ConnectionManager<ChannelType>::AddOutgoing(uint32_t peer_id,
+                                                         uint32_t lane,
+                                                         rdma_cm_id* id,
+                                                         uint32_t peer_data) {
+  RDMA_CM_CHECK(fcntl, id->recv_cq->channel->fd, F_SETFL,
+                fcntl(id->recv_cq->channel->fd, F_GETFL) | O_NONBLOCK);
+  RDMA_CM_CHECK(fcntl, id->send_cq->channel->fd, F_SETFL,
+                fcntl(id->send_cq->channel->fd, F_GETFL) | O_NONBLOCK);
+
+  // Disconnecting and cleaning up expect every connection made by this node to
+  // have an event channel of its own.
+  auto* event_channel = rdma_create_event_channel();
+  ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                               << "rdma_create_event_channel(): "
+                               << strerror(errno)),
+                   event_channel != nullptr);
+  if (fcntl(event_channel->fd, F_SETFL,
+            fcntl(event_channel->fd, F_GETFL) | O_NONBLOCK) != 0 ||
+      rdma_migrate_id(id, event_channel) != 0) {
+    auto status = InternalErrorBuilder()
+                  << "Failed to move connection to " << peer_id << ": "
+                  << strerror(errno);
+    rdma_destroy_event_channel(event_channel);
+    return status;
+  }
+
+  auto conn = std::make_unique<conn_type>(
+      my_id_, peer_id, std::make_unique<ChannelType>(id), peer_data);
+  absl::MutexLock lock(&mu_);
+  // The peer accepted this request, so it has replaced its end of any
+  // connection made in the meantime.
+  RetireEstablished(peer_id, lane);
+  if (auto pending = requested_.find(Slot(peer_id, lane));
+      pending != requested_.end()) {
+    retired_.push_back(std::move(pending->second));
+    requested_.erase(pending);
+  }
+  AddEstablished(lane, std::move(conn));
+  return absl::OkStatus();
+}
+
+template <typename ChannelType>
+absl::Status ConnectionManager<ChannelType>::ConnectAll(
+    const std::vector<PeerAddress>& peers, std::chrono::milliseconds timeout) {
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  {
+    absl::MutexLock lock(&mu_);
+    for (const auto& p : peers) addresses_.insert_or_assign(p.id, p);
+  }
+
+  std::vector<PendingConnect> outgoing;
+  std::vector<uint32_t> incoming;
+  for (const auto& p : peers) {
+    if (p.id == my_id_) {
+      auto conn = Connect(p.id, p.address, p.port);
+      while (absl::IsUnavailable(conn.status())) {
+        ROME_CHECK_QUIET(ROME_RETURN(DeadlineExceededErrorBuilder()
+                                     << "Timed out connecting loopback"),
+                         std::chrono::steady_clock::now() < deadline);
+        conn = Connect(p.id, p.address, p.port);
+      }
+      if (!conn.ok()) return conn.status();
+    } else if (my_id_ < p.id) {
+      for (uint32_t lane = 0; lane < qps_per_peer_; ++lane) {
+        auto* conn = Lookup(p.id, lane);
+        if (conn != nullptr && !conn->HasFailed()) continue;
+        outgoing.push_back(
+            PendingConnect{p, lane, 0, std::chrono::steady_clock::now()});
+      }
+    } else {
+      incoming.push_back(p.id);
+    }
+  }
+  auto status = ConnectPending(std::move(outgoing), deadline);
+  if (!status.ok()) return status;
+
+  // The remaining connections are accepted by the broker.
+  for (auto peer_id : incoming) {
+    for (uint32_t lane = 0; lane < qps_per_peer_; ++lane) {
+      while (Lookup(peer_id, lane) == nullptr) {
+        ROME_CHECK_QUIET(ROME_RETURN(DeadlineExceededErrorBuilder()
+                                     << "Timed out waiting for " << peer_id
+                                     << " to connect (lane=" << lane << ")"),
+                         std::chrono::steady_clock::now() < deadline);
+        std::this_thread::sleep_for(std::chrono::microseconds(kMinBackoffUs));
+      }
+    }
+  }
+  return absl::OkStatus();
+}
+
+template <typename ChannelType>
+absl::Status ConnectionManager<ChannelType>::ConnectPending(
+    std::vector<PendingConnect> outgoing,
+    std::chrono::steady_clock::time_point deadline) {
+  using clock = std::chrono::steady_clock;
+  if (outgoing.empty()) return absl::OkStatus();
+  auto* event_channel = rdma_create_event_channel();
+  ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                               << "rdma_create_event_channel(): "
+                               << strerror(errno)),
+                   event_channel != nullptr);
+  RDMA_CM_CHECK(fcntl, event_channel->fd, F_SETFL,
+                fcntl(event_channel->fd, F_GETFL) | O_NONBLOCK);
+
+  // Every request in flight reports its events on the same channel, so they
+  // all make progress at once, from resolving the address and route through to
+  // the handshake. A peer that has not started its broker yet, or that is
+  // busy, rejects the request and it is issued again after a backoff.
+  std::unordered_map<rdma_cm_id*, PendingConnect> in_flight;
+  absl::Status status = absl::OkStatus();
+  while (status.ok() && (!outgoing.empty() || !in_flight.empty())) {
+    auto now = clock::now();
+    if (now >= deadline) {
+      status = DeadlineExceededErrorBuilder()
+               << "Timed out with " << outgoing.size() + in_flight.size()
+               << " connections not established";
+      break;
+    }
+    auto wake = deadline;
+    for (auto iter = outgoing.begin(); iter != outgoing.end();) {
+      if (iter->retry_at > now) {
+        wake = std::min(wake, iter->retry_at);
+        ++iter;
+        continue;
+      }
+      ROME_DEBUG("[ConnectAll] (Node {}) Trying to connect to: {} (lane={})",
+                 my_id_, iter->peer.id, iter->lane);
+      auto id = IssueConnect(iter->peer, event_channel);
+      if (!id.ok()) {
+        status = id.status();
+        break;
+      }
+      in_flight.emplace(*id, std::move(*iter));
+      iter = outgoing.erase(iter);
+    }
+    if (!status.ok()) break;
+
+    // Sleep until an event arrives or the next retry is due.
+    pollfd fds{event_channel->fd, POLLIN, 0};
+    auto wait = std::chrono::ceil<std::chrono::milliseconds>(wake - now);
+    int ready = poll(&fds, 1, static_cast<int>(std::clamp<int64_t>(
+                                  wait.count(), 0,
+                                  std::numeric_limits<int>::max())));
+    if (ready < 0 && errno != EINTR) {
+      status = InternalErrorBuilder() << "poll(): " << strerror(errno);
+      break;
+    }
+    if (ready <= 0) continue;
+
+    rdma_cm_event* event;
+    if (rdma_get_cm_event(event_channel, &event) != 0) {
+      if (errno != EAGAIN) {
+        status = InternalErrorBuilder()
+                 << "rdma_get_cm_event(): " << strerror(errno);
+      }
+      continue;
+    }
+    auto* id = event->id;
+    auto cm_event = event->event;
+    auto peer_data = PeerData(event);
+    rdma_ack_cm_event(event);
+    ROME_DEBUG("[ConnectPending] (Node {}) Got event: {} (id={})", my_id_,
+               rdma_event_str(cm_event), fmt::ptr(id));
+
+    auto pending = in_flight.find(id);
+    ROME_ASSERT(pending != in_flight.end(), "Event for unknown id");
+    switch (cm_event) {
+      case RDMA_CM_EVENT_ADDR_RESOLVED:
+        if (rdma_resolve_route(id, kResolveTimeoutMs) != 0) {
+          status = InternalErrorBuilder()
+                   << "rdma_resolve_route(): " << strerror(errno);
+        }
+        break;
+      case RDMA_CM_EVENT_ROUTE_RESOLVED:
+        status = ConnectResolved(id, pending->second.lane);
+        break;
+      case RDMA_CM_EVENT_ESTABLISHED:
+        status = AddOutgoing(pending->second.peer.id, pending->second.lane, id,
+                             peer_data);
+        if (status.ok()) in_flight.erase(pending);
+        break;
+      case RDMA_CM_EVENT_ADDR_ERROR:
+      case RDMA_CM_EVENT_ROUTE_ERROR:
+      case RDMA_CM_EVENT_REJECTED:
+      case RDMA_CM_EVENT_UNREACHABLE:
+      case RDMA_CM_EVENT_CONNECT_ERROR: {
+        auto retry = std::move(pending->second);
+        in_flight.erase(pending);
+        rdma_destroy_ep(id);
+
+        // When both ends reconnect at once, the peer's request wins if it has
+        // the lower ID, and there is nothing left to retry.
+        auto slot = Slot(retry.peer.id, retry.lane);
+        mu_.Lock();
+        bool replaced =
+            established_.contains(slot) || requested_.contains(slot);
+        mu_.Unlock();
+        if (replaced) break;
+
+        retry.backoff_us = retry.backoff_us > 0
+                               ? std::min(retry.backoff_us * 2,
+                                          kMaxRetryBackoffUs)
+                               : kMinBackoffUs;
+        retry.retry_at =
+            clock::now() + std::chrono::microseconds(retry.backoff_us);
+        outgoing.push_back(std::move(retry));
+        break;
+      }
+      default:
+        status = InternalErrorBuilder()
+                 << "Got unexpected event: " << rdma_event_str(cm_event);
+    }
+  }
+  for (auto& [id, pending] : in_flight) {
+    rdma_destroy_ep(id);
+  }
+  rdma_destroy_event_channel(event_channel);
+  return status;
+}
+
+template <typename ChannelType>
+void ConnectionManager<ChannelType>::SetConnectData(uint32_t data) {
+  connect_data_ = data;
+}
+
+template <typename ChannelType>
+absl::StatusOr<typename ConnectionManager<ChannelType>::conn_type*>
+ConnectionManager<ChannelType>::Reconnect(uint32_t peer_id, uint32_t lane,
+                                          std::chrono::milliseconds timeout) {
+  ROME_CHECK_QUIET(ROME_RETURN(util::InvalidArgumentErrorBuilder()
+                               << "Cannot reconnect to " << peer_id
+                               << " (lane=" << lane << ")"),
+                   peer_id != my_id_ && lane < qps_per_peer_);
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  mu_.Lock();
+  auto address = addresses_.find(peer_id);
+  if (address == addresses_.end()) {
+    mu_.Unlock();
+    return util::NotFoundErrorBuilder() << "Unknown address: " << peer_id;
+  }
+  auto slot = Slot(peer_id, lane);
+  if (auto current = established_.find(slot);
+      current != established_.end() && !current->second->HasFailed()) {
+    // The peer has replaced the connection already.
+    auto* conn = current->second.get();
+    mu_.Unlock();
+    return conn;
+  }
+  auto* failed = Lookup(peer_id, lane);
+
+  // If the peer's replacement was accepted, it only needs to be established.
+  bool accepted = requested_.contains(slot);
+  std::vector<PendingConnect> outgoing;
+  if (!accepted) {
+    outgoing.push_back(PendingConnect{address->second, lane, 0,
+                                      std::chrono::steady_clock::now()});
+    requesting_.insert(slot);
+    RetireEstablished(peer_id, lane);
+  }
+  mu_.Unlock();
+
+  ROME_DEBUG("[Reconnect] (Node {}) Reconnecting to: {} (lane={})", my_id_,
+             peer_id, lane);
+  auto status = ConnectPending(std::move(outgoing), deadline);
+  if (!accepted) {
+    absl::MutexLock lock(&mu_);
+    requesting_.erase(slot);
+  }
+  if (absl::IsDeadlineExceeded(status)) {
+    return util::UnavailableErrorBuilder()
+           << "Failed to reconnect to " << peer_id << " (lane=" << lane
+           << "): " << status.message();
+  }
+  if (!status.ok()) return status;
+
+  // If the peer's request won, its connection is published once established.
+  auto* conn = Lookup(peer_id, lane);
+  while (conn == nullptr || conn == failed) {
+    ROME_CHECK_QUIET(ROME_RETURN(util::UnavailableErrorBuilder()
+                                 << "Timed out reconnecting to " << peer_id
+                                 << " (lane=" << lane << ")"),
+                     std::chrono::steady_clock::now() < deadline);
+    std::this_thread::sleep_for(std::chrono::microseconds(kMinBackoffUs));
+    conn = Lookup(peer_id, lane);
+  }
+  return conn;
+}
+
 template <typename ChannelType>
 absl::StatusOr<typename ConnectionManager<ChannelType>::conn_type*>
 ConnectionManager<ChannelType>::GetConnection(uint32_t peer_id) {
-  while (!Acquire(my_id_)) {
-    std::this_thread::yield();
-  }
-  auto conn = established_.find(peer_id);
-  if (conn != established_.end()) {
-    auto result = conn->second.get();
-    Release();
-    return result;
-  } else {
-    Release();
-    return util::NotFoundErrorBuilder() << "Connection not found: " << peer_id;
+  auto* conn = Lookup(peer_id, GetLane());
+  if (conn == nullptr) conn = Lookup(peer_id, 0);
+  ROME_CHECK_QUIET(ROME_RETURN(util::NotFoundErrorBuilder()
+                               << "Connection not found: " << peer_id),
+                   conn != nullptr);
+  return conn;
+}
+
+template <typename ChannelType>
+absl::StatusOr<typename ConnectionManager<ChannelType>::conn_type*>
+ConnectionManager<ChannelType>::GetConnection(uint32_t peer_id,
+                                              uint32_t lane) {
+  auto* conn = Lookup(peer_id, lane);
+  ROME_CHECK_QUIET(ROME_RETURN(util::NotFoundErrorBuilder()
+                               << "Connection not found: " << peer_id
+                               << " (lane=" << lane << ")"),
+                   conn != nullptr);
+  return conn;
+}
+
+template <typename ChannelType>
+typename ConnectionManager<ChannelType>::conn_type*
+ConnectionManager<ChannelType>::Lookup(uint32_t peer_id, uint32_t lane) {
+  auto* table = table_.load(std::memory_order_acquire);
+  auto slot = Slot(peer_id, lane);
+  if (lane >= qps_per_peer_ || slot >= table->size) return nullptr;
+  return table->slots[slot].load(std::memory_order_acquire);
+}
+
+template <typename ChannelType>
+typename ConnectionManager<ChannelType>::conn_type*
+ConnectionManager<ChannelType>::AddEstablished(
+    uint32_t lane, std::unique_ptr<conn_type> conn) {
+  auto slot = Slot(conn->dst_id(), lane);
+  connected_.insert(slot);
+
+  auto iter = established_.emplace(slot, std::move(conn));
+  ROME_ASSERT(iter.second, "Unexepected error");
+  auto* added = iter.first->second.get();
+
+  auto* table = table_.load(std::memory_order_relaxed);
+  if (slot >= table->size) {
+    auto size = table->size;
+    while (slot >= size) size *= 2;
+    auto grown = std::make_unique<ConnectionTable>(size);
+    for (size_t i = 0; i < table->size; ++i) {
+      grown->slots[i].store(table->slots[i].load(std::memory_order_relaxed),
+                            std::memory_order_relaxed);
+    }
+    table = grown.get();
+    tables_.push_back(std::move(grown));
+    table_.store(table, std::memory_order_release);
+  }
+  table->slots[slot].store(added, std::memory_order_release);
+  return added;
+}
+
+template <typename ChannelType>
+void ConnectionManager<ChannelType>::RetireEstablished(uint32_t peer_id,
+                                                       uint32_t lane) {
+  auto conn = established_.find(Slot(peer_id, lane));
+  if (conn == established_.end()) return;
+  rdma_disconnect(conn->second->id());
+  retired_.push_back(std::move(conn->second));
+  established_.erase(conn);
+}
+
+template <typename ChannelType>
+template <typename MessageType>
+absl::Status ConnectionManager<ChannelType>::Broadcast(
+    const MessageType& msg, const std::vector<uint32_t>& peers) {
+  auto raw = ChannelType::EncodeMessage(msg);
+  return SendEncodedToAll(peers, raw.buffer.get(), raw.length);
+}
+
+template <typename ChannelType>
+template <typename MessageType>
+absl::Status ConnectionManager<ChannelType>::TreeBroadcast(
+    const MessageType& msg, const std::vector<uint32_t>& group,
+    uint32_t fanout) {
+  std::vector<uint32_t> children;
+  auto parent = GetTreeNeighbors(my_id_, group, fanout, &children);
+  if (!parent.ok()) return parent.status();
+  return Broadcast(msg, children);
+}
+
+template <typename ChannelType>
+template <typename MessageType>
+absl::StatusOr<MessageType>
+ConnectionManager<ChannelType>::DeliverTreeBroadcast(
+    uint32_t root, const std::vector<uint32_t>& group, uint32_t fanout,
+    std::chrono::milliseconds timeout) {
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  std::vector<uint32_t> children;
+  auto parent = GetTreeNeighbors(root, group, fanout, &children);
+  if (!parent.ok()) return parent.status();
+  ROME_CHECK_QUIET(ROME_RETURN(util::InvalidArgumentErrorBuilder()
+                               << "Cannot deliver own broadcast: " << root),
+                   *parent != my_id_);
+  auto conn = GetConnection(*parent, 0);
+  if (!conn.ok()) return conn.status();
+
+  auto forward = [&](const uint8_t* buffer, size_t length) {
+    return SendEncodedToAll(children, buffer, length);
+  };
+  auto* channel = (*conn)->channel();
+  auto msg = channel->template TryDeliverForwarding<MessageType>(forward);
+  while (absl::IsUnavailable(msg.status())) {
+    ROME_CHECK_QUIET(ROME_RETURN(DeadlineExceededErrorBuilder()
+                                 << "Timed out waiting for the broadcast of "
+                                 << root << " from " << *parent),
+                     std::chrono::steady_clock::now() < deadline);
+    msg = channel->template TryDeliverForwarding<MessageType>(forward);
+  }
+  return msg;
+}
+
+template <typename ChannelType>
+absl::Status ConnectionManager<ChannelType>::SendEncodedToAll(
+    const std::vector<uint32_t>& peers, const uint8_t* buffer, size_t length) {
+  std::vector<ChannelType*> channels;
+  channels.reserve(peers.size());
+  for (auto peer : peers) {
+    auto conn = GetConnection(peer, 0);
+    if (!conn.ok()) return conn.status();
+    channels.push_back((*conn)->channel());
+  }
+  for (auto* channel : channels) {
+    auto status = channel->SendEncoded(buffer, length);
+    if (!status.ok()) return status;
+  }
+  if constexpr (requires(ChannelType* c) { c->Flush(); }) {
+    for (auto* channel : channels) {
+      auto status = channel->Flush();
+      if (!status.ok()) return status;
+    }
+  }
+  return absl::OkStatus();
+}
+
+template <typename ChannelType>
+absl::StatusOr<uint32_t> ConnectionManager<ChannelType>::GetTreeNeighbors(
+    uint32_t root, const std::vector<uint32_t>& group, uint32_t fanout,
+    std::vector<uint32_t>* children) {
+  ROME_CHECK_QUIET(
+      ROME_RETURN(util::InvalidArgumentErrorBuilder() << "Fanout must be > 0"),
+      fanout > 0);
+  std::vector<uint32_t> sorted(group);
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+  auto root_iter = std::lower_bound(sorted.begin(), sorted.end(), root);
+  auto self_iter = std::lower_bound(sorted.begin(), sorted.end(), my_id_);
+  ROME_CHECK_QUIET(ROME_RETURN(util::InvalidArgumentErrorBuilder()
+                               << "Group must contain root and self: root="
+                               << root << ", self=" << my_id_),
+                   root_iter != sorted.end() && *root_iter == root &&
+                       self_iter != sorted.end() && *self_iter == my_id_);
+
+  // Positions in the tree count from the root, wrapping around the group, and
+  // the children of position `p` are `p * fanout + 1` through
+  // `p * fanout + fanout`.
+  const uint64_t n = sorted.size();
+  const uint64_t offset = root_iter - sorted.begin();
+  const uint64_t pos = (self_iter - sorted.begin() + n - offset) % n;
+  auto member = [&](uint64_t p) { return sorted[(p + offset) % n]; };
+  children->clear();
+  for (uint64_t c = pos * fanout + 1; c <= pos * fanout + fanout && c < n;
+       ++c) {
+    children->push_back(member(c));
   }
+  return pos == 0 ? my_id_ : member((pos - 1) / fanout);
 }
 
 }  // namespace rome::rdma
\ No newline at end of file
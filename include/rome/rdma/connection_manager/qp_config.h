@@ -0,0 +1,88 @@
+#pragma once
+
+#include <infiniband/verbs.h>
+
+#include <cstdint>
+#include <string_view>
+
+#include "rome/logging/logging.h"
+
+namespace rome::rdma {
+
+// Attributes of the QPs created by a `ConnectionManager`. Requests beyond what
+// the device supports are lowered by `Negotiate`. The receive queue must hold
+// all of the two-sided messenger's receive slots, so `ConnectionManager::Start`
+// raises `max_recv_wr` to the messenger's `kRecvSlots` if needed.
+struct QpConfig {
+  // Work requests and scatter/gather entries per queue, and the largest send
+  // that may be posted inline.
+  uint32_t max_send_wr = 64;
+  uint32_t max_recv_wr = 64;
+  uint32_t max_send_sge = 1;
+  uint32_t max_recv_sge = 1;
+  uint32_t max_inline_data = 0;
+
+  // Reads and atomics that a QP may have outstanding as the initiator, and
+  // that it serves at once as the responder.
+  uint8_t max_rd_atomic = 8;
+  uint8_t max_dest_rd_atomic = 8;
+
+  // The RDMA CM takes the MTU and RNR NAK timer of a connection from its path,
+  // so these only apply to the loopback connection.
+  ibv_mtu path_mtu = IBV_MTU_4096;
+  uint8_t min_rnr_timer = 12;
+
+  // Exponent of the local ACK timeout, and how many times to retry after a
+  // timeout or an RNR NAK. An RNR retry count of 7 retries forever.
+  uint8_t timeout = 12;
+  uint8_t retry_cnt = 7;
+  uint8_t rnr_retry = 1;
+
+  // The entry of the port's GID table that routes QPs connected with
+  // `ConnectQp` over RoCE, where no RDMA CM picks one. Which entry holds a
+  // RoCE v2 GID depends on the host, so it is not always the first.
+  uint8_t gid_index = 0;
+
+  // Returns a copy of this config with every attribute lowered to what
+  // `device` and the verbs interface support.
+  inline QpConfig Negotiate(const ibv_device_attr& device) const;
+};
+
+namespace internal {
+
+// Lowers `value` to `limit`, with a warning if it is not already within it.
+template <typename T>
+inline T LowerToLimit(std::string_view name, T value, int64_t limit) {
+  if (static_cast<int64_t>(value) <= limit) return value;
+  ROME_WARN("Lowering {} from {} to {}", name, static_cast<int64_t>(value),
+            limit);
+  return static_cast<T>(limit);
+}
+
+}  // namespace internal
+
+QpConfig QpConfig::Negotiate(const ibv_device_attr& device) const {
+  using internal::LowerToLimit;
+  QpConfig config = *this;
+  config.max_send_wr =
+      LowerToLimit("max_send_wr", max_send_wr, device.max_qp_wr);
+  config.max_recv_wr =
+      LowerToLimit("max_recv_wr", max_recv_wr, device.max_qp_wr);
+  config.max_send_sge =
+      LowerToLimit("max_send_sge", max_send_sge, device.max_sge);
+  config.max_recv_sge =
+      LowerToLimit("max_recv_sge", max_recv_sge, device.max_sge);
+  config.max_rd_atomic =
+      LowerToLimit("max_rd_atomic", max_rd_atomic, device.max_qp_init_rd_atom);
+  config.max_dest_rd_atomic = LowerToLimit(
+      "max_dest_rd_atomic", max_dest_rd_atomic, device.max_qp_rd_atom);
+
+  // The widths of these fields in the wire protocol.
+  config.timeout = LowerToLimit("timeout", timeout, 31);
+  config.min_rnr_timer = LowerToLimit("min_rnr_timer", min_rnr_timer, 31);
+  config.retry_cnt = LowerToLimit("retry_cnt", retry_cnt, 7);
+  config.rnr_retry = LowerToLimit("rnr_retry", rnr_retry, 7);
+  return config;
+}
+
+}  // namespace rome::rdma
@@ -2,26 +2,34 @@
 
 #include <infiniband/verbs.h>
 
+#include <atomic>
 #include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <optional>
 #include <sstream>
 #include <thread>
 #include <type_traits>
-#include <unordered_map>
+#include <vector>
 
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
 #include "protos/rdma.pb.h"
 #include "remote_ptr.h"
 #include "rome/metrics/summary.h"
+#include "rome/rdma/channel/async_accessor.h"
+#include "rome/rdma/channel/sync_accessor.h"
 #include "rome/rdma/channel/twosided_messenger.h"
 #include "rome/rdma/connection_manager/connection.h"
 #include "rome/rdma/connection_manager/connection_manager.h"
+#include "rome/rdma/memory_region_cache.h"
 #include "rome/rdma/rmalloc/rmalloc.h"
 
 namespace rome::rdma {
 
-using ::rome::rdma::EmptyRdmaAccessor;
+using ::rome::rdma::AsyncRdmaAccessor;
 using ::rome::rdma::RdmaChannel;
 using ::rome::rdma::RemoteObjectProto;
 using ::rome::rdma::TwoSidedRdmaMessenger;
@@ -38,11 +46,19 @@ class MemoryPool {
 #else
   static constexpr size_t kMemoryPoolMessageSize =
       ROME_MEMORY_POOL_MESSAGE_SIZE;
+#endif
+  // One-sided operations are posted through the channel's accessor, so this
+  // decides whether they wait while posting or only once their result is
+  // needed.
+#ifndef ROME_MEMORY_POOL_ACCESSOR
+  typedef AsyncRdmaAccessor accessor_type;
+#else
+  typedef ROME_MEMORY_POOL_ACCESSOR accessor_type;
 #endif
  public:
   typedef RdmaChannel<TwoSidedRdmaMessenger<kMemoryPoolMessengerCapacity,
                                             kMemoryPoolMessageSize>,
-                      EmptyRdmaAccessor>
+                      accessor_type>
       channel_type;
   typedef ConnectionManager<channel_type> cm_type;
   typedef cm_type::conn_type conn_type;
@@ -57,6 +73,8 @@ class MemoryPool {
         : id(id), address(address), port(port) {}
   };
 
+  // The keys are those of the first chunk of the peer's memory and of this
+  // node's, which cover all of it unless it was registered in chunks.
   struct conn_info_t {
     conn_type *conn;
     uint32_t rkey;
@@ -170,9 +188,31 @@ class MemoryPool {
   rome::metrics::MetricProto rdma_per_read_proto() {
     return rdma_per_read_.ToProto();
   }
-  conn_info_t conn_info(uint16_t id) const { return conn_info_.at(id); }
+  // Returns the connection to node `id` on the calling thread's lane. Dies if
+  // `id` is not a peer.
+  conn_info_t conn_info(uint16_t id) const {
+    auto i = static_cast<size_t>(id) * connection_manager_->qps_per_peer() +
+             connection_manager_->GetLane();
+    ROME_ASSERT(i < conn_info_.size() && conn_info_[i].conn != nullptr,
+                "Unknown peer: {}", id);
+    const auto &slot = conn_info_[i];
+    return conn_info_t{slot.conn.load(std::memory_order_acquire),
+                       slot.rkey.load(std::memory_order_relaxed),
+                       LocalKey(rdma_memory_->memory().raw())};
+  }
+  MemoryRegionCache *memory_region_cache() const {
+    return memory_region_cache_.get();
+  }
 
-  inline absl::Status Init(uint32_t capacity, const std::vector<Peer> &peers);
+  // Allocates `capacity` bytes of remotely accessible memory and connects to
+  // `peers`. The memory is registered as `options` asks for, or with hugepages
+  // if any are available when it is not given. If it is registered in chunks
+  // (see `RdmaMemory::Registration::kParallel`), every peer is sent the rkey
+  // of each chunk, and operations pick the one covering their address.
+  // Allocations never cross a chunk, so neither does an operation on one.
+  inline absl::Status Init(
+      uint64_t capacity, const std::vector<Peer> &peers,
+      const std::optional<RdmaMemory::Options> &options = std::nullopt);
 
   template <typename T>
   remote_ptr<T> Allocate(size_t size = 1);
@@ -180,25 +220,53 @@ class MemoryPool {
   template <typename T>
   void Deallocate(remote_ptr<T> p, size_t size = 1);
 
-  void Execute(DoorbellBatch *batch);
+  // One-sided operations replace a failed connection and retry on the new
+  // one, up to `kMaxRecoveries` times before failing with
+  // `absl::UnavailableError()`. Other errors are returned as they are. An
+  // operation with a kill switch fails with `absl::CancelledError()` if it is
+  // set before the operation completes.
+  absl::Status Execute(DoorbellBatch *batch);
 
   template <typename T>
-  remote_ptr<T> Read(remote_ptr<T> ptr, remote_ptr<T> prealloc = remote_nullptr,
-                     std::atomic<bool> *kill = nullptr);
+  absl::StatusOr<remote_ptr<T>> Read(remote_ptr<T> ptr,
+                                     remote_ptr<T> prealloc = remote_nullptr,
+                                     std::atomic<bool> *kill = nullptr);
 
   template <typename T>
-  remote_ptr<T> PartialRead(remote_ptr<T> ptr, size_t offset, size_t bytes,
-                            remote_ptr<T> prealloc = remote_nullptr);
+  absl::StatusOr<remote_ptr<T>> PartialRead(
+      remote_ptr<T> ptr, size_t offset, size_t bytes,
+      remote_ptr<T> prealloc = remote_nullptr);
 
   template <typename T>
-  void Write(remote_ptr<T> ptr, const T &val,
-             remote_ptr<T> prealloc = remote_nullptr);
+  absl::Status Write(remote_ptr<T> ptr, const T &val,
+                     remote_ptr<T> prealloc = remote_nullptr);
+
+  // Zero-copy transfers between remote memory and an application buffer that
+  // was not allocated from this pool. The buffer is registered on first use and
+  // the registration is cached, so callers must invalidate it through
+  // `memory_region_cache()` before freeing the buffer. Unlike the operations
+  // above, these do not retry. If the connection has failed, it is replaced
+  // and `absl::UnavailableError()` is returned so that the transfer can be
+  // retried.
+  template <typename T>
+  absl::Status ReadInto(remote_ptr<T> ptr, T *buffer, size_t bytes = sizeof(T));
 
   template <typename T>
-  T AtomicSwap(remote_ptr<T> ptr, uint64_t swap, uint64_t hint = 0);
+  absl::Status WriteFrom(remote_ptr<T> ptr, const T *buffer,
+                         size_t bytes = sizeof(T));
+
+  // Atomics are not idempotent, so they are never posted again after their
+  // connection fails, since the failure may have only lost the completion of
+  // an atomic that took effect. Instead, the connection is replaced and
+  // `absl::UnavailableError()` is returned, and the caller must read the
+  // target again to decide whether to retry.
+  template <typename T>
+  absl::StatusOr<T> AtomicSwap(remote_ptr<T> ptr, uint64_t swap,
+                               uint64_t hint = 0);
 
   template <typename T>
-  T CompareAndSwap(remote_ptr<T> ptr, uint64_t expected, uint64_t swap);
+  absl::StatusOr<T> CompareAndSwap(remote_ptr<T> ptr, uint64_t expected,
+                                   uint64_t swap);
 
   template <typename T>
   inline remote_ptr<T> GetRemotePtr(const T *ptr) const {
@@ -207,25 +275,86 @@ class MemoryPool {
 
   template <typename T>
   inline remote_ptr<T> GetBaseAddress() const {
-    return GetRemotePtr<T>(reinterpret_cast<const T *>(mr_->addr));
+    return GetRemotePtr<T>(
+        reinterpret_cast<const T *>(rdma_memory_->memory().raw()));
   }
 
  private:
+  // How many times an operation replaces its connection before giving up, and
+  // how long each replacement may take.
+  static constexpr int kMaxRecoveries = 3;
+  static constexpr auto kRecoverTimeout = std::chrono::seconds(5);
+
   template <typename T>
-  inline void ReadInternal(remote_ptr<T> ptr, size_t offset, size_t bytes,
-                           size_t chunk_size, remote_ptr<T> prealloc,
-                           std::atomic<bool> *kill = nullptr);
+  inline absl::Status ReadInternal(remote_ptr<T> ptr, size_t offset,
+                                   size_t bytes, size_t chunk_size,
+                                   remote_ptr<T> prealloc,
+                                   std::atomic<bool> *kill = nullptr);
+
+  // Posts `wr` through the connection's accessor and waits for it to complete.
+  // Returns `absl::CancelledError()` if `kill` is set first, leaving the
+  // accessor to reap the completion later.
+  inline absl::Status PostAndWait(conn_type *conn, ibv_send_wr *wr,
+                                  std::atomic<bool> *kill = nullptr);
+
+  // Like `PostAndWait`, but replaces the connection to node `id` whenever it
+  // fails and posts `wr` again, with the rkey of the peer's new connection, up
+  // to `kMaxRecoveries` times. Unless `wr` is `idempotent`, it is not posted
+  // again and `absl::UnavailableError()` is returned once the connection has
+  // been replaced.
+  inline absl::Status PostWithRecovery(uint16_t id, ibv_send_wr *wr,
+                                       bool idempotent,
+                                       std::atomic<bool> *kill = nullptr);
+
+  // Replaces every connection to node `id` that has failed, after an operation
+  // on `conn` failed with `status`. Each replacement carries the peer's rkey
+  // in its handshake, since it may have changed. Returns
+  // `absl::UnavailableError()` once the operation can be retried, or if the
+  // connection could not be replaced within `kRecoverTimeout`, and `status` if
+  // it did not fail because of the connection.
+  inline absl::Status Recover(uint16_t id, conn_type *conn,
+                              const absl::Status &status);
+
+  // Returns the lkey of this node's memory at `addr`, and the rkey of node
+  // `id`'s memory at `addr`, given the `rkey` of its first chunk.
+  uint32_t LocalKey(const void *addr) const {
+    return VALUE_OR_DIE(rdma_memory_->GetKeys(addr)).lkey;
+  }
+  inline uint32_t RemoteKey(uint16_t id, uint32_t rkey, uint64_t addr) const;
 
-  Peer self_;
+  inline absl::Status TransferInternal(ibv_wr_opcode opcode, uint16_t id,
+                                       uint64_t remote_addr, const void *buffer,
+                                       size_t bytes);
 
-  volatile uint64_t *prev_ = nullptr;
+  Peer self_;
 
   std::unique_ptr<ConnectionManager<channel_type>> connection_manager_;
   std::unique_ptr<rdma_memory_resource> rdma_memory_;
-  ibv_mr *mr_;
+  std::unique_ptr<MemoryRegionCache> memory_region_cache_;
+
+  // The connection and rkey of a lane to a peer, which `Recover` replaces
+  // while other threads read them.
+  struct conn_slot_t {
+    std::atomic<conn_type *> conn{nullptr};
+    std::atomic<uint32_t> rkey{0};
+  };
+
+  // Indexed by node ID and then lane. Nodes that are not peers have a null
+  // connection.
+  std::vector<conn_slot_t> conn_info_;
+
+  // The start address and rkey of each chunk of a peer's memory, in address
+  // order, indexed by node ID. Set by `Init` and never changed after, since a
+  // replacement connection only carries the rkey of the first chunk.
+  struct remote_chunk_t {
+    uint64_t raddr;
+    uint32_t rkey;
+  };
+  std::vector<std::vector<remote_chunk_t>> peer_chunks_;
 
-  std::unordered_map<uint16_t, conn_info_t> conn_info_;
-  ibv_send_wr send_wr_{};
+  // Serializes `Recover` for each node, also indexed by node ID, so that a
+  // peer being replaced does not hold up operations on the others.
+  std::unique_ptr<absl::Mutex[]> recover_mu_;
 
   rome::metrics::Summary<size_t> rdma_per_read_;
 };
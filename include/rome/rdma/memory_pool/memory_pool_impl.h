@@ -3,8 +3,10 @@
 #include <asm-generic/errno-base.h>
 #include <infiniband/verbs.h>
 
+#include <algorithm>
 #include <cmath>
 #include <cstddef>
+#include <iterator>
 #include <memory>
 
 #include "memory_pool.h"
@@ -52,12 +54,13 @@ void MemoryPool::DoorbellBatchBuilder::AddReadInternal(remote_ptr<T> rptr,
     } else {
       sge->length = (i == num_chunks - 1 ? remainder : chunk);
     }
-    sge->lkey = batch_->conn_info().lkey;
+    sge->lkey = pool_->LocalKey(local);
 
     wr->opcode = IBV_WR_RDMA_READ;
     if (fence) wr->send_flags |= IBV_SEND_FENCE;
     wr->wr.rdma.remote_addr = rptr.address() + chunk_offset;
-    wr->wr.rdma.rkey = batch_->conn_info().rkey;
+    wr->wr.rdma.rkey = pool_->RemoteKey(rptr.id(), batch_->conn_info().rkey,
+                                        wr->wr.rdma.remote_addr);
   }
 }
 
@@ -79,12 +82,13 @@ void MemoryPool::DoorbellBatchBuilder::AddWrite(remote_ptr<T> rptr,
 
   sge->addr = (uint64_t)std::to_address(prealloc);
   sge->length = sizeof(T);
-  sge->lkey = batch_->conn_info().lkey;
+  sge->lkey = pool_->LocalKey(std::to_address(prealloc));
 
   wr->opcode = IBV_WR_RDMA_WRITE;
   if (fence) wr->send_flags |= IBV_SEND_FENCE;
   wr->wr.rdma.remote_addr = (uint64_t)std::to_address(rptr);
-  wr->wr.rdma.rkey = batch_->conn_info().rkey;
+  wr->wr.rdma.rkey = pool_->RemoteKey(rptr.id(), batch_->conn_info().rkey,
+                                      wr->wr.rdma.remote_addr);
 }
 
 template <typename T>
@@ -97,12 +101,13 @@ void MemoryPool::DoorbellBatchBuilder::AddWriteBytes(remote_ptr<T> rptr,
 
   sge->addr = (uint64_t)std::to_address(prealloc);
   sge->length = bytes;
-  sge->lkey = batch_->conn_info().lkey;
+  sge->lkey = pool_->LocalKey(std::to_address(prealloc));
 
   wr->opcode = IBV_WR_RDMA_WRITE;
   if (fence) wr->send_flags |= IBV_SEND_FENCE;
   wr->wr.rdma.remote_addr = (uint64_t)std::to_address(rptr);
-  wr->wr.rdma.rkey = batch_->conn_info().rkey;
+  wr->wr.rdma.rkey = pool_->RemoteKey(rptr.id(), batch_->conn_info().rkey,
+                                      wr->wr.rdma.remote_addr);
 }
 
 inline std::unique_ptr<MemoryPool::DoorbellBatch>
@@ -124,42 +129,80 @@ MemoryPool::MemoryPool(
       connection_manager_(std::move(connection_manager)),
       rdma_per_read_("rdma_per_read", "ops", 10000) {}
 
-absl::Status MemoryPool::Init(uint32_t capacity,
-                              const std::vector<Peer> &peers) {      
+absl::Status MemoryPool::Init(
+    uint64_t capacity, const std::vector<Peer> &peers,
+    const std::optional<RdmaMemory::Options> &options) {
   auto status = connection_manager_->Start(self_.address, self_.port);
   ROME_CHECK_OK(ROME_RETURN(status), status);
-  rdma_memory_ = std::make_unique<rdma_memory_resource>(
-      capacity + sizeof(uint64_t), connection_manager_->pd());
-  mr_ = rdma_memory_->mr();
+  if (options.has_value()) {
+    auto rdma_memory = rdma_memory_resource::Create(
+        capacity + sizeof(uint64_t), *options, connection_manager_->pd());
+    ROME_CHECK_OK(ROME_RETURN(rdma_memory.status()), rdma_memory);
+    rdma_memory_ = std::move(*rdma_memory);
+  } else {
+    rdma_memory_ = std::make_unique<rdma_memory_resource>(
+        capacity + sizeof(uint64_t), connection_manager_->pd());
+  }
+  memory_region_cache_ =
+      std::make_unique<MemoryRegionCache>(connection_manager_->pd());
+
+  // One region per chunk, or a single one covering the whole memory.
+  const auto &memory = rdma_memory_->memory();
+  PeerInfoProto local_info;
+  local_info.set_id(self_.id);
+  for (uint64_t offset = 0; offset < memory.capacity();
+       offset += memory.chunk_size()) {
+    auto *region = local_info.add_regions();
+    region->set_raddr(reinterpret_cast<uint64_t>(memory.raw() + offset));
+    region->set_rkey(VALUE_OR_DIE(memory.GetKeys(memory.raw() + offset)).rkey);
+  }
 
-  auto alloc = rdma_allocator<uint64_t>(rdma_memory_.get());
-  prev_ = alloc.allocate();
+  // Every connection carries the rkey of the first chunk in its handshake, so
+  // that `Recover` can read it from a replacement without waiting for a message
+  // on it.
+  connection_manager_->SetConnectData(local_info.regions(0).rkey());
 
+  std::vector<cm_type::PeerAddress> addresses;
   for (const auto &p : peers) {
-    auto connected = connection_manager_->Connect(p.id, p.address, p.port);
-    while (absl::IsUnavailable(connected.status())) {
-      connected = connection_manager_->Connect(p.id, p.address, p.port);
-    } 
-    ROME_CHECK_OK(ROME_RETURN(connected.status()), connected);
+    addresses.push_back(cm_type::PeerAddress{p.id, p.address, p.port});
   }
+  status = connection_manager_->ConnectAll(addresses);
+  ROME_CHECK_OK(ROME_RETURN(status), status);
 
-  RemoteObjectProto rm_proto;
-  rm_proto.set_rkey(mr_->rkey);
-  rm_proto.set_raddr(reinterpret_cast<uint64_t>(mr_->addr));
-  for (const auto &p : peers) {
-    auto conn = VALUE_OR_DIE(connection_manager_->GetConnection(p.id));
-    status = conn->channel()->Send(rm_proto);
-    ROME_CHECK_OK(ROME_RETURN(status), status);
-  }
+  std::vector<uint32_t> ids;
+  for (const auto &p : peers) ids.push_back(p.id);
+  status = connection_manager_->Broadcast(local_info, ids);
+  ROME_CHECK_OK(ROME_RETURN(status), status);
 
+  const auto lanes = connection_manager_->qps_per_peer();
+  uint16_t max_id = 0;
+  for (const auto &p : peers) max_id = std::max(max_id, p.id);
+  conn_info_ = std::vector<conn_slot_t>((max_id + 1) * lanes);
+  recover_mu_ = std::make_unique<absl::Mutex[]>(max_id + 1);
+  peer_chunks_.resize(max_id + 1);
   for (const auto &p : peers) {
-    auto conn = VALUE_OR_DIE(connection_manager_->GetConnection(p.id));
-    auto got = conn->channel()->TryDeliver<RemoteObjectProto>();
+    auto conn = VALUE_OR_DIE(connection_manager_->GetConnection(p.id, 0));
+    auto got = conn->channel()->TryDeliver<PeerInfoProto>();
     while (!got.ok() && got.status().code() == absl::StatusCode::kUnavailable) {
-      got = conn->channel()->TryDeliver<RemoteObjectProto>();
+      got = conn->channel()->TryDeliver<PeerInfoProto>();
     }
     ROME_CHECK_OK(ROME_RETURN(got.status()), got);
-    conn_info_.emplace(p.id, conn_info_t{conn, got->rkey(), mr_->lkey});
+    ROME_CHECK_QUIET(ROME_RETURN(util::InternalErrorBuilder()
+                                 << "No memory regions from node " << p.id),
+                     got->regions_size() > 0);
+    auto &chunks = peer_chunks_[p.id];
+    for (const auto &region : got->regions()) {
+      chunks.push_back(remote_chunk_t{region.raddr(), region.rkey()});
+    }
+    std::sort(chunks.begin(), chunks.end(),
+              [](const auto &a, const auto &b) { return a.raddr < b.raddr; });
+    // The loopback connection only has the first lane.
+    for (uint32_t lane = 0; lane < lanes; ++lane) {
+      auto lane_conn = connection_manager_->GetConnection(p.id, lane);
+      auto &slot = conn_info_[p.id * lanes + lane];
+      slot.rkey = chunks.front().rkey;
+      slot.conn = lane_conn.ok() ? *lane_conn : conn;
+    }
   }
   return absl::OkStatus();
 }
@@ -177,49 +220,146 @@ void MemoryPool::Deallocate(remote_ptr<T> p, size_t size) {
   rdma_allocator<T>(rdma_memory_.get()).deallocate(std::to_address(p), size);
 }
 
-inline void MemoryPool::Execute(DoorbellBatch *batch) {
-  ibv_send_wr *bad;
-  auto *conn = batch->conn_info().conn;
-  RDMA_CM_ASSERT(ibv_post_send, conn->id()->qp, batch->wrs_, &bad);
+uint32_t MemoryPool::RemoteKey(uint16_t id, uint32_t rkey,
+                               uint64_t addr) const {
+  const auto &chunks = peer_chunks_[id];
+  if (chunks.size() <= 1) return rkey;
+  auto next = std::upper_bound(
+      chunks.begin(), chunks.end(), addr,
+      [](uint64_t a, const auto &chunk) { return a < chunk.raddr; });
+  ROME_ASSERT_DEBUG(next != chunks.begin(), "Address not in memory of node {}",
+                    id);
+  return std::prev(next)->rkey;
+}
 
-  int poll;
-  ibv_wc wc;
-  while ((poll = ibv_poll_cq(conn->id()->send_cq, 1, &wc)) == 0) {
-    if (batch->is_mortal() && *kill) return;
+inline absl::Status MemoryPool::Execute(DoorbellBatch *batch) {
+  return PostWithRecovery(batch->conn_info().conn->dst_id(), batch->wrs_,
+                          /*idempotent=*/true, batch->kill_switch_);
+}
+
+absl::Status MemoryPool::PostAndWait(conn_type *conn, ibv_send_wr *wr,
+                                     std::atomic<bool> *kill) {
+  auto *channel = conn->channel();
+  ibv_send_wr *bad = nullptr;
+  auto token = channel->PostAsync(wr, &bad);
+  if (!token.ok()) return token.status();
+  if (kill == nullptr) return channel->Wait(*token);
+  while (!*kill) {
+    auto done = channel->TryComplete(*token);
+    if (!done.ok()) return done.status();
+    if (*done) return absl::OkStatus();
     cpu_relax();
   }
-  ROME_ASSERT(poll == 1 && wc.status == IBV_WC_SUCCESS,
-              "ibv_poll_cq(): {} (dest={})",
-              (poll < 0 ? strerror(errno) : ibv_wc_status_str(wc.status)),
-              remote_ptr<uint8_t>(wc.wr_id));
+  return absl::CancelledError("Killed");
+}
+
+absl::Status MemoryPool::PostWithRecovery(uint16_t id, ibv_send_wr *wr,
+                                          bool idempotent,
+                                          std::atomic<bool> *kill) {
+  absl::Status status;
+  for (int recoveries = 0; recoveries <= kMaxRecoveries; ++recoveries) {
+    auto info = conn_info(id);
+    for (auto *w = wr; w != nullptr; w = w->next) {
+      if (w->opcode == IBV_WR_ATOMIC_CMP_AND_SWP ||
+          w->opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) {
+        w->wr.atomic.rkey = RemoteKey(id, info.rkey, w->wr.atomic.remote_addr);
+      } else {
+        w->wr.rdma.rkey = RemoteKey(id, info.rkey, w->wr.rdma.remote_addr);
+      }
+    }
+    status = PostAndWait(info.conn, wr, kill);
+    if (status.ok() || absl::IsCancelled(status)) return status;
+    status = Recover(id, info.conn, status);
+    if (!absl::IsUnavailable(status)) return status;
+    // The work requests may have taken effect even though their completion
+    // was lost, so only the caller can tell whether posting them again is safe.
+    if (!idempotent) {
+      return util::UnavailableErrorBuilder()
+             << "Connection to " << id
+             << " was replaced; the operation may or may not have taken effect";
+    }
+  }
+  return util::UnavailableErrorBuilder()
+         << "Gave up on node " << id << " after " << kMaxRecoveries
+         << " recoveries: " << status.message();
+}
+
+absl::Status MemoryPool::Recover(uint16_t id, conn_type *conn,
+                                 const absl::Status &status) {
+  if (id == self_.id || !conn->HasFailed()) return status;
+  absl::MutexLock lock(&recover_mu_[id]);
+  const auto lanes = connection_manager_->qps_per_peer();
+  std::vector<conn_type *> replacements(lanes, nullptr);
+  for (uint32_t lane = 0; lane < lanes; ++lane) {
+    // Another thread may have replaced the lane already.
+    auto *current =
+        conn_info_[id * lanes + lane].conn.load(std::memory_order_relaxed);
+    if (!current->HasFailed()) continue;
+
+    // The peer may have replaced its end already, otherwise reconnect.
+    auto latest = connection_manager_->GetConnection(id, lane);
+    if (latest.ok() && *latest != current && !(*latest)->HasFailed()) {
+      replacements[lane] = *latest;
+    } else {
+      auto replacement =
+          connection_manager_->Reconnect(id, lane, kRecoverTimeout);
+      if (!replacement.ok()) return replacement.status();
+      replacements[lane] = *replacement;
+    }
+  }
+
+  // Only the first chunk's rkey comes with a replacement, so a peer whose
+  // chunks were registered again cannot be recovered.
+  for (const auto *replacement : replacements) {
+    if (replacement == nullptr || peer_chunks_[id].size() <= 1) continue;
+    ROME_CHECK_QUIET(
+        ROME_RETURN(util::FailedPreconditionErrorBuilder()
+                    << "Node " << id << " registered its memory again"),
+        replacement->peer_data() == peer_chunks_[id].front().rkey);
+  }
+  for (uint32_t lane = 0; lane < lanes; ++lane) {
+    if (replacements[lane] == nullptr) continue;
+    auto &slot = conn_info_[id * lanes + lane];
+    slot.rkey.store(replacements[lane]->peer_data(), std::memory_order_relaxed);
+    slot.conn.store(replacements[lane], std::memory_order_release);
+  }
+  ROME_WARN("Replaced connection to node {}", id);
+  return util::UnavailableErrorBuilder()
+         << "Connection to " << id << " was replaced";
 }
 
 template <typename T>
-remote_ptr<T> MemoryPool::Read(remote_ptr<T> ptr, remote_ptr<T> prealloc,
-                               std::atomic<bool> *kill) {
+absl::StatusOr<remote_ptr<T>> MemoryPool::Read(remote_ptr<T> ptr,
+                                               remote_ptr<T> prealloc,
+                                               std::atomic<bool> *kill) {
   if (prealloc == remote_nullptr) prealloc = Allocate<T>();
-  ReadInternal(ptr, 0, sizeof(T), sizeof(T), prealloc, kill);
+  auto status = ReadInternal(ptr, 0, sizeof(T), sizeof(T), prealloc, kill);
+  if (!status.ok()) return status;
   return prealloc;
 }
 
 template <typename T>
-remote_ptr<T> MemoryPool::PartialRead(remote_ptr<T> ptr, size_t offset,
-                                      size_t bytes, remote_ptr<T> prealloc) {
+absl::StatusOr<remote_ptr<T>> MemoryPool::PartialRead(remote_ptr<T> ptr,
+                                                      size_t offset,
+                                                      size_t bytes,
+                                                      remote_ptr<T> prealloc) {
   if (prealloc == remote_nullptr) prealloc = Allocate<T>();
-  ReadInternal(ptr, offset, bytes, sizeof(T), prealloc);
+  auto status = ReadInternal(ptr, offset, bytes, sizeof(T), prealloc);
+  if (!status.ok()) return status;
   return prealloc;
 }
 
 template <typename T>
-void MemoryPool::ReadInternal(remote_ptr<T> ptr, size_t offset, size_t bytes,
-                              size_t chunk_size, remote_ptr<T> prealloc,
-                              std::atomic<bool> *kill) {
+absl::Status MemoryPool::ReadInternal(remote_ptr<T> ptr, size_t offset,
+                                      size_t bytes, size_t chunk_size,
+                                      remote_ptr<T> prealloc,
+                                      std::atomic<bool> *kill) {
   const int num_chunks =
       bytes % chunk_size ? (bytes / chunk_size) + 1 : bytes / chunk_size;
   const size_t remainder = bytes % chunk_size;
   const bool is_multiple = remainder == 0;
 
-  auto info = conn_info_.at(ptr.id());
+  auto info = conn_info(ptr.id());
 
   T *local = std::to_address(prealloc);
   ibv_sge sges[num_chunks];
@@ -232,7 +372,7 @@ void MemoryPool::ReadInternal(remote_ptr<T> ptr, size_t offset, size_t bytes,
     } else {
       sges[i].length = (i == num_chunks - 1 ? remainder : chunk_size);
     }
-    sges[i].lkey = mr_->lkey;
+    sges[i].lkey = LocalKey(local);
 
     wrs[i].num_sge = 1;
     wrs[i].sg_list = &sges[i];
@@ -240,37 +380,21 @@ void MemoryPool::ReadInternal(remote_ptr<T> ptr, size_t offset, size_t bytes,
     wrs[i].send_flags = IBV_SEND_FENCE;
     if (i == num_chunks - 1) wrs[i].send_flags |= IBV_SEND_SIGNALED;
     wrs[i].wr.rdma.remote_addr = ptr.address() + chunk_offset;
-    wrs[i].wr.rdma.rkey = info.rkey;
+    wrs[i].wr.rdma.rkey = RemoteKey(ptr.id(), info.rkey, ptr.address());
     wrs[i].next = (i != num_chunks - 1 ? &wrs[i + 1] : nullptr);
   }
 
-  ibv_send_wr *bad;
-  RDMA_CM_ASSERT(ibv_post_send, info.conn->id()->qp, wrs, &bad);
-  ibv_wc wc;
-  int poll = 0;
-  if (kill == nullptr) {
-    for (; poll == 0; poll = ibv_poll_cq(info.conn->id()->send_cq, 1, &wc))
-      ;
-    ROME_ASSERT(
-        poll == 1 && wc.status == IBV_WC_SUCCESS, "ibv_poll_cq(): {} @ {}",
-        (poll < 0 ? strerror(errno) : ibv_wc_status_str(wc.status)), ptr);
-  } else {
-    for (; poll == 0 && !(*kill);
-         poll = ibv_poll_cq(info.conn->id()->send_cq, 1, &wc))
-      ;
-    if (!(*kill) && (poll != 1 || wc.status != IBV_WC_SUCCESS)) {
-      ROME_FATAL("ibv_poll_cq(): {}",
-                 (poll < 0 ? strerror(errno) : ibv_wc_status_str(wc.status)));
-    }
-  }
+  auto status = PostWithRecovery(ptr.id(), wrs, /*idempotent=*/true, kill);
+  if (!status.ok()) return status;
   rdma_per_read_ << num_chunks;
+  return absl::OkStatus();
 }
 
 template <typename T>
-void MemoryPool::Write(remote_ptr<T> ptr, const T &val,
+absl::Status MemoryPool::Write(remote_ptr<T> ptr, const T &val,
                        remote_ptr<T> prealloc) {
   ROME_DEBUG("Write: {:x} @ {}", (uint64_t)val, ptr);
-  auto info = conn_info_.at(ptr.id());
+  auto info = conn_info(ptr.id());
 
   T *local;
   if (prealloc == remote_nullptr) {
@@ -290,104 +414,137 @@ void MemoryPool::Write(remote_ptr<T> ptr, const T &val,
   ibv_sge sge{};
   sge.addr = reinterpret_cast<uint64_t>(local);
   sge.length = sizeof(T);
-  sge.lkey = mr_->lkey;
+  sge.lkey = LocalKey(local);
 
-  send_wr_.num_sge = 1;
-  send_wr_.sg_list = &sge;
-  send_wr_.opcode = IBV_WR_RDMA_WRITE;
-  send_wr_.send_flags = IBV_SEND_SIGNALED | IBV_SEND_FENCE;
-  send_wr_.wr.rdma.remote_addr = ptr.address();
-  send_wr_.wr.rdma.rkey = info.rkey;
+  ibv_send_wr wr{};
+  wr.num_sge = 1;
+  wr.sg_list = &sge;
+  wr.opcode = IBV_WR_RDMA_WRITE;
+  wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_FENCE;
+  wr.wr.rdma.remote_addr = ptr.address();
+  wr.wr.rdma.rkey = RemoteKey(ptr.id(), info.rkey, ptr.address());
 
-  ibv_send_wr *bad = nullptr;
-  RDMA_CM_ASSERT(ibv_post_send, info.conn->id()->qp, &send_wr_, &bad);
-  ibv_wc wc;
-  auto poll = ibv_poll_cq(info.conn->id()->send_cq, 1, &wc);
-  while (poll == 0 || (poll < 0 && errno == EAGAIN)) {
-    poll = ibv_poll_cq(info.conn->id()->send_cq, 1, &wc);
-  }
+  auto status = PostWithRecovery(ptr.id(), &wr, /*idempotent=*/true);
 
   if (prealloc == remote_nullptr) {
     auto alloc = rdma_allocator<T>(rdma_memory_.get());
     alloc.deallocate(local);
   }
-  ROME_ASSERT(poll == 1 && wc.status == IBV_WC_SUCCESS,
-              "ibv_poll_cq(): {} ({})",
-              (poll < 0 ? strerror(errno) : ibv_wc_status_str(wc.status)),
-              (std::stringstream() << ptr).str());
+  return status;
 }
 
 template <typename T>
-T MemoryPool::AtomicSwap(remote_ptr<T> ptr, uint64_t swap, uint64_t hint) {
-  static_assert(sizeof(T) == 8);
-  auto info = conn_info_.at(ptr.id());
+absl::Status MemoryPool::ReadInto(remote_ptr<T> ptr, T *buffer, size_t bytes) {
+  return TransferInternal(IBV_WR_RDMA_READ, ptr.id(), ptr.address(), buffer,
+                          bytes);
+}
+
+template <typename T>
+absl::Status MemoryPool::WriteFrom(remote_ptr<T> ptr, const T *buffer,
+                                   size_t bytes) {
+  return TransferInternal(IBV_WR_RDMA_WRITE, ptr.id(), ptr.address(), buffer,
+                          bytes);
+}
+
+absl::Status MemoryPool::TransferInternal(ibv_wr_opcode opcode, uint16_t id,
+                                          uint64_t remote_addr,
+                                          const void *buffer, size_t bytes) {
+  auto info = conn_info(id);
+  auto mr = memory_region_cache_->Acquire(buffer, bytes);
+  ROME_CHECK_OK(ROME_RETURN(mr.status()), mr);
 
   ibv_sge sge{};
-  sge.addr = reinterpret_cast<uint64_t>(prev_);
-  sge.length = sizeof(uint64_t);
-  sge.lkey = mr_->lkey;
+  sge.addr = reinterpret_cast<uint64_t>(buffer);
+  sge.length = bytes;
+  sge.lkey = (*mr)->lkey;
+
+  ibv_send_wr wr{};
+  wr.num_sge = 1;
+  wr.sg_list = &sge;
+  wr.opcode = opcode;
+  wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_FENCE;
+  wr.wr.rdma.remote_addr = remote_addr;
+  wr.wr.rdma.rkey = RemoteKey(id, info.rkey, remote_addr);
+
+  auto status = PostAndWait(info.conn, &wr);
+  memory_region_cache_->Release(*mr);
+  if (status.ok()) return status;
+  return Recover(id, info.conn, status);
+}
+
+template <typename T>
+absl::StatusOr<T> MemoryPool::AtomicSwap(remote_ptr<T> ptr, uint64_t swap,
+                                         uint64_t hint) {
+  static_assert(sizeof(T) == 8);
+  auto info = conn_info(ptr.id());
 
-  send_wr_.num_sge = 1;
-  send_wr_.sg_list = &sge;
-  send_wr_.opcode = IBV_WR_ATOMIC_CMP_AND_SWP;
-  send_wr_.send_flags = IBV_SEND_SIGNALED | IBV_SEND_FENCE;
-  send_wr_.wr.atomic.remote_addr = ptr.address();
-  send_wr_.wr.atomic.rkey = info.rkey;
-  send_wr_.wr.atomic.compare_add = hint;
-  send_wr_.wr.atomic.swap = swap;
+  // Several threads may swap at once, so each call gets its own buffer for the
+  // previous value.
+  auto alloc = rdma_allocator<uint64_t>(rdma_memory_.get());
+  volatile uint64_t *prev = alloc.allocate();
 
-  ibv_send_wr *bad = nullptr;
+  ibv_sge sge{};
+  sge.addr = reinterpret_cast<uint64_t>(prev);
+  sge.length = sizeof(uint64_t);
+  sge.lkey = LocalKey(const_cast<uint64_t *>(prev));
+
+  ibv_send_wr wr{};
+  wr.num_sge = 1;
+  wr.sg_list = &sge;
+  wr.opcode = IBV_WR_ATOMIC_CMP_AND_SWP;
+  wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_FENCE;
+  wr.wr.atomic.remote_addr = ptr.address();
+  wr.wr.atomic.rkey = RemoteKey(ptr.id(), info.rkey, ptr.address());
+  wr.wr.atomic.compare_add = hint;
+  wr.wr.atomic.swap = swap;
+
+  absl::Status status;
   while (true) {
-    RDMA_CM_ASSERT(ibv_post_send, info.conn->id()->qp, &send_wr_, &bad);
-    ibv_wc wc;
-    auto poll = ibv_poll_cq(info.conn->id()->send_cq, 1, &wc);
-    while (poll == 0 || (poll < 0 && errno == EAGAIN)) {
-      poll = ibv_poll_cq(info.conn->id()->send_cq, 1, &wc);
-    }
-    ROME_ASSERT(poll == 1 && wc.status == IBV_WC_SUCCESS, "ibv_poll_cq(): {}",
-                (poll < 0 ? strerror(errno) : ibv_wc_status_str(wc.status)));
+    status = PostWithRecovery(ptr.id(), &wr, /*idempotent=*/false);
+    if (!status.ok()) break;
 
     ROME_DEBUG("Swap: expected={:x}, swap={:x}, prev={:x} (id={})",
-               send_wr_.wr.atomic.compare_add, (uint64_t)swap, *prev_,
-               self_.id);
-    if (*prev_ == send_wr_.wr.atomic.compare_add) break;
-    send_wr_.wr.atomic.compare_add = *prev_;
+               wr.wr.atomic.compare_add, (uint64_t)swap, *prev, self_.id);
+    if (*prev == wr.wr.atomic.compare_add) break;
+    wr.wr.atomic.compare_add = *prev;
   };
-  return T(*prev_);
+  const uint64_t result = *prev;
+  alloc.deallocate(const_cast<uint64_t *>(prev));
+  if (!status.ok()) return status;
+  return T(result);
 }
 
 template <typename T>
-T MemoryPool::CompareAndSwap(remote_ptr<T> ptr, uint64_t expected,
-                             uint64_t swap) {
+absl::StatusOr<T> MemoryPool::CompareAndSwap(remote_ptr<T> ptr,
+                                             uint64_t expected, uint64_t swap) {
   static_assert(sizeof(T) == 8);
-  auto info = conn_info_.at(ptr.id());
-  
-  ibv_sge sge{};
-  sge.addr = reinterpret_cast<uint64_t>(prev_);
-  sge.length = sizeof(uint64_t);
-  sge.lkey = mr_->lkey;
+  auto info = conn_info(ptr.id());
 
-  send_wr_.num_sge = 1;
-  send_wr_.sg_list = &sge;
-  send_wr_.opcode = IBV_WR_ATOMIC_CMP_AND_SWP;
-  send_wr_.send_flags = IBV_SEND_SIGNALED | IBV_SEND_FENCE;
-  send_wr_.wr.atomic.remote_addr = ptr.address();
-  send_wr_.wr.atomic.rkey = info.rkey;
-  send_wr_.wr.atomic.compare_add = expected;
-  send_wr_.wr.atomic.swap = swap;
+  auto alloc = rdma_allocator<uint64_t>(rdma_memory_.get());
+  volatile uint64_t *prev = alloc.allocate();
 
-  ibv_send_wr *bad = nullptr;
-  RDMA_CM_ASSERT(ibv_post_send, info.conn->id()->qp, &send_wr_, &bad);
-  ibv_wc wc;
-  auto poll = ibv_poll_cq(info.conn->id()->send_cq, 1, &wc);
-  while (poll == 0 || (poll < 0 && errno == EAGAIN)) {
-    poll = ibv_poll_cq(info.conn->id()->send_cq, 1, &wc);
-  }
-  ROME_ASSERT(poll == 1 && wc.status == IBV_WC_SUCCESS, "ibv_poll_cq(): {}",
-              (poll < 0 ? strerror(errno) : ibv_wc_status_str(wc.status)));
+  ibv_sge sge{};
+  sge.addr = reinterpret_cast<uint64_t>(prev);
+  sge.length = sizeof(uint64_t);
+  sge.lkey = LocalKey(const_cast<uint64_t *>(prev));
+
+  ibv_send_wr wr{};
+  wr.num_sge = 1;
+  wr.sg_list = &sge;
+  wr.opcode = IBV_WR_ATOMIC_CMP_AND_SWP;
+  wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_FENCE;
+  wr.wr.atomic.remote_addr = ptr.address();
+  wr.wr.atomic.rkey = RemoteKey(ptr.id(), info.rkey, ptr.address());
+  wr.wr.atomic.compare_add = expected;
+  wr.wr.atomic.swap = swap;
+
+  auto status = PostWithRecovery(ptr.id(), &wr, /*idempotent=*/false);
+  const uint64_t result = *prev;
+  alloc.deallocate(const_cast<uint64_t *>(prev));
+  if (!status.ok()) return status;
   ROME_DEBUG("CompareAndSwap: expected={:x}, swap={:x}, actual={:x}  (id={})",
-             expected, swap, *prev_, static_cast<uint64_t>(self_.id));
-  return T(*prev_);
+             expected, swap, result, static_cast<uint64_t>(self_.id));
+  return T(result);
 }
 
-}  // namespace rome::rdma
\ No newline at end of file
+}  // namespace rome::rdma
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <infiniband/verbs.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+#include "rdma_util.h"
+#include "rome/rdma/rdma_memory.h"
+
+namespace rome::rdma {
+
+// Caches memory regions registered for application buffers so that they can be
+// used directly in one-sided operations instead of being copied into memory
+// allocated from an `RdmaMemory`. Registrations are page aligned and kept in an
+// interval map keyed by address, so later requests that fall within a cached
+// registration reuse it. Registrations that are not in use are evicted in
+// least-recently-used order once the cache exceeds its limits.
+//
+// Callers must `Release` every region returned by `Acquire`, and must call
+// `Invalidate` before unmapping or freeing a buffer that may have been cached.
+class MemoryRegionCache {
+ public:
+  struct Options {
+    // Limits on the number and total size of cached registrations. Regions in
+    // use are never evicted, so these can be exceeded temporarily.
+    size_t max_regions = 1024;
+    uint64_t max_bytes = 1UL << 32;  // 4 GiB
+    int access = RdmaMemory::kDefaultAccess;
+  };
+
+  explicit MemoryRegionCache(ibv_pd *pd) : MemoryRegionCache(pd, Options{}) {}
+  MemoryRegionCache(ibv_pd *pd, const Options &options)
+      : pd_(pd), options_(options) {}
+  ~MemoryRegionCache();
+
+  MemoryRegionCache(const MemoryRegionCache &) = delete;
+  MemoryRegionCache(MemoryRegionCache &&) = delete;
+
+  // Returns a memory region covering `[addr, addr + length)`, registering one
+  // if none is cached. Cached registrations that overlap the new one are merged
+  // into it. The region remains valid until it is passed to `Release`.
+  absl::StatusOr<ibv_mr *> Acquire(const void *addr, uint64_t length);
+  void Release(ibv_mr *mr);
+
+  // Drops any cached registration overlapping `[addr, addr + length)`. Regions
+  // that are still in use are deregistered once they are released.
+  void Invalidate(const void *addr, uint64_t length);
+
+  // Getters.
+  size_t size() const;
+  uint64_t registered_bytes() const;
+
+ private:
+  struct Entry {
+    ibv_mr_unique_ptr mr;
+    uintptr_t begin;
+    uintptr_t end;
+    int refs = 0;
+    bool retired = false;
+    std::list<Entry *>::iterator lru;  // Valid iff `refs == 0`.
+  };
+
+  // Removes the entry starting at `begin` from the interval map. If it is in
+  // use then it is kept alive until it is released.
+  void Remove(uintptr_t begin) EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  void Evict() EXCLUSIVE_LOCKS_REQUIRED(mu_);
+
+  ibv_pd *const pd_;
+  const Options options_;
+
+  mutable absl::Mutex mu_;
+
+  // Registrations keyed by the first address they cover. Entries never overlap.
+  std::map<uintptr_t, std::unique_ptr<Entry>> entries_ GUARDED_BY(mu_);
+
+  // Removed registrations that are still in use.
+  std::unordered_map<ibv_mr *, std::unique_ptr<Entry>> retired_
+      GUARDED_BY(mu_);
+
+  // All live registrations, including retired ones, for `Release`.
+  std::unordered_map<ibv_mr *, Entry *> by_mr_ GUARDED_BY(mu_);
+
+  // Unused registrations, most recently released first.
+  std::list<Entry *> lru_ GUARDED_BY(mu_);
+
+  uint64_t bytes_ GUARDED_BY(mu_) = 0;
+};
+
+}  // namespace rome::rdma
@@ -83,6 +83,10 @@ class RdmaBroker {
   // Flag to indicate that the worker thread should terminate.
   std::atomic<bool> terminate_;
 
+  // An eventfd that `Stop` signals to wake the worker thread while it is
+  // blocked waiting for events on `listen_channel_`.
+  int wakeup_fd_;
+
   // The working thread that listens and responds to incoming messages.
   struct thread_deleter {
     void operator()(std::thread* thread) {
@@ -23,6 +23,16 @@ class RdmaDevice {
 
   static absl::Status LookupDevice(std::string_view name);
 
+  // Returns the NUMA node that the device called `name` is attached to, or -1
+  // if it is unknown (e.g., on machines with a single node).
+  static int GetNumaNode(std::string_view name);
+
+  // Returns the IPv4 address of the network interface behind `port` of the
+  // device called `name`. Brokers listen on it to accept connections through
+  // that port. Returns `absl::NotFound()` if the interface has no address.
+  static absl::StatusOr<std::string> GetAddress(std::string_view name,
+                                                int port);
+
   static std::unique_ptr<RdmaDevice> Create(std::string_view name,
                                             std::optional<int> port) {
     auto *device = new RdmaDevice();
@@ -41,6 +51,7 @@ class RdmaDevice {
   // Getters.
   std::string name() { return dev_context_->device->name; }
   int port() { return port_; }
+  int numa_node() { return GetNumaNode(name()); }
 
   //  Creates a new protection domain registered with the device under the given
   //  `id`. This domain can then be retrieved to allocate memory regions.
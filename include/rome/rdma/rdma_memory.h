@@ -5,9 +5,11 @@
 
 #include <cstdint>
 #include <memory>
+#include <optional>
 #include <string>
 #include <unordered_map>
 #include <variant>
+#include <vector>
 
 #include "absl/status/status.h"
 #include "absl/status/statusor.h"
@@ -25,59 +27,233 @@ class RdmaMemory {
       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
       IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC;
 
+  // The pages backing the memory. Large regions should use hugepages so that
+  // the NIC needs fewer translation entries to cover them. Hugetlb pages (i.e.,
+  // `kHuge*`) must be reserved ahead of time, for example through
+  // `/sys/kernel/mm/hugepages/hugepages-<size>kB/nr_hugepages`. If they cannot
+  // be allocated then the memory falls back to transparent hugepages.
+  enum class PageSize : uint8_t {
+    kDefault = 0,  // Regular pages from the system allocator.
+    kTransparent,  // Regular pages advised with `MADV_HUGEPAGE`.
+    kHuge,         // Hugetlb pages of the system's default hugepage size.
+    kHuge2MiB,     // 2 MiB hugetlb pages.
+    kHuge1GiB,     // 1 GiB hugetlb pages.
+  };
+
+  // How the memory is registered with the device. Registering pins and
+  // translates every page, which dominates start up for large regions.
+  enum class Registration : uint8_t {
+    kEager = 0,  // One memory region, registered on the constructing thread.
+    kParallel,   // Equally sized chunks, registered concurrently.
+    kOnDemand,   // One on-demand paging region, or `kParallel` if unsupported.
+  };
+
+  // The keys needed to access a registered address.
+  struct Keys {
+    uint32_t lkey;
+    uint32_t rkey;
+  };
+
+  struct Options {
+    PageSize page_size = PageSize::kDefault;
+
+    Registration registration = Registration::kEager;
+
+    // Number of threads used for `Registration::kParallel`, which is also the
+    // number of chunks. Defaults to the number of hardware threads.
+    unsigned registration_threads = 0;
+
+    // Pre-faults every page during construction, so that neither registration
+    // nor the first access to a page pays for faulting it in.
+    bool populate = false;
+
+    // Backs the memory with a shared mapping of the file at `file` (e.g., on
+    // tmpfs, hugetlbfs or a DAX filesystem) instead of anonymous memory. The
+    // file is created if it does not exist, otherwise its contents are mapped
+    // as they are. This lets a restarted process register the same contents
+    // without reloading them. On hugetlbfs, the page size of the mount is used.
+    std::optional<std::string> file;
+
+    // Address at which to map `file`. Contents that hold raw pointers into the
+    // memory (e.g., `remote_ptr`) remain valid across restarts only if the
+    // memory is mapped at the same address each time. If the address is not
+    // available then the memory is mapped elsewhere. Ignored without `file`.
+    void* address = nullptr;
+  };
+
   ~RdmaMemory();
   RdmaMemory(uint64_t capacity, ibv_pd* const pd)
       : RdmaMemory(capacity, std::nullopt, pd) {}
+
+  // Uses hugepages of the default size if the file at `path` (typically
+  // `/proc/sys/vm/nr_hugepages`) reports that any are available.
   RdmaMemory(uint64_t capacity, std::optional<std::string_view> path,
              ibv_pd* const pd);
+  RdmaMemory(uint64_t capacity, const Options& options, ibv_pd* const pd);
+
+  // Like the constructor, but returns an error instead of aborting if the
+  // memory cannot be allocated, mapped from `Options::file` or registered.
+  static absl::StatusOr<std::unique_ptr<RdmaMemory>> Create(
+      uint64_t capacity, const Options& options, ibv_pd* const pd);
 
   RdmaMemory(const RdmaMemory&) = delete;
   RdmaMemory(RdmaMemory&& rm)
       : capacity_(rm.capacity_),
+        pd_(rm.pd_),
+        page_size_(rm.page_size_),
+        file_backed_(rm.file_backed_),
+        restored_(rm.restored_),
         raw_(std::move(rm.raw_)),
-        memory_regions_(std::move(rm.memory_regions_)) {}
+        regions_(std::move(rm.regions_)),
+        region_ids_(std::move(rm.region_ids_)),
+        default_mr_(rm.default_mr_),
+        chunk_size_(rm.chunk_size_),
+        chunks_(std::move(rm.chunks_)) {}
 
   // Getters.
   uint64_t capacity() const { return capacity_; }
 
+  // The pages that actually back the memory, which may differ from those
+  // requested if the allocation had to fall back.
+  PageSize page_size() const { return page_size_; }
+
+  // Whether the memory is a mapping of `Options::file`, and whether that file
+  // already held `capacity()` bytes when it was mapped (i.e., the contents are
+  // those left by a previous owner).
+  bool file_backed() const { return file_backed_; }
+  bool restored() const { return restored_; }
+
   uint8_t* raw() const {
     return std::visit([](const auto& r) { return r.get(); }, raw_);
   }
 
+  // Identifies a memory region by its position in the flat list of regions.
+  // Looking up a region by handle is a vector index instead of a hash lookup.
+  using RegionHandle = uint32_t;
+
   // Creates a new memory region associated with the given protection domain
   // `pd` at the provided offset and with the given length. If a region with the
-  // same `id` already exists then it returns `absl::AlreadyExistsError()`.
-  absl::Status RegisterMemoryRegion(std::string_view id, int offset,
-                                    int length);
+  // same `id` already exists then it returns `absl::AlreadyExistsError()`. The
+  // id "default" names the region covering the whole capacity, so it is
+  // rejected with `absl::InvalidArgumentError()` for memory registered in
+  // chunks.
+  absl::Status RegisterMemoryRegion(std::string_view id, uint64_t offset,
+                                    uint64_t length);
   absl::Status RegisterMemoryRegion(std::string_view id, ibv_pd* const pd,
-                                    int offset, int length);
+                                    uint64_t offset, uint64_t length);
 
-  ibv_mr* GetDefaultMemoryRegion() const;
+  // Names a window of the default registration (or of one chunk, if registered
+  // in parallel) without registering new memory. The window shares the keys of
+  // the memory it was carved from, so adding many of them is cheap.
+  absl::StatusOr<RegionHandle> AddMemoryRegionView(std::string_view id,
+                                                   uint64_t offset,
+                                                   uint64_t length);
+
+  // Returns the memory region covering the whole capacity, or `nullptr` if the
+  // memory was registered in chunks (see `Registration::kParallel`), in which
+  // case `GetKeys` must be used instead. Only memory registered with
+  // `Registration::kEager` always has one.
+  ibv_mr* GetDefaultMemoryRegion() const { return default_mr_; }
   absl::StatusOr<ibv_mr*> GetMemoryRegion(std::string_view id) const;
 
+  // Resolves `id` once so that later lookups can use `GetMemoryRegion(handle)`.
+  absl::StatusOr<RegionHandle> GetMemoryRegionHandle(std::string_view id) const;
+  ibv_mr* GetMemoryRegion(RegionHandle handle) const {
+    return regions_[handle].get();
+  }
+
+  // Returns the keys registered for `addr` regardless of how the memory was
+  // registered. When registered in chunks, a single access must not cross a
+  // multiple of `chunk_size()` from the start of the memory.
+  absl::StatusOr<Keys> GetKeys(const void* addr) const {
+    auto offset = reinterpret_cast<const uint8_t*>(addr) - raw();
+    if (offset < 0 || static_cast<uint64_t>(offset) >= capacity_) {
+      return absl::OutOfRangeError("Address is outside of memory");
+    }
+    auto* mr = chunks_.empty() ? GetDefaultMemoryRegion()
+                               : chunks_[offset / chunk_size_].get();
+    return Keys{mr->lkey, mr->rkey};
+  }
+
+  // The size of each separately registered chunk, which is the capacity unless
+  // the memory was registered in parallel.
+  uint64_t chunk_size() const { return chunk_size_; }
+
+  // Writes the contents of file-backed memory back to the file. This is a no-op
+  // for anonymous memory.
+  absl::Status Flush();
+
  private:
   static constexpr char kDefaultId[] = "default";
 
   // Handles deleting memory allocated using mmap (when using hugepages)
   struct mmap_deleter {
-    void operator()(uint8_t raw[]) { munmap(raw, sizeof(*raw)); }
+    size_t length;
+    void operator()(uint8_t raw[]) { munmap(raw, length); }
   };
 
+  // Constructs memory that is neither allocated nor registered, for `Create`.
+  struct Unallocated {};
+  RdmaMemory(Unallocated, uint64_t capacity, ibv_pd* const pd);
+
+  // Allocates and registers the memory as `options` asks for.
+  absl::Status Init(const Options& options);
+
+  // Allocates `capacity_` bytes backed by `options.page_size` pages, falling
+  // back to smaller pages if the allocation fails. Sets `page_size_` to the
+  // pages that were used.
+  absl::Status Allocate(const Options& options);
+  bool TryMapHugetlb(PageSize page_size, bool populate);
+  bool TryMapTransparent(bool populate);
+  absl::Status MapFile(const Options& options);
+
+  // Registers the whole capacity according to `options.registration`.
+  absl::Status Register(const Options& options);
+  absl::Status RegisterParallel(unsigned num_threads);
+
   // Validates that the given offset and length are not ill formed w.r.t. to the
   // capacity of this memory.
-  bool ValidateRegion(int offset, int length);
+  bool ValidateRegion(uint64_t offset, uint64_t length);
 
   // Preallocated size.
   const uint64_t capacity_;
 
+  // Protection domain of the default registration.
+  ibv_pd* pd_;
+
+  PageSize page_size_;
+  bool file_backed_ = false;
+  bool restored_ = false;
+
   // Either points to an array of bytes allocated with the system allocator or
   // with `mmap`. At some point, this could be replaced with a custom allocator.
   std::variant<std::unique_ptr<uint8_t[]>,
                std::unique_ptr<uint8_t[], mmap_deleter>>
       raw_;
 
-  // A map of memory regions registered with this particular memory.
-  std::unordered_map<std::string, ibv_mr_unique_ptr> memory_regions_;
+  // A region either owns its registration or is a view sharing the keys of
+  // another one, in which case it holds a copy of that `ibv_mr` with adjusted
+  // bounds. Both are heap allocated, so pointers to them remain valid as more
+  // regions are added.
+  struct Region {
+    ibv_mr_unique_ptr mr;
+    std::unique_ptr<ibv_mr> view;
+
+    ibv_mr* get() const { return mr != nullptr ? mr.get() : view.get(); }
+  };
+
+  absl::StatusOr<RegionHandle> AddRegion(std::string_view id, Region region);
+
+  // Memory regions associated with this memory, indexed by `RegionHandle`, and
+  // the handles of each region by id.
+  std::vector<Region> regions_;
+  std::unordered_map<std::string, RegionHandle> region_ids_;
+  ibv_mr* default_mr_ = nullptr;
+
+  // Memory regions of the chunks of a parallel registration, in address order.
+  // Empty if a single region covers the whole capacity.
+  uint64_t chunk_size_;
+  std::vector<ibv_mr_unique_ptr> chunks_;
 };
 
 }  // namespace rome
\ No newline at end of file
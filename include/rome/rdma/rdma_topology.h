@@ -0,0 +1,68 @@
+#pragma once
+// Machines may have several RDMA devices, each with several ports, attached to
+// different NUMA nodes. Every port is reached through an address of its own, so
+// a node serves each port with its own `ConnectionManager` (and thus broker and
+// PD), started on the port's `address`. The topology decides which of them a
+// thread should use: threads are spread round-robin over the ports attached to
+// their NUMA node, so that traffic is striped across ports without crossing the
+// interconnect between NUMA nodes.
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
+
+namespace rome::rdma {
+
+struct RdmaPortInfo {
+  std::string device;
+  int port;
+  int numa_node;  // -1 if unknown
+  std::string address;
+};
+
+class RdmaTopology {
+ public:
+  explicit RdmaTopology(std::vector<RdmaPortInfo> ports);
+
+  // Finds every active port with an IPv4 address. Returns `absl::NotFound()`
+  // if there is none.
+  static absl::StatusOr<std::unique_ptr<RdmaTopology>> Discover();
+
+  // Returns the NUMA node of the CPU that the calling thread runs on, or -1 if
+  // it is unknown.
+  static int CurrentNumaNode();
+
+  RdmaTopology(const RdmaTopology&) = delete;
+  RdmaTopology(RdmaTopology&&) = delete;
+
+  // Getters.
+  const std::vector<RdmaPortInfo>& ports() const { return ports_; }
+
+  // Returns the indices of the ports attached to `numa_node`. If there are
+  // none, for example because the nodes are unknown, every port is local.
+  std::vector<uint32_t> LocalPorts(int numa_node) const;
+
+  // Returns the index of the port used by the `index`th thread on `numa_node`.
+  uint32_t AssignPort(int numa_node, uint32_t index) const;
+
+  // Assigns a port to another thread on `numa_node`. Every call counts as
+  // another thread, so that threads on a node are striped across its ports.
+  uint32_t AssignPort(int numa_node);
+
+  // Assigns a port to the calling thread, according to the NUMA node it runs
+  // on. Threads should call it once, after they are pinned to a CPU.
+  uint32_t AssignPort();
+
+ private:
+  std::vector<RdmaPortInfo> ports_;
+
+  absl::Mutex mu_;
+  std::unordered_map<int, uint32_t> threads_ ABSL_GUARDED_BY(mu_);
+};
+
+}  // namespace rome::rdma
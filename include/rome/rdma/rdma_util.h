@@ -45,6 +45,31 @@ struct ibv_mr_deleter {
 };
 using ibv_mr_unique_ptr = std::unique_ptr<ibv_mr, ibv_mr_deleter>;
 
+struct ibv_cq_deleter {
+  void operator()(ibv_cq *cq) { ibv_destroy_cq(cq); }
+};
+using ibv_cq_unique_ptr = std::unique_ptr<ibv_cq, ibv_cq_deleter>;
+
+struct ibv_qp_deleter {
+  void operator()(ibv_qp *qp) { ibv_destroy_qp(qp); }
+};
+using ibv_qp_unique_ptr = std::unique_ptr<ibv_qp, ibv_qp_deleter>;
+
+struct ibv_ah_deleter {
+  void operator()(ibv_ah *ah) { ibv_destroy_ah(ah); }
+};
+using ibv_ah_unique_ptr = std::unique_ptr<ibv_ah, ibv_ah_deleter>;
+
+struct ibv_srq_deleter {
+  void operator()(ibv_srq *srq) { ibv_destroy_srq(srq); }
+};
+using ibv_srq_unique_ptr = std::unique_ptr<ibv_srq, ibv_srq_deleter>;
+
+struct ibv_xrcd_deleter {
+  void operator()(ibv_xrcd *xrcd) { ibv_close_xrcd(xrcd); }
+};
+using ibv_xrcd_unique_ptr = std::unique_ptr<ibv_xrcd, ibv_xrcd_deleter>;
+
 inline absl::StatusOr<std::string> ibdev2netip(std::string_view ib_dev) {
   auto Call = [](std::string cmd) {
     std::array<char, 1024> buffer;
@@ -17,19 +17,60 @@ class rdma_memory_resource : public util::pmr::memory_resource {
  public:
   virtual ~rdma_memory_resource() {}
   explicit rdma_memory_resource(size_t bytes, ibv_pd *pd)
-      : rdma_memory_(std::make_unique<RdmaMemory>(
-            bytes, "/proc/sys/vm/nr_hugepages", pd)),
-        head_(rdma_memory_->raw() + bytes) {
-    std::memset(alignments_.data(), 0, sizeof(alignments_));
-    ROME_DEBUG("rdma_memory_resource: {} to {} (length={})",
-               fmt::ptr(rdma_memory_->raw()), fmt::ptr(head_.load()), bytes);
+      : rdma_memory_resource(std::make_unique<RdmaMemory>(
+            bytes, "/proc/sys/vm/nr_hugepages", pd)) {}
+
+  // Registers the memory as `options` asks for. If it is registered in chunks,
+  // allocations are kept within one chunk so that `GetKeys` covers them.
+  rdma_memory_resource(size_t bytes, const RdmaMemory::Options &options,
+                       ibv_pd *pd)
+      : rdma_memory_resource(
+            std::make_unique<RdmaMemory>(bytes, options, pd)) {}
+
+  // Like the constructor, but returns an error if the memory cannot be set up
+  // (see `RdmaMemory::Create`).
+  static absl::StatusOr<std::unique_ptr<rdma_memory_resource>> Create(
+      size_t bytes, const RdmaMemory::Options &options, ibv_pd *pd) {
+    auto rdma_memory = RdmaMemory::Create(bytes, options, pd);
+    if (!rdma_memory.ok()) return rdma_memory.status();
+    return std::unique_ptr<rdma_memory_resource>(
+        new rdma_memory_resource(std::move(*rdma_memory)));
   }
 
   rdma_memory_resource(const rdma_memory_resource &) = delete;
   rdma_memory_resource &operator=(const rdma_memory_resource &) = delete;
-  ibv_mr *mr() const { return rdma_memory_->GetDefaultMemoryRegion(); }
+
+  // Returns the single memory region covering the whole resource. Fails if the
+  // memory was registered in chunks, in which case `GetKeys` must be used.
+  ibv_mr *mr() const {
+    auto *mr = rdma_memory_->GetDefaultMemoryRegion();
+    ROME_ASSERT(mr != nullptr, "Memory is registered in chunks of {} bytes",
+                rdma_memory_->chunk_size());
+    return mr;
+  }
+
+  // Returns whether a single memory region covers the whole resource.
+  bool has_single_region() const {
+    return rdma_memory_->GetDefaultMemoryRegion() != nullptr;
+  }
+
+  absl::StatusOr<RdmaMemory::Keys> GetKeys(const void *addr) const {
+    return rdma_memory_->GetKeys(addr);
+  }
+
+  // The memory that allocations are made from.
+  const RdmaMemory &memory() const { return *rdma_memory_; }
 
  private:
+  explicit rdma_memory_resource(std::unique_ptr<RdmaMemory> rdma_memory)
+      : rdma_memory_(std::move(rdma_memory)),
+        head_(rdma_memory_->raw() + rdma_memory_->capacity()) {
+    std::memset(alignments_.data(), 0, sizeof(alignments_));
+    ROME_DEBUG("rdma_memory_resource: {} to {} (length={})",
+               fmt::ptr(rdma_memory_->raw()), fmt::ptr(head_.load()),
+               rdma_memory_->capacity());
+  }
+
   static constexpr uint8_t kMinSlabClass = 3;
   static constexpr uint8_t kMaxSlabClass = 20;
   static constexpr uint8_t kNumSlabClasses = kMaxSlabClass - kMinSlabClass + 1;
@@ -83,6 +124,13 @@ class rdma_memory_resource : public util::pmr::memory_resource {
       }
     }
 
+    // A block larger than a chunk cannot be kept within one.
+    if (bytes > rdma_memory_->chunk_size()) {
+      ROME_ERROR("Cannot allocate {} bytes within chunks of {} bytes", bytes,
+                 rdma_memory_->chunk_size());
+      return nullptr;
+    }
+
     uint8_t *__e = head_, *__d;
     do {
       __d = (uint8_t *)((uint64_t)__e & ~(alignment - 1)) - bytes;
@@ -90,12 +138,29 @@ class rdma_memory_resource : public util::pmr::memory_resource {
         ROME_CRITICAL("OOM!");
         return nullptr;
       }
+      // Keep the allocation within the registered chunk that holds its end, by
+      // moving it below the start of that chunk if it would cross it.
+      auto *__c = ChunkStart(__d + bytes - 1);
+      if (__d < __c) {
+        __d = (uint8_t *)((uint64_t)__c & ~(alignment - 1)) - bytes;
+        if ((void *)(__d) < rdma_memory_->raw()) {
+          ROME_CRITICAL("OOM!");
+          return nullptr;
+        }
+      }
     } while (!head_.compare_exchange_strong(__e, __d));
 
     ROME_TRACE("Allocated {} bytes @ {}", bytes, fmt::ptr(__d));
     return reinterpret_cast<void *>(__d);
   }
 
+  // Returns the start of the separately registered chunk containing `p`.
+  uint8_t *ChunkStart(uint8_t *p) const {
+    auto chunk = rdma_memory_->chunk_size();
+    auto offset = static_cast<uint64_t>(p - rdma_memory_->raw());
+    return rdma_memory_->raw() + offset / chunk * chunk;
+  }
+
   void do_deallocate(void *p, size_t bytes, size_t alignment) override {
     ROME_TRACE("Deallocating {} bytes @ {}", bytes, fmt::ptr(p));
     auto slabclass = UpperLog2(bytes);
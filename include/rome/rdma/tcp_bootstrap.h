@@ -0,0 +1,80 @@
+#pragma once
+// An out-of-band rendezvous over TCP. Every node sends a `PeerInfoProto` to a
+// coordinator, which waits for all of them and then answers every node with the
+// full membership at once. Since the entries carry QP numbers and rkeys, nodes
+// can connect their QPs with `ConnectQp` and issue one-sided operations without
+// exchanging anything over RDMA or relying on the RDMA CM. Nothing here touches
+// a device except `GetQpInfo` and `ConnectQp`, so the control plane can be
+// tested on machines without one.
+
+#include <infiniband/verbs.h>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <thread>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "protos/rdma.pb.h"
+#include "rome/rdma/connection_manager/qp_config.h"
+
+namespace rome::rdma {
+
+class BootstrapCoordinator {
+ public:
+  ~BootstrapCoordinator();
+
+  // Listens on `port`, or on the first available port if `port` is `nullopt`,
+  // and serves a single rendezvous of `num_nodes` nodes in the background.
+  static absl::StatusOr<std::unique_ptr<BootstrapCoordinator>> Create(
+      std::optional<uint16_t> port, uint32_t num_nodes);
+
+  BootstrapCoordinator(const BootstrapCoordinator&) = delete;
+  BootstrapCoordinator(BootstrapCoordinator&&) = delete;
+
+  // Getters.
+  uint16_t port() const { return port_; }
+
+  // Waits for the rendezvous to finish and returns its status. Fails if two
+  // nodes report the same ID.
+  absl::Status Wait();
+
+ private:
+  BootstrapCoordinator(int listen_fd, uint16_t port, uint32_t num_nodes);
+
+  void Run();
+
+  int listen_fd_;
+  uint16_t port_;
+  uint32_t num_nodes_;
+
+  // Status of the rendezvous, which is only read once `runner_` is joined.
+  absl::Status status_;
+  std::unique_ptr<std::thread> runner_;
+};
+
+// Sends `self` to the coordinator listening on `address`:`port` and returns
+// the membership once every node has checked in. Connection attempts are
+// retried until `timeout` has passed, so nodes may start before the
+// coordinator.
+absl::StatusOr<MembershipProto> Rendezvous(
+    std::string_view address, uint16_t port, const PeerInfoProto& self,
+    std::chrono::milliseconds timeout = std::chrono::seconds(30));
+
+// Describes `qp`, which uses port `port_num` of its device, for the peer that
+// connects to it. On RoCE, the peer routes to the GID at `gid_index`, which
+// should match the `QpConfig::gid_index` that `qp` is connected with.
+absl::StatusOr<QpInfoProto> GetQpInfo(ibv_qp* qp, uint8_t port_num,
+                                      uint8_t gid_index = 0);
+
+// Moves `qp` through INIT, RTR and RTS, connecting it to the QP described by
+// `remote` with the attributes in `config`, routing by `config.gid_index` on
+// RoCE. The MTU is capped at the port's active MTU. RC and XRC QPs are
+// supported, and XRC targets stop at RTR.
+absl::Status ConnectQp(ibv_qp* qp, uint8_t port_num, const QpInfoProto& remote,
+                       const QpConfig& config);
+
+}  // namespace rome::rdma
@@ -0,0 +1,75 @@
+#pragma once
+// XRC (eXtended Reliable Connected) transport through standard verbs. With RC,
+// a node needs a QP for every process it reaches, each of which takes a context
+// in the NIC's cache. An XRC initiator QP instead reaches every process on the
+// node that its target QP belongs to, naming the process by the number of an
+// SRQ in each work request (`wr.qp_type.xrc.remote_srqn`). Processes share the
+// target QP by opening the same XRC domain, and register memory under the PD
+// of their own SRQ. Clients with many peers per node therefore need as many
+// QPs as there are nodes rather than processes.
+//
+// XRC QPs are connected without the RDMA CM, by exchanging their `GetQpInfo`
+// through a `BootstrapCoordinator` and passing them to `ConnectQp`.
+
+#include <infiniband/verbs.h>
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "rome/rdma/connection_manager/qp_config.h"
+#include "rome/rdma/rdma_util.h"
+
+namespace rome::rdma {
+
+class XrcDomain {
+ public:
+  ~XrcDomain();
+
+  // Opens an XRC domain on the device of `pd`. Processes on the same node that
+  // open it with the same `file` share it, otherwise it is private to this
+  // one. Completions of every QP and SRQ created by the domain are reported on
+  // a single CQ of `cq_depth` entries.
+  static absl::StatusOr<std::unique_ptr<XrcDomain>> Create(
+      ibv_pd* pd, std::optional<std::string_view> file = std::nullopt,
+      uint32_t cq_depth = 256);
+
+  XrcDomain(const XrcDomain&) = delete;
+  XrcDomain(XrcDomain&&) = delete;
+
+  // Getters.
+  ibv_xrcd* xrcd() const { return xrcd_.get(); }
+  ibv_cq* cq() const { return cq_.get(); }
+
+  // Creates an SRQ of `depth` receives, and returns it with the number that
+  // initiators name to reach it. Memory registered under the domain's PD can
+  // be accessed by one-sided operations that name any of its SRQs.
+  absl::StatusOr<std::pair<ibv_srq*, uint32_t>> CreateSrq(uint32_t depth);
+
+  // Creates an initiator QP, with the queue sizes of `config`.
+  absl::StatusOr<ibv_qp*> CreateSendQp(const QpConfig& config);
+
+  // Creates a target QP, which serves one initiator on behalf of every SRQ in
+  // the domain.
+  absl::StatusOr<ibv_qp*> CreateRecvQp();
+
+ private:
+  XrcDomain(ibv_pd* pd, int fd);
+
+  ibv_pd* pd_;  //! NOT OWNED
+
+  // The file that names a shared domain, or -1 if it is private.
+  int fd_;
+
+  ibv_xrcd_unique_ptr xrcd_;
+  ibv_cq_unique_ptr cq_;
+  std::vector<ibv_srq_unique_ptr> srqs_;
+  std::vector<ibv_qp_unique_ptr> qps_;
+};
+
+}  // namespace rome::rdma
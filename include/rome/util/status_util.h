@@ -51,5 +51,7 @@ using InvalidArgumentErrorBuilder =
 using ResourceExhaustedErrorBuilder =
     StatusBuilder<absl::StatusCode::kResourceExhausted>;
 using AbortedErrorBuilder = StatusBuilder<absl::StatusCode::kAborted>;
+using DeadlineExceededErrorBuilder =
+    StatusBuilder<absl::StatusCode::kDeadlineExceeded>;
 
 }  // namespace util
\ No newline at end of file
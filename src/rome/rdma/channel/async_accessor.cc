@@ -0,0 +1,127 @@
+#include "rome/rdma/channel/async_accessor.h"
+
+#include <asm-generic/errno-base.h>
+#include <infiniband/verbs.h>
+
+#include <cstring>
+
+#include "rome/logging/logging.h"
+#include "rome/rdma/rdma_util.h"
+#include "rome/util/status_util.h"
+#include "rome/util/thread_util.h"
+
+namespace rome::rdma {
+
+using ::util::InternalErrorBuilder;
+using ::util::InvalidArgumentErrorBuilder;
+
+AsyncRdmaAccessor::AsyncRdmaAccessor(rdma_cm_id *id)
+    : id_(id), sq_depth_(0), posted_(0), completed_(0) {
+  if (id_ == nullptr) return;
+  ibv_qp_attr attr;
+  ibv_qp_init_attr init_attr;
+  RDMA_CM_ASSERT(ibv_query_qp, id_->qp, &attr, IBV_QP_CAP, &init_attr);
+  sq_depth_ = SendCompletions::AccessorDepth(init_attr.cap.max_send_wr);
+}
+
+absl::Status AsyncRdmaAccessor::PostInternal(ibv_send_wr *wr,
+                                             ibv_send_wr **bad) {
+  auto token = PostAsyncInternal(wr, bad);
+  if (!token.ok()) return token.status();
+  return WaitInternal(*token);
+}
+
+absl::StatusOr<CompletionToken> AsyncRdmaAccessor::PostAsyncInternal(
+    ibv_send_wr *wr, ibv_send_wr **bad) {
+  uint64_t length = 1;
+  auto *last = wr;
+  for (; last->next != nullptr; last = last->next) {
+    last->send_flags &= ~IBV_SEND_SIGNALED;
+    ++length;
+  }
+  last->send_flags |= IBV_SEND_SIGNALED;
+  ROME_CHECK_QUIET(ROME_RETURN(InvalidArgumentErrorBuilder()
+                               << "Chain of " << length
+                               << " work requests exceeds the accessor's "
+                               << sq_depth_ << " SQ entries"),
+                   length <= sq_depth_);
+
+  absl::MutexLock lock(&post_mu_);
+  // Wait for earlier chains to leave room in the accessor's share of the SQ.
+  const CompletionToken token = posted_ + length;
+  while (token > completed_ + sq_depth_) {
+    auto done = TryCompleteInternal(token - sq_depth_);
+    if (!done.ok()) return done.status();
+    if (*done) break;
+    cpu_relax();
+  }
+  last->wr_id = SendCompletions::kAccessorTag | token;
+  *bad = nullptr;
+  RDMA_CM_CHECK(ibv_post_send, id_->qp, wr, bad);
+  posted_ = token;
+  return token;
+}
+
+absl::StatusOr<bool> AsyncRdmaAccessor::TryCompleteInternal(
+    CompletionToken token) {
+  if (token <= completed_) return true;
+  if (send_completions_ != nullptr) {
+    if (token <= send_completions_->accessor_completed()) return true;
+    // The messenger may have polled a failed completion of ours, after which
+    // no chain that has not completed yet ever will.
+    auto failed = send_completions_->accessor_failed();
+    if (!failed.ok()) return failed;
+  }
+  // Whoever is polling already will see this token's completion.
+  if (!poll_mu_.TryLock()) return false;
+  static constexpr int kMaxPoll = 16;
+  ibv_wc wcs[kMaxPoll];
+  int comps = ibv_poll_cq(id_->send_cq, kMaxPoll, wcs);
+  if (comps < 0 && errno != EAGAIN) {
+    poll_mu_.Unlock();
+    return InternalErrorBuilder() << "ibv_poll_cq(): " << strerror(errno);
+  }
+  // Every completion is passed on before reporting a failure, so that the
+  // messenger still sees those of its sends that were polled here, failed
+  // ones included.
+  CompletionToken latest = 0;
+  for (int i = 0; i < comps; ++i) {
+    if (!SendCompletions::IsAccessor(wcs[i].wr_id)) {
+      if (send_completions_ != nullptr) {
+        send_completions_->PassToMessenger(wcs[i].wr_id, wcs[i].status);
+      }
+    } else if (wcs[i].status == IBV_WC_SUCCESS) {
+      latest = wcs[i].wr_id & ~SendCompletions::kAccessorTag;
+    }
+    if (wcs[i].status != IBV_WC_SUCCESS && failed_.ok()) {
+      failed_ = InternalErrorBuilder()
+                << "ibv_poll_cq(): " << ibv_wc_status_str(wcs[i].status)
+                << " (wr_id=" << wcs[i].wr_id << ")";
+    }
+  }
+
+  auto completed = completed_.load();
+  while (completed < latest &&
+         !completed_.compare_exchange_weak(completed, latest)) {
+  }
+  // The QP is in the error state from the first failure on, so any chain that
+  // has not completed by then never will.
+  if (token > completed_ && !failed_.ok()) {
+    auto status = failed_;
+    poll_mu_.Unlock();
+    return status;
+  }
+  poll_mu_.Unlock();
+  return token <= completed_;
+}
+
+absl::Status AsyncRdmaAccessor::WaitInternal(CompletionToken token) {
+  while (true) {
+    auto done = TryCompleteInternal(token);
+    if (!done.ok()) return done.status();
+    if (*done) return absl::OkStatus();
+    cpu_relax();
+  }
+}
+
+}  // namespace rome::rdma
@@ -10,27 +10,86 @@
 namespace rome::rdma {
 
 using ::util::InternalErrorBuilder;
+using ::util::InvalidArgumentErrorBuilder;
 
-SyncRdmaAccessor::SyncRdmaAccessor(rdma_cm_id *id) : id_(id) {}
+SyncRdmaAccessor::SyncRdmaAccessor(rdma_cm_id *id)
+    : id_(id), sq_depth_(0), posted_(0) {
+  if (id_ == nullptr) return;
+  ibv_qp_attr attr;
+  ibv_qp_init_attr init_attr;
+  RDMA_CM_ASSERT(ibv_query_qp, id_->qp, &attr, IBV_QP_CAP, &init_attr);
+  sq_depth_ = SendCompletions::AccessorDepth(init_attr.cap.max_send_wr);
+}
 
 absl::Status SyncRdmaAccessor::PostInternal(ibv_send_wr *wr,
                                             ibv_send_wr **bad) {
+  // Only the last work request is signaled, and it is tagged with the chain's
+  // token so that its completion can be told apart from those of the
+  // messenger's sends. Tokens count work requests, as in `AsyncRdmaAccessor`.
+  uint64_t length = 1;
+  auto *last = wr;
+  for (; last->next != nullptr; last = last->next) {
+    last->send_flags &= ~IBV_SEND_SIGNALED;
+    ++length;
+  }
+  last->send_flags |= IBV_SEND_SIGNALED;
+  ROME_CHECK_QUIET(ROME_RETURN(InvalidArgumentErrorBuilder()
+                               << "Chain of " << length
+                               << " work requests exceeds the accessor's "
+                               << sq_depth_ << " SQ entries"),
+                   length <= sq_depth_);
+  const CompletionToken token = posted_ + length;
+  last->wr_id = SendCompletions::kAccessorTag | token;
+
   *bad = nullptr;
   RDMA_CM_CHECK(ibv_post_send, id_->qp, wr, bad);
   if (*bad != nullptr) {
     ROME_FATAL("WTF");
   }
+  posted_ = token;
 
+  // The messenger may poll the completion first, in which case it passes the
+  // token, or the failure, on instead.
   ibv_wc wc;
-  auto ret = ibv_poll_cq(id_->send_cq, 1, &wc);
-  while (ret == 0 || (ret < 0 && errno == EAGAIN)) {
-    ret = ibv_poll_cq(id_->send_cq, 1, &wc);
+  while (send_completions_ == nullptr ||
+         send_completions_->accessor_completed() < token) {
+    if (send_completions_ != nullptr) {
+      auto failed = send_completions_->accessor_failed();
+      if (!failed.ok()) return failed;
+    }
+    auto ret = ibv_poll_cq(id_->send_cq, 1, &wc);
+    if (ret == 0 || (ret < 0 && errno == EAGAIN)) continue;
+    ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                                 << "ibv_poll_cq(): " << strerror(errno)),
+                     ret == 1);
+    const bool accessor = SendCompletions::IsAccessor(wc.wr_id);
+    if (!accessor && send_completions_ != nullptr) {
+      send_completions_->PassToMessenger(wc.wr_id, wc.status);
+    }
+    ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                                 << "ibv_poll_cq(): "
+                                 << ibv_wc_status_str(wc.status)),
+                     wc.status == IBV_WC_SUCCESS);
+    if (accessor && (wc.wr_id & ~SendCompletions::kAccessorTag) >= token) {
+      return absl::OkStatus();
+    }
   }
-  ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
-                               << "ibv_poll_cq(): "
-                               << (ret < 0 ? strerror(errno)
-                                           : ibv_wc_status_str(wc.status))),
-                   ret == 1 && wc.status == IBV_WC_SUCCESS);
+  return absl::OkStatus();
+}
+
+absl::StatusOr<CompletionToken> SyncRdmaAccessor::PostAsyncInternal(
+    ibv_send_wr *wr, ibv_send_wr **bad) {
+  auto status = PostInternal(wr, bad);
+  if (!status.ok()) return status;
+  return posted_;
+}
+
+absl::StatusOr<bool> SyncRdmaAccessor::TryCompleteInternal(
+    CompletionToken token) {
+  return true;
+}
+
+absl::Status SyncRdmaAccessor::WaitInternal(CompletionToken token) {
   return absl::OkStatus();
 }
 
@@ -0,0 +1,332 @@
+#include "rome/rdma/channel/ud_messenger.h"
+
+#include <infiniband/verbs.h>
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+
+#include "rome/logging/logging.h"
+#include "rome/rdma/rdma_util.h"
+#include "rome/rdma/tcp_bootstrap.h"
+#include "rome/util/status_util.h"
+
+namespace rome::rdma {
+
+using ::util::InternalErrorBuilder;
+using ::util::NotFoundErrorBuilder;
+using ::util::ResourceExhaustedErrorBuilder;
+
+namespace {
+
+// Whether sequence number `a` comes before `b`, allowing for wrap around.
+inline bool SeqBefore(uint32_t a, uint32_t b) {
+  return static_cast<int32_t>(a - b) < 0;
+}
+
+inline uint32_t MtuBytes(ibv_mtu mtu) { return 128u << mtu; }
+
+}  // namespace
+
+UdEndpoint::~UdEndpoint() = default;
+
+/* static */ absl::StatusOr<std::unique_ptr<UdEndpoint>> UdEndpoint::Create(
+    uint32_t my_id, ibv_pd* pd, uint8_t port_num, uint8_t gid_index) {
+  auto endpoint = std::unique_ptr<UdEndpoint>(
+      new UdEndpoint(my_id, pd, port_num, gid_index));
+  auto status = endpoint->Init();
+  if (!status.ok()) return status;
+  return endpoint;
+}
+
+UdEndpoint::UdEndpoint(uint32_t my_id, ibv_pd* pd, uint8_t port_num,
+                       uint8_t gid_index)
+    : my_id_(my_id),
+      pd_(pd),
+      port_num_(port_num),
+      gid_index_(gid_index),
+      global_routing_(false),
+      mtu_bytes_(0),
+      send_mr_(nullptr),
+      recv_mr_(nullptr),
+      send_base_(nullptr),
+      recv_base_(nullptr),
+      send_next_(0),
+      send_posted_(0),
+      send_completed_(0) {}
+
+absl::Status UdEndpoint::Init() {
+  ibv_port_attr port_attr;
+  RDMA_CM_CHECK(ibv_query_port, pd_->context, port_num_, &port_attr);
+  global_routing_ = port_attr.link_layer == IBV_LINK_LAYER_ETHERNET;
+  mtu_bytes_ = MtuBytes(port_attr.active_mtu);
+
+  const uint64_t send_bytes = uint64_t{kSendSlots} * mtu_bytes_;
+  const uint64_t recv_bytes = uint64_t{kRecvSlots} * (kGrhBytes + mtu_bytes_);
+  rm_ = std::make_unique<RdmaMemory>(send_bytes + recv_bytes, pd_);
+  auto status = rm_->RegisterMemoryRegion(kSendId, 0, send_bytes);
+  if (status.ok()) {
+    status = rm_->RegisterMemoryRegion(kRecvId, send_bytes, recv_bytes);
+  }
+  if (!status.ok()) return status;
+  send_mr_ = VALUE_OR_DIE(rm_->GetMemoryRegion(kSendId));
+  recv_mr_ = VALUE_OR_DIE(rm_->GetMemoryRegion(kRecvId));
+  send_base_ = reinterpret_cast<uint8_t*>(send_mr_->addr);
+  recv_base_ = reinterpret_cast<uint8_t*>(recv_mr_->addr);
+
+  send_cq_.reset(ibv_create_cq(pd_->context, kSendSlots, nullptr, nullptr, 0));
+  recv_cq_.reset(ibv_create_cq(pd_->context, kRecvSlots, nullptr, nullptr, 0));
+  ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                               << "ibv_create_cq(): " << strerror(errno)),
+                   send_cq_ != nullptr && recv_cq_ != nullptr);
+
+  ibv_qp_init_attr init_attr;
+  std::memset(&init_attr, 0, sizeof(init_attr));
+  init_attr.send_cq = send_cq_.get();
+  init_attr.recv_cq = recv_cq_.get();
+  init_attr.cap.max_send_wr = kSendSlots;
+  init_attr.cap.max_recv_wr = kRecvSlots;
+  init_attr.cap.max_send_sge = init_attr.cap.max_recv_sge = 1;
+  init_attr.qp_type = IBV_QPT_UD;
+  qp_.reset(ibv_create_qp(pd_, &init_attr));
+  ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                               << "ibv_create_qp(): " << strerror(errno)),
+                   qp_ != nullptr);
+
+  ibv_qp_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.qp_state = IBV_QPS_INIT;
+  attr.pkey_index = 0;
+  attr.port_num = port_num_;
+  attr.qkey = kQkey;
+  RDMA_CM_CHECK(ibv_modify_qp, qp_.get(), &attr,
+                IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_QKEY);
+  attr.qp_state = IBV_QPS_RTR;
+  RDMA_CM_CHECK(ibv_modify_qp, qp_.get(), &attr, IBV_QP_STATE);
+  attr.qp_state = IBV_QPS_RTS;
+  attr.sq_psn = 0;
+  RDMA_CM_CHECK(ibv_modify_qp, qp_.get(), &attr, IBV_QP_STATE | IBV_QP_SQ_PSN);
+
+  for (uint32_t slot = 0; slot < kRecvSlots; ++slot) {
+    status = PostRecv(slot);
+    if (!status.ok()) return status;
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<QpInfoProto> UdEndpoint::address() const {
+  return GetQpInfo(qp_.get(), port_num_, gid_index_);
+}
+
+absl::Status UdEndpoint::AddPeer(uint32_t peer_id, const QpInfoProto& address,
+                                 uint32_t first_seq) {
+  ibv_ah_attr ah_attr;
+  std::memset(&ah_attr, 0, sizeof(ah_attr));
+  ah_attr.dlid = address.lid();
+  ah_attr.port_num = port_num_;
+  if (global_routing_) {
+    ROME_CHECK_QUIET(
+        ROME_RETURN(absl::InvalidArgumentError("Peer address has no GID")),
+        address.gid().size() == sizeof(ah_attr.grh.dgid.raw));
+    ah_attr.is_global = 1;
+    std::memcpy(ah_attr.grh.dgid.raw, address.gid().data(),
+                address.gid().size());
+    ah_attr.grh.sgid_index = gid_index_;
+    ah_attr.grh.hop_limit = 1;
+  }
+  ibv_ah_unique_ptr ah(ibv_create_ah(pd_, &ah_attr));
+  ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                               << "ibv_create_ah(): " << strerror(errno)),
+                   ah != nullptr);
+
+  auto [iter, added] = peers_.try_emplace(peer_id);
+  auto& peer = iter->second;
+  if (added) {
+    peer.next_seq = peer.acked = peer.expected = first_seq;
+  }
+  peer.ah = std::move(ah);
+  peer.qp_num = address.qp_num();
+  return absl::OkStatus();
+}
+
+absl::Status UdEndpoint::Send(uint32_t peer_id, const uint8_t* buffer,
+                              size_t length) {
+  ROME_CHECK_QUIET(ROME_RETURN(ResourceExhaustedErrorBuilder()
+                               << "Message too large: " << length),
+                   length <= max_message_bytes());
+  auto iter = peers_.find(peer_id);
+  ROME_CHECK_QUIET(
+      ROME_RETURN(NotFoundErrorBuilder() << "Unknown peer: " << peer_id),
+      iter != peers_.end());
+  auto& peer = iter->second;
+  while (peer.unacked.size() >= kWindow) {
+    auto status = Progress();
+    if (!status.ok()) return status;
+  }
+
+  if (peer.unacked.empty()) peer.sent_at = std::chrono::steady_clock::now();
+  peer.unacked.emplace_back(reinterpret_cast<const char*>(buffer), length);
+  return PostDatagram(peer, 0, peer.next_seq++, buffer, length);
+}
+
+absl::StatusOr<Message> UdEndpoint::TryDeliver(uint32_t peer_id) {
+  auto status = Progress();
+  if (!status.ok()) return status;
+  auto iter = peers_.find(peer_id);
+  ROME_CHECK_QUIET(
+      ROME_RETURN(NotFoundErrorBuilder() << "Unknown peer: " << peer_id),
+      iter != peers_.end());
+  auto& delivered = iter->second.delivered;
+  if (delivered.empty()) return absl::UnavailableError("Retry");
+  auto msg = std::move(delivered.front());
+  delivered.pop_front();
+  return msg;
+}
+
+absl::Status UdEndpoint::Progress() {
+  ibv_wc wcs[kPollBurst];
+  int ret = ibv_poll_cq(recv_cq_.get(), kPollBurst, wcs);
+  ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                               << "ibv_poll_cq(): " << strerror(errno)),
+                   ret >= 0);
+  for (int i = 0; i < ret; ++i) {
+    ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                                 << "Receive failed: "
+                                 << ibv_wc_status_str(wcs[i].status)),
+                     wcs[i].status == IBV_WC_SUCCESS);
+    auto status = HandleDatagram(wcs[i].wr_id, wcs[i].byte_len);
+    if (!status.ok()) return status;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  for (auto& [peer_id, peer] : peers_) {
+    if (!peer.unacked.empty() && now - peer.sent_at >= kRetransmitTimeout) {
+      ROME_TRACE("Retransmitting to {}: seq={}, count={}", peer_id, peer.acked,
+                 peer.unacked.size());
+      peer.sent_at = now;
+      uint32_t seq = peer.acked;
+      for (const auto& payload : peer.unacked) {
+        auto status =
+            PostDatagram(peer, 0, seq++, payload.data(), payload.size());
+        if (!status.ok()) return status;
+      }
+    }
+    if (peer.owed_acks >= kAckBatch ||
+        (peer.owed_acks > 0 && now - peer.owed_since >= kAckDelay)) {
+      auto status = PostDatagram(peer, kAckOnly, 0, nullptr, 0);
+      if (!status.ok()) return status;
+    }
+  }
+  return PollSendCompletions(/*wait=*/false);
+}
+
+absl::Status UdEndpoint::PostRecv(uint32_t slot) {
+  ibv_sge sge;
+  sge.addr = reinterpret_cast<uint64_t>(recv_base_ +
+                                        slot * (kGrhBytes + mtu_bytes_));
+  sge.length = kGrhBytes + mtu_bytes_;
+  sge.lkey = recv_mr_->lkey;
+
+  ibv_recv_wr wr, *bad;
+  std::memset(&wr, 0, sizeof(wr));
+  wr.wr_id = slot;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  RDMA_CM_CHECK(ibv_post_recv, qp_.get(), &wr, &bad);
+  return absl::OkStatus();
+}
+
+absl::Status UdEndpoint::PostDatagram(Peer& peer, uint16_t flags, uint32_t seq,
+                                      const void* buffer, size_t length) {
+  if (send_posted_ - send_completed_ == kSendSlots) {
+    auto status = PollSendCompletions(/*wait=*/true);
+    if (!status.ok()) return status;
+  }
+
+  // Sends complete in the order they were posted, so slots are reused in order
+  // too.
+  auto* slot = send_base_ + send_next_ * mtu_bytes_;
+  send_next_ = (send_next_ + 1) % kSendSlots;
+  ++send_posted_;
+
+  Header header{my_id_, seq, peer.expected, flags,
+                static_cast<uint16_t>(length)};
+  std::memcpy(slot, &header, sizeof(header));
+  if (length > 0) std::memcpy(slot + sizeof(header), buffer, length);
+  peer.owed_acks = 0;
+
+  ibv_sge sge;
+  sge.addr = reinterpret_cast<uint64_t>(slot);
+  sge.length = sizeof(header) + length;
+  sge.lkey = send_mr_->lkey;
+
+  ibv_send_wr wr, *bad;
+  std::memset(&wr, 0, sizeof(wr));
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.wr_id = send_posted_;
+  wr.opcode = IBV_WR_SEND;
+  wr.send_flags = send_posted_ % kSignalInterval == 0 ? IBV_SEND_SIGNALED : 0;
+  wr.wr.ud.ah = peer.ah.get();
+  wr.wr.ud.remote_qpn = peer.qp_num;
+  wr.wr.ud.remote_qkey = kQkey;
+  RDMA_CM_CHECK(ibv_post_send, qp_.get(), &wr, &bad);
+  return absl::OkStatus();
+}
+
+absl::Status UdEndpoint::PollSendCompletions(bool wait) {
+  ibv_wc wcs[kPollBurst];
+  int ret;
+  do {
+    ret = ibv_poll_cq(send_cq_.get(), kPollBurst, wcs);
+    ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                                 << "ibv_poll_cq(): " << strerror(errno)),
+                     ret >= 0);
+  } while (wait && ret == 0);
+  for (int i = 0; i < ret; ++i) {
+    ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                                 << "Send failed: "
+                                 << ibv_wc_status_str(wcs[i].status)),
+                     wcs[i].status == IBV_WC_SUCCESS);
+    send_completed_ = wcs[i].wr_id;
+  }
+  return absl::OkStatus();
+}
+
+absl::Status UdEndpoint::HandleDatagram(uint32_t slot, uint32_t length) {
+  auto* datagram = recv_base_ + slot * (kGrhBytes + mtu_bytes_) + kGrhBytes;
+  Header header;
+  std::memcpy(&header, datagram, sizeof(header));
+  auto iter = peers_.find(header.src);
+  if (length < kGrhBytes + sizeof(header) ||
+      length < kGrhBytes + sizeof(header) + header.length) {
+    ROME_WARN("Dropping truncated datagram: {} bytes", length);
+  } else if (iter == peers_.end()) {
+    ROME_WARN("Dropping datagram from unknown peer: {}", header.src);
+  } else {
+    auto& peer = iter->second;
+    while (SeqBefore(peer.acked, header.ack) && !peer.unacked.empty()) {
+      peer.unacked.pop_front();
+      ++peer.acked;
+      peer.sent_at = std::chrono::steady_clock::now();
+    }
+
+    if (!(header.flags & kAckOnly)) {
+      if (header.seq == peer.expected) {
+        Message msg{std::make_unique<uint8_t[]>(header.length), header.length};
+        std::memcpy(msg.buffer.get(), datagram + sizeof(header),
+                    header.length);
+        peer.delivered.push_back(std::move(msg));
+        ++peer.expected;
+      }
+      // Duplicates and messages past a gap are dropped, but still acknowledged
+      // so that the sender learns what did arrive.
+      if (peer.owed_acks++ == 0) {
+        peer.owed_since = std::chrono::steady_clock::now();
+      }
+    }
+  }
+  return PostRecv(slot);
+}
+
+}  // namespace rome::rdma
@@ -0,0 +1,143 @@
+#include "rome/rdma/memory_region_cache.h"
+
+#include <infiniband/verbs.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "rome/logging/logging.h"
+#include "rome/util/status_util.h"
+
+namespace rome::rdma {
+
+using ::util::FailedPreconditionErrorBuilder;
+using ::util::InternalErrorBuilder;
+
+MemoryRegionCache::~MemoryRegionCache() {
+  absl::MutexLock lock(&mu_);
+  for (const auto &[mr, entry] : by_mr_) {
+    if (entry->refs > 0) {
+      ROME_WARN("Destroying cache while memory region is in use: {}",
+                fmt::ptr(mr));
+    }
+  }
+}
+
+absl::StatusOr<ibv_mr *> MemoryRegionCache::Acquire(const void *addr,
+                                                    uint64_t length) {
+  if (addr == nullptr || length == 0) {
+    return FailedPreconditionErrorBuilder()
+           << "Cannot register empty buffer: " << addr;
+  }
+  static const uintptr_t kPageSize = sysconf(_SC_PAGESIZE);
+  auto begin = reinterpret_cast<uintptr_t>(addr);
+  auto end = begin + length;
+
+  absl::MutexLock lock(&mu_);
+  auto iter = entries_.upper_bound(begin);
+  if (iter != entries_.begin()) {
+    auto *entry = std::prev(iter)->second.get();
+    if (entry->end >= end) {
+      if (entry->refs++ == 0) lru_.erase(entry->lru);
+      return entry->mr.get();
+    }
+  }
+
+  // Registrations cover whole pages, so an overlapping entry can only extend
+  // over pages that are already part of the application's buffers.
+  begin &= ~(kPageSize - 1);
+  end = (end + kPageSize - 1) & ~(kPageSize - 1);
+  iter = entries_.upper_bound(begin);
+  if (iter != entries_.begin() && std::prev(iter)->second->end > begin) --iter;
+  while (iter != entries_.end() && iter->first < end) {
+    begin = std::min(begin, iter->second->begin);
+    end = std::max(end, iter->second->end);
+    Remove((iter++)->first);
+  }
+
+  auto mr = ibv_mr_unique_ptr(ibv_reg_mr(pd_, reinterpret_cast<void *>(begin),
+                                         end - begin, options_.access));
+  if (mr == nullptr) {
+    return InternalErrorBuilder()
+           << "ibv_reg_mr(): " << std::strerror(errno);
+  }
+  ROME_DEBUG("Cached memory region: {} (length={})",
+             fmt::ptr(reinterpret_cast<void *>(begin)), end - begin);
+
+  auto entry = std::make_unique<Entry>();
+  entry->mr = std::move(mr);
+  entry->begin = begin;
+  entry->end = end;
+  entry->refs = 1;
+  auto *region = entry->mr.get();
+  by_mr_.emplace(region, entry.get());
+  entries_.emplace(begin, std::move(entry));
+  bytes_ += end - begin;
+  Evict();
+  return region;
+}
+
+void MemoryRegionCache::Release(ibv_mr *mr) {
+  absl::MutexLock lock(&mu_);
+  auto iter = by_mr_.find(mr);
+  ROME_ASSERT(iter != by_mr_.end(), "Unknown memory region: {}",
+              fmt::ptr(mr));
+  auto *entry = iter->second;
+  ROME_ASSERT(entry->refs > 0, "Memory region released too many times: {}",
+              fmt::ptr(mr));
+  if (--entry->refs > 0) return;
+  if (entry->retired) {
+    by_mr_.erase(iter);
+    retired_.erase(mr);
+    return;
+  }
+  lru_.push_front(entry);
+  entry->lru = lru_.begin();
+  Evict();
+}
+
+void MemoryRegionCache::Invalidate(const void *addr, uint64_t length) {
+  auto begin = reinterpret_cast<uintptr_t>(addr);
+  auto end = begin + length;
+  absl::MutexLock lock(&mu_);
+  auto iter = entries_.upper_bound(begin);
+  if (iter != entries_.begin() && std::prev(iter)->second->end > begin) --iter;
+  while (iter != entries_.end() && iter->first < end) {
+    Remove((iter++)->first);
+  }
+}
+
+size_t MemoryRegionCache::size() const {
+  absl::MutexLock lock(&mu_);
+  return entries_.size();
+}
+
+uint64_t MemoryRegionCache::registered_bytes() const {
+  absl::MutexLock lock(&mu_);
+  return bytes_;
+}
+
+void MemoryRegionCache::Remove(uintptr_t begin) {
+  auto node = entries_.extract(begin);
+  auto &entry = node.mapped();
+  bytes_ -= entry->end - entry->begin;
+  if (entry->refs == 0) {
+    lru_.erase(entry->lru);
+    by_mr_.erase(entry->mr.get());
+    return;
+  }
+  entry->retired = true;
+  auto *mr = entry->mr.get();
+  retired_.emplace(mr, std::move(entry));
+}
+
+void MemoryRegionCache::Evict() {
+  while (!lru_.empty() && (entries_.size() > options_.max_regions ||
+                           bytes_ > options_.max_bytes)) {
+    Remove(lru_.back()->begin);
+  }
+}
+
+}  // namespace rome::rdma
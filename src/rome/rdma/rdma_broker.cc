@@ -13,8 +13,11 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <rdma/rdma_cma.h>
+#include <poll.h>
 #include <rdma/rdma_verbs.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <barrier>
 #include <chrono>
@@ -48,6 +51,7 @@ using ::util::suspend_always;
 RdmaBroker ::~RdmaBroker() {
   [[maybe_unused]] auto s = Stop();
   rdma_destroy_ep(listen_id_);
+  if (wakeup_fd_ >= 0) close(wakeup_fd_);
   // if (listen_channel_ != nullptr) {
   //   rdma_destroy_event_channel(listen_channel_);
   // }
@@ -69,6 +73,7 @@ std::unique_ptr<RdmaBroker> RdmaBroker::Create(
 
 RdmaBroker::RdmaBroker(RdmaReceiverInterface* receiver)
     : terminate_(false),
+      wakeup_fd_(-1),
       status_(absl::OkStatus()),
       listen_channel_(nullptr),
       listen_id_(nullptr),
@@ -125,6 +130,11 @@ absl::Status RdmaBroker::Init(std::optional<std::string_view> address,
   port_ = rdma_get_src_port(listen_id_);
   ROME_INFO("Listening: {}:{}", address_, port_);
 
+  wakeup_fd_ = eventfd(0, EFD_NONBLOCK);
+  ROME_CHECK_QUIET(
+      ROME_RETURN(InternalErrorBuilder() << "eventfd(): " << strerror(errno)),
+      wakeup_fd_ >= 0);
+
   runner_.reset(new std::thread([&]() { this->Run(); }));
 
   return absl::OkStatus();
@@ -134,29 +144,36 @@ absl::Status RdmaBroker::Init(std::optional<std::string_view> address,
 // connection request handler that we are not accepting new requests.
 absl::Status RdmaBroker::Stop() {
   terminate_ = true;
+  if (wakeup_fd_ >= 0) {
+    uint64_t one = 1;
+    [[maybe_unused]] auto n = write(wakeup_fd_, &one, sizeof(one));
+  }
   runner_.reset();
   return status_;
 }
 
 Coro RdmaBroker::HandleConnectionRequests() {
   rdma_cm_event* event = nullptr;
-  int ret;
+  pollfd fds[2] = {{listen_channel_->fd, POLLIN, 0}, {wakeup_fd_, POLLIN, 0}};
   while (true) {
-    do {
-      std::this_thread::sleep_for(std::chrono::milliseconds(10));
-      // If we are shutting down, and there are no connections left then we
-      // should finish.
-      if (terminate_) co_return;
-
-      // Attempt to read from `listen_channel_`
-      ret = rdma_get_cm_event(listen_channel_, &event);
-      if (ret != 0 && errno != EAGAIN) {
+    // If we are shutting down, and there are no connections left then we
+    // should finish.
+    if (terminate_) co_return;
+
+    // Attempt to read from `listen_channel_`, blocking until either it has an
+    // event or `Stop` signals `wakeup_fd_`.
+    while (rdma_get_cm_event(listen_channel_, &event) != 0) {
+      if (errno != EAGAIN) {
         status_ = InternalErrorBuilder()
                   << "rdma_get_cm_event(): " << strerror(errno);
         co_return;
       }
-      co_await suspend_always{};
-    } while ((ret != 0 && errno == EAGAIN));
+      if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+        status_ = InternalErrorBuilder() << "poll(): " << strerror(errno);
+        co_return;
+      }
+      if (terminate_) co_return;
+    }
 
     ROME_DEBUG("({}) Got event: {} (id={})", fmt::ptr(this),
                rdma_event_str(event->event), fmt::ptr(event->id));
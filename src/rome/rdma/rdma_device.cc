@@ -1,8 +1,17 @@
 #include "rome/rdma/rdma_device.h"
 
+#include <arpa/inet.h>
+#include <ifaddrs.h>
 #include <infiniband/verbs.h>
+#include <netinet/in.h>
 
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <optional>
+#include <string>
+#include <system_error>
 #include <vector>
 
 #include "rome/logging/logging.h"
@@ -43,6 +52,17 @@ absl::StatusOr<std::vector<int>> FindActivePorts(ibv_context *context) {
   }
 }
 
+constexpr char kSysfsRoot[] = "/sys/class/infiniband/";
+
+// Returns the first line of the file at `path`, or `nullopt` if it cannot be
+// read.
+std::optional<std::string> ReadSysfs(const std::string &path) {
+  std::ifstream file(path);
+  std::string line;
+  if (!std::getline(file, line)) return std::nullopt;
+  return line;
+}
+
 }  // namespace
 
 /* static */ absl::StatusOr<std::vector<std::pair<std::string, int>>>
@@ -76,6 +96,57 @@ RdmaDevice::GetAvailableDevices() {
   return util::NotFoundErrorBuilder() << "Device not found: " << name;
 }
 
+/* static */ int RdmaDevice::GetNumaNode(std::string_view name) {
+  auto node = ReadSysfs(kSysfsRoot + std::string(name) + "/device/numa_node");
+  return node.has_value() ? std::atoi(node->c_str()) : -1;
+}
+
+/* static */ absl::StatusOr<std::string> RdmaDevice::GetAddress(
+    std::string_view name, int port) {
+  // RoCE ports name their interface in the GID table. IB ports are reached
+  // through the IPoIB interfaces of the same PCI device, which are numbered by
+  // port starting at zero.
+  const auto dev_dir = kSysfsRoot + std::string(name);
+  auto ifname = ReadSysfs(dev_dir + "/ports/" + std::to_string(port) +
+                          "/gid_attrs/ndevs/0");
+  if (!ifname.has_value()) {
+    std::error_code ec;
+    for (const auto &entry :
+         std::filesystem::directory_iterator(dev_dir + "/device/net", ec)) {
+      auto dev_port = ReadSysfs(entry.path().string() + "/dev_port");
+      if (dev_port.has_value() && std::atoi(dev_port->c_str()) == port - 1) {
+        ifname = entry.path().filename().string();
+        break;
+      }
+    }
+  }
+  ROME_CHECK_QUIET(ROME_RETURN(NotFoundErrorBuilder() << "No interface: "
+                                                      << name << ":" << port),
+                   ifname.has_value());
+
+  ifaddrs *addrs;
+  ROME_CHECK_QUIET(
+      ROME_RETURN(UnknownErrorBuilder() << "getifaddrs(): " << strerror(errno)),
+      getifaddrs(&addrs) == 0);
+  std::optional<std::string> found;
+  for (auto *a = addrs; a != nullptr; a = a->ifa_next) {
+    if (a->ifa_addr == nullptr || a->ifa_addr->sa_family != AF_INET ||
+        *ifname != a->ifa_name) {
+      continue;
+    }
+    char buffer[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in *>(a->ifa_addr)->sin_addr,
+              buffer, sizeof(buffer));
+    found = buffer;
+    break;
+  }
+  freeifaddrs(addrs);
+  ROME_CHECK_QUIET(
+      ROME_RETURN(NotFoundErrorBuilder() << "No IPv4 address: " << *ifname),
+      found.has_value());
+  return *found;
+}
+
 RdmaDevice::~RdmaDevice() { protection_domains_.clear(); }
 
 absl::Status RdmaDevice::OpenDevice(std::string_view dev_name) {
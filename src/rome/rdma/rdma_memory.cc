@@ -1,22 +1,42 @@
 #include "rome/rdma/rdma_memory.h"
 
+#include <fcntl.h>
 #include <infiniband/verbs.h>
+#include <linux/magic.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <limits>
 #include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "absl/status/statusor.h"
 #include "rome/logging/logging.h"
 #include "rome/util/status_util.h"
 
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
 namespace rome::rdma {
 
 using ::util::AlreadyExistsErrorBuilder;
 using ::util::FailedPreconditionErrorBuilder;
+using ::util::InvalidArgumentErrorBuilder;
 using ::util::NotFoundErrorBuilder;
+using ::util::ResourceExhaustedErrorBuilder;
 using ::util::UnknownErrorBuilder;
 
 namespace {
@@ -40,65 +60,366 @@ absl::StatusOr<int> GetNumHugepages(std::string_view path) {
   return absl::UnknownError("Failed to read nr_hugepages");
 }
 
+bool UseHugepages(std::optional<std::string_view> path) {
+  if (!path.has_value()) return false;
+  auto nr_hugepages = GetNumHugepages(path.value());
+  return nr_hugepages.ok() && nr_hugepages.value() > 0;
+}
+
+// Whether RC memory regions on the device can be registered for on-demand
+// paging with all of the access rights in `RdmaMemory::kDefaultAccess`.
+bool SupportsOnDemandPaging(ibv_context *context) {
+  ibv_device_attr_ex attr;
+  if (ibv_query_device_ex(context, nullptr, &attr) != 0) return false;
+  constexpr uint32_t kRequired = IBV_ODP_SUPPORT_SEND | IBV_ODP_SUPPORT_RECV |
+                                 IBV_ODP_SUPPORT_WRITE | IBV_ODP_SUPPORT_READ |
+                                 IBV_ODP_SUPPORT_ATOMIC;
+  return (attr.odp_caps.general_caps & IBV_ODP_SUPPORT) &&
+         (attr.odp_caps.per_transport_caps.rc_odp_caps & kRequired) ==
+             kRequired;
+}
+
+constexpr uint64_t k2MiB = 1ul << 21;
+constexpr uint64_t k1GiB = 1ul << 30;
+
+constexpr uint64_t RoundUp(uint64_t x, uint64_t alignment) {
+  return (x + alignment - 1) & ~(alignment - 1);
+}
+
+// Returns the size of the default hugepages, which `MAP_HUGETLB` uses when no
+// size is given, as listed in /proc/meminfo. Falls back to 2 MiB if it is not.
+uint64_t DefaultHugepageBytes() {
+  static const uint64_t bytes = []() -> uint64_t {
+    std::ifstream file("/proc/meminfo");
+    std::string key;
+    uint64_t kib;
+    while (file >> key) {
+      if (key == "Hugepagesize:") return file >> kib ? kib << 10 : k2MiB;
+      file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+    return k2MiB;
+  }();
+  return bytes;
+}
+
+// Returns the size of the hugepages backing memory of `page_size`, or 2 MiB if
+// it is not backed by hugetlb pages of a known size.
+uint64_t HugepageBytes(RdmaMemory::PageSize page_size) {
+  switch (page_size) {
+    case RdmaMemory::PageSize::kHuge1GiB:
+      return k1GiB;
+    case RdmaMemory::PageSize::kHuge:
+      return DefaultHugepageBytes();
+    default:
+      return k2MiB;
+  }
+}
+
+// Faults in every page of the given range by writing to it. Writing is
+// necessary, since reads of untouched anonymous memory map the shared zero
+// page.
+void Prefault(uint8_t *base, uint64_t length) {
+#ifdef MADV_POPULATE_WRITE
+  if (madvise(base, length, MADV_POPULATE_WRITE) == 0) return;
+#endif
+  const auto page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+  for (uint64_t i = 0; i < length; i += page) {
+    reinterpret_cast<volatile uint8_t *>(base)[i] = 0;
+  }
+}
+
 }  // namespace
 
-RdmaMemory::~RdmaMemory() { memory_regions_.clear(); }
+RdmaMemory::~RdmaMemory() {
+  regions_.clear();
+  chunks_.clear();
+}
 
 RdmaMemory::RdmaMemory(uint64_t capacity, std::optional<std::string_view> path,
                        ibv_pd *const pd)
-    : capacity_(capacity) {
-  bool use_hugepages = false;
-  if (path.has_value()) {
-    auto nr_hugepages = GetNumHugepages(path.value());
-    if (nr_hugepages.ok() && nr_hugepages.value() > 0) {
-      use_hugepages = true;
+    : RdmaMemory(capacity,
+                 Options{.page_size = UseHugepages(path) ? PageSize::kHuge
+                                                         : PageSize::kDefault},
+                 pd) {}
+
+RdmaMemory::RdmaMemory(uint64_t capacity, const Options &options,
+                       ibv_pd *const pd)
+    : RdmaMemory(Unallocated{}, capacity, pd) {
+  ROME_ASSERT_OK(Init(options));
+}
+
+RdmaMemory::RdmaMemory(Unallocated, uint64_t capacity, ibv_pd *const pd)
+    : capacity_(capacity), pd_(pd), chunk_size_(capacity) {}
+
+absl::StatusOr<std::unique_ptr<RdmaMemory>> RdmaMemory::Create(
+    uint64_t capacity, const Options &options, ibv_pd *const pd) {
+  auto memory =
+      std::unique_ptr<RdmaMemory>(new RdmaMemory(Unallocated{}, capacity, pd));
+  auto status = memory->Init(options);
+  if (!status.ok()) return status;
+  return memory;
+}
+
+absl::Status RdmaMemory::Init(const Options &options) {
+  auto status = Allocate(options);
+  if (!status.ok()) return status;
+  return Register(options);
+}
+
+absl::Status RdmaMemory::Register(const Options &options) {
+  switch (options.registration) {
+    case Registration::kOnDemand:
+      if (SupportsOnDemandPaging(pd_->context)) {
+        auto mr = ibv_mr_unique_ptr(ibv_reg_mr(
+            pd_, raw(), capacity_, kDefaultAccess | IBV_ACCESS_ON_DEMAND));
+        if (mr != nullptr) {
+          default_mr_ = mr.get();
+          regions_.push_back(Region{std::move(mr), nullptr});
+          region_ids_.emplace(kDefaultId, regions_.size() - 1);
+          ROME_DEBUG("Registered on-demand paging region: {} (length={})",
+                     fmt::ptr(raw()), capacity_);
+          return absl::OkStatus();
+        }
+        ROME_WARN("Failed to register on-demand paging region ({}); "
+                  "registering in parallel",
+                  strerror(errno));
+      } else {
+        ROME_WARN("On-demand paging is not supported; registering in parallel");
+      }
+      [[fallthrough]];
+    case Registration::kParallel:
+      return RegisterParallel(options.registration_threads > 0
+                                  ? options.registration_threads
+                                  : std::thread::hardware_concurrency());
+    case Registration::kEager:
+      break;
+  }
+  return RegisterMemoryRegion(kDefaultId, pd_, 0, capacity_);
+}
+
+absl::Status RdmaMemory::RegisterParallel(unsigned num_threads) {
+  // Chunks are a multiple of the hugepage size so that, when the memory is
+  // backed by hugepages, no page is registered by more than one chunk.
+  uint64_t alignment = HugepageBytes(page_size_);
+  num_threads = std::max(num_threads, 1u);
+  chunk_size_ = RoundUp((capacity_ + num_threads - 1) / num_threads, alignment);
+  if (chunk_size_ >= capacity_) {
+    chunk_size_ = capacity_;
+    return RegisterMemoryRegion(kDefaultId, pd_, 0, capacity_);
+  }
+
+  const auto num_chunks = (capacity_ + chunk_size_ - 1) / chunk_size_;
+  chunks_.resize(num_chunks);
+  std::vector<std::thread> threads;
+  for (uint64_t i = 0; i < num_chunks; ++i) {
+    threads.emplace_back([this, i]() {
+      auto offset = i * chunk_size_;
+      auto length = std::min(chunk_size_, capacity_ - offset);
+      chunks_[i] = ibv_mr_unique_ptr(
+          ibv_reg_mr(pd_, raw() + offset, length, kDefaultAccess));
+    });
+  }
+  for (auto &t : threads) t.join();
+
+  for (const auto &mr : chunks_) {
+    if (mr == nullptr) {
+      chunks_.clear();
+      return absl::InternalError("Failed to register memory region chunk");
     }
   }
+  ROME_DEBUG("Registered {} chunks of {} bytes in parallel", num_chunks,
+             chunk_size_);
+  return absl::OkStatus();
+}
+
+absl::Status RdmaMemory::Allocate(const Options &options) {
+  if (options.file.has_value()) return MapFile(options);
+
+  switch (options.page_size) {
+    case PageSize::kHuge:
+    case PageSize::kHuge2MiB:
+    case PageSize::kHuge1GiB:
+      if (TryMapHugetlb(options.page_size, options.populate)) {
+        return absl::OkStatus();
+      }
+      ROME_WARN(
+          "Failed to allocate hugepages ({}); falling back to transparent "
+          "hugepages",
+          strerror(errno));
+      [[fallthrough]];
+    case PageSize::kTransparent:
+      if (TryMapTransparent(options.populate)) return absl::OkStatus();
+      ROME_WARN("Failed to allocate transparent hugepages ({})",
+                strerror(errno));
+      [[fallthrough]];
+    case PageSize::kDefault:
+      break;
+  }
 
-  if (!use_hugepages) {
-    ROME_TRACE("Not using hugepages; performance might suffer.");
-    auto bytes = ((capacity >> 6) + 1) << 6;  // Round up to nearest 64B
-    raw_ = std::unique_ptr<uint8_t[]>(
-        reinterpret_cast<uint8_t *>(std::aligned_alloc(64, bytes)));
-    ROME_ASSERT(std::get<0>(raw_) != nullptr, "Allocation failed.");
-  } else {
-    ROME_INFO("Using hugepages");
-    raw_ = std::unique_ptr<uint8_t[], mmap_deleter>(reinterpret_cast<uint8_t *>(
-        mmap(nullptr, capacity_, PROT_READ | PROT_WRITE,
-             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)));
-    ROME_ASSERT(reinterpret_cast<void *>(std::get<1>(raw_).get()) != MAP_FAILED,
-                "mmap failed.");
+  ROME_TRACE("Not using hugepages; performance might suffer.");
+  auto bytes = ((capacity_ >> 6) + 1) << 6;  // Round up to nearest 64B
+  raw_ = std::unique_ptr<uint8_t[]>(
+      reinterpret_cast<uint8_t *>(std::aligned_alloc(64, bytes)));
+  if (std::get<0>(raw_) == nullptr) {
+    return ResourceExhaustedErrorBuilder()
+           << "Failed to allocate " << bytes << " bytes";
   }
-  ROME_ASSERT_OK(RegisterMemoryRegion(kDefaultId, pd, 0, capacity_));
+  if (options.populate) Prefault(std::get<0>(raw_).get(), capacity_);
+  page_size_ = PageSize::kDefault;
+  return absl::OkStatus();
 }
 
-inline bool RdmaMemory::ValidateRegion(int offset, int length) {
-  if (offset < 0 || length < 0) return false;
-  if (offset + length > capacity_) return false;
+bool RdmaMemory::TryMapHugetlb(PageSize page_size, bool populate) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+  if (populate) flags |= MAP_POPULATE;
+  if (page_size == PageSize::kHuge2MiB) {
+    flags |= MAP_HUGE_2MB;
+  } else if (page_size == PageSize::kHuge1GiB) {
+    flags |= MAP_HUGE_1GB;
+  }
+  const uint64_t alignment = HugepageBytes(page_size);
+
+  // Hugetlb mappings must be unmapped in multiples of the page size.
+  auto bytes = RoundUp(capacity_, alignment);
+  auto *raw = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (raw == MAP_FAILED) return false;
+  ROME_INFO("Using hugepages");
+  raw_ = std::unique_ptr<uint8_t[], mmap_deleter>(
+      reinterpret_cast<uint8_t *>(raw), mmap_deleter{bytes});
+  page_size_ = page_size;
   return true;
 }
 
-absl::Status RdmaMemory::RegisterMemoryRegion(std::string_view id, int offset,
-                                              int length) {
-  return RegisterMemoryRegion(id, GetDefaultMemoryRegion()->pd, offset, length);
+bool RdmaMemory::TryMapTransparent(bool populate) {
+  // Transparent hugepages are only used for 2 MiB aligned ranges, so we over
+  // allocate and then trim the mapping on either side of the aligned range.
+  auto bytes = RoundUp(capacity_, k2MiB);
+  auto *raw = reinterpret_cast<uint8_t *>(
+      mmap(nullptr, bytes + k2MiB, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (raw == MAP_FAILED) return false;
+  auto *aligned = reinterpret_cast<uint8_t *>(
+      RoundUp(reinterpret_cast<uint64_t>(raw), k2MiB));
+  if (aligned != raw) munmap(raw, aligned - raw);
+  munmap(aligned + bytes, (raw + k2MiB) - aligned);
+
+  if (madvise(aligned, bytes, MADV_HUGEPAGE) != 0) {
+    munmap(aligned, bytes);
+    return false;
+  }
+  ROME_INFO("Using transparent hugepages");
+  raw_ = std::unique_ptr<uint8_t[], mmap_deleter>(aligned,
+                                                  mmap_deleter{bytes});
+  if (populate) Prefault(aligned, bytes);
+  page_size_ = PageSize::kTransparent;
+  return true;
+}
+
+absl::Status RdmaMemory::MapFile(const Options &options) {
+  const auto &path = options.file.value();
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return UnknownErrorBuilder()
+           << "open(): " << strerror(errno) << " (" << path << ")";
+  }
+
+  // Every failure past this point must close the file.
+  auto fail = [fd, &path](std::string_view call) -> absl::Status {
+    absl::Status status = UnknownErrorBuilder()
+                          << call << "(): " << strerror(errno) << " (" << path
+                          << ")";
+    close(fd);
+    return status;
+  };
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) return fail("fstat");
+  restored_ = static_cast<uint64_t>(st.st_size) >= capacity_;
+
+  // Files on hugetlbfs must be mapped in multiples of the mount's page size,
+  // which is reported as the filesystem's block size.
+  uint64_t bytes = capacity_;
+  page_size_ = options.page_size == PageSize::kTransparent
+                   ? PageSize::kTransparent
+                   : PageSize::kDefault;
+  struct statfs fs;
+  if (fstatfs(fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC) {
+    bytes = RoundUp(capacity_, fs.f_bsize);
+    page_size_ = fs.f_bsize == k1GiB   ? PageSize::kHuge1GiB
+                 : fs.f_bsize == k2MiB ? PageSize::kHuge2MiB
+                                       : PageSize::kHuge;
+  }
+
+  if (static_cast<uint64_t>(st.st_size) < bytes && ftruncate(fd, bytes) != 0) {
+    return fail("ftruncate");
+  }
+
+  int flags = MAP_SHARED;
+  if (options.populate) flags |= MAP_POPULATE;
+  void *raw = MAP_FAILED;
+  if (options.address != nullptr) {
+    raw = mmap(options.address, bytes, PROT_READ | PROT_WRITE,
+               flags | MAP_FIXED_NOREPLACE, fd, 0);
+    if (raw == MAP_FAILED) {
+      ROME_WARN("Cannot map {} at {} ({}); mapping elsewhere", path,
+                options.address, strerror(errno));
+    }
+  }
+  if (raw == MAP_FAILED) {
+    raw = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, flags, fd, 0);
+  }
+  if (raw == MAP_FAILED) return fail("mmap");
+  close(fd);  // The mapping holds its own reference to the file.
+
+  if (page_size_ == PageSize::kTransparent &&
+      madvise(raw, bytes, MADV_HUGEPAGE) != 0) {
+    page_size_ = PageSize::kDefault;
+  }
+  raw_ = std::unique_ptr<uint8_t[], mmap_deleter>(
+      reinterpret_cast<uint8_t *>(raw), mmap_deleter{bytes});
+  file_backed_ = true;
+  ROME_INFO("Mapped {} @ {} (restored={})", path, raw, restored_);
+  return absl::OkStatus();
+}
+
+absl::Status RdmaMemory::Flush() {
+  if (!file_backed_) return absl::OkStatus();
+  if (msync(raw(), capacity_, MS_SYNC) != 0) {
+    return UnknownErrorBuilder() << "msync(): " << strerror(errno);
+  }
+  return absl::OkStatus();
+}
+
+inline bool RdmaMemory::ValidateRegion(uint64_t offset, uint64_t length) {
+  return offset <= capacity_ && length <= capacity_ - offset;
+}
+
+absl::Status RdmaMemory::RegisterMemoryRegion(std::string_view id,
+                                              uint64_t offset,
+                                              uint64_t length) {
+  return RegisterMemoryRegion(id, pd_, offset, length);
 }
 
 absl::Status RdmaMemory::RegisterMemoryRegion(std::string_view id,
-                                              ibv_pd *const pd, int offset,
-                                              int length) {
+                                              ibv_pd *const pd,
+                                              uint64_t offset,
+                                              uint64_t length) {
   if (!ValidateRegion(offset, length)) {
     return FailedPreconditionErrorBuilder()
            << "Requested memory region invalid: " << id;
   }
 
-  auto iter = memory_regions_.find(std::string(id));
-  if (iter != memory_regions_.end()) {
-    return AlreadyExistsErrorBuilder() << "Memory region exists: {}" << id;
+  if (region_ids_.contains(std::string(id))) {
+    return AlreadyExistsErrorBuilder() << "Memory region exists: " << id;
   }
 
-  auto *base = reinterpret_cast<uint8_t *>(std::visit(
-                   [](const auto &raw) { return raw.get(); }, raw_)) +
-               offset;
+  // The default region must cover the whole capacity, which the chunks do.
+  if (id == kDefaultId && !chunks_.empty()) {
+    return InvalidArgumentErrorBuilder()
+           << "Memory is registered in chunks, cannot register: " << id;
+  }
+
+  auto *base = raw() + offset;
   auto mr = ibv_mr_unique_ptr(ibv_reg_mr(pd, base, length, kDefaultAccess));
   if (errno == ENOMEM){
     ROME_DEBUG("Not enough resources to register memory region.");
@@ -109,23 +430,64 @@ absl::Status RdmaMemory::RegisterMemoryRegion(std::string_view id,
   ROME_CHECK_QUIET(
       ROME_RETURN(absl::InternalError("Failed to register memory region")),
       mr != nullptr);
-  memory_regions_.emplace(id, std::move(mr));
+  auto *region = mr.get();
+  auto handle = AddRegion(id, Region{std::move(mr), nullptr});
+  ROME_CHECK_QUIET(ROME_RETURN(handle.status()), handle.ok());
+  if (id == kDefaultId) default_mr_ = region;
   ROME_DEBUG("Memory region registered: {} @ {} to {} (length={})", id,
              fmt::ptr(base), fmt::ptr(base + length), length);
   return absl::OkStatus();
 }
 
-ibv_mr *RdmaMemory::GetDefaultMemoryRegion() const {
-  return memory_regions_.find(kDefaultId)->second.get();
+absl::StatusOr<RdmaMemory::RegionHandle> RdmaMemory::AddMemoryRegionView(
+    std::string_view id, uint64_t offset, uint64_t length) {
+  if (!ValidateRegion(offset, length) || length == 0) {
+    return FailedPreconditionErrorBuilder()
+           << "Requested memory region invalid: " << id;
+  }
+
+  ibv_mr *parent = default_mr_;
+  if (parent == nullptr) {
+    // Views of memory registered in chunks must fall within a single chunk.
+    auto chunk = offset / chunk_size_;
+    if (chunk != (offset + length - 1) / chunk_size_) {
+      return FailedPreconditionErrorBuilder()
+             << "Memory region view crosses a registration boundary: " << id;
+    }
+    parent = chunks_[chunk].get();
+  }
+
+  auto view = std::make_unique<ibv_mr>(*parent);
+  view->addr = raw() + offset;
+  view->length = length;
+  return AddRegion(id, Region{nullptr, std::move(view)});
+}
+
+absl::StatusOr<RdmaMemory::RegionHandle> RdmaMemory::AddRegion(
+    std::string_view id, Region region) {
+  auto [iter, inserted] =
+      region_ids_.emplace(std::string(id), regions_.size());
+  if (!inserted) {
+    return AlreadyExistsErrorBuilder() << "Memory region exists: " << id;
+  }
+  regions_.push_back(std::move(region));
+  return iter->second;
 }
 
 absl::StatusOr<ibv_mr *> RdmaMemory::GetMemoryRegion(
     std::string_view id) const {
-  auto iter = memory_regions_.find(std::string(id));
-  if (iter == memory_regions_.end()) {
-    return NotFoundErrorBuilder() << "Memory region not found: {}" << id;
+  auto handle = GetMemoryRegionHandle(id);
+  if (!handle.ok()) return handle.status();
+  return GetMemoryRegion(*handle);
+}
+
+absl::StatusOr<RdmaMemory::RegionHandle> RdmaMemory::GetMemoryRegionHandle(
+    std::string_view id) const {
+  auto iter = region_ids_.find(std::string(id));
+  if (iter == region_ids_.end()) {
+    return NotFoundErrorBuilder() << "Memory region not found: " << id;
   }
-  return iter->second.get();
+  return iter->second;
 }
 
 }  // namespace rome
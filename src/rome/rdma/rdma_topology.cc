@@ -0,0 +1,78 @@
+#include "rome/rdma/rdma_topology.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "rome/logging/logging.h"
+#include "rome/rdma/rdma_device.h"
+#include "rome/util/status_util.h"
+
+namespace rome::rdma {
+
+using ::util::NotFoundErrorBuilder;
+
+RdmaTopology::RdmaTopology(std::vector<RdmaPortInfo> ports)
+    : ports_(std::move(ports)) {}
+
+/* static */ absl::StatusOr<std::unique_ptr<RdmaTopology>>
+RdmaTopology::Discover() {
+  auto devices = RdmaDevice::GetAvailableDevices();
+  if (!devices.ok()) return devices.status();
+  std::vector<RdmaPortInfo> ports;
+  for (const auto& [name, port] : *devices) {
+    auto address = RdmaDevice::GetAddress(name, port);
+    if (!address.ok()) {
+      ROME_DEBUG("Skipping port {}:{}: {}", name, port,
+                 address.status().ToString());
+      continue;
+    }
+    ports.push_back(
+        RdmaPortInfo{name, port, RdmaDevice::GetNumaNode(name), *address});
+    ROME_INFO("Found port: dev_name={}, port={}, numa_node={}, addr={}", name,
+              port, ports.back().numa_node, ports.back().address);
+  }
+  ROME_CHECK_QUIET(
+      ROME_RETURN(NotFoundErrorBuilder() << "No ports with an IPv4 address"),
+      !ports.empty());
+  return std::make_unique<RdmaTopology>(std::move(ports));
+}
+
+/* static */ int RdmaTopology::CurrentNumaNode() {
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) return -1;
+  return static_cast<int>(node);
+}
+
+std::vector<uint32_t> RdmaTopology::LocalPorts(int numa_node) const {
+  std::vector<uint32_t> local;
+  for (uint32_t i = 0; i < ports_.size(); ++i) {
+    if (numa_node >= 0 && ports_[i].numa_node == numa_node) local.push_back(i);
+  }
+  if (local.empty()) {
+    for (uint32_t i = 0; i < ports_.size(); ++i) local.push_back(i);
+  }
+  return local;
+}
+
+uint32_t RdmaTopology::AssignPort(int numa_node, uint32_t index) const {
+  ROME_ASSERT(!ports_.empty(), "No ports to assign");
+  auto local = LocalPorts(numa_node);
+  return local[index % local.size()];
+}
+
+uint32_t RdmaTopology::AssignPort(int numa_node) {
+  uint32_t index;
+  {
+    absl::MutexLock lock(&mu_);
+    index = threads_[numa_node]++;
+  }
+  return AssignPort(numa_node, index);
+}
+
+uint32_t RdmaTopology::AssignPort() { return AssignPort(CurrentNumaNode()); }
+
+}  // namespace rome::rdma
@@ -0,0 +1,305 @@
+#include "rome/rdma/tcp_bootstrap.h"
+
+#include <arpa/inet.h>
+#include <infiniband/verbs.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "google/protobuf/message_lite.h"
+#include "rome/logging/logging.h"
+#include "rome/rdma/rdma_util.h"
+#include "rome/util/status_util.h"
+
+namespace rome::rdma {
+
+using ::util::AlreadyExistsErrorBuilder;
+using ::util::InternalErrorBuilder;
+using ::util::ResourceExhaustedErrorBuilder;
+using ::util::UnavailableErrorBuilder;
+
+namespace {
+
+// How long to wait before retrying to connect to a coordinator.
+constexpr auto kConnectRetryInterval = std::chrono::milliseconds(10);
+
+// Rejects frames that cannot be a membership of any reasonable cluster.
+constexpr uint32_t kMaxFrameBytes = 64 << 20;  // 64 MiB
+
+absl::Status WriteAll(int fd, const void* buffer, size_t length) {
+  auto* next = reinterpret_cast<const uint8_t*>(buffer);
+  while (length > 0) {
+    auto n = send(fd, next, length, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    ROME_CHECK_QUIET(
+        ROME_RETURN(UnavailableErrorBuilder() << "send(): " << strerror(errno)),
+        n > 0);
+    next += n;
+    length -= n;
+  }
+  return absl::OkStatus();
+}
+
+absl::Status ReadAll(int fd, void* buffer, size_t length) {
+  auto* next = reinterpret_cast<uint8_t*>(buffer);
+  while (length > 0) {
+    auto n = recv(fd, next, length, 0);
+    if (n < 0 && errno == EINTR) continue;
+    ROME_CHECK_QUIET(ROME_RETURN(UnavailableErrorBuilder()
+                                 << "recv(): "
+                                 << (n == 0 ? "Connection closed"
+                                            : strerror(errno))),
+                     n > 0);
+    next += n;
+    length -= n;
+  }
+  return absl::OkStatus();
+}
+
+// Messages are framed by their length, in network byte order.
+absl::Status SendProto(int fd, const google::protobuf::MessageLite& msg) {
+  std::string frame(sizeof(uint32_t), '\0');
+  uint32_t length = htonl(static_cast<uint32_t>(msg.ByteSizeLong()));
+  std::memcpy(frame.data(), &length, sizeof(length));
+  msg.AppendToString(&frame);
+  return WriteAll(fd, frame.data(), frame.size());
+}
+
+absl::Status RecvProto(int fd, google::protobuf::MessageLite* msg) {
+  uint32_t length;
+  auto status = ReadAll(fd, &length, sizeof(length));
+  if (!status.ok()) return status;
+  length = ntohl(length);
+  ROME_CHECK_QUIET(ROME_RETURN(ResourceExhaustedErrorBuilder()
+                               << "Frame too large: " << length),
+                   length <= kMaxFrameBytes);
+  std::string buffer(length, '\0');
+  status = ReadAll(fd, buffer.data(), length);
+  if (!status.ok()) return status;
+  ROME_CHECK_QUIET(ROME_RETURN(absl::DataLossError("Failed to parse frame")),
+                   msg->ParseFromString(buffer));
+  return absl::OkStatus();
+}
+
+}  // namespace
+
+BootstrapCoordinator::~BootstrapCoordinator() {
+  // Wakes up the runner if it is still waiting for nodes to connect.
+  shutdown(listen_fd_, SHUT_RDWR);
+  if (runner_ != nullptr && runner_->joinable()) runner_->join();
+  close(listen_fd_);
+}
+
+/* static */ absl::StatusOr<std::unique_ptr<BootstrapCoordinator>>
+BootstrapCoordinator::Create(std::optional<uint16_t> port, uint32_t num_nodes) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  ROME_CHECK_QUIET(
+      ROME_RETURN(InternalErrorBuilder() << "socket(): " << strerror(errno)),
+      fd >= 0);
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port.value_or(0));
+  socklen_t addr_len = sizeof(addr);
+  if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0 ||
+      getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &addr_len) != 0) {
+    auto status = InternalErrorBuilder()
+                  << "Failed to listen on port " << port.value_or(0) << ": "
+                  << strerror(errno);
+    close(fd);
+    return status;
+  }
+
+  auto* coordinator =
+      new BootstrapCoordinator(fd, ntohs(addr.sin_port), num_nodes);
+  ROME_INFO("Bootstrap coordinator listening: {} (nodes={})",
+            coordinator->port(), num_nodes);
+  coordinator->runner_ =
+      std::make_unique<std::thread>([coordinator]() { coordinator->Run(); });
+  return std::unique_ptr<BootstrapCoordinator>(coordinator);
+}
+
+BootstrapCoordinator::BootstrapCoordinator(int listen_fd, uint16_t port,
+                                           uint32_t num_nodes)
+    : listen_fd_(listen_fd), port_(port), num_nodes_(num_nodes) {}
+
+absl::Status BootstrapCoordinator::Wait() {
+  if (runner_ != nullptr && runner_->joinable()) runner_->join();
+  return status_;
+}
+
+void BootstrapCoordinator::Run() {
+  // Nodes send their entries as soon as they connect, so the entries of nodes
+  // waiting in the backlog arrive while earlier ones are read.
+  std::vector<int> fds;
+  MembershipProto membership;
+  while (fds.size() < num_nodes_) {
+    int fd = accept(listen_fd_, nullptr, nullptr);
+    if (fd < 0 && errno == EINTR) continue;
+    if (fd < 0) {
+      status_ = UnavailableErrorBuilder() << "accept(): " << strerror(errno);
+      break;
+    }
+    fds.push_back(fd);
+    status_ = RecvProto(fd, membership.add_peers());
+    if (!status_.ok()) break;
+  }
+
+  if (status_.ok()) {
+    auto* peers = membership.mutable_peers();
+    std::sort(peers->pointer_begin(), peers->pointer_end(),
+              [](const PeerInfoProto* a, const PeerInfoProto* b) {
+                return a->id() < b->id();
+              });
+    for (int i = 1; i < peers->size(); ++i) {
+      if (peers->Get(i).id() == peers->Get(i - 1).id()) {
+        status_ = AlreadyExistsErrorBuilder()
+                  << "Duplicate node ID: " << peers->Get(i).id();
+        break;
+      }
+    }
+  }
+
+  // Nodes that do not get the membership see the connection close instead.
+  for (auto fd : fds) {
+    if (status_.ok()) {
+      auto status = SendProto(fd, membership);
+      if (!status.ok()) ROME_ERROR("SendProto(): {}", status.ToString());
+    }
+    close(fd);
+  }
+  ROME_DEBUG("Bootstrap finished: {}", status_.ToString());
+}
+
+absl::StatusOr<MembershipProto> Rendezvous(std::string_view address,
+                                           uint16_t port,
+                                           const PeerInfoProto& self,
+                                           std::chrono::milliseconds timeout) {
+  addrinfo hints, *resolved = nullptr;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  auto port_str = std::to_string(port);
+  int gai_ret =
+      getaddrinfo(std::string(address).c_str(), port_str.c_str(), &hints,
+                  &resolved);
+  ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder() << "getaddrinfo(): "
+                                                      << gai_strerror(gai_ret)),
+                   gai_ret == 0);
+
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  int fd = -1;
+  while (true) {
+    fd = socket(resolved->ai_family, resolved->ai_socktype,
+                resolved->ai_protocol);
+    if (fd >= 0 && connect(fd, resolved->ai_addr, resolved->ai_addrlen) == 0) {
+      break;
+    }
+    auto error = errno;
+    if (fd >= 0) close(fd);
+    if (std::chrono::steady_clock::now() >= deadline) {
+      freeaddrinfo(resolved);
+      return UnavailableErrorBuilder() << "Failed to reach coordinator "
+                                       << address << ":" << port << ": "
+                                       << strerror(error);
+    }
+    std::this_thread::sleep_for(kConnectRetryInterval);
+  }
+  freeaddrinfo(resolved);
+
+  MembershipProto membership;
+  auto status = SendProto(fd, self);
+  if (status.ok()) status = RecvProto(fd, &membership);
+  close(fd);
+  if (!status.ok()) return status;
+  return membership;
+}
+
+absl::StatusOr<QpInfoProto> GetQpInfo(ibv_qp* qp, uint8_t port_num,
+                                      uint8_t gid_index) {
+  ibv_port_attr port_attr;
+  RDMA_CM_CHECK(ibv_query_port, qp->context, port_num, &port_attr);
+  ibv_gid gid;
+  RDMA_CM_CHECK(ibv_query_gid, qp->context, port_num, gid_index, &gid);
+
+  QpInfoProto info;
+  info.set_qp_num(qp->qp_num);
+  info.set_lid(port_attr.lid);
+  info.set_gid(gid.raw, sizeof(gid.raw));
+  return info;
+}
+
+absl::Status ConnectQp(ibv_qp* qp, uint8_t port_num, const QpInfoProto& remote,
+                       const QpConfig& config) {
+  ibv_port_attr port_attr;
+  RDMA_CM_CHECK(ibv_query_port, qp->context, port_num, &port_attr);
+
+  ibv_qp_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.qp_state = IBV_QPS_INIT;
+  attr.pkey_index = 0;
+  attr.port_num = port_num;
+  attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+                         IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC;
+  RDMA_CM_CHECK(
+      ibv_modify_qp, qp, &attr,
+      IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS);
+
+  attr.qp_state = IBV_QPS_RTR;
+  attr.path_mtu = std::min(config.path_mtu, port_attr.active_mtu);
+  attr.dest_qp_num = remote.qp_num();
+  attr.rq_psn = 0;
+  attr.max_dest_rd_atomic = config.max_dest_rd_atomic;
+  attr.min_rnr_timer = config.min_rnr_timer;
+  attr.ah_attr.dlid = remote.lid();
+  attr.ah_attr.port_num = port_num;
+  // RoCE has no LIDs, so the connection is routed by GID instead.
+  if (port_attr.link_layer == IBV_LINK_LAYER_ETHERNET) {
+    ROME_CHECK_QUIET(
+        ROME_RETURN(absl::InvalidArgumentError("Remote QP has no GID")),
+        remote.gid().size() == sizeof(attr.ah_attr.grh.dgid.raw));
+    attr.ah_attr.is_global = 1;
+    std::memcpy(attr.ah_attr.grh.dgid.raw, remote.gid().data(),
+                remote.gid().size());
+    attr.ah_attr.grh.sgid_index = config.gid_index;
+    attr.ah_attr.grh.hop_limit = 1;
+  }
+  // XRC initiators never respond to reads or atomics, and XRC targets never
+  // send, so they stay in RTR.
+  int rtr_mask = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN |
+                 IBV_QP_RQ_PSN;
+  if (qp->qp_type != IBV_QPT_XRC_SEND) {
+    rtr_mask |= IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
+  }
+  RDMA_CM_CHECK(ibv_modify_qp, qp, &attr, rtr_mask);
+  if (qp->qp_type == IBV_QPT_XRC_RECV) return absl::OkStatus();
+
+  attr.qp_state = IBV_QPS_RTS;
+  attr.sq_psn = 0;
+  attr.timeout = config.timeout;
+  attr.retry_cnt = config.retry_cnt;
+  attr.rnr_retry = config.rnr_retry;
+  attr.max_rd_atomic = config.max_rd_atomic;
+  RDMA_CM_CHECK(ibv_modify_qp, qp, &attr,
+                IBV_QP_STATE | IBV_QP_SQ_PSN | IBV_QP_TIMEOUT |
+                    IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY |
+                    IBV_QP_MAX_QP_RD_ATOMIC);
+  return absl::OkStatus();
+}
+
+}  // namespace rome::rdma
@@ -0,0 +1,116 @@
+#include "rome/rdma/xrc_domain.h"
+
+#include <fcntl.h>
+#include <infiniband/verbs.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "rome/logging/logging.h"
+#include "rome/rdma/rdma_util.h"
+#include "rome/util/status_util.h"
+
+namespace rome::rdma {
+
+using ::util::InternalErrorBuilder;
+
+XrcDomain::~XrcDomain() {
+  // Everything is destroyed before what it was created from.
+  qps_.clear();
+  srqs_.clear();
+  cq_.reset();
+  xrcd_.reset();
+  if (fd_ >= 0) close(fd_);
+}
+
+/* static */ absl::StatusOr<std::unique_ptr<XrcDomain>> XrcDomain::Create(
+    ibv_pd* pd, std::optional<std::string_view> file, uint32_t cq_depth) {
+  int fd = -1;
+  if (file.has_value()) {
+    fd = open(std::string(*file).c_str(), O_CREAT | O_RDWR, 0600);
+    ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                                 << "open(): " << *file << ": "
+                                 << strerror(errno)),
+                     fd >= 0);
+  }
+  auto domain = std::unique_ptr<XrcDomain>(new XrcDomain(pd, fd));
+
+  ibv_xrcd_init_attr xrcd_attr;
+  std::memset(&xrcd_attr, 0, sizeof(xrcd_attr));
+  xrcd_attr.comp_mask = IBV_XRCD_INIT_ATTR_FD | IBV_XRCD_INIT_ATTR_OFLAGS;
+  xrcd_attr.fd = fd;
+  xrcd_attr.oflags = O_CREAT;
+  domain->xrcd_.reset(ibv_open_xrcd(pd->context, &xrcd_attr));
+  ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                               << "ibv_open_xrcd(): " << strerror(errno)),
+                   domain->xrcd_ != nullptr);
+
+  domain->cq_.reset(ibv_create_cq(pd->context, cq_depth, nullptr, nullptr, 0));
+  ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                               << "ibv_create_cq(): " << strerror(errno)),
+                   domain->cq_ != nullptr);
+  return domain;
+}
+
+XrcDomain::XrcDomain(ibv_pd* pd, int fd) : pd_(pd), fd_(fd) {}
+
+absl::StatusOr<std::pair<ibv_srq*, uint32_t>> XrcDomain::CreateSrq(
+    uint32_t depth) {
+  ibv_srq_init_attr_ex init_attr;
+  std::memset(&init_attr, 0, sizeof(init_attr));
+  init_attr.attr.max_wr = depth;
+  init_attr.attr.max_sge = 1;
+  init_attr.comp_mask = IBV_SRQ_INIT_ATTR_TYPE | IBV_SRQ_INIT_ATTR_PD |
+                        IBV_SRQ_INIT_ATTR_XRCD | IBV_SRQ_INIT_ATTR_CQ;
+  init_attr.srq_type = IBV_SRQT_XRC;
+  init_attr.pd = pd_;
+  init_attr.xrcd = xrcd_.get();
+  init_attr.cq = cq_.get();
+  ibv_srq_unique_ptr srq(ibv_create_srq_ex(pd_->context, &init_attr));
+  ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                               << "ibv_create_srq_ex(): " << strerror(errno)),
+                   srq != nullptr);
+
+  uint32_t srq_num;
+  RDMA_CM_CHECK(ibv_get_srq_num, srq.get(), &srq_num);
+  ROME_DEBUG("Created XRC SRQ: {}", srq_num);
+  srqs_.push_back(std::move(srq));
+  return std::make_pair(srqs_.back().get(), srq_num);
+}
+
+absl::StatusOr<ibv_qp*> XrcDomain::CreateSendQp(const QpConfig& config) {
+  ibv_qp_init_attr_ex init_attr;
+  std::memset(&init_attr, 0, sizeof(init_attr));
+  init_attr.qp_type = IBV_QPT_XRC_SEND;
+  init_attr.send_cq = init_attr.recv_cq = cq_.get();
+  init_attr.cap.max_send_wr = config.max_send_wr;
+  init_attr.cap.max_send_sge = config.max_send_sge;
+  init_attr.cap.max_inline_data = config.max_inline_data;
+  init_attr.sq_sig_all = 0;
+  init_attr.comp_mask = IBV_QP_INIT_ATTR_PD;
+  init_attr.pd = pd_;
+  ibv_qp_unique_ptr qp(ibv_create_qp_ex(pd_->context, &init_attr));
+  ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                               << "ibv_create_qp_ex(): " << strerror(errno)),
+                   qp != nullptr);
+  qps_.push_back(std::move(qp));
+  return qps_.back().get();
+}
+
+absl::StatusOr<ibv_qp*> XrcDomain::CreateRecvQp() {
+  ibv_qp_init_attr_ex init_attr;
+  std::memset(&init_attr, 0, sizeof(init_attr));
+  init_attr.qp_type = IBV_QPT_XRC_RECV;
+  init_attr.comp_mask = IBV_QP_INIT_ATTR_XRCD;
+  init_attr.xrcd = xrcd_.get();
+  ibv_qp_unique_ptr qp(ibv_create_qp_ex(pd_->context, &init_attr));
+  ROME_CHECK_QUIET(ROME_RETURN(InternalErrorBuilder()
+                               << "ibv_create_qp_ex(): " << strerror(errno)),
+                   qp != nullptr);
+  qps_.push_back(std::move(qp));
+  return qps_.back().get();
+}
+
+}  // namespace rome::rdma
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <rdma/rdma_cma.h>
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "protos/testutil.pb.h"
+#include "rome/logging/logging.h"
+#include "rome/rdma/channel/rdma_messenger.h"
+#include "rome/rdma/rdma_receiver.h"
+#include "rome/rdma/rdma_util.h"
+#include "rome/util/status_util.h"
+
+namespace rome::rdma {
+
+// The two ends of a connection used by the channel tests. The receiver accepts
+// a connection through an `RdmaBroker` and the client connects to it, and each
+// creates a `ChannelType` on a QP with `kNumWr` work requests in each queue.
+// Tests that build on the channel override `OnChannelCreated()` to do so before
+// the connection is accepted or established.
+template <typename ChannelType, uint32_t kNumWr>
+class FakeRdmaReceiver : public RdmaReceiverInterface {
+ public:
+  void OnConnectRequest(rdma_cm_id* id, rdma_cm_event* event) override {
+    ibv_qp_init_attr init_attr;
+    std::memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.cap.max_send_wr = init_attr.cap.max_recv_wr = kNumWr;
+    init_attr.cap.max_send_sge = init_attr.cap.max_recv_sge = 1;
+    init_attr.cap.max_inline_data = 0;
+    init_attr.qp_type = id->qp_type;
+    RDMA_CM_ASSERT(rdma_create_qp, id, nullptr, &init_attr);
+
+    id_ = id;
+    channel_ = std::make_unique<ChannelType>(id_);
+    OnChannelCreated(channel_.get());
+
+    RDMA_CM_ASSERT(rdma_accept, id, nullptr);
+    rdma_ack_cm_event(event);
+  }
+
+  void OnEstablished(rdma_cm_id* id, rdma_cm_event* event) override {
+    rdma_ack_cm_event(event);
+  }
+
+  void OnDisconnect(rdma_cm_id* id) override { rdma_disconnect(id); }
+
+  absl::StatusOr<testutil::RdmaChannelTestProto> Deliver() {
+    return channel_->template TryDeliver<testutil::RdmaChannelTestProto>();
+  }
+
+  absl::StatusOr<MessageView> Peek() { return channel_->TryPeekMessage(); }
+
+  absl::Status Send(const testutil::RdmaChannelTestProto& proto) {
+    return channel_->Send(proto);
+  }
+
+  template <typename T>
+  absl::StatusOr<T> DeliverAs() {
+    return channel_->template TryDeliver<T>();
+  }
+
+  template <typename Handler>
+  absl::Status Handle(Handler&& handler) {
+    return channel_->template TryHandle<testutil::RdmaChannelTestProto>(
+        std::forward<Handler>(handler));
+  }
+
+  template <typename Handler>
+  absl::StatusOr<size_t> HandleBatch(Handler&& handler, size_t max_messages) {
+    return channel_->template TryDeliverBatch<testutil::RdmaChannelTestProto>(
+        std::forward<Handler>(handler), max_messages);
+  }
+
+ protected:
+  // Called with the new channel before the connection is accepted.
+  virtual void OnChannelCreated(ChannelType* channel) {}
+
+ private:
+  rdma_cm_id* id_;
+  std::unique_ptr<ChannelType> channel_;
+};
+
+template <typename ChannelType, uint32_t kNumWr>
+class FakeRdmaClient {
+ public:
+  virtual ~FakeRdmaClient() { rdma_destroy_ep(id_); }
+
+  absl::Status Connect(std::string_view server, uint16_t port) {
+    rdma_cm_id* id = nullptr;
+    rdma_addrinfo hints, *resolved;
+    ibv_qp_init_attr init_attr;
+
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_port_space = RDMA_PS_TCP;
+    hints.ai_flags = AI_NUMERICSERV;
+    int gai_ret = rdma_getaddrinfo(
+        server.data(), std::to_string(htons(port)).data(), &hints, &resolved);
+    ROME_CHECK_QUIET(
+        ROME_RETURN(::util::InternalErrorBuilder()
+                    << "rdma_getaddrinfo(): " << gai_strerror(gai_ret)),
+        gai_ret == 0);
+    ROME_ASSERT(
+        reinterpret_cast<sockaddr_in*>(resolved->ai_dst_addr)->sin_port == port,
+        "Port does not match: expected={}, actual={}", port,
+        reinterpret_cast<sockaddr_in*>(resolved->ai_dst_addr)->sin_port);
+
+    std::memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.cap.max_send_wr = init_attr.cap.max_recv_wr = kNumWr;
+    init_attr.cap.max_send_sge = init_attr.cap.max_recv_sge = 1;
+    init_attr.cap.max_inline_data = 0;
+    init_attr.qp_type = ibv_qp_type(resolved->ai_qp_type);
+    RDMA_CM_CHECK(rdma_create_ep, &id, resolved, nullptr, &init_attr);
+
+    id_ = id;
+    channel_ = std::make_unique<ChannelType>(id_);
+    auto status = OnChannelCreated(channel_.get());
+    if (!status.ok()) return status;
+
+    RDMA_CM_CHECK(rdma_connect, id, nullptr);
+    ROME_INFO(
+        "Connected to {} (port={})",
+        inet_ntoa(
+            reinterpret_cast<sockaddr_in*>(rdma_get_peer_addr(id))->sin_addr),
+        rdma_get_dst_port(id));
+    return OnConnected();
+  }
+
+  absl::Status Send(const testutil::RdmaChannelTestProto& proto) {
+    return channel_->template Send<testutil::RdmaChannelTestProto>(proto);
+  }
+
+  template <typename T>
+  absl::Status Send(const T& msg) {
+    return channel_->Send(msg);
+  }
+
+  absl::Status Flush() { return channel_->Flush(); }
+
+  absl::Status SendMessage(const Message& msg) {
+    return channel_->SendMessage(msg);
+  }
+
+  absl::StatusOr<testutil::RdmaChannelTestProto> Deliver() {
+    return channel_->template TryDeliver<testutil::RdmaChannelTestProto>();
+  }
+
+ protected:
+  // Called with the new channel before connecting, and once connected.
+  virtual absl::Status OnChannelCreated(ChannelType* channel) {
+    return absl::OkStatus();
+  }
+  virtual absl::Status OnConnected() { return absl::OkStatus(); }
+
+ private:
+  rdma_cm_id* id_;
+  std::unique_ptr<ChannelType> channel_;
+};
+
+}  // namespace rome::rdma
@@ -0,0 +1,84 @@
+#include "rome/rdma/channel/rdma_accessor.h"
+
+#include <infiniband/verbs.h>
+
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "rome/rdma/channel/async_accessor.h"
+
+namespace rome::rdma {
+namespace {
+
+TEST(SendCompletionsTest, TagsAccessorWorkRequests) {
+  // Test plan: Check that only tagged `wr_id`s are taken for the accessor's.
+  EXPECT_TRUE(SendCompletions::IsAccessor(SendCompletions::kAccessorTag | 1));
+  EXPECT_FALSE(SendCompletions::IsAccessor(1));
+  EXPECT_FALSE(SendCompletions::IsAccessor(uint64_t{0xffffffff}));
+}
+
+TEST(SendCompletionsTest, AccessorKeepsLatestToken) {
+  // Test plan: Pass accessor completions out of order and check that the
+  // latest token is kept, since every earlier chain completed before it.
+  SendCompletions shared;
+  EXPECT_EQ(shared.accessor_completed(), 0);
+  shared.PassToAccessor(SendCompletions::kAccessorTag | 3);
+  shared.PassToAccessor(SendCompletions::kAccessorTag | 2);
+  EXPECT_EQ(shared.accessor_completed(), 3);
+  shared.PassToAccessor(SendCompletions::kAccessorTag | 7);
+  EXPECT_EQ(shared.accessor_completed(), 7);
+}
+
+TEST(SendCompletionsTest, MessengerTakesEveryCompletionInOrder) {
+  // Test plan: Pass messenger completions and check that each is taken once,
+  // in the order it was passed, along with its status.
+  using Completion = SendCompletions::Completion;
+  SendCompletions shared;
+  EXPECT_TRUE(shared.TakeMessengerCompletions().empty());
+  shared.PassToMessenger(4);
+  shared.PassToMessenger(9);
+  EXPECT_THAT(shared.TakeMessengerCompletions(),
+              ::testing::ElementsAre(Completion{4, IBV_WC_SUCCESS},
+                                     Completion{9, IBV_WC_SUCCESS}));
+  EXPECT_TRUE(shared.TakeMessengerCompletions().empty());
+  shared.PassToMessenger(12, IBV_WC_WR_FLUSH_ERR);
+  EXPECT_THAT(shared.TakeMessengerCompletions(),
+              ::testing::ElementsAre(Completion{12, IBV_WC_WR_FLUSH_ERR}));
+}
+
+TEST(SendCompletionsTest, AccessorSeesFailedCompletion) {
+  // Test plan: Pass a failed accessor completion as the messenger would and
+  // check that chains already completed still are, while waiting for any other
+  // returns the failure instead of spinning.
+  SendCompletions shared;
+  AsyncRdmaAccessor accessor(nullptr);
+  accessor.ShareSendCompletions(&shared);
+  shared.PassToAccessor(SendCompletions::kAccessorTag | 2);
+  EXPECT_TRUE(shared.accessor_failed().ok());
+  shared.PassToAccessor(SendCompletions::kAccessorTag | 5,
+                        IBV_WC_REM_ACCESS_ERR);
+  EXPECT_FALSE(shared.accessor_failed().ok());
+  EXPECT_EQ(shared.accessor_completed(), 2);
+
+  auto done = accessor.TryCompleteInternal(2);
+  ASSERT_TRUE(done.ok());
+  EXPECT_TRUE(*done);
+  EXPECT_FALSE(accessor.TryCompleteInternal(5).ok());
+  EXPECT_FALSE(accessor.WaitInternal(5).ok());
+}
+
+TEST(SendCompletionsTest, SplitsTheSendQueue) {
+  // Test plan: Check that the messenger's and the accessor's shares of the SQ
+  // never add up to more than it holds, and that each gets at least one entry.
+  for (uint32_t depth : {2u, 3u, 64u, 65u, 1024u}) {
+    EXPECT_EQ(SendCompletions::MessengerDepth(depth) +
+                  SendCompletions::AccessorDepth(depth),
+              depth);
+    EXPECT_GE(SendCompletions::MessengerDepth(depth), 1u);
+    EXPECT_GE(SendCompletions::AccessorDepth(depth), 1u);
+  }
+}
+
+}  // namespace
+}  // namespace rome::rdma
@@ -0,0 +1,177 @@
+#include "rome/rdma/channel/rdma_rpc.h"
+
+#include <future>
+#include <string>
+#include <vector>
+
+#include "fake_rdma_channel.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "protos/testutil.pb.h"
+#include "rome/rdma/channel/rdma_accessor.h"
+#include "rome/rdma/channel/rdma_channel.h"
+#include "rome/rdma/channel/twosided_messenger.h"
+#include "rome/rdma/rdma_broker.h"
+#include "rome/testutil/status_matcher.h"
+
+namespace rome::rdma {
+namespace {
+
+constexpr char kServer[] = "10.0.0.1";
+constexpr uint32_t kPort = 18020;
+constexpr uint32_t kCapacity = 1UL << 12;
+constexpr int32_t kRecvMaxBytes = 64;
+constexpr uint32_t kNumWr = kCapacity / kRecvMaxBytes;
+
+constexpr RpcMethodId kEcho = 1;
+constexpr RpcMethodId kFail = 2;
+constexpr RpcMethodId kUnknown = 3;
+
+using ChannelType = RdmaChannel<TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>,
+                                EmptyRdmaAccessor>;
+using EndpointType = RdmaRpcEndpoint<ChannelType>;
+using TestProto = testutil::RdmaChannelTestProto;
+
+// Serves the echo and failing methods on the accepted connection.
+class RpcReceiver : public FakeRdmaReceiver<ChannelType, kNumWr> {
+ public:
+  void OnDisconnect(rdma_cm_id* id) override {
+    endpoint_->Stop();
+    FakeRdmaReceiver::OnDisconnect(id);
+  }
+
+  EndpointType* endpoint() { return endpoint_.get(); }
+
+ protected:
+  void OnChannelCreated(ChannelType* channel) override {
+    endpoint_ = std::make_unique<EndpointType>(channel);
+    auto status = endpoint_->RegisterMethod<TestProto, TestProto>(
+        kEcho, [](const TestProto& request) -> absl::StatusOr<TestProto> {
+          return request;
+        });
+    ROME_ASSERT_OK(status);
+    status = endpoint_->RegisterMethod<TestProto, TestProto>(
+        kFail, [](const TestProto& request) -> absl::StatusOr<TestProto> {
+          return absl::InvalidArgumentError(request.message());
+        });
+    ROME_ASSERT_OK(status);
+    ROME_ASSERT_OK(endpoint_->Start());
+  }
+
+ private:
+  std::unique_ptr<EndpointType> endpoint_;
+};
+
+// Serves the echo method on the connecting side, so that calls can be made in
+// both directions.
+class RpcClient : public FakeRdmaClient<ChannelType, kNumWr> {
+ public:
+  EndpointType* endpoint() { return endpoint_.get(); }
+
+ protected:
+  absl::Status OnChannelCreated(ChannelType* channel) override {
+    endpoint_ = std::make_unique<EndpointType>(channel);
+    return endpoint_->RegisterMethod<TestProto, TestProto>(
+        kEcho, [](const TestProto& request) -> absl::StatusOr<TestProto> {
+          return request;
+        });
+  }
+
+  absl::Status OnConnected() override { return endpoint_->Start(); }
+
+ private:
+  // Destroyed before the channel and the QP that it uses.
+  std::unique_ptr<EndpointType> endpoint_;
+};
+
+class RdmaRpcTest : public ::testing::Test {
+ protected:
+  RdmaRpcTest() { ROME_INIT_LOG(); }
+
+  void SetUp() {
+    broker_ = RdmaBroker::Create(kServer, kPort, &receiver_);
+    ASSERT_NE(broker_, nullptr);
+    ASSERT_OK(client_.Connect(kServer, kPort));
+  }
+
+  RpcReceiver receiver_;
+  std::unique_ptr<RdmaBroker> broker_;
+  RpcClient client_;
+};
+
+TEST_F(RdmaRpcTest, CallOnce) {
+  TestProto request;
+  request.set_message("ping");
+  auto response = client_.endpoint()->Call<TestProto>(kEcho, request).get();
+  ASSERT_OK(response.status());
+  EXPECT_EQ(response->message(), "ping");
+}
+
+TEST_F(RdmaRpcTest, ManyCallsInFlight) {
+  // Test plan: Issue many more calls than the channel has receive slots before
+  // waiting for any of them, and check that each gets its own response.
+  constexpr int kNumCalls = ChannelType::kRecvSlots * 4;
+  std::vector<std::future<absl::StatusOr<TestProto>>> futures;
+  TestProto request;
+  for (int i = 0; i < kNumCalls; ++i) {
+    request.set_message(std::to_string(i));
+    futures.push_back(client_.endpoint()->Call<TestProto>(kEcho, request));
+  }
+  for (int i = 0; i < kNumCalls; ++i) {
+    auto response = futures[i].get();
+    ASSERT_OK(response.status());
+    EXPECT_EQ(response->message(), std::to_string(i));
+  }
+}
+
+TEST_F(RdmaRpcTest, CallsBothWaysBeyondCreditWindow) {
+  // Test plan: Have both sides issue many more calls than either has credits
+  // at once. Each worker then holds requests whose responses it cannot send
+  // until the other releases its own, which must not deadlock.
+  constexpr int kNumCalls = ChannelType::kInitialCredits * 8;
+  std::vector<std::future<absl::StatusOr<TestProto>>> client_futures;
+  std::vector<std::future<absl::StatusOr<TestProto>>> server_futures;
+  TestProto request;
+  for (int i = 0; i < kNumCalls; ++i) {
+    request.set_message(std::to_string(i));
+    client_futures.push_back(
+        client_.endpoint()->Call<TestProto>(kEcho, request));
+    server_futures.push_back(
+        receiver_.endpoint()->Call<TestProto>(kEcho, request));
+  }
+  for (int i = 0; i < kNumCalls; ++i) {
+    auto response = client_futures[i].get();
+    ASSERT_OK(response.status());
+    EXPECT_EQ(response->message(), std::to_string(i));
+    response = server_futures[i].get();
+    ASSERT_OK(response.status());
+    EXPECT_EQ(response->message(), std::to_string(i));
+  }
+}
+
+TEST_F(RdmaRpcTest, HandlerErrorIsReturned) {
+  TestProto request;
+  request.set_message("bad request");
+  auto response = client_.endpoint()->Call<TestProto>(kFail, request).get();
+  EXPECT_THAT(response.status(),
+              ::testutil::StatusIs(absl::StatusCode::kInvalidArgument));
+  EXPECT_EQ(response.status().message(), "bad request");
+}
+
+TEST_F(RdmaRpcTest, UnknownMethod) {
+  auto response =
+      client_.endpoint()->Call<TestProto>(kUnknown, TestProto()).get();
+  EXPECT_THAT(response.status(),
+              ::testutil::StatusIs(absl::StatusCode::kNotFound));
+}
+
+TEST_F(RdmaRpcTest, CallAfterStopIsCancelled) {
+  client_.endpoint()->Stop();
+  auto response =
+      client_.endpoint()->Call<TestProto>(kEcho, TestProto()).get();
+  EXPECT_THAT(response.status(),
+              ::testutil::StatusIs(absl::StatusCode::kCancelled));
+}
+
+}  // namespace
+}  // namespace rome::rdma
@@ -1,21 +1,22 @@
-#include "twosided_messenger.h"
+#include "rome/rdma/channel/twosided_messenger.h"
 
+#include <cstring>
+#include <limits>
+#include <memory>
 #include <random>
 
+#include "fake_rdma_channel.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "protos/testutil.pb.h"
-#include "rdma_accessor.h"
-#include "rdma_channel.h"
+#include "rome/rdma/channel/rdma_accessor.h"
+#include "rome/rdma/channel/rdma_channel.h"
 #include "rome/rdma/rdma_broker.h"
+#include "rome/testutil/status_matcher.h"
 
-namespace rome {
+namespace rome::rdma {
 namespace {
 
-using ::rome::RdmaBroker;
-using ::rome::RdmaReceiverInterface;
-using ::util::InternalErrorBuilder;
-
 constexpr char kServer[] = "10.0.0.1";
 constexpr uint32_t kPort = 18018;
 constexpr uint32_t kCapacity = 1UL << 12;
@@ -26,89 +27,15 @@ const std::string kMessage = "Shhh, it's a message!";
 using ChannelType = RdmaChannel<TwoSidedRdmaMessenger<kCapacity, kRecvMaxBytes>,
                                 EmptyRdmaAccessor>;
 
-class FakeRdmaReceiver : public RdmaReceiverInterface {
- public:
-  void OnConnectRequest(rdma_cm_id* id, rdma_cm_event* event) override {
-    ibv_qp_init_attr init_attr;
-    std::memset(&init_attr, 0, sizeof(init_attr));
-    init_attr.cap.max_send_wr = init_attr.cap.max_recv_wr = kNumWr;
-    init_attr.cap.max_send_sge = init_attr.cap.max_recv_sge = 1;
-    init_attr.cap.max_inline_data = 0;
-    init_attr.qp_type = id->qp_type;
-    RDMA_CM_ASSERT(rdma_create_qp, id, nullptr, &init_attr);
-
-    id_ = id;
-    channel_ = std::make_unique<ChannelType>(id_);
-
-    RDMA_CM_ASSERT(rdma_accept, id, nullptr);
-    rdma_ack_cm_event(event);
-  }
-
-  void OnEstablished(rdma_cm_id* id, rdma_cm_event* event) override {
-    rdma_ack_cm_event(event);
-  }
-
-  void OnDisconnect(rdma_cm_id* id) override { rdma_disconnect(id); }
-
-  absl::StatusOr<testutil::RdmaChannelTestProto> Deliver() {
-    return channel_->TryDeliver<testutil::RdmaChannelTestProto>();
-  }
-
- private:
-  rdma_cm_id* id_;
-  std::unique_ptr<ChannelType> channel_;
+struct Heartbeat {
+  static constexpr uint32_t kMessageTag = 1;
+  uint64_t node;
+  uint64_t epoch;
 };
 
-class FakeRdmaClient {
- public:
-  ~FakeRdmaClient() { rdma_destroy_ep(id_); }
-
-  absl::Status Connect(std::string_view server, uint16_t port) {
-    rdma_cm_id* id = nullptr;
-    rdma_addrinfo hints, *resolved;
-    ibv_qp_init_attr init_attr;
-
-    std::memset(&hints, 0, sizeof(hints));
-    hints.ai_port_space = RDMA_PS_TCP;
-    hints.ai_flags = AI_NUMERICSERV;
-    int gai_ret = rdma_getaddrinfo(
-        server.data(), std::to_string(htons(port)).data(), &hints, &resolved);
-    ROME_CHECK_QUIET(
-        ROME_RETURN(InternalErrorBuilder()
-                    << "rdma_getaddrinfo(): " << gai_strerror(gai_ret)),
-        gai_ret == 0);
-    ROME_ASSERT(
-        reinterpret_cast<sockaddr_in*>(resolved->ai_dst_addr)->sin_port == port,
-        "Port does not match: expected={}, actual={}", port,
-        reinterpret_cast<sockaddr_in*>(resolved->ai_dst_addr)->sin_port);
-
-    std::memset(&init_attr, 0, sizeof(init_attr));
-    init_attr.cap.max_send_wr = init_attr.cap.max_recv_wr = kNumWr;
-    init_attr.cap.max_send_sge = init_attr.cap.max_recv_sge = 1;
-    init_attr.cap.max_inline_data = 0;
-    init_attr.qp_type = ibv_qp_type(resolved->ai_qp_type);
-    RDMA_CM_CHECK(rdma_create_ep, &id, resolved, nullptr, &init_attr);
-
-    id_ = id;
-    channel_ = std::make_unique<ChannelType>(id_);
-
-    RDMA_CM_CHECK(rdma_connect, id, nullptr);
-    ROME_INFO(
-        "Connected to {} (port={})",
-        inet_ntoa(
-            reinterpret_cast<sockaddr_in*>(rdma_get_peer_addr(id))->sin_addr),
-        rdma_get_dst_port(id));
-
-    return absl::OkStatus();
-  }
-
-  absl::Status Send(const testutil::RdmaChannelTestProto& proto) {
-    return channel_->Send<testutil::RdmaChannelTestProto>(proto);
-  }
-
- private:
-  rdma_cm_id* id_;
-  std::unique_ptr<ChannelType> channel_;
+struct LockGrant {
+  static constexpr uint32_t kMessageTag = 2;
+  uint64_t lock;
 };
 
 class RdmaChannelTest : public ::testing::Test {
@@ -121,9 +48,9 @@ class RdmaChannelTest : public ::testing::Test {
     ASSERT_OK(client_.Connect(kServer, kPort));
   }
 
-  FakeRdmaReceiver receiver_;
+  FakeRdmaReceiver<ChannelType, kNumWr> receiver_;
   std::unique_ptr<RdmaBroker> broker_;
-  FakeRdmaClient client_;
+  FakeRdmaClient<ChannelType, kNumWr> client_;
 };
 
 TEST_F(RdmaChannelTest, Test) {
@@ -186,7 +113,186 @@ TEST_F(RdmaChannelTest, DeliverMultipleRepopulatingRecvBufferMultipleTimes) {
   }
 }
 
-TEST_F(RdmaChannelTest, LargeProtoExhaustsBuffer) {
+TEST_F(RdmaChannelTest, PipelinedSends) {
+  // Test plan: Send as many messages as the sender has credits without
+  // delivering any in between, then check that they all arrive in order.
+  constexpr int kNumMessages = ChannelType::kInitialCredits;
+  testutil::RdmaChannelTestProto proto;
+  for (int i = 0; i < kNumMessages; ++i) {
+    *proto.mutable_message() = std::to_string(i);
+    ASSERT_OK(client_.Send(proto));
+  }
+  ASSERT_OK(client_.Flush());
+  for (int i = 0; i < kNumMessages; ++i) {
+    auto proto_or = receiver_.Deliver();
+    while (absl::IsUnavailable(proto_or.status())) {
+      proto_or = receiver_.Deliver();
+    }
+    ASSERT_OK(proto_or.status());
+    EXPECT_EQ(proto_or->message(), std::to_string(i));
+  }
+}
+
+TEST_F(RdmaChannelTest, CreditsAreReturned) {
+  // Test plan: Exchange many more messages than there are receive slots in one
+  // direction only, so that credits must be returned in credit-only messages.
+  testutil::RdmaChannelTestProto proto;
+  *proto.mutable_message() = kMessage;
+  for (int i = 0; i < ChannelType::kRecvSlots * 10; ++i) {
+    ASSERT_OK(client_.Send(proto));
+    auto proto_or = receiver_.Deliver();
+    while (absl::IsUnavailable(proto_or.status())) {
+      proto_or = receiver_.Deliver();
+    }
+    ASSERT_OK(proto_or.status());
+    EXPECT_EQ(proto_or->message(), kMessage);
+  }
+}
+
+TEST_F(RdmaChannelTest, NoCreditsWhileHoldingMessages) {
+  // Test plan: Use up the receiver's credits, then have it hold a message from
+  // the client. Waiting for credits could then deadlock if the client were
+  // also waiting, so the next send must fail instead of blocking. Once the
+  // message is released and the client drains its messages, sends succeed.
+  testutil::RdmaChannelTestProto proto;
+  *proto.mutable_message() = kMessage;
+  for (int i = 0; i < ChannelType::kInitialCredits; ++i) {
+    ASSERT_OK(receiver_.Send(proto));
+  }
+  ASSERT_OK(client_.Send(proto));
+  auto view = receiver_.Peek();
+  while (absl::IsUnavailable(view.status())) view = receiver_.Peek();
+  ASSERT_OK(view.status());
+  EXPECT_THAT(receiver_.Send(proto),
+              ::testutil::StatusIs(absl::StatusCode::kUnavailable));
+
+  ASSERT_OK(receiver_.Deliver().status());
+  for (int i = 0; i < ChannelType::kInitialCredits; ++i) {
+    auto proto_or = client_.Deliver();
+    while (absl::IsUnavailable(proto_or.status())) {
+      proto_or = client_.Deliver();
+    }
+    ASSERT_OK(proto_or.status());
+  }
+  EXPECT_OK(receiver_.Send(proto));
+}
+
+TEST_F(RdmaChannelTest, HandleInPlace) {
+  // Test plan: Parse messages directly from the receive buffer and check that
+  // the slot is only released once the handler returns, across reposts.
+  testutil::RdmaChannelTestProto proto;
+  *proto.mutable_message() = kMessage;
+
+  for (int i = 0; i < ((kCapacity / 2) / kRecvMaxBytes) * 2; ++i) {
+    ASSERT_OK(client_.Send(proto));
+    int handled = 0;
+    auto status = receiver_.Handle(
+        [&](const testutil::RdmaChannelTestProto& received) {
+          EXPECT_EQ(received.message(), kMessage);
+          ++handled;
+        });
+    while (absl::IsUnavailable(status)) {
+      status = receiver_.Handle(
+          [&](const testutil::RdmaChannelTestProto& received) {
+            EXPECT_EQ(received.message(), kMessage);
+            ++handled;
+          });
+    }
+    ASSERT_OK(status);
+    EXPECT_EQ(handled, 1);
+  }
+}
+
+TEST_F(RdmaChannelTest, DeliverBatch) {
+  // Test plan: Send several messages before delivering any, then deliver them
+  // in batches of bounded size and check that they all arrive in order.
+  constexpr int kNumMessages = ChannelType::kInitialCredits;
+  constexpr size_t kMaxBatch = 3;
+  testutil::RdmaChannelTestProto proto;
+  for (int i = 0; i < kNumMessages; ++i) {
+    *proto.mutable_message() = std::to_string(i);
+    ASSERT_OK(client_.Send(proto));
+  }
+  ASSERT_OK(client_.Flush());
+
+  int delivered = 0;
+  while (delivered < kNumMessages) {
+    auto batch = receiver_.HandleBatch(
+        [&](const testutil::RdmaChannelTestProto& received) {
+          EXPECT_EQ(received.message(), std::to_string(delivered++));
+        },
+        kMaxBatch);
+    if (absl::IsUnavailable(batch.status())) continue;
+    ASSERT_OK(batch.status());
+    EXPECT_LE(*batch, kMaxBatch);
+  }
+  EXPECT_EQ(delivered, kNumMessages);
+}
+
+TEST_F(RdmaChannelTest, DeliverBatchReportsErrorAfterCount) {
+  // Test plan: Send a message followed by one that cannot be decoded, and
+  // check that the batch delivering the first still counts it, and that the
+  // error is returned by the next call instead.
+  testutil::RdmaChannelTestProto proto;
+  *proto.mutable_message() = kMessage;
+  ASSERT_OK(client_.Send(proto));
+  Message invalid{std::make_unique<uint8_t[]>(3), 3};
+  std::memset(invalid.buffer.get(), 0xff, invalid.length);
+  ASSERT_OK(client_.SendMessage(invalid));
+  ASSERT_OK(client_.Flush());
+
+  int handled = 0;
+  auto handler = [&](const testutil::RdmaChannelTestProto& received) {
+    EXPECT_EQ(received.message(), kMessage);
+    ++handled;
+  };
+  auto batch = receiver_.HandleBatch(handler, 2);
+  while (absl::IsUnavailable(batch.status())) {
+    batch = receiver_.HandleBatch(handler, 2);
+  }
+  EXPECT_THAT(batch, ::testutil::IsOkAndHolds(1));
+  batch = receiver_.HandleBatch(handler, 2);
+  while (absl::IsUnavailable(batch.status())) {
+    batch = receiver_.HandleBatch(handler, 2);
+  }
+  EXPECT_THAT(batch.status(),
+              ::testutil::StatusIs(absl::StatusCode::kDataLoss));
+  EXPECT_EQ(handled, 1);
+}
+
+TEST_F(RdmaChannelTest, FixedLayoutMessages) {
+  // Test plan: Send plain structs of different types and check that they are
+  // copied across intact.
+  ASSERT_OK(client_.Send(Heartbeat{.node = 3, .epoch = 42}));
+  ASSERT_OK(client_.Send(LockGrant{.lock = 7}));
+  auto heartbeat = receiver_.DeliverAs<Heartbeat>();
+  while (absl::IsUnavailable(heartbeat.status())) {
+    heartbeat = receiver_.DeliverAs<Heartbeat>();
+  }
+  ASSERT_OK(heartbeat.status());
+  EXPECT_EQ(heartbeat->node, 3);
+  EXPECT_EQ(heartbeat->epoch, 42);
+  auto grant = receiver_.DeliverAs<LockGrant>();
+  while (absl::IsUnavailable(grant.status())) {
+    grant = receiver_.DeliverAs<LockGrant>();
+  }
+  ASSERT_OK(grant.status());
+  EXPECT_EQ(grant->lock, 7);
+}
+
+TEST_F(RdmaChannelTest, FixedLayoutTagMismatch) {
+  // Test plan: Deliver a struct as the wrong type and check that it is
+  // rejected instead of being reinterpreted.
+  ASSERT_OK(client_.Send(LockGrant{.lock = 7}));
+  auto heartbeat = receiver_.DeliverAs<Heartbeat>();
+  while (absl::IsUnavailable(heartbeat.status())) {
+    heartbeat = receiver_.DeliverAs<Heartbeat>();
+  }
+  EXPECT_THAT(heartbeat.status(),
+              ::testutil::StatusIs(absl::StatusCode::kDataLoss));
+}
+
+TEST_F(RdmaChannelTest, LargeProtoUsesRendezvous) {
   testutil::RdmaChannelTestProto proto;
 
   static const char alphabet[] =
@@ -199,21 +305,34 @@ TEST_F(RdmaChannelTest, LargeProtoExhaustsBuffer) {
   std::uniform_int_distribution<> dist(
       0, sizeof(alphabet) / sizeof(*alphabet) - 2);
 
-  // Each protobuf string includes at least one byte for its wire-format and its
-  // field number. It also includes a `varint` that denotes the strings length.
-  // Therefore, if we set the size of the field to be exactly the number of
-  // bytes we are able to handle at the receiver, then the total bytes will be
-  // larger and the `Send` operations should fail.
-  // See (https://developers.google.com/protocol-buffers/docs/encoding).
-  static constexpr int kSize = kRecvMaxBytes;
-  std::string str;
-  str.reserve(kSize);
-  std::generate_n(std::back_inserter(str), kSize, [&]() { return dist(eng); });
-
-  proto.mutable_message()->reserve(str.size());
-  proto.mutable_message()->swap(str);
-
-  EXPECT_THAT(client_.Send(proto),
+  // Messages that do not fit in the receiver's slots are staged by the sender
+  // and read by the receiver, so they arrive intact regardless of their size.
+  // Sending more of them than there are slots checks that staging buffers are
+  // reused once the receiver has released the messages that advertised them.
+  for (int size : {kRecvMaxBytes, kRecvMaxBytes * 100, 1 << 20}) {
+    for (int i = 0; i < ChannelType::kRecvSlots; ++i) {
+      std::string str;
+      str.reserve(size);
+      std::generate_n(std::back_inserter(str), size,
+                      [&]() { return alphabet[dist(eng)]; });
+      *proto.mutable_message() = str;
+
+      ASSERT_OK(client_.Send(proto));
+      auto proto_or = receiver_.Deliver();
+      while (absl::IsUnavailable(proto_or.status())) {
+        proto_or = receiver_.Deliver();
+      }
+      ASSERT_OK(proto_or.status());
+      EXPECT_EQ(proto_or->message(), str);
+    }
+  }
+}
+
+TEST_F(RdmaChannelTest, MessageTooLarge) {
+  // Test plan: Check that a message whose length does not fit in a rendezvous
+  // header is rejected before anything is allocated for it.
+  Message msg{nullptr, size_t{std::numeric_limits<uint32_t>::max()} + 1};
+  EXPECT_THAT(client_.SendMessage(msg),
               ::testutil::StatusIs(absl::StatusCode::kResourceExhausted));
 }
 
@@ -1,9 +1,10 @@
-#include "connection_manager.h"
+#include "rome/rdma/connection_manager/connection_manager.h"
 
 #include <algorithm>
+#include <atomic>
 #include <barrier>
 #include <chrono>
-#include <experimental/coroutine>
+#include <coroutine>
 #include <iterator>
 #include <random>
 #include <thread>
@@ -228,4 +229,309 @@ TEST_F(ConnectionManagerTest, FullyConnected) {
   }
 }
 
-}  // namespace rome::rdma
\ No newline at end of file
+TEST_F(ConnectionManagerTest, ConnectAll) {
+  // Test plan: Have every node of a group connect to all of the others at
+  // once, then check that each node can exchange a message with every other.
+  static constexpr int kNumNodes = 9;
+  std::vector<std::unique_ptr<ConnectionManager<Channel>>> conns;
+  std::vector<ConnectionManager<Channel>::PeerAddress> peers;
+  for (int i = 0; i < kNumNodes; ++i) {
+    conns.emplace_back(std::make_unique<ConnectionManager<Channel>>(i));
+    ASSERT_OK(conns.back()->Start(kAddress, std::nullopt));
+    peers.push_back({static_cast<uint32_t>(i), kAddress, conns.back()->port()});
+  }
+
+  std::vector<std::thread> threads;
+  std::barrier sync(kNumNodes);
+  for (int i = 0; i < kNumNodes; ++i) {
+    threads.emplace_back([&conns, &peers, &sync, i]() {
+      EXPECT_OK(conns[i]->ConnectAll(peers));
+      EXPECT_EQ(conns[i]->GetNumConnections(), kNumNodes);
+      sync.arrive_and_wait();
+
+      for (const auto& p : peers) {
+        TestProto proto;
+        *proto.mutable_message() = std::to_string(i);
+        auto* conn = VALUE_OR_DIE(conns[i]->GetConnection(p.id));
+        EXPECT_OK(conn->channel()->Send(proto));
+      }
+      for (const auto& p : peers) {
+        auto* conn = VALUE_OR_DIE(conns[i]->GetConnection(p.id));
+        auto m = conn->channel()->TryDeliver<TestProto>();
+        while (absl::IsUnavailable(m.status())) {
+          m = conn->channel()->TryDeliver<TestProto>();
+        }
+        EXPECT_OK(m);
+        if (m.ok()) {
+          EXPECT_EQ(m->message(), std::to_string(p.id));
+        }
+      }
+
+      sync.arrive_and_wait();
+      conns[i]->Shutdown();
+    });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+TEST_F(ConnectionManagerTest, MultipleQpsPerPeer) {
+  // Test plan: Connect a group of nodes with several QPs per peer, then check
+  // that each lane is a separate connection that delivers its own messages.
+  static constexpr int kNumNodes = 4;
+  static constexpr int kQpsPerPeer = 3;
+  std::vector<std::unique_ptr<ConnectionManager<Channel>>> conns;
+  std::vector<ConnectionManager<Channel>::PeerAddress> peers;
+  for (int i = 0; i < kNumNodes; ++i) {
+    conns.emplace_back(
+        std::make_unique<ConnectionManager<Channel>>(i, kQpsPerPeer));
+    ASSERT_OK(conns.back()->Start(kAddress, std::nullopt));
+    peers.push_back({static_cast<uint32_t>(i), kAddress, conns.back()->port()});
+  }
+
+  std::vector<std::thread> threads;
+  std::barrier sync(kNumNodes);
+  for (int i = 0; i < kNumNodes; ++i) {
+    threads.emplace_back([&conns, &peers, &sync, i]() {
+      EXPECT_OK(conns[i]->ConnectAll(peers));
+      // Every peer has one connection per lane, and loopback has one.
+      EXPECT_EQ(conns[i]->GetNumConnections(),
+                (kNumNodes - 1) * kQpsPerPeer + 1);
+      sync.arrive_and_wait();
+
+      for (const auto& p : peers) {
+        if (p.id == static_cast<uint32_t>(i)) continue;
+        for (uint32_t lane = 0; lane < kQpsPerPeer; ++lane) {
+          TestProto proto;
+          *proto.mutable_message() = std::to_string(lane);
+          auto* conn = VALUE_OR_DIE(conns[i]->GetConnection(p.id, lane));
+          EXPECT_OK(conn->channel()->Send(proto));
+        }
+      }
+      for (const auto& p : peers) {
+        if (p.id == static_cast<uint32_t>(i)) continue;
+        for (uint32_t lane = 0; lane < kQpsPerPeer; ++lane) {
+          auto* conn = VALUE_OR_DIE(conns[i]->GetConnection(p.id, lane));
+          auto m = conn->channel()->TryDeliver<TestProto>();
+          while (absl::IsUnavailable(m.status())) {
+            m = conn->channel()->TryDeliver<TestProto>();
+          }
+          EXPECT_OK(m);
+          if (m.ok()) {
+            EXPECT_EQ(m->message(), std::to_string(lane));
+          }
+        }
+      }
+
+      sync.arrive_and_wait();
+      conns[i]->Shutdown();
+    });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+TEST_F(ConnectionManagerTest, Reconnect) {
+  // Test plan: Connect two nodes, then have one of them replace the connection
+  // and check that both ends switch to a new connection that delivers messages
+  // and carries the data the peer set. The old connection must stay visible
+  // until then, and report that it failed once replaced.
+  static constexpr int kNumNodes = 2;
+  static constexpr uint32_t kData = 100;
+  std::vector<std::unique_ptr<ConnectionManager<Channel>>> conns;
+  std::vector<ConnectionManager<Channel>::PeerAddress> peers;
+  for (int i = 0; i < kNumNodes; ++i) {
+    conns.emplace_back(std::make_unique<ConnectionManager<Channel>>(i));
+    conns.back()->SetConnectData(kData + i);
+    ASSERT_OK(conns.back()->Start(kAddress, std::nullopt));
+    peers.push_back({static_cast<uint32_t>(i), kAddress, conns.back()->port()});
+  }
+
+  std::vector<std::thread> threads;
+  std::barrier sync(kNumNodes);
+  for (int i = 0; i < kNumNodes; ++i) {
+    threads.emplace_back([&conns, &peers, &sync, i]() {
+      EXPECT_OK(conns[i]->ConnectAll(peers));
+      const uint32_t peer = 1 - i;
+      auto* old_conn = VALUE_OR_DIE(conns[i]->GetConnection(peer));
+      EXPECT_FALSE(old_conn->HasFailed());
+      EXPECT_EQ(old_conn->peer_data(), kData + peer);
+      sync.arrive_and_wait();
+
+      ConnectionManager<Channel>::conn_type* conn;
+      if (i == 1) {
+        conn = VALUE_OR_DIE(conns[i]->Reconnect(peer, 0));
+      } else {
+        do {
+          conn = VALUE_OR_DIE(conns[i]->GetConnection(peer));
+        } while (conn == old_conn);
+      }
+      EXPECT_NE(conn, old_conn);
+      EXPECT_FALSE(conn->HasFailed());
+      EXPECT_EQ(conn->peer_data(), kData + peer);
+
+      TestProto proto;
+      *proto.mutable_message() = std::to_string(i);
+      EXPECT_OK(conn->channel()->Send(proto));
+      auto m = conn->channel()->TryDeliver<TestProto>();
+      while (absl::IsUnavailable(m.status())) {
+        m = conn->channel()->TryDeliver<TestProto>();
+      }
+      EXPECT_OK(m);
+      if (m.ok()) {
+        EXPECT_EQ(m->message(), std::to_string(peer));
+      }
+
+      // Both ends have switched, so the old connection was disconnected.
+      sync.arrive_and_wait();
+      EXPECT_TRUE(old_conn->HasFailed());
+      sync.arrive_and_wait();
+      conns[i]->Shutdown();
+    });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+TEST_F(ConnectionManagerTest, ReconnectFromBothEnds) {
+  // Test plan: Have one node replace a connection, then have the other try to
+  // replace it too once it sees the failure. Either it gets the peer's
+  // replacement back or its own request wins, but both must end up with a
+  // single new connection.
+  static constexpr int kNumNodes = 2;
+  std::vector<std::unique_ptr<ConnectionManager<Channel>>> conns;
+  std::vector<ConnectionManager<Channel>::PeerAddress> peers;
+  for (int i = 0; i < kNumNodes; ++i) {
+    conns.emplace_back(std::make_unique<ConnectionManager<Channel>>(i));
+    ASSERT_OK(conns.back()->Start(kAddress, std::nullopt));
+    peers.push_back({static_cast<uint32_t>(i), kAddress, conns.back()->port()});
+  }
+
+  std::vector<std::thread> threads;
+  std::barrier sync(kNumNodes);
+  std::atomic<ConnectionManager<Channel>::conn_type*> replacement{nullptr};
+  for (int i = 0; i < kNumNodes; ++i) {
+    threads.emplace_back([&, i]() {
+      EXPECT_OK(conns[i]->ConnectAll(peers));
+      const uint32_t peer = 1 - i;
+      auto* old_conn = VALUE_OR_DIE(conns[i]->GetConnection(peer, 0));
+      sync.arrive_and_wait();
+
+      if (i == 1) {
+        EXPECT_OK(conns[i]->Reconnect(peer, 0));
+      } else {
+        while (!old_conn->HasFailed()) {
+          std::this_thread::yield();
+        }
+        auto* conn = VALUE_OR_DIE(conns[i]->Reconnect(peer, 0));
+        EXPECT_NE(conn, old_conn);
+        replacement = conn;
+      }
+      sync.arrive_and_wait();
+      auto* conn = VALUE_OR_DIE(conns[i]->GetConnection(peer, 0));
+      EXPECT_FALSE(conn->HasFailed());
+      if (i == 0) EXPECT_EQ(conn, replacement);
+      // The peer and the loopback connection.
+      EXPECT_EQ(conns[i]->GetNumConnections(), 2);
+      sync.arrive_and_wait();
+      conns[i]->Shutdown();
+    });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+TEST_F(ConnectionManagerTest, TreeBroadcast) {
+  // Test plan: Fully connect a group of nodes, then broadcast from one of them
+  // along a binary tree and check that every other node delivers the message.
+  static constexpr int kNumNodes = 7;
+  static constexpr int kRoot = 2;
+  static constexpr int kFanout = 2;
+  std::vector<std::unique_ptr<ConnectionManager<Channel>>> conns;
+  std::vector<std::pair<uint32_t, uint16_t>> node_info;
+  std::vector<uint32_t> group;
+  for (int i = 0; i < kNumNodes; ++i) {
+    conns.emplace_back(std::make_unique<ConnectionManager<Channel>>(i));
+    ASSERT_OK(conns.back()->Start(kAddress, std::nullopt));
+    node_info.push_back({i, conns.back()->port()});
+    group.push_back(i);
+  }
+
+  std::vector<std::thread> threads;
+  std::barrier sync(kNumNodes);
+  for (int i = 0; i < kNumNodes; ++i) {
+    threads.emplace_back([&conns, &node_info, &group, &sync, i, this]() {
+      for (auto n : node_info) {
+        auto conn_or = Connect(&(*conns[i]), n.first, kAddress, n.second);
+        if (!conn_or.ok()) {
+          ROME_FATAL(conn_or.status().ToString());
+        }
+      }
+      sync.arrive_and_wait();
+
+      if (i == kRoot) {
+        TestProto p;
+        *p.mutable_message() = "broadcast";
+        EXPECT_OK(conns[i]->TreeBroadcast(p, group, kFanout));
+      } else {
+        auto m = conns[i]->DeliverTreeBroadcast<TestProto>(kRoot, group,
+                                                           kFanout);
+        EXPECT_OK(m);
+        if (m.ok()) {
+          EXPECT_EQ(m->message(), "broadcast");
+        }
+      }
+
+      sync.arrive_and_wait();
+      conns[i]->Shutdown();
+    });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+TEST_F(ConnectionManagerTest, DeliverTreeBroadcastTimesOut) {
+  // Test plan: Connect two nodes and have the child wait for a broadcast that
+  // the root never sends, then check that it gives up after the timeout.
+  static constexpr int kNumNodes = 2;
+  std::vector<std::unique_ptr<ConnectionManager<Channel>>> conns;
+  std::vector<ConnectionManager<Channel>::PeerAddress> peers;
+  std::vector<uint32_t> group;
+  for (int i = 0; i < kNumNodes; ++i) {
+    conns.emplace_back(std::make_unique<ConnectionManager<Channel>>(i));
+    ASSERT_OK(conns.back()->Start(kAddress, std::nullopt));
+    peers.push_back({static_cast<uint32_t>(i), kAddress, conns.back()->port()});
+    group.push_back(i);
+  }
+
+  std::vector<std::thread> threads;
+  std::barrier sync(kNumNodes);
+  for (int i = 0; i < kNumNodes; ++i) {
+    threads.emplace_back([&conns, &peers, &group, &sync, i]() {
+      EXPECT_OK(conns[i]->ConnectAll(peers));
+      if (i == 1) {
+        auto m = conns[i]->DeliverTreeBroadcast<TestProto>(
+            0, group, 1, std::chrono::milliseconds(100));
+        EXPECT_TRUE(absl::IsDeadlineExceeded(m.status()));
+      }
+      sync.arrive_and_wait();
+      conns[i]->Shutdown();
+    });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
+}  // namespace rome::rdma
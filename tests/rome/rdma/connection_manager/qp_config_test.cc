@@ -0,0 +1,39 @@
+#include "rome/rdma/connection_manager/qp_config.h"
+
+#include <cstring>
+
+#include "gtest/gtest.h"
+
+namespace rome::rdma {
+namespace {
+
+TEST(QpConfigTest, NegotiateLowersToDeviceLimits) {
+  // Test plan: Negotiate a config that asks for more than a device supports,
+  // then check that only the attributes over the limits are lowered.
+  ibv_device_attr device;
+  std::memset(&device, 0, sizeof(device));
+  device.max_qp_wr = 1024;
+  device.max_sge = 4;
+  device.max_qp_init_rd_atom = 16;
+  device.max_qp_rd_atom = 4;
+
+  QpConfig requested;
+  requested.max_send_wr = 4096;
+  requested.max_recv_wr = 256;
+  requested.max_send_sge = 8;
+  requested.max_rd_atomic = 16;
+  requested.max_dest_rd_atomic = 16;
+  requested.retry_cnt = 9;
+  auto config = requested.Negotiate(device);
+  EXPECT_EQ(config.max_send_wr, 1024);
+  EXPECT_EQ(config.max_recv_wr, 256);
+  EXPECT_EQ(config.max_send_sge, 4);
+  EXPECT_EQ(config.max_recv_sge, 1);
+  EXPECT_EQ(config.max_rd_atomic, 16);
+  EXPECT_EQ(config.max_dest_rd_atomic, 4);
+  EXPECT_EQ(config.retry_cnt, 7);
+  EXPECT_EQ(config.timeout, requested.timeout);
+}
+
+}  // namespace
+}  // namespace rome::rdma
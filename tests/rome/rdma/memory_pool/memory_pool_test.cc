@@ -6,11 +6,14 @@
 #include <cstring>
 #include <memory>
 #include <random>
+#include <thread>
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
-#include "remote_ptr.h"
+#include "rome/rdma/memory_pool/remote_ptr.h"
 #include "rome/rdma/connection_manager/connection_manager.h"
+#include "rome/testutil/status_matcher.h"
 
 namespace rome::rdma {
 namespace {
@@ -46,36 +49,38 @@ class LoopbackPolicy : public ::testing::Test {
   template <typename T>
   remote_ptr<T> Read(remote_ptr<T> ptr,
                      remote_ptr<T> prealloc = remote_nullptr) {
-    return mp_->Read(ptr, prealloc);
+    return VALUE_OR_DIE(mp_->Read(ptr, prealloc));
   }
 
   template <typename T>
   remote_ptr<T> PartialRead(remote_ptr<T> ptr, size_t offset, size_t bytes,
                             remote_ptr<T> prealloc = remote_nullptr) {
-    return mp_->PartialRead(ptr, offset, bytes, prealloc);
+    return VALUE_OR_DIE(mp_->PartialRead(ptr, offset, bytes, prealloc));
   }
 
   template <typename T>
   void Write(remote_ptr<T> ptr, const T& value,
              remote_ptr<T> prealloc = remote_nullptr) {
-    return mp_->Write(ptr, value, prealloc);
+    ROME_ASSERT_OK(mp_->Write(ptr, value, prealloc));
   }
 
   template <typename T>
   T AtomicSwap(remote_ptr<T> ptr, uint64_t swap, uint64_t hint = 0) {
-    return mp_->AtomicSwap(ptr, swap, hint);
+    return VALUE_OR_DIE(mp_->AtomicSwap(ptr, swap, hint));
   }
 
   template <typename T>
   T CompareAndSwap(remote_ptr<T> ptr, uint64_t expected, uint64_t swap) {
-    return mp_->CompareAndSwap(ptr, expected, swap);
+    return VALUE_OR_DIE(mp_->CompareAndSwap(ptr, expected, swap));
   }
 
   MemoryPool::DoorbellBatchBuilder CreateDoorbellBatchBuilder(int num_ops) {
     return MemoryPool::DoorbellBatchBuilder(mp_.get(), p_.id, num_ops);
   }
 
-  void Execute(MemoryPool::DoorbellBatch* batch) { return mp_->Execute(batch); }
+  absl::Status Execute(MemoryPool::DoorbellBatch* batch) {
+    return mp_->Execute(batch);
+  }
 
  private:
   const MemoryPool::Peer p_ = kServer;
@@ -113,29 +118,29 @@ class ClientServerPolicy : public ::testing::Test {
   template <typename T>
   remote_ptr<T> Read(remote_ptr<T> ptr,
                      remote_ptr<T> prealloc = remote_nullptr) {
-    return client_mp_->Read(ptr, prealloc);
+    return VALUE_OR_DIE(client_mp_->Read(ptr, prealloc));
   }
 
   template <typename T>
   remote_ptr<T> PartialRead(remote_ptr<T> ptr, size_t offset, size_t bytes,
                             remote_ptr<T> prealloc = remote_nullptr) {
-    return client_mp_->PartialRead(ptr, offset, bytes, prealloc);
+    return VALUE_OR_DIE(client_mp_->PartialRead(ptr, offset, bytes, prealloc));
   }
 
   template <typename T>
   void Write(remote_ptr<T> ptr, const T& value,
              remote_ptr<T> prealloc = remote_nullptr) {
-    return client_mp_->Write(ptr, value, prealloc);
+    ROME_ASSERT_OK(client_mp_->Write(ptr, value, prealloc));
   }
 
   template <typename T>
   T AtomicSwap(remote_ptr<T> ptr, uint64_t swap, uint64_t hint = 0) {
-    return client_mp_->AtomicSwap(ptr, swap, hint);
+    return VALUE_OR_DIE(client_mp_->AtomicSwap(ptr, swap, hint));
   }
 
   template <typename T>
   T CompareAndSwap(remote_ptr<T> ptr, uint64_t expected, uint64_t swap) {
-    return client_mp_->CompareAndSwap(ptr, expected, swap);
+    return VALUE_OR_DIE(client_mp_->CompareAndSwap(ptr, expected, swap));
   }
 
   MemoryPool::DoorbellBatchBuilder CreateDoorbellBatchBuilder(int num_ops) {
@@ -143,11 +148,10 @@ class ClientServerPolicy : public ::testing::Test {
                                             num_ops);
   }
 
-  void Execute(MemoryPool::DoorbellBatch* batch) {
+  absl::Status Execute(MemoryPool::DoorbellBatch* batch) {
     return client_mp_->Execute(batch);
   }
 
- private:
   const MemoryPool::Peer server_ = kServer;
   const MemoryPool::Peer client_ = kClient;
   std::unique_ptr<MemoryPool> server_mp_;
@@ -214,6 +218,30 @@ TYPED_TEST(MemoryPoolTestFixture, CompareAndSwapTest) {
   }
 }
 
+TYPED_TEST(MemoryPoolTestFixture, ConcurrentCompareAndSwapTest) {
+  // Test plan: Increment a counter with CAS from several threads at once, then
+  // check that no increment was lost to threads mixing up their results.
+  constexpr int kThreads = 4;
+  constexpr uint64_t kIncrements = 1000;
+  auto target = TestFixture::template AllocateServer<uint64_t>();
+  *target = 0;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&]() {
+      for (uint64_t i = 0; i < kIncrements; ++i) {
+        uint64_t expected = 0;
+        while (true) {
+          auto prev = this->CompareAndSwap(target, expected, expected + 1);
+          if (prev == expected) break;
+          expected = prev;
+        }
+      }
+    });
+  }
+  for (auto& t : threads) t.join();
+  EXPECT_EQ(*target, kThreads * kIncrements);
+}
+
 template <typename Policy, size_t S>
 class PartialReadConfig : public Policy {
  private:
@@ -317,7 +345,7 @@ TYPED_TEST(DoorbellBatchTestFixture, SingleReadTest) {
   auto builder = TestFixture::CreateDoorbellBatchBuilder(1);
   auto dest = builder.AddRead(src);
   auto batch = builder.Build();
-  TestFixture::Execute(batch.get());
+  ASSERT_OK(TestFixture::Execute(batch.get()));
 
   EXPECT_EQ(*(std::to_address(dest)), kValue);
 }
@@ -331,7 +359,7 @@ TYPED_TEST(DoorbellBatchTestFixture, SingleWriteTest) {
   auto builder = TestFixture::CreateDoorbellBatchBuilder(1);
   builder.AddWrite(dest, kValue);
   auto batch = builder.Build();
-  TestFixture::Execute(batch.get());
+  ASSERT_OK(TestFixture::Execute(batch.get()));
 
   EXPECT_EQ(*(std::to_address(dest)), kValue);
 }
@@ -347,7 +375,7 @@ TYPED_TEST(DoorbellBatchTestFixture, WriteThenReadTest) {
   auto read = builder.AddRead(dest);
   *(std::to_address(read)) = 0;
   auto batch = builder.Build();
-  TestFixture::Execute(batch.get());
+  ASSERT_OK(TestFixture::Execute(batch.get()));
 
   EXPECT_EQ(*(std::to_address(dest)), kValue);
   EXPECT_EQ(*(std::to_address(read)), kValue);
@@ -366,16 +394,114 @@ TYPED_TEST(DoorbellBatchTestFixture, ReuseTest) {
   auto read = builder.AddRead(dest);
   *read = 0;
   auto batch = builder.Build();
-  TestFixture::Execute(batch.get());
+  ASSERT_OK(TestFixture::Execute(batch.get()));
 
   EXPECT_EQ(*(std::to_address(dest)), kValue);
   EXPECT_EQ(*(std::to_address(read)), kValue);
 
   *src = kValue + 1;
-  TestFixture::Execute(batch.get());
+  ASSERT_OK(TestFixture::Execute(batch.get()));
   EXPECT_EQ(*dest, kValue + 1);
   EXPECT_EQ(*read, kValue + 1);
 }
 
+TYPED_TEST(DoorbellBatchTestFixture, KillSwitchTest) {
+  // Test plan: Execute a batch whose kill switch is already set, then check
+  // that its abandoned completion does not confuse the next batch.
+  const uint64_t kValue = 0xf0f0f0f0f0f0f0f0;
+  auto dest = TestFixture::template AllocateServer<uint64_t>();
+  *dest = 0;
+
+  std::atomic<bool> kill(true);
+  auto builder = TestFixture::CreateDoorbellBatchBuilder(1);
+  builder.AddWrite(dest, kValue);
+  builder.AddKillSwitch(&kill);
+  auto killed = builder.Build();
+  EXPECT_THAT(TestFixture::Execute(killed.get()),
+              ::testutil::StatusIs(absl::StatusCode::kCancelled));
+
+  builder = TestFixture::CreateDoorbellBatchBuilder(1);
+  auto read = builder.AddRead(dest, /*fence=*/true);
+  *read = 0;
+  auto batch = builder.Build();
+  ASSERT_OK(TestFixture::Execute(batch.get()));
+  EXPECT_EQ(*read, kValue);
+}
+
+TEST_F(MemoryPoolTest, AccessesChunkedMemory) {
+  // Test plan: Register both pools in several chunks, then check that reads,
+  // writes and CAS from the client reach a target outside the server's first
+  // chunk, which needs that chunk's own rkey.
+  using CM = ConnectionManager<MemoryPool::channel_type>;
+  const uint64_t kCapacity = 1ul << 23;
+  RdmaMemory::Options options;
+  options.registration = RdmaMemory::Registration::kParallel;
+  options.registration_threads = 4;
+  MemoryPool server(kServer, std::make_unique<CM>(kServer.id));
+  MemoryPool client(kClient, std::make_unique<CM>(kClient.id));
+  std::thread t(
+      [&]() { ASSERT_OK(server.Init(kCapacity, {kClient}, options)); });
+  ASSERT_OK(client.Init(kCapacity, {kServer}, options));
+  t.join();
+
+  auto target = server.Allocate<uint64_t>();
+  ASSERT_GE(target.address() - server.GetBaseAddress<uint8_t>().address(),
+            kCapacity / options.registration_threads);
+  *target = 42;
+  auto read = client.Read(target);
+  ASSERT_OK(read.status());
+  EXPECT_EQ(**read, 42);
+  ASSERT_OK(client.Write<uint64_t>(target, 43));
+  EXPECT_EQ(*target, 43);
+  EXPECT_THAT(client.CompareAndSwap(target, 43, 44),
+              ::testutil::IsOkAndHolds(43));
+  EXPECT_EQ(*target, 44);
+}
+
+class MemoryPoolRecoveryTest : public ClientServerPolicy {};
+
+TEST_F(MemoryPoolRecoveryTest, RetriesOnReplacedConnection) {
+  // Test plan: Have the server replace its connection to the client, then
+  // check that operations from the client fail over to the replacement, with
+  // the rkey from its handshake, instead of failing.
+  auto target = AllocateServer<uint64_t>();
+  *target = 42;
+  auto* old_conn = client_mp_->conn_info(server_.id).conn;
+  ASSERT_OK(server_mp_->connection_manager()->Reconnect(client_.id, 0));
+  while (!old_conn->HasFailed()) {
+    std::this_thread::yield();
+  }
+
+  auto result = client_mp_->Read(target);
+  ASSERT_OK(result.status());
+  EXPECT_EQ(**result, 42);
+  EXPECT_NE(client_mp_->conn_info(server_.id).conn, old_conn);
+  EXPECT_THAT(client_mp_->CompareAndSwap(target, 42, 43),
+              ::testutil::IsOkAndHolds(42));
+  EXPECT_EQ(*target, 43);
+}
+
+TEST_F(MemoryPoolRecoveryTest, DoesNotReplayAtomics) {
+  // Test plan: Have the server replace its connection to the client, then
+  // check that a CAS posted on the failed connection replaces it but is not
+  // posted again, leaving the target as it was, and that the caller's own
+  // retry then succeeds on the replacement.
+  auto target = AllocateServer<uint64_t>();
+  *target = 42;
+  auto* old_conn = client_mp_->conn_info(server_.id).conn;
+  ASSERT_OK(server_mp_->connection_manager()->Reconnect(client_.id, 0));
+  while (!old_conn->HasFailed()) {
+    std::this_thread::yield();
+  }
+
+  EXPECT_THAT(client_mp_->CompareAndSwap(target, 42, 43),
+              ::testutil::StatusIs(absl::StatusCode::kUnavailable));
+  EXPECT_EQ(*target, 42);
+  EXPECT_NE(client_mp_->conn_info(server_.id).conn, old_conn);
+  EXPECT_THAT(client_mp_->CompareAndSwap(target, 42, 43),
+              ::testutil::IsOkAndHolds(42));
+  EXPECT_EQ(*target, 43);
+}
+
 }  // namespace
 }  // namespace rome::rdma
@@ -59,7 +59,7 @@ TEST(RemotePtrTest, DecrementT) {
   p = remote_ptr<int>(4, (uint64_t)400);
 
   auto r = (p -= 4);
-  EXPECT_EQ(r.address(), 399 * sizeof(int));
+  EXPECT_EQ(r.address(), 400 - 4 * sizeof(int));
   EXPECT_EQ(p.address(), r.address());
 }
 
@@ -0,0 +1,105 @@
+#include "rome/rdma/memory_region_cache.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "rome/rdma/rdma_device.h"
+#include "rome/testutil/status_matcher.h"
+
+namespace rome::rdma {
+namespace {
+
+class MemoryRegionCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    auto devices = RdmaDevice::GetAvailableDevices();
+    ASSERT_OK(devices);
+    auto device = devices->front();
+    dev_ = RdmaDevice::Create(device.first, std::nullopt);
+    ASSERT_OK(dev_->CreateProtectionDomain("test"));
+    auto pd = dev_->GetProtectionDomain("test");
+    ASSERT_OK(pd);
+    pd_ = *pd;
+  }
+
+  std::unique_ptr<RdmaDevice> dev_;
+  ibv_pd* pd_;
+};
+
+TEST_F(MemoryRegionCacheTest, ReusesRegistration) {
+  // Test plan: Register a buffer and check that requests for any part of it
+  // are served by the same memory region.
+  std::vector<uint8_t> buffer(1 << 16);
+  MemoryRegionCache cache(pd_);
+  auto mr = cache.Acquire(buffer.data(), buffer.size());
+  ASSERT_OK(mr);
+  auto sub = cache.Acquire(buffer.data() + 128, 256);
+  ASSERT_OK(sub);
+  EXPECT_EQ(*mr, *sub);
+  EXPECT_EQ(cache.size(), 1);
+  cache.Release(*sub);
+  cache.Release(*mr);
+}
+
+TEST_F(MemoryRegionCacheTest, MergesOverlappingRegistrations) {
+  // Test plan: Register two halves of a buffer and then the whole buffer, and
+  // check that the halves are replaced by a single registration.
+  std::vector<uint8_t> buffer(1 << 16);
+  const auto kHalf = buffer.size() / 2;
+  MemoryRegionCache cache(pd_);
+  auto first = cache.Acquire(buffer.data(), kHalf);
+  ASSERT_OK(first);
+  cache.Release(*first);
+  auto second = cache.Acquire(buffer.data() + kHalf, kHalf);
+  ASSERT_OK(second);
+  auto whole = cache.Acquire(buffer.data(), buffer.size());
+  ASSERT_OK(whole);
+  EXPECT_EQ(cache.size(), 1);
+  EXPECT_GE((*whole)->length, buffer.size());
+
+  // The second half is still in use, so its registration must remain valid.
+  EXPECT_LE((*second)->addr, buffer.data() + kHalf);
+  cache.Release(*second);
+  cache.Release(*whole);
+}
+
+TEST_F(MemoryRegionCacheTest, EvictsLeastRecentlyUsed) {
+  // Test plan: Register more buffers than the cache holds and check that only
+  // unused registrations are evicted.
+  constexpr int kBuffers = 4;
+  std::vector<std::vector<uint8_t>> buffers(kBuffers,
+                                            std::vector<uint8_t>(1 << 16));
+  MemoryRegionCache cache(pd_, MemoryRegionCache::Options{.max_regions = 2});
+  std::vector<ibv_mr*> mrs;
+  for (auto& buffer : buffers) {
+    auto mr = cache.Acquire(buffer.data(), buffer.size());
+    ASSERT_OK(mr);
+    mrs.push_back(*mr);
+  }
+  EXPECT_EQ(cache.size(), kBuffers);
+  for (auto* mr : mrs) cache.Release(mr);
+  EXPECT_EQ(cache.size(), 2);
+}
+
+TEST_F(MemoryRegionCacheTest, Invalidate) {
+  // Test plan: Invalidate a cached buffer and check that it is registered again
+  // on the next request.
+  std::vector<uint8_t> buffer(1 << 16);
+  MemoryRegionCache cache(pd_);
+  auto mr = cache.Acquire(buffer.data(), buffer.size());
+  ASSERT_OK(mr);
+  cache.Release(*mr);
+  cache.Invalidate(buffer.data(), buffer.size());
+  EXPECT_EQ(cache.size(), 0);
+  EXPECT_EQ(cache.registered_bytes(), 0);
+  mr = cache.Acquire(buffer.data(), buffer.size());
+  ASSERT_OK(mr);
+  EXPECT_EQ(cache.size(), 1);
+  cache.Release(*mr);
+}
+
+}  // namespace
+}  // namespace rome::rdma
@@ -1,5 +1,9 @@
 #include "rome/rdma/rdma_memory.h"
 
+#include <cstdio>
+#include <cstring>
+#include <string>
+
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "rome/rdma/rdma_device.h"
@@ -45,5 +49,121 @@ TEST_F(RdmaMemoryTest, Hugepages) {
 #endif
 }
 
+TEST_F(RdmaMemoryTest, TransparentHugepages) {
+  // Test plan: Check that memory backed by transparent hugepages is usable and
+  // that pre-faulting the pages does not disturb the registration.
+  const uint64_t kCapacity = 1UL << 22;  // 4 MiB
+  RdmaMemory rmem(kCapacity,
+                  RdmaMemory::Options{
+                      .page_size = RdmaMemory::PageSize::kTransparent,
+                      .populate = true},
+                  GetTestPd());
+  EXPECT_NE(rmem.page_size(), RdmaMemory::PageSize::kHuge);
+  EXPECT_EQ(rmem.GetDefaultMemoryRegion()->length, kCapacity);
+  std::memset(rmem.raw(), 0xff, kCapacity);
+}
+
+TEST_F(RdmaMemoryTest, GigabyteHugepagesFallBack) {
+  // Test plan: Request 1 GiB hugepages and check that the memory is created
+  // regardless of whether any are reserved on the machine.
+  const uint64_t kCapacity = 1UL << 20;  // 1 MiB
+  RdmaMemory rmem(
+      kCapacity,
+      RdmaMemory::Options{.page_size = RdmaMemory::PageSize::kHuge1GiB},
+      GetTestPd());
+  EXPECT_EQ(rmem.GetDefaultMemoryRegion()->length, kCapacity);
+  rmem.raw()[kCapacity - 1] = 1;
+}
+
+TEST_F(RdmaMemoryTest, FileBackedRestore) {
+  // Test plan: Write to file-backed memory, destroy it, then map the same file
+  // again and check that the contents survived and are reported as restored.
+  const uint64_t kCapacity = 1UL << 20;  // 1 MiB
+  const std::string kFile = "/dev/shm/rome_rdma_memory_test";
+  std::remove(kFile.c_str());
+  RdmaMemory::Options options{.file = kFile};
+  {
+    RdmaMemory rmem(kCapacity, options, GetTestPd());
+    EXPECT_TRUE(rmem.file_backed());
+    EXPECT_FALSE(rmem.restored());
+    std::memset(rmem.raw(), 0xab, kCapacity);
+    ASSERT_OK(rmem.Flush());
+  }
+  RdmaMemory rmem(kCapacity, options, GetTestPd());
+  EXPECT_TRUE(rmem.restored());
+  EXPECT_EQ(rmem.raw()[0], 0xab);
+  EXPECT_EQ(rmem.raw()[kCapacity - 1], 0xab);
+  std::remove(kFile.c_str());
+}
+
+TEST_F(RdmaMemoryTest, FileBackedMapFailure) {
+  // Test plan: Create file-backed memory in a directory that does not exist
+  // and check that the failure to open the file is returned.
+  const uint64_t kCapacity = 1UL << 20;  // 1 MiB
+  RdmaMemory::Options options{.file = "/nonexistent/rome_rdma_memory_test"};
+  auto rmem = RdmaMemory::Create(kCapacity, options, GetTestPd());
+  EXPECT_FALSE(rmem.ok());
+}
+
+TEST_F(RdmaMemoryTest, ParallelRegistration) {
+  // Test plan: Register memory in chunks on multiple threads and check that
+  // every address resolves to the keys of the chunk that contains it.
+  const uint64_t kCapacity = 1UL << 26;  // 64 MiB
+  RdmaMemory rmem(
+      kCapacity,
+      RdmaMemory::Options{.registration = RdmaMemory::Registration::kParallel,
+                          .registration_threads = 4},
+      GetTestPd());
+  EXPECT_EQ(rmem.GetDefaultMemoryRegion(), nullptr);
+  EXPECT_EQ(rmem.chunk_size(), kCapacity / 4);
+  auto first = rmem.GetKeys(rmem.raw());
+  auto last = rmem.GetKeys(rmem.raw() + kCapacity - 1);
+  ASSERT_OK(first);
+  ASSERT_OK(last);
+  EXPECT_NE(first->lkey, last->lkey);
+  EXPECT_FALSE(rmem.GetKeys(rmem.raw() + kCapacity).ok());
+
+  // A region named like the default one would only cover part of the memory.
+  EXPECT_TRUE(absl::IsInvalidArgument(
+      rmem.RegisterMemoryRegion("default", 0, rmem.chunk_size())));
+  EXPECT_EQ(rmem.GetDefaultMemoryRegion(), nullptr);
+}
+
+TEST_F(RdmaMemoryTest, OnDemandRegistration) {
+  // Test plan: Request on-demand paging and check that the whole memory is
+  // accessible whether or not the device supports it.
+  const uint64_t kCapacity = 1UL << 26;  // 64 MiB
+  RdmaMemory rmem(
+      kCapacity,
+      RdmaMemory::Options{.registration = RdmaMemory::Registration::kOnDemand},
+      GetTestPd());
+  EXPECT_OK(rmem.GetKeys(rmem.raw()));
+  EXPECT_OK(rmem.GetKeys(rmem.raw() + kCapacity - 1));
+}
+
+TEST_F(RdmaMemoryTest, MemoryRegionViews) {
+  // Test plan: Carve many named views out of the default registration and
+  // check that they resolve by handle, share its keys and are bounds checked
+  // without overflowing.
+  const uint64_t kCapacity = 1UL << 20;  // 1 MiB
+  const uint64_t kLength = 1UL << 12;
+  RdmaMemory rmem(kCapacity, GetTestPd());
+  auto* mr = rmem.GetDefaultMemoryRegion();
+  for (uint64_t i = 0; i < kCapacity / kLength; ++i) {
+    auto id = "view" + std::to_string(i);
+    auto handle = rmem.AddMemoryRegionView(id, i * kLength, kLength);
+    ASSERT_OK(handle);
+    auto* view = rmem.GetMemoryRegion(*handle);
+    EXPECT_EQ(view->addr, rmem.raw() + i * kLength);
+    EXPECT_EQ(view->length, kLength);
+    EXPECT_EQ(view->rkey, mr->rkey);
+    EXPECT_EQ(*rmem.GetMemoryRegion(id), view);
+  }
+  EXPECT_FALSE(rmem.AddMemoryRegionView("view0", 0, kLength).ok());
+  EXPECT_FALSE(rmem.AddMemoryRegionView("overflow", ~0UL, 2).ok());
+  EXPECT_FALSE(rmem.RegisterMemoryRegion("overflow", kLength, ~0UL).ok());
+  EXPECT_FALSE(rmem.GetMemoryRegionHandle("missing").ok());
+}
+
 }  // namespace
 }  // namespace rome
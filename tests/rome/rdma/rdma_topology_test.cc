@@ -0,0 +1,80 @@
+#include "rome/rdma/rdma_topology.h"
+
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "rome/logging/logging.h"
+
+namespace rome::rdma {
+namespace {
+
+using ::testing::ElementsAre;
+
+// Two dual-port NICs, one on each of two NUMA nodes.
+std::vector<RdmaPortInfo> TwoNics() {
+  return {{"mlx5_0", 1, 0, "10.0.0.1"},
+          {"mlx5_0", 2, 0, "10.0.1.1"},
+          {"mlx5_1", 1, 1, "10.0.2.1"},
+          {"mlx5_1", 2, 1, "10.0.3.1"}};
+}
+
+TEST(RdmaTopologyTest, LocalPortsAreOnTheSameNumaNode) {
+  // Test plan: Check that each node's ports are local to it, and that nodes
+  // without ports fall back to every port.
+  RdmaTopology topology(TwoNics());
+  EXPECT_THAT(topology.LocalPorts(0), ElementsAre(0, 1));
+  EXPECT_THAT(topology.LocalPorts(1), ElementsAre(2, 3));
+  EXPECT_THAT(topology.LocalPorts(2), ElementsAre(0, 1, 2, 3));
+  EXPECT_THAT(topology.LocalPorts(-1), ElementsAre(0, 1, 2, 3));
+}
+
+TEST(RdmaTopologyTest, AssignPortStripesThreadsAcrossLocalPorts) {
+  // Test plan: Assign ports to several threads on each node, and check that
+  // they alternate between the node's ports.
+  RdmaTopology topology(TwoNics());
+  std::vector<uint32_t> node0, node1;
+  for (uint32_t i = 0; i < 4; ++i) {
+    node0.push_back(topology.AssignPort(0, i));
+    node1.push_back(topology.AssignPort(1, i));
+  }
+  EXPECT_THAT(node0, ElementsAre(0, 1, 0, 1));
+  EXPECT_THAT(node1, ElementsAre(2, 3, 2, 3));
+}
+
+TEST(RdmaTopologyTest, AssignPortCountsThreadsPerNumaNode) {
+  // Test plan: Assign ports to threads on both nodes in an uneven interleaving,
+  // and check that each node's threads are striped as if the other node's did
+  // not exist.
+  RdmaTopology topology(TwoNics());
+  std::vector<uint32_t> node0, node1;
+  node0.push_back(topology.AssignPort(0));
+  node0.push_back(topology.AssignPort(0));
+  node0.push_back(topology.AssignPort(0));
+  node1.push_back(topology.AssignPort(1));
+  node0.push_back(topology.AssignPort(0));
+  node1.push_back(topology.AssignPort(1));
+  node1.push_back(topology.AssignPort(1));
+  EXPECT_THAT(node0, ElementsAre(0, 1, 0, 1));
+  EXPECT_THAT(node1, ElementsAre(2, 3, 2));
+}
+
+TEST(RdmaTopologyTest, UnknownNumaNodesUseEveryPort) {
+  // Test plan: Without NUMA information, threads are striped across every
+  // port, whichever node they run on. The node is passed explicitly, since the
+  // one the test happens to run on is up to the scheduler.
+  auto ports = TwoNics();
+  for (auto& p : ports) p.numa_node = -1;
+  RdmaTopology topology(std::move(ports));
+  for (int node : {-1, 0, 1}) {
+    std::vector<uint32_t> assigned;
+    for (uint32_t i = 0; i < 5; ++i) {
+      assigned.push_back(topology.AssignPort(node, i));
+    }
+    EXPECT_THAT(assigned, ElementsAre(0, 1, 2, 3, 0)) << "node " << node;
+  }
+}
+
+}  // namespace
+}  // namespace rome::rdma
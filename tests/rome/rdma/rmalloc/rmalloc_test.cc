@@ -1,4 +1,4 @@
-#include "rmalloc.h"
+#include "rome/rdma/rmalloc/rmalloc.h"
 
 #include <infiniband/verbs.h>
 
@@ -9,6 +9,7 @@
 #include "rome/rdma/connection_manager/connection_manager.h"
 #include "rome/rdma/rdma_device.h"
 #include "rome/rdma/rdma_util.h"
+#include "rome/testutil/status_matcher.h"
 
 namespace rome::rdma {
 namespace {
@@ -132,6 +133,30 @@ TEST_F(RdmaAllocatorTest, ReallocateDifferentType) {
   EXPECT_NE(y, nullptr);
 }
 
+TEST_F(RdmaAllocatorTest, AllocationsStayWithinChunks) {
+  // Test plan: Register the memory in chunks and allocate more than a chunk's
+  // worth of blocks that do not evenly divide it. Every block must then resolve
+  // to the same keys at both ends, since a single access cannot span chunks.
+  constexpr uint64_t kCapacity = 1ul << 26;  // 64 MiB
+  constexpr size_t kBlockBytes = 3 << 18;    // 768 KiB
+  rdma_memory_resource memory_resource(
+      kCapacity,
+      RdmaMemory::Options{.registration = RdmaMemory::Registration::kParallel,
+                          .registration_threads = 4},
+      pd_);
+  ASSERT_FALSE(memory_resource.has_single_region());
+  auto alloc = rdma_allocator<uint8_t>(&memory_resource);
+  for (int i = 0; i < 40; ++i) {
+    auto* x = alloc.allocate(kBlockBytes);
+    ASSERT_NE(x, nullptr);
+    auto first = memory_resource.GetKeys(x);
+    auto last = memory_resource.GetKeys(x + kBlockBytes - 1);
+    ASSERT_OK(first.status());
+    ASSERT_OK(last.status());
+    EXPECT_EQ(first->lkey, last->lkey);
+  }
+}
+
 TEST_F(RdmaAllocatorTest, RemotelyAccessMemory) {
   // Test plan: Allocate a region of memory then test that we can remotely
   // access it. Exemplifies how to use the allocator in practice.
@@ -0,0 +1,103 @@
+#include "rome/rdma/tcp_bootstrap.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "protos/rdma.pb.h"
+#include "rome/logging/logging.h"
+#include "rome/testutil/status_matcher.h"
+
+namespace rome::rdma {
+namespace {
+
+constexpr char kAddress[] = "127.0.0.1";
+
+PeerInfoProto MakePeer(uint32_t id) {
+  PeerInfoProto peer;
+  peer.set_id(id);
+  peer.set_address(kAddress);
+  peer.set_port(18000 + id);
+  auto* region = peer.add_regions();
+  region->set_raddr(0x1000 * (id + 1));
+  region->set_rkey(100 + id);
+  return peer;
+}
+
+TEST(TcpBootstrapTest, DistributesMembership) {
+  // Test plan: Rendezvous a group of nodes through a coordinator, then check
+  // that every node receives every entry, sorted by ID.
+  ROME_INIT_LOG();
+  static constexpr uint32_t kNumNodes = 5;
+  auto coordinator = BootstrapCoordinator::Create(std::nullopt, kNumNodes);
+  ASSERT_OK(coordinator);
+
+  std::vector<std::thread> threads;
+  std::vector<MembershipProto> memberships(kNumNodes);
+  for (uint32_t i = 0; i < kNumNodes; ++i) {
+    // Start the nodes in reverse order, so they do not check in by ID.
+    uint32_t id = kNumNodes - 1 - i;
+    threads.emplace_back([&coordinator, &memberships, id]() {
+      auto membership =
+          Rendezvous(kAddress, (*coordinator)->port(), MakePeer(id));
+      EXPECT_OK(membership);
+      if (membership.ok()) memberships[id] = *membership;
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_OK((*coordinator)->Wait());
+
+  for (const auto& membership : memberships) {
+    ASSERT_EQ(membership.peers_size(), kNumNodes);
+    for (uint32_t id = 0; id < kNumNodes; ++id) {
+      const auto& peer = membership.peers(id);
+      EXPECT_EQ(peer.id(), id);
+      EXPECT_EQ(peer.port(), 18000 + id);
+      ASSERT_EQ(peer.regions_size(), 1);
+      EXPECT_EQ(peer.regions(0).rkey(), 100 + id);
+    }
+  }
+}
+
+TEST(TcpBootstrapTest, RejectsDuplicateIds) {
+  // Test plan: Rendezvous two nodes with the same ID and check that both the
+  // coordinator and the nodes fail.
+  ROME_INIT_LOG();
+  auto coordinator = BootstrapCoordinator::Create(std::nullopt, 2);
+  ASSERT_OK(coordinator);
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 2; ++i) {
+    threads.emplace_back([&coordinator]() {
+      auto membership =
+          Rendezvous(kAddress, (*coordinator)->port(), MakePeer(0));
+      EXPECT_FALSE(membership.ok());
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  EXPECT_TRUE(absl::IsAlreadyExists((*coordinator)->Wait()));
+}
+
+TEST(TcpBootstrapTest, TimesOutWithoutCoordinator) {
+  // Test plan: Rendezvous with a port that nothing listens on, then check that
+  // the node gives up once the timeout passes.
+  ROME_INIT_LOG();
+  uint16_t port;
+  {
+    auto coordinator = BootstrapCoordinator::Create(std::nullopt, 1);
+    ASSERT_OK(coordinator);
+    port = (*coordinator)->port();
+  }
+  auto membership = Rendezvous(kAddress, port, MakePeer(0),
+                               std::chrono::milliseconds(50));
+  EXPECT_TRUE(absl::IsUnavailable(membership.status()));
+}
+
+}  // namespace
+}  // namespace rome::rdma